@@ -0,0 +1,816 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the functions that find the set
+ *  of objects reachable from a commit: the commit itself, its tree, the
+ *  blobs named by the tree, and the same again for every parent commit.
+ *
+ *  Finding that set by walking the history means reading, inflating and
+ *  parsing every commit and tree along the way. To avoid that, a pack can
+ *  have a reachability bitmap file, `pack-<hex>.bitmap`, next to its index.
+ *  For a selection of the commits in the pack, it stores one bit per object
+ *  in the pack (in the order of the pack index) telling whether the object
+ *  is reachable from that commit. The set for a commit with a bitmap is
+ *  then read straight from the file, and the walk for any other commit
+ *  stops as soon as it reaches a commit with a bitmap, whose set is added
+ *  with a bitwise OR.
+ *
+ *  The bitmaps are compressed with EWAH (Enhanced Word-Aligned Hybrid), in
+ *  the same serialized form that git uses: the number of bits, the number
+ *  of 64-bit words, the words, and the position of the last marker word
+ *  (all big-endian). The words are groups of one marker word followed by
+ *  literal words. A marker word holds, in bit 0, the value of a run of
+ *  words that are all zeroes or all ones, in bits 1-32 the length of that
+ *  run, and in bits 33-63 the number of literal words that follow it. Long
+ *  stretches of objects that are all reachable or all unreachable, which
+ *  is what the pack index order tends to produce, cost a single word.
+ *
+ *  The bitmap file consists of:
+ *
+ *  -A header: the signature "BITM", the version and the number of bitmaps
+ *   (4-byte big-endian integers), then the SHA1 hash of the pack.
+ *
+ *  -A table with one 28-byte row per bitmap, sorted by commit: the SHA1
+ *   hash of the commit, and the offset and size of its bitmap in the file.
+ *
+ *  -The EWAH bitmaps.
+ *
+ *  -The SHA1 hash of everything before it.
+ */
+#include "pack.h"
+/* The above 'include' allows use of the following functions and
+   variables from "pack.h" and "cache.h" header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -get_be32(p)/put_be32(p, val): Read and write 32-bit big-endian integers.
+                                  Sourced from "pack.h".
+
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
+   -calloc(count, size)/realloc(ptr, size)/free(ptr): Manage heap memory.
+                                                       Sourced from
+                                                       <stdlib.h>.
+
+   -prepare_packed_git(): Find all packs in the pack directory.
+
+   -map_fd(fd, size): Map the contents of an open file into memory.
+
+   -error(message): Print an error message and return -1.
+
+   -munmap(addr, len): Remove a mapping made with mmap(). Sourced from
+                       <sys/mman.h>.
+
+   -find_pack_index_pos(): Find the position of an object in a pack index.
+
+   -read_sha1_file(): Read and inflate an object from the object store.
+
+   -get_sha1_hex(): Convert a hexadecimal object name to its raw form.
+
+   -sha1_init()/sha1_update()/sha1_final(): Calculate an SHA1 hash. Sourced
+                                             from "cache.h" (defined in
+                                             sha1.c).
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -bitmap_new(): Allocate an uncompressed bitmap.
+
+   -bitmap_set()/bitmap_get(): Set and test one bit of a bitmap.
+
+   -bitmap_free(): Free a bitmap.
+
+   -ewah_serialize(): Compress a bitmap with EWAH.
+
+   -ewah_or(): Decompress an EWAH bitmap into an uncompressed one with a
+               bitwise OR.
+
+   -object_set_insert(): Add an object to a hash set of objects.
+
+   -open_bitmap_index(): Map the bitmap file of the first pack that has one.
+
+   -find_commit(): Find a commit in a sorted array of commits.
+
+   -lookup_bitmap(): Find the bitmap of a commit.
+
+   -walk_reachable(): Add the objects reachable from a commit to a set.
+
+   -write_bitmap_index(): Write the bitmap file of a pack.
+*/
+
+#ifndef BGIT_WINDOWS
+    #define RENAME( src_file, target_file ) rename( src_file, target_file )
+    #define RENAME_FAIL -1
+#else
+    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
+                                                target_file, \
+                                                MOVEFILE_REPLACE_EXISTING )
+    #define RENAME_FAIL 0
+#endif
+
+/* Size of the bitmap file header and of one row of its table. */
+#define BITMAP_HDR_SIZE 32
+#define BITMAP_ROW_SIZE 28
+
+/* Limits of the run length and literal count in an EWAH marker word. */
+#define RLW_MAX_RUN 0xffffffffULL
+#define RLW_MAX_LITERALS 0x7fffffffULL
+
+/* One in this many commits gets a bitmap, besides the branch tips. */
+#define BITMAP_COMMIT_INTERVAL 100
+
+/*
+ * Read and write 64-bit big-endian integers.
+ */
+static unsigned long long get_be64(const unsigned char *p)
+{
+    return ((unsigned long long)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be64(unsigned char *p, unsigned long long val)
+{
+    put_be32(p, (unsigned int)(val >> 32));
+    put_be32(p + 4, (unsigned int)val);
+}
+
+/*
+ * Function: `bitmap_new`
+ * Parameters:
+ *      -nr_bits: The number of bits.
+ * Purpose: Allocate an uncompressed bitmap with all bits cleared.
+ */
+struct bitmap *bitmap_new(unsigned int nr_bits)
+{
+    struct bitmap *b = malloc(sizeof(*b));
+
+    b->nr_words = (nr_bits + 63) / 64;
+    b->words = calloc(b->nr_words ? b->nr_words : 1, sizeof(*b->words));
+    return b;
+}
+
+/*
+ * Function: `bitmap_set`
+ * Parameters:
+ *      -b: A bitmap.
+ *      -pos: The number of the bit to set.
+ * Purpose: Set one bit of a bitmap.
+ */
+void bitmap_set(struct bitmap *b, unsigned int pos)
+{
+    b->words[pos / 64] |= 1ULL << (pos % 64);
+}
+
+/*
+ * Function: `bitmap_get`
+ * Parameters:
+ *      -b: A bitmap.
+ *      -pos: The number of the bit to test.
+ * Purpose: Return nonzero if the bit is set.
+ */
+int bitmap_get(struct bitmap *b, unsigned int pos)
+{
+    return (b->words[pos / 64] >> (pos % 64)) & 1;
+}
+
+/*
+ * Function: `bitmap_free`
+ * Parameters:
+ *      -b: A bitmap.
+ * Purpose: Free a bitmap allocated by `bitmap_new()`.
+ */
+void bitmap_free(struct bitmap *b)
+{
+    if (!b)
+        return;
+    free(b->words);
+    free(b);
+}
+
+/*
+ * Function: `ewah_serialize`
+ * Parameters:
+ *      -b: The bitmap to compress.
+ *      -nr_bits: The number of bits in the bitmap that are meaningful.
+ *      -size: Filled in with the size of the result in bytes.
+ * Purpose: Compress a bitmap with EWAH and return it in its serialized form,
+ *          in newly allocated memory. Each group is a run of words that are
+ *          all zeroes or all ones, followed by the literal words up to the
+ *          next such word.
+ */
+unsigned char *ewah_serialize(struct bitmap *b, unsigned int nr_bits,
+                              unsigned long *size)
+{
+    unsigned long long *w = b->words;
+    unsigned int nr_words = (nr_bits + 63) / 64;
+    unsigned int i = 0, n = 0, last_rlw = 0;
+    unsigned char *out, *words;
+
+    /* At worst, every word is a literal preceded by its own marker. */
+    out = malloc(8 + (2UL * nr_words + 1) * 8 + 4);
+    words = out + 8;
+
+    do {
+        unsigned long long run = 0, bit = 0, literals = 0, rlw;
+        unsigned int start;
+
+        if (i < nr_words && (!w[i] || !~w[i])) {
+            unsigned long long fill = w[i];
+            bit = fill & 1;
+            while (i < nr_words && w[i] == fill && run < RLW_MAX_RUN) {
+                run++;
+                i++;
+            }
+        }
+        start = i;
+        while (i < nr_words && w[i] && ~w[i] && literals < RLW_MAX_LITERALS) {
+            literals++;
+            i++;
+        }
+
+        rlw = bit | (run << 1) | (literals << 33);
+        last_rlw = n;
+        put_be64(words + (unsigned long)n++ * 8, rlw);
+        for (; start < i; start++)
+            put_be64(words + (unsigned long)n++ * 8, w[start]);
+    } while (i < nr_words);
+
+    put_be32(out, nr_bits);
+    put_be32(out + 4, n);
+    put_be32(words + (unsigned long)n * 8, last_rlw);
+    *size = 8 + (unsigned long)n * 8 + 4;
+    return out;
+}
+
+/*
+ * Function: `ewah_or`
+ * Parameters:
+ *      -buf: A serialized EWAH bitmap.
+ *      -size: Its size in bytes.
+ *      -dst: The uncompressed bitmap to add its bits to.
+ * Purpose: Set every bit in `dst` that is set in the EWAH bitmap. Runs of
+ *          ones are filled in a word at a time and runs of zeroes are
+ *          skipped, so this never looks at individual bits. Returns -1 if
+ *          the EWAH bitmap is corrupt or larger than `dst`.
+ */
+int ewah_or(const unsigned char *buf, unsigned long size, struct bitmap *dst)
+{
+    unsigned int nr_bits, nr_words, i = 0, pos = 0;
+    const unsigned char *words = buf + 8;
+
+    if (size < 12)
+        return -1;
+    nr_bits = get_be32(buf);
+    nr_words = get_be32(buf + 4);
+    if (size < 8 + (unsigned long)nr_words * 8 + 4 ||
+        (nr_bits + 63) / 64 > dst->nr_words)
+        return -1;
+
+    while (i < nr_words) {
+        unsigned long long rlw = get_be64(words + (unsigned long)i++ * 8);
+        unsigned long long run = (rlw >> 1) & RLW_MAX_RUN;
+        unsigned long long literals = rlw >> 33;
+
+        if (pos + run + literals > dst->nr_words || i + literals > nr_words)
+            return -1;
+        if (rlw & 1)
+            memset(dst->words + pos, 0xff, run * sizeof(*dst->words));
+        pos += run;
+        while (literals--)
+            dst->words[pos++] |= get_be64(words + (unsigned long)i++ * 8);
+    }
+    return 0;
+}
+
+/*
+ * Function: `object_set_insert`
+ * Parameters:
+ *      -set: A hash set of objects.
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Add an object to the set. Returns 1 if it was not in the set yet,
+ *          and 0 if it was. The set is an open-addressing hash table keyed
+ *          by the first bytes of the SHA1 hash, which are already random.
+ */
+int object_set_insert(struct object_set *set, const unsigned char *sha1)
+{
+    unsigned int i, mask;
+    int rawsz = object_hash()->rawsz;
+
+    if (2 * (set->nr + 1) > set->alloc) {
+        struct object_set bigger;
+
+        bigger.alloc = set->alloc ? 2 * set->alloc : 64;
+        bigger.nr = 0;
+        bigger.sha1s = calloc(bigger.alloc, rawsz);
+        bigger.used = calloc(bigger.alloc, 1);
+        for (i = 0; i < set->alloc; i++)
+            if (set->used[i])
+                object_set_insert(&bigger,
+                                  set->sha1s + (unsigned long)i * rawsz);
+        free(set->sha1s);
+        free(set->used);
+        *set = bigger;
+    }
+
+    mask = set->alloc - 1;
+    i = get_be32(sha1) & mask;
+    while (set->used[i]) {
+        if (!memcmp(set->sha1s + (unsigned long)i * rawsz, sha1, rawsz))
+            return 0;
+        i = (i + 1) & mask;
+    }
+    set->used[i] = 1;
+    memcpy(set->sha1s + (unsigned long)i * rawsz, sha1, rawsz);
+    set->nr++;
+    return 1;
+}
+
+/*
+ * Function: `open_bitmap_index`
+ * Parameters: none
+ * Purpose: Find the first pack that has a bitmap file, map the file, check
+ *          that it belongs to the pack and return a `bitmap_index`
+ *          describing it. Returns NULL if no pack has a usable bitmap file.
+ */
+struct bitmap_index *open_bitmap_index(void)
+{
+    struct packed_git *p;
+
+    prepare_packed_git();
+    for (p = packed_git; p; p = p->next) {
+        struct bitmap_index *bi;
+        struct stat st;
+        unsigned char *map;
+        unsigned long size;
+        unsigned int nr, i;
+        char *path;
+        int len = strlen(p->pack_name), fd;
+
+        path = malloc(len + 3);
+        memcpy(path, p->pack_name, len - 5);
+        strcpy(path + len - 5, ".bitmap");
+        fd = OPEN_FILE(path, O_RDONLY, 0);
+        free(path);
+        if (fd < 0)
+            continue;
+        if (fstat(fd, &st) < 0 || st.st_size < BITMAP_HDR_SIZE + 20) {
+            close(fd);
+            continue;
+        }
+        size = st.st_size;
+        map = map_fd(fd, size);
+        close(fd);
+        if (!map)
+            continue;
+
+        if (get_be32(map) != BITMAP_SIGNATURE ||
+            get_be32(map + 4) != BITMAP_VERSION) {
+            error("unknown bitmap file format");
+            goto unmap;
+        }
+        nr = get_be32(map + 8);
+        if (size < BITMAP_HDR_SIZE + (unsigned long)nr * BITMAP_ROW_SIZE + 20) {
+            error("bitmap file truncated");
+            goto unmap;
+        }
+        /* The pack's own hash is the first of the two at the end of its index. */
+        if (memcmp(map + 12, p->index_map + p->index_size - 40, 20)) {
+            error("bitmap file does not match its pack");
+            goto unmap;
+        }
+        for (i = 0; i < nr; i++) {
+            unsigned char *row = map + BITMAP_HDR_SIZE + i * BITMAP_ROW_SIZE;
+            unsigned long off = get_be32(row + 20), sz = get_be32(row + 24);
+            if (off > size - 20 || sz > size - 20 - off)
+                break;
+        }
+        if (i < nr) {
+            error("bitmap file is corrupt");
+            goto unmap;
+        }
+
+        bi = calloc(1, sizeof(*bi));
+        bi->pack = p;
+        bi->map = map;
+        bi->size = size;
+        bi->nr = nr;
+        return bi;
+
+        /* The bitmap is not usable: remove the mapping made above. */
+unmap:
+        #ifndef BGIT_WINDOWS
+        munmap(map, size);
+        #else
+        UnmapViewOfFile( map );
+        #endif
+    }
+    return NULL;
+}
+
+/*
+ * Function: `bitmap_commit_compare`
+ * Parameters:
+ *      -a, b: Pointers to two commits.
+ * Purpose: `qsort()`/`bsearch()` comparison function ordering commits by
+ *          SHA1 hash.
+ */
+static int bitmap_commit_compare(const void *a, const void *b)
+{
+    const struct bitmap_commit *x = a, *y = b;
+    return memcmp(x->sha1, y->sha1, 20);
+}
+
+/*
+ * Function: `find_commit`
+ * Parameters:
+ *      -commits: The sorted array of commits.
+ *      -nr: The number of commits.
+ *      -sha1: The SHA1 hash to look for.
+ * Purpose: Binary search the array of commits.
+ */
+static struct bitmap_commit *find_commit(struct bitmap_commit *commits,
+                                         unsigned int nr,
+                                         const unsigned char *sha1)
+{
+    struct bitmap_commit key;
+
+    key.sha1 = sha1;
+    return bsearch(&key, commits, nr, sizeof(*commits),
+                   bitmap_commit_compare);
+}
+
+/*
+ * Function: `lookup_bitmap`
+ * Parameters:
+ *      -bi: A mapped bitmap file.
+ *      -sha1: The SHA1 hash of a commit.
+ *      -size: Filled in with the size of the bitmap.
+ * Purpose: Binary search the table of a bitmap file for a commit, and return
+ *          a pointer to its EWAH bitmap, or NULL if it does not have one.
+ */
+const unsigned char *lookup_bitmap(struct bitmap_index *bi,
+                                   const unsigned char *sha1,
+                                   unsigned long *size)
+{
+    unsigned int first = 0, last = bi->nr;
+
+    /* While a bitmap file is being written, its bitmaps are in memory. */
+    if (!bi->map) {
+        struct bitmap_commit *bc = find_commit(bi->commits, bi->nr, sha1);
+        if (!bc || !bc->ewah)
+            return NULL;
+        *size = bc->ewah_size;
+        return bc->ewah;
+    }
+
+    while (last > first) {
+        unsigned int next = (first + last) >> 1;
+        unsigned char *row = bi->map + BITMAP_HDR_SIZE + next * BITMAP_ROW_SIZE;
+        int cmp = memcmp(row, sha1, 20);
+        if (!cmp) {
+            *size = get_be32(row + 24);
+            return bi->map + get_be32(row + 20);
+        }
+        if (cmp > 0)
+            last = next;
+        else
+            first = next + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Function: `mark_object`
+ * Parameters:
+ *      -r: The set being built.
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Add an object to the set: its bit if it is in the pack the set's
+ *          bitmap covers, otherwise the hash set of other objects. Returns
+ *          1 if the object was not in the set yet.
+ */
+static int mark_object(struct reachable *r, const unsigned char *sha1)
+{
+    int pos = -1;
+
+    if (r->pack)
+        pos = find_pack_index_pos(r->pack, (unsigned char *)sha1);
+    if (pos < 0)
+        return object_set_insert(&r->extra, sha1);
+    if (bitmap_get(r->bits, pos))
+        return 0;
+    bitmap_set(r->bits, pos);
+    return 1;
+}
+
+/*
+ * Function: `walk_tree`
+ * Parameters:
+ *      -r: The set being built.
+ *      -sha1: The SHA1 hash of a tree.
+ * Purpose: Add a tree and everything it names to the set. Entries whose mode
+ *          is a directory are trees themselves and are walked too.
+ */
+static int walk_tree(struct reachable *r, const unsigned char *sha1)
+{
+    char type[20];
+    unsigned long size;
+    char *buf, *p, *end;
+    int rawsz = object_hash()->rawsz;
+
+    if (!mark_object(r, sha1))
+        return 0;
+    buf = read_sha1_file((unsigned char *)sha1, type, &size);
+    if (!buf || strcmp(type, "tree")) {
+        free(buf);
+        return error("unable to read tree");
+    }
+
+    p = buf;
+    end = buf + size;
+    while (p < end) {
+        char *nul = memchr(p, 0, end - p);
+        unsigned int mode;
+
+        if (!nul || nul + 1 + rawsz > end || sscanf(p, "%o", &mode) != 1) {
+            free(buf);
+            return error("corrupt 'tree' file");
+        }
+        if (S_ISDIR(mode)) {
+            if (walk_tree(r, (unsigned char *)nul + 1) < 0) {
+                free(buf);
+                return -1;
+            }
+        } else {
+            mark_object(r, (unsigned char *)nul + 1);
+        }
+        p = nul + 1 + rawsz;
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * Function: `walk_reachable`
+ * Parameters:
+ *      -r: The set being built. Objects already in it are not walked again.
+ *      -bi: A bitmap file to take shortcuts from, or NULL.
+ *      -sha1: The SHA1 hash of a commit.
+ * Purpose: Add every object reachable from a commit to the set. Commits are
+ *          kept on a stack instead of being walked recursively, since the
+ *          history can be much deeper than the C stack. A commit that has a
+ *          bitmap in `bi` is not read at all: its bitmap is ORed into the
+ *          set, and covers everything reachable from it.
+ */
+int walk_reachable(struct reachable *r, struct bitmap_index *bi,
+                   const unsigned char *sha1)
+{
+    unsigned char (*stack)[MAX_RAWSZ] = malloc(MAX_RAWSZ * 64);
+    unsigned int nr = 0, alloc = 64;
+    int rawsz = object_hash()->rawsz, hexsz = object_hash()->hexsz;
+    int ret = 0;
+
+    memcpy(stack[nr++], sha1, rawsz);
+    while (nr && !ret) {
+        unsigned char commit[MAX_RAWSZ], tree[MAX_RAWSZ];
+        const unsigned char *ewah;
+        unsigned long size;
+        char type[20], *buf, *p, *end;
+
+        memcpy(commit, stack[--nr], rawsz);
+        if (bi && bi->pack == r->pack &&
+            (ewah = lookup_bitmap(bi, commit, &size)) != NULL) {
+            if (ewah_or(ewah, size, r->bits) < 0)
+                ret = error("corrupt bitmap");
+            continue;
+        }
+        if (!mark_object(r, commit))
+            continue;
+
+        buf = read_sha1_file(commit, type, &size);
+        if (!buf || strcmp(type, "commit") || size < 5 + hexsz + 1 ||
+            memcmp(buf, "tree ", 5) || get_sha1_hex(buf + 5, tree)) {
+            free(buf);
+            ret = error("unable to read commit");
+            break;
+        }
+        ret = walk_tree(r, tree);
+
+        /*
+         * Push the parents; each "parent <hex>" line is 48 bytes with SHA1
+         * names.
+         */
+        p = buf + 5 + hexsz + 1;
+        end = buf + size;
+        while (p + 7 + hexsz + 1 <= end && !memcmp(p, "parent ", 7)) {
+            if (nr == alloc) {
+                alloc *= 2;
+                stack = realloc(stack, MAX_RAWSZ * alloc);
+            }
+            if (get_sha1_hex(p + 7, stack[nr]) < 0)
+                break;
+            nr++;
+            p += 7 + hexsz + 1;
+        }
+        free(buf);
+    }
+    free(stack);
+    return ret;
+}
+
+/*
+ * Function: `write_bitmap_index`
+ * Parameters:
+ *      -p: The pack to write the bitmap file for.
+ *      -commit_sha1s: The SHA1 hashes of the commits in the pack.
+ *      -nr: The number of commits.
+ * Purpose: Choose the commits that get a bitmap, build their bitmaps and
+ *          write them to `pack-<hex>.bitmap`.
+ *
+ *          The tips of the history (commits in the pack that no other commit
+ *          in the pack names as a parent) always get a bitmap, since those
+ *          are what queries usually start from. So does every 100th commit
+ *          met while walking back from the tips, so that the walk for any
+ *          other commit soon reaches one. The selected commits are then
+ *          built starting from the last one met, i.e. roughly the oldest,
+ *          so that each walk can stop at the bitmaps built before it.
+ *
+ *          A commit only gets a bitmap if everything reachable from it is
+ *          in the pack, since the bitmap has no bits for other objects.
+ */
+int write_bitmap_index(struct packed_git *p, unsigned char **commit_sha1s,
+                       unsigned int nr)
+{
+    struct bitmap_commit *commits = calloc(nr ? nr : 1, sizeof(*commits));
+    struct bitmap_commit **order = malloc((nr ? nr : 1) * sizeof(*order));
+    struct bitmap_index bi;
+    unsigned int i, nr_order = 0, nr_selected = 0, nr_written = 0;
+    unsigned long size, pos;
+    unsigned char *buf, *row;
+    char *path, *tmp;
+    struct sha1_ctx c;
+    int len, fd;
+
+    for (i = 0; i < nr; i++)
+        commits[i].sha1 = commit_sha1s[i];
+    qsort(commits, nr, sizeof(*commits), bitmap_commit_compare);
+
+    /* Find the tips by marking every commit that is someone's parent. */
+    for (i = 0; i < nr; i++) {
+        char type[20], *data, *q, *end;
+        unsigned char parent[20];
+        unsigned long data_size;
+
+        data = read_sha1_file((unsigned char *)commits[i].sha1, type,
+                              &data_size);
+        if (!data)
+            return error("unable to read commit");
+        q = data + 46;
+        end = data + data_size;
+        while (data_size >= 46 && q + 48 <= end && !memcmp(q, "parent ", 7) &&
+               !get_sha1_hex(q + 7, parent)) {
+            struct bitmap_commit *pc = find_commit(commits, nr, parent);
+            if (pc)
+                pc->is_parent = 1;
+            q += 48;
+        }
+        free(data);
+    }
+
+    /*
+     * Number the commits breadth first from the tips. Every commit in the
+     * pack is reachable from some tip, unless the history has a cycle.
+     */
+    for (i = 0; i < nr; i++)
+        if (!commits[i].is_parent) {
+            commits[i].selected = 1;
+            order[nr_order++] = &commits[i];
+        }
+    for (i = 0; i < nr_order; i++) {
+        char type[20], *data, *q, *end;
+        unsigned char parent[20];
+        unsigned long data_size;
+
+        if (i % BITMAP_COMMIT_INTERVAL == BITMAP_COMMIT_INTERVAL - 1)
+            order[i]->selected = 1;
+        data = read_sha1_file((unsigned char *)order[i]->sha1, type,
+                              &data_size);
+        if (!data)
+            return error("unable to read commit");
+        q = data + 46;
+        end = data + data_size;
+        while (data_size >= 46 && q + 48 <= end && !memcmp(q, "parent ", 7) &&
+               !get_sha1_hex(q + 7, parent)) {
+            struct bitmap_commit *pc = find_commit(commits, nr, parent);
+            if (pc && pc->is_parent == 1) {
+                pc->is_parent = 2;
+                order[nr_order++] = pc;
+            }
+            q += 48;
+        }
+        free(data);
+    }
+
+    /*
+     * Build the bitmaps oldest first, looking the ones already built up in
+     * `commits` so that later walks can stop at them.
+     */
+    memset(&bi, 0, sizeof(bi));
+    bi.pack = p;
+    bi.commits = commits;
+    bi.nr = nr;
+    for (i = nr_order; i-- > 0; ) {
+        struct bitmap_commit *bc = order[i];
+        struct reachable r;
+
+        if (!bc->selected)
+            continue;
+        nr_selected++;
+        memset(&r, 0, sizeof(r));
+        r.pack = p;
+        r.bits = bitmap_new(p->num_objects);
+        if (!walk_reachable(&r, &bi, bc->sha1) && !r.extra.nr) {
+            bc->ewah = ewah_serialize(r.bits, p->num_objects, &bc->ewah_size);
+            nr_written++;
+        }
+        bitmap_free(r.bits);
+        free(r.extra.sha1s);
+        free(r.extra.used);
+    }
+
+    /* Lay out the header, the table and the bitmaps in commit order. */
+    size = BITMAP_HDR_SIZE + (unsigned long)nr_written * BITMAP_ROW_SIZE + 20;
+    for (i = 0; i < nr; i++)
+        size += commits[i].ewah_size;
+    buf = calloc(1, size);
+    put_be32(buf, BITMAP_SIGNATURE);
+    put_be32(buf + 4, BITMAP_VERSION);
+    put_be32(buf + 8, nr_written);
+    memcpy(buf + 12, p->index_map + p->index_size - 40, 20);
+    row = buf + BITMAP_HDR_SIZE;
+    pos = BITMAP_HDR_SIZE + (unsigned long)nr_written * BITMAP_ROW_SIZE;
+    for (i = 0; i < nr; i++) {
+        if (!commits[i].ewah)
+            continue;
+        memcpy(row, commits[i].sha1, 20);
+        put_be32(row + 20, pos);
+        put_be32(row + 24, commits[i].ewah_size);
+        memcpy(buf + pos, commits[i].ewah, commits[i].ewah_size);
+        pos += commits[i].ewah_size;
+        row += BITMAP_ROW_SIZE;
+    }
+    sha1_init(&c);
+    sha1_update(&c, buf, size - 20);
+    sha1_final(buf + size - 20, &c);
+
+    len = strlen(p->pack_name);
+    path = malloc(len + 3);
+    memcpy(path, p->pack_name, len - 5);
+    strcpy(path + len - 5, ".bitmap");
+    tmp = malloc(len + 8);
+    sprintf(tmp, "%s.lock", path);
+    fd = OPEN_FILE(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, buf, size) != size) {
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+        return error("unable to write bitmap file");
+    }
+    close(fd);
+    if (RENAME(tmp, path) == RENAME_FAIL) {
+        unlink(tmp);
+        return error("unable to rename bitmap file");
+    }
+    fprintf(stderr, "Bitmaps %u (of %u selected commits)\n", nr_written,
+            nr_selected);
+
+    for (i = 0; i < nr; i++)
+        free(commits[i].ewah);
+    free(commits);
+    free(order);
+    free(buf);
+    free(path);
+    free(tmp);
+    return 0;
+}
@@ -0,0 +1,527 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define the BLAKE3 hash, one of the hash
+ *  algorithms a repository can name its objects with (see hash.c).
+ *
+ *  Unlike SHA1 and SHA256, which mix a message into one state a block at a
+ *  time, BLAKE3 is a tree:
+ *
+ *  -The message is cut into chunks of 1024 bytes. Each chunk is hashed on
+ *   its own, 64 bytes at a time, into a 32-byte "chaining value" (CV). The
+ *   number of the chunk is part of what is hashed.
+ *
+ *  -Pairs of CVs are hashed into the CV of their "parent", pairs of those
+ *   into theirs, and so on up to the root, which gives the hash. The left
+ *   subtree of every parent holds the largest power of two number of
+ *   chunks that leaves at least one for the right.
+ *
+ *  Subtrees do not depend on each other, so a large message can be hashed
+ *  on several threads: each takes a subtree, and only the CVs of the
+ *  subtrees are combined at the end. That is what `blake3_update()` does
+ *  when it is given a large piece of the message at once.
+ *
+ *  Hashing a piece at a time works like this: CVs of finished subtrees are
+ *  kept on a stack, and two CVs on top of the stack are merged into their
+ *  parent as soon as it is certain that more chunks follow them. How many
+ *  CVs the stack holds after N chunks is the number of bits set in N. The
+ *  last chunk, and with it the root, is only finished by `blake3_final()`.
+ */
+#include "cache.h"
+#include <pthread.h>
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <pthread.h> header files, ranked in order
+   of first use in this file. Function names are followed by parenthesis
+   whereas variable/struct names are not:
+
+   -memcpy(s1, s2, n): Copy n bytes from the object pointed to by s2 into the
+                       object pointed to by s1. Sourced from <string.h>.
+
+   -memset(void *s, int c, size_t n): Copies `c` (converted to an unsigned
+                                      char) into each of the first `n` bytes
+                                      of the object pointed to by `s`.
+
+   -pthread_create()/pthread_join(): Start and wait for a thread. Sourced
+                                     from <pthread.h>.
+
+   -blake3_ctx: Structure holding the state of a hash being computed.
+                Sourced from "cache.h".
+
+   -hash_threads(): Return how many threads may hash one object. Sourced
+                    from "cache.h" (defined in hash.c).
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN: The sizes of a chunk and of a block.
+
+   -CHUNK_START/CHUNK_END/PARENT/ROOT: Flags telling what is being hashed.
+
+   -BLAKE3_PARALLEL_MIN: The smallest subtree worth giving its own thread.
+
+   -blake3_iv: The starting value, which is also the key when not hashing
+               with a key.
+
+   -msg_schedule: The order of the message words in each round.
+
+   -get_le32(): Read a little-endian 32-bit word.
+
+   -g()/compress_block(): The BLAKE3 compression function.
+
+   -chunk_cv(): Hash a whole chunk into its CV.
+
+   -parent_cv(): Hash two CVs into the CV of their parent.
+
+   -subtree_job: A subtree hashed on another thread.
+
+   -subtree_cv(): Hash a subtree into its CV, on several threads if it is
+                  large.
+
+   -subtree_thread(): The function such a thread runs.
+
+   -chunk_update()/chunk_output(): Hash the current chunk a piece at a time.
+
+   -push_cv()/merge_cv_stack(): Keep the stack of CVs.
+
+   -blake3_init(): Start a hash.
+
+   -blake3_update(): Add data to a hash.
+
+   -blake3_final(): Finish a hash.
+*/
+
+/* The size of a chunk and of a block within a chunk. */
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_BLOCK_LEN 64
+
+/* Flags telling the compression function what it is hashing. */
+#define CHUNK_START (1 << 0)
+#define CHUNK_END   (1 << 1)
+#define PARENT      (1 << 2)
+#define ROOT        (1 << 3)
+
+/*
+ * The smallest subtree worth hashing on a thread of its own. Starting a
+ * thread costs about as much as hashing a few kilobytes.
+ */
+#define BLAKE3_PARALLEL_MIN (256 * 1024)
+
+/* The starting value, as given by the BLAKE3 specification. */
+static const unsigned int blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* The order in which each round takes the message words of the last. */
+static const unsigned char msg_schedule[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+/*
+ * Function: `get_le32`
+ * Parameters:
+ *      -p: Four bytes.
+ * Purpose: Read a little-endian 32-bit word, which is how BLAKE3 reads its
+ *          input.
+ */
+static unsigned int get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+/* Rotate a 32-bit word right by `n` bits. */
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * Function: `g`
+ * Parameters:
+ *      -s: The 16 words of the state.
+ *      -a, b, c, d: Which four words to mix.
+ *      -x, y: Two message words to mix in.
+ * Purpose: The quarter-round that the compression function is built from.
+ */
+static void g(unsigned int *s, int a, int b, int c, int d, unsigned int x,
+              unsigned int y)
+{
+    s[a] = s[a] + s[b] + x;
+    s[d] = ROR(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = ROR(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + y;
+    s[d] = ROR(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = ROR(s[b] ^ s[c], 7);
+}
+
+/*
+ * Function: `compress_block`
+ * Parameters:
+ *      -cv: The eight words of the chaining value, which are replaced with
+ *           the result.
+ *      -block: 64 bytes to hash, padded with zeroes if shorter.
+ *      -block_len: How many of them are used.
+ *      -counter: The number of the chunk (0 for parents).
+ *      -flags: What is being hashed.
+ * Purpose: Mix one block into a chaining value, in seven rounds of eight
+ *          quarter-rounds each.
+ */
+static void compress_block(unsigned int *cv, const unsigned char *block,
+                           unsigned int block_len, unsigned long long counter,
+                           unsigned int flags)
+{
+    unsigned int s[16], m[16], t[16];
+    int i, r;
+
+    for (i = 0; i < 16; i++)
+        m[i] = get_le32(block + 4 * i);
+    memcpy(s, cv, 32);
+    memcpy(s + 8, blake3_iv, 16);
+    s[12] = (unsigned int) counter;
+    s[13] = (unsigned int) (counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    for (r = 0; r < 7; r++) {
+        g(s, 0, 4, 8, 12, m[0], m[1]);
+        g(s, 1, 5, 9, 13, m[2], m[3]);
+        g(s, 2, 6, 10, 14, m[4], m[5]);
+        g(s, 3, 7, 11, 15, m[6], m[7]);
+        g(s, 0, 5, 10, 15, m[8], m[9]);
+        g(s, 1, 6, 11, 12, m[10], m[11]);
+        g(s, 2, 7, 8, 13, m[12], m[13]);
+        g(s, 3, 4, 9, 14, m[14], m[15]);
+        if (r == 6)
+            break;
+        for (i = 0; i < 16; i++)
+            t[i] = m[msg_schedule[i]];
+        memcpy(m, t, sizeof(m));
+    }
+    for (i = 0; i < 8; i++)
+        cv[i] = s[i] ^ s[i + 8];
+}
+
+/*
+ * Function: `chunk_cv`
+ * Parameters:
+ *      -cv: Where to store the eight words of the chunk's CV.
+ *      -input: A whole chunk, BLAKE3_CHUNK_LEN bytes.
+ *      -counter: The number of the chunk.
+ * Purpose: Hash a whole chunk that is known not to be the root.
+ */
+static void chunk_cv(unsigned int *cv, const unsigned char *input,
+                     unsigned long long counter)
+{
+    int i;
+
+    memcpy(cv, blake3_iv, 32);
+    for (i = 0; i < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; i++)
+        compress_block(cv, input + i * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN,
+                       counter, (i == 0 ? CHUNK_START : 0) |
+                       (i == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ?
+                        CHUNK_END : 0));
+}
+
+/*
+ * Function: `parent_cv`
+ * Parameters:
+ *      -cv: Where to store the eight words of the parent's CV.
+ *      -left, right: The CVs of the parent's children.
+ *      -flags: PARENT, or PARENT | ROOT for the root.
+ * Purpose: Hash two CVs into their parent's.
+ */
+static void parent_cv(unsigned int *cv, const unsigned int *left,
+                      const unsigned int *right, unsigned int flags)
+{
+    unsigned char block[BLAKE3_BLOCK_LEN];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        block[4 * i] = left[i];
+        block[4 * i + 1] = left[i] >> 8;
+        block[4 * i + 2] = left[i] >> 16;
+        block[4 * i + 3] = left[i] >> 24;
+        block[32 + 4 * i] = right[i];
+        block[32 + 4 * i + 1] = right[i] >> 8;
+        block[32 + 4 * i + 2] = right[i] >> 16;
+        block[32 + 4 * i + 3] = right[i] >> 24;
+    }
+    memcpy(cv, blake3_iv, 32);
+    compress_block(cv, block, BLAKE3_BLOCK_LEN, 0, flags);
+}
+
+/*
+ * Template of a subtree hashed on a thread of its own by `subtree_cv()`.
+ */
+struct subtree_job {
+    const unsigned char *input;
+    unsigned long len;
+    unsigned long long counter;
+    int threads;
+    unsigned int cv[8];
+};
+
+static void subtree_cv(unsigned int *cv, const unsigned char *input,
+                       unsigned long len, unsigned long long counter,
+                       int threads);
+
+/*
+ * Function: `subtree_thread`
+ * Parameters:
+ *      -data: The `subtree_job`.
+ * Purpose: Hash a subtree on a thread of its own.
+ */
+static void *subtree_thread(void *data)
+{
+    struct subtree_job *job = data;
+
+    subtree_cv(job->cv, job->input, job->len, job->counter, job->threads);
+    return NULL;
+}
+
+/*
+ * Function: `subtree_cv`
+ * Parameters:
+ *      -cv: Where to store the eight words of the subtree's CV.
+ *      -input: The subtree's chunks.
+ *      -len: Their length, a power of two number of whole chunks.
+ *      -counter: The number of the first chunk.
+ *      -threads: How many threads may hash the subtree.
+ * Purpose: Hash a subtree that is known not to be the whole message. A
+ *          large one is split between threads: the left half is given to
+ *          a new thread with half of them, while this thread hashes the
+ *          right half.
+ */
+static void subtree_cv(unsigned int *cv, const unsigned char *input,
+                       unsigned long len, unsigned long long counter,
+                       int threads)
+{
+    unsigned long half = len / 2;
+    struct subtree_job left;
+    unsigned int right[8];
+    pthread_t thread;
+    int on_thread = 0;
+
+    if (len == BLAKE3_CHUNK_LEN) {
+        chunk_cv(cv, input, counter);
+        return;
+    }
+    left.input = input;
+    left.len = half;
+    left.counter = counter;
+    left.threads = threads / 2;
+    if (threads > 1 && half >= BLAKE3_PARALLEL_MIN)
+        on_thread = !pthread_create(&thread, NULL, subtree_thread, &left);
+    if (!on_thread) {
+        left.threads = threads;
+        subtree_thread(&left);
+    }
+    subtree_cv(right, input + half, half, counter + half / BLAKE3_CHUNK_LEN,
+               on_thread ? threads - threads / 2 : threads);
+    if (on_thread)
+        pthread_join(thread, NULL);
+    parent_cv(cv, left.cv, right, PARENT);
+}
+
+/*
+ * Function: `chunk_update`
+ * Parameters:
+ *      -c: The hash.
+ *      -input: Data that belongs to the current chunk.
+ *      -len: Its length, at most what the chunk still has room for.
+ * Purpose: Add data to the current chunk. A full block is only hashed once
+ *          more data follows it, since the last block of the chunk is
+ *          hashed with the CHUNK_END flag, and, if the chunk is the whole
+ *          message, with ROOT.
+ */
+static void chunk_update(struct blake3_ctx *c, const unsigned char *input,
+                         unsigned long len)
+{
+    while (len) {
+        unsigned long take;
+
+        if (c->buf_len == BLAKE3_BLOCK_LEN) {
+            compress_block(c->cv, c->buf, BLAKE3_BLOCK_LEN,
+                           c->chunk_counter,
+                           c->blocks_compressed ? 0 : CHUNK_START);
+            c->blocks_compressed++;
+            c->buf_len = 0;
+            memset(c->buf, 0, BLAKE3_BLOCK_LEN);
+        }
+        take = BLAKE3_BLOCK_LEN - c->buf_len;
+        if (take > len)
+            take = len;
+        memcpy(c->buf + c->buf_len, input, take);
+        c->buf_len += take;
+        input += take;
+        len -= take;
+    }
+}
+
+/*
+ * Function: `chunk_output`
+ * Parameters:
+ *      -c: The hash.
+ *      -cv: Where to store the eight words of the chunk's CV.
+ *      -flags: 0, or ROOT if the chunk is the whole message.
+ * Purpose: Finish the current chunk, then start the next one.
+ */
+static void chunk_output(struct blake3_ctx *c, unsigned int *cv,
+                         unsigned int flags)
+{
+    memcpy(cv, c->cv, 32);
+    compress_block(cv, c->buf, c->buf_len, c->chunk_counter,
+                   (c->blocks_compressed ? 0 : CHUNK_START) | CHUNK_END |
+                   flags);
+    memcpy(c->cv, blake3_iv, 32);
+    memset(c->buf, 0, BLAKE3_BLOCK_LEN);
+    c->buf_len = 0;
+    c->blocks_compressed = 0;
+    c->chunk_counter++;
+}
+
+/*
+ * Function: `merge_cv_stack`
+ * Parameters:
+ *      -c: The hash.
+ *      -total_chunks: How many chunks have been finished.
+ * Purpose: Merge the CVs on top of the stack into their parents, until the
+ *          stack holds one CV per bit set in `total_chunks`. This is only
+ *          done once more chunks are known to follow, so the root is never
+ *          merged early.
+ */
+static void merge_cv_stack(struct blake3_ctx *c,
+                           unsigned long long total_chunks)
+{
+    unsigned int bits = 0;
+
+    for (; total_chunks; total_chunks &= total_chunks - 1)
+        bits++;
+    while (c->cv_stack_len > bits) {
+        unsigned int *left = c->cv_stack[c->cv_stack_len - 2];
+        parent_cv(left, left, c->cv_stack[c->cv_stack_len - 1], PARENT);
+        c->cv_stack_len--;
+    }
+}
+
+/*
+ * Function: `push_cv`
+ * Parameters:
+ *      -c: The hash.
+ *      -cv: The CV of a finished subtree.
+ *      -counter: The number of the subtree's first chunk.
+ * Purpose: Put a CV on the stack, merging what can be merged first.
+ */
+static void push_cv(struct blake3_ctx *c, const unsigned int *cv,
+                    unsigned long long counter)
+{
+    merge_cv_stack(c, counter);
+    memcpy(c->cv_stack[c->cv_stack_len++], cv, 32);
+}
+
+/*
+ * Function: `blake3_init`
+ * Parameters:
+ *      -c: The hash to start.
+ * Purpose: Start a hash.
+ */
+void blake3_init(struct blake3_ctx *c)
+{
+    memset(c, 0, sizeof(*c));
+    memcpy(c->cv, blake3_iv, 32);
+}
+
+/*
+ * Function: `blake3_update`
+ * Parameters:
+ *      -c: The hash.
+ *      -data: The data to add.
+ *      -len: The length of the data.
+ * Purpose: Add data to a hash. After finishing the current chunk, whole
+ *          subtrees are hashed straight from `data`, as large as the data
+ *          and the chunks hashed so far allow, and with as many threads as
+ *          `hash_threads()` allows. The last chunk always goes into the
+ *          chunk state, in case it is the last of the message.
+ */
+void blake3_update(struct blake3_ctx *c, const void *data, unsigned long len)
+{
+    const unsigned char *p = data;
+    unsigned int cv[8];
+
+    if (c->buf_len || c->blocks_compressed) {
+        unsigned long take = BLAKE3_CHUNK_LEN - BLAKE3_BLOCK_LEN *
+                             c->blocks_compressed - c->buf_len;
+        if (take > len)
+            take = len;
+        chunk_update(c, p, take);
+        p += take;
+        len -= take;
+        if (!len)
+            return;
+        chunk_output(c, cv, 0);
+        push_cv(c, cv, c->chunk_counter - 1);
+    }
+
+    while (len > BLAKE3_CHUNK_LEN) {
+        unsigned long subtree = BLAKE3_CHUNK_LEN;
+        unsigned long long offset = c->chunk_counter * BLAKE3_CHUNK_LEN;
+
+        /*
+         * The largest power of two number of chunks that fits in the data,
+         * leaves at least one byte behind, and starts at a multiple of its
+         * own size.
+         */
+        while (2 * subtree < len && !(offset & (2 * subtree - 1)))
+            subtree *= 2;
+        subtree_cv(cv, p, subtree, c->chunk_counter, hash_threads());
+        push_cv(c, cv, c->chunk_counter);
+        c->chunk_counter += subtree / BLAKE3_CHUNK_LEN;
+        p += subtree;
+        len -= subtree;
+    }
+
+    if (len) {
+        chunk_update(c, p, len);
+        merge_cv_stack(c, c->chunk_counter);
+    }
+}
+
+/*
+ * Function: `blake3_final`
+ * Parameters:
+ *      -out: Where to store the 32-byte hash.
+ *      -c: The hash.
+ * Purpose: Finish a hash: the last chunk is finished, then merged with the
+ *          CVs on the stack from the top down, and the last merge is the
+ *          root.
+ */
+void blake3_final(unsigned char *out, struct blake3_ctx *c)
+{
+    unsigned int cv[8];
+    int i, n = c->cv_stack_len;
+
+    chunk_output(c, cv, n ? 0 : ROOT);
+    while (n--)
+        parent_cv(cv, c->cv_stack[n], cv, n ? PARENT : PARENT | ROOT);
+    for (i = 0; i < 32; i++)
+        out[i] = cv[i / 4] >> (8 * (i % 4));
+}
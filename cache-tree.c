@@ -0,0 +1,404 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to remember, in the index, the tree objects
+ *  `write-tree` wrote, so that it does not have to build and hash them
+ *  again while the files they hold are not changed.
+ *
+ *  The cache tree has a node for each directory of the index (the root
+ *  node for the whole index), holding:
+ *
+ *  -The number of index entries below the directory, or -1 once one of
+ *   them was added, changed or removed, which makes the node invalid.
+ *
+ *  -The name of the tree object for the directory, when it is valid.
+ *
+ *  -A node for each subdirectory, sorted by name.
+ *
+ *  `update-cache` invalidates the nodes of the directories above every path
+ *  whose entry it adds, changes or removes (`cache_tree_invalidate_path()`),
+ *  and `write-tree` only builds the trees of invalid nodes.
+ *
+ *  The cache tree is stored in the "TREE" extension of the index (see
+ *  read-cache.c), as the nodes in pre-order, each one as:
+ *
+ *      <name> NUL <entry count> SP <number of subdirectories> LF <object name>
+ *
+ *  where the counts are in ASCII decimal, the name of the root node is empty
+ *  and the object name (`object_hash()->rawsz` bytes) is left out of
+ *  invalid nodes. The subdirectories of a node follow it.
+ */
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -calloc(nmemb, size): Allocate zeroed memory for an array. Sourced from
+                         <stdlib.h>.
+
+   -free(ptr): Free allocated memory. Sourced from <stdlib.h>.
+
+   -cache_name_compare(): Compare two names the way the index orders them.
+                          Sourced from "cache.h" (defined in read-cache.c).
+
+   -alloc_nr(x): Grow an allocation. Sourced from "cache.h".
+
+   -realloc(ptr, size): Resize an allocated block of memory. Sourced from
+                        <stdlib.h>.
+
+   -memmove(dest, src, n): Move memory that may overlap. Sourced from
+                           <string.h>.
+
+   -malloc(size): Allocate memory. Sourced from <stdlib.h>.
+
+   -memcpy(dest, src, n): Copy memory. Sourced from <string.h>.
+
+   -strchr(s, c): Find a character in a string. Sourced from <string.h>.
+
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
+   -memchr(s, c, n): Find a byte in memory. Sourced from <string.h>.
+
+   -sprintf(s, format, ...): Print to a string. Sourced from <stdio.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -active_cache_tree: The cache tree of the index, or NULL.
+
+   -cache_tree_new(): Allocate an invalid node.
+
+   -cache_tree_free(): Free a node and the nodes below it.
+
+   -subtree_pos(): Find a subdirectory of a node by its name.
+
+   -cache_tree_sub(): Return a subdirectory of a node.
+
+   -cache_tree_invalidate_path(): Invalidate the nodes above a path.
+
+   -parse_count(): Parse a count in the extension.
+
+   -read_one(): Read a node and the nodes below it from the extension.
+
+   -cache_tree_read(): Read the cache tree from the extension.
+
+   -tree_buffer: A growing buffer for `cache_tree_write()`.
+
+   -write_one(): Append a node and the nodes below it to the extension.
+
+   -cache_tree_write(): Build the extension holding the cache tree.
+*/
+
+/* The cache tree of the index. */
+struct cache_tree *active_cache_tree = NULL;
+
+/*
+ * Function: `cache_tree_new`
+ * Parameters: none
+ * Purpose: Allocate a node that is invalid and has no subdirectories.
+ */
+struct cache_tree *cache_tree_new(void)
+{
+    struct cache_tree *it = calloc(1, sizeof(struct cache_tree));
+
+    it->entry_count = -1;
+    return it;
+}
+
+/*
+ * Function: `cache_tree_free`
+ * Parameters:
+ *      -it: A node, or NULL.
+ * Purpose: Free a node and every node below it.
+ */
+void cache_tree_free(struct cache_tree *it)
+{
+    int i;
+
+    if (!it)
+        return;
+    for (i = 0; i < it->subtree_nr; i++) {
+        cache_tree_free(it->down[i]->cache_tree);
+        free(it->down[i]);
+    }
+    free(it->down);
+    free(it);
+}
+
+/*
+ * Function: `subtree_pos`
+ * Parameters:
+ *      -it: A node.
+ *      -name: The name of a subdirectory, not NUL-terminated.
+ *      -len: The length of the name.
+ * Purpose: Find a subdirectory by a binary search of the sorted
+ *          subdirectories of a node. Returns `-pos-1` if it is at `pos`, or
+ *          else the position where it would go, like `cache_name_pos()`.
+ */
+static int subtree_pos(struct cache_tree *it, const char *name, int len)
+{
+    int first = 0, last = it->subtree_nr;
+
+    while (last > first) {
+        int next = (last + first) >> 1;
+        struct cache_tree_sub *sub = it->down[next];
+        int cmp = cache_name_compare(name, len, sub->name, sub->namelen);
+
+        if (!cmp)
+            return -next-1;
+        if (cmp < 0) {
+            last = next;
+            continue;
+        }
+        first = next+1;
+    }
+    return first;
+}
+
+/*
+ * Function: `cache_tree_sub`
+ * Parameters:
+ *      -it: A node.
+ *      -name: The name of a subdirectory, not NUL-terminated.
+ *      -len: The length of the name.
+ *      -create: Whether to add the subdirectory if the node has none by
+ *               that name.
+ * Purpose: Return a subdirectory of a node, whose `cache_tree` is its node,
+ *          or NULL if there is none and `create` is not set. The node of a
+ *          new subdirectory is invalid.
+ */
+struct cache_tree_sub *cache_tree_sub(struct cache_tree *it, const char *name,
+                                      int len, int create)
+{
+    struct cache_tree_sub *sub;
+    int pos = subtree_pos(it, name, len);
+
+    if (pos < 0)
+        return it->down[-pos-1];
+    if (!create)
+        return NULL;
+
+    if (it->subtree_nr == it->subtree_alloc) {
+        it->subtree_alloc = alloc_nr(it->subtree_alloc);
+        it->down = realloc(it->down, it->subtree_alloc *
+                                     sizeof(struct cache_tree_sub *));
+    }
+    memmove(it->down + pos + 1, it->down + pos,
+            (it->subtree_nr - pos) * sizeof(struct cache_tree_sub *));
+    it->subtree_nr++;
+
+    sub = malloc(sizeof(*sub) + len + 1);
+    sub->cache_tree = cache_tree_new();
+    sub->used = 0;
+    sub->namelen = len;
+    memcpy(sub->name, name, len);
+    sub->name[len] = '\0';
+    it->down[pos] = sub;
+    return sub;
+}
+
+/*
+ * Function: `cache_tree_invalidate_path`
+ * Parameters:
+ *      -it: The root node, or NULL.
+ *      -path: The path of an index entry that was added, changed or
+ *             removed.
+ * Purpose: Invalidate the node of every directory above the path, the root
+ *          node included. Nodes of other directories stay valid.
+ */
+void cache_tree_invalidate_path(struct cache_tree *it, const char *path)
+{
+    struct cache_tree_sub *sub;
+    const char *slash;
+
+    while (it) {
+        it->entry_count = -1;
+        slash = strchr(path, '/');
+        if (!slash)
+            return;
+        sub = cache_tree_sub(it, path, slash - path, 0);
+        it = sub ? sub->cache_tree : NULL;
+        path = slash + 1;
+    }
+}
+
+/*
+ * Function: `parse_count`
+ * Parameters:
+ *      -p: The first character of a count in the extension.
+ *      -end: The end of the extension.
+ *      -val: Set to the count.
+ *      -term: The character that must follow the count.
+ * Purpose: Parse an ASCII decimal count, which may be negative, without
+ *          reading past the end of the extension. Returns a pointer past the
+ *          terminating character, or NULL if the count is garbled.
+ */
+static const char *parse_count(const char *p, const char *end, long *val,
+                               int term)
+{
+    int negative = 0, digits = 0;
+
+    *val = 0;
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        *val = *val * 10 + (*p - '0');
+    if (!digits || digits > 9 || p == end || *p != term)
+        return NULL;
+    if (negative)
+        *val = -*val;
+    return p + 1;
+}
+
+/*
+ * Function: `read_one`
+ * Parameters:
+ *      -it: The node to fill in, whose name was read already.
+ *      -buf: Points to the counts of the node in the extension, and is moved
+ *            past the node and the nodes below it.
+ *      -end: The end of the extension.
+ * Purpose: Read a node and the nodes below it. Returns -1 if the extension
+ *          is cut short or garbled.
+ */
+static int read_one(struct cache_tree *it, const char **buf, const char *end)
+{
+    int rawsz = object_hash()->rawsz;
+    const char *p = *buf, *name, *nul;
+    long count, subtree_nr, i;
+
+    p = parse_count(p, end, &count, ' ');
+    if (!p)
+        return -1;
+    p = parse_count(p, end, &subtree_nr, '\n');
+    if (!p || subtree_nr < 0)
+        return -1;
+    it->entry_count = count < 0 ? -1 : count;
+    if (it->entry_count >= 0) {
+        if (end - p < rawsz)
+            return -1;
+        memcpy(it->sha1, p, rawsz);
+        p += rawsz;
+    }
+
+    /* The subdirectories follow in order, each starting with its name. */
+    for (i = 0; i < subtree_nr; i++) {
+        name = p;
+        nul = memchr(name, '\0', end - name);
+        if (!nul)
+            return -1;
+        p = nul + 1;
+        if (read_one(cache_tree_sub(it, name, nul - name, 1)->cache_tree,
+                     &p, end) < 0)
+            return -1;
+    }
+    *buf = p;
+    return 0;
+}
+
+/*
+ * Function: `cache_tree_read`
+ * Parameters:
+ *      -buf: The data of the "TREE" extension of the index.
+ *      -size: Its size in bytes.
+ * Purpose: Read the cache tree into `active_cache_tree`. A garbled cache
+ *          tree is dropped rather than reported, since `write-tree` can
+ *          always build every tree again.
+ */
+void cache_tree_read(const char *buf, unsigned long size)
+{
+    cache_tree_free(active_cache_tree);
+    active_cache_tree = NULL;
+
+    /* The root node comes first, and its name is empty. */
+    if (!size || *buf)
+        return;
+    buf++;
+    active_cache_tree = cache_tree_new();
+    if (read_one(active_cache_tree, &buf, buf + size - 1) < 0) {
+        cache_tree_free(active_cache_tree);
+        active_cache_tree = NULL;
+    }
+}
+
+/* Template of a growing buffer for `cache_tree_write()`. */
+struct tree_buffer {
+    char *buf;
+    unsigned long len, alloc;
+};
+
+/*
+ * Function: `write_one`
+ * Parameters:
+ *      -it: A node.
+ *      -name: The name of the node's directory within its parent, "" for
+ *             the root node.
+ *      -namelen: The length of the name.
+ *      -b: The buffer to append to.
+ * Purpose: Append a node and the nodes below it to the extension.
+ */
+static void write_one(struct cache_tree *it, const char *name, int namelen,
+                      struct tree_buffer *b)
+{
+    int rawsz = object_hash()->rawsz, i;
+    unsigned long need = namelen + 1 + 2 * 12 + rawsz;
+
+    if (b->len + need > b->alloc) {
+        b->alloc = alloc_nr(b->len + need);
+        b->buf = realloc(b->buf, b->alloc);
+    }
+    memcpy(b->buf + b->len, name, namelen);
+    b->len += namelen;
+    b->buf[b->len++] = '\0';
+    b->len += sprintf(b->buf + b->len, "%d %d\n", it->entry_count,
+                      it->subtree_nr);
+    if (it->entry_count >= 0) {
+        memcpy(b->buf + b->len, it->sha1, rawsz);
+        b->len += rawsz;
+    }
+    for (i = 0; i < it->subtree_nr; i++)
+        write_one(it->down[i]->cache_tree, it->down[i]->name,
+                  it->down[i]->namelen, b);
+}
+
+/*
+ * Function: `cache_tree_write`
+ * Parameters:
+ *      -it: The root node.
+ *      -size: Set to the size of the extension.
+ * Purpose: Build the data of the "TREE" extension of the index in memory
+ *          allocated with `malloc()`.
+ */
+void *cache_tree_write(struct cache_tree *it, unsigned long *size)
+{
+    struct tree_buffer b = { NULL, 0, 0 };
+
+    write_one(it, "", 0, &b);
+    *size = b.len;
+    return b.buf;
+}
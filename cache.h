@@ -47,6 +47,9 @@
 #include <stdlib.h>     /* Standard C library for library definitions. */
 #include <stdarg.h>     /* Standard C library for variable argument lists. */
 #include <errno.h>      /* Standard C library for system error numbers. */
+#include <limits.h>     /* Standard C library for implementation limits. */
+#include <dirent.h>     /* Standard C library for reading directories. */
+#include <time.h>       /* Standard C library for time and CPU time. */
 
 #ifndef BGIT_WINDOWS
     #include <sys/mman.h>   /* Standard C library for memory management */
@@ -92,6 +95,41 @@
 /* This `CACHE_SIGNATURE` is hardcoded to be loaded into all cache headers. */
 #define CACHE_SIGNATURE 0x44495243   /* Linus Torvalds: "DIRC" */
 
+/*
+ * The version of the index written by `write_cache()`. Version 1 entries
+ * held 20-byte SHA1 hashes; version 2 entries hold `MAX_RAWSZ` bytes, so
+ * that the hash algorithm of the repository can be changed (see hash.c).
+ * Version 3 entries are those of version 2, followed by extensions.
+ * Version 4 is version 3 with a checksum other than SHA1 in the header
+ * (see index-checksum.c), and is only written when `index.checksum` asks
+ * for one. `read_cache()` reads all four versions.
+ */
+#define CACHE_VERSION 4
+
+/*
+ * Template of the header of an index extension. Extensions follow the
+ * entries, each one a header and `size` bytes of data. A reader skips the
+ * extensions whose signature starts with an upper case letter when it does
+ * not know them, and refuses an index holding any other unknown extension.
+ */
+struct cache_ext_header {
+    unsigned char signature[4];
+    unsigned int size;
+};
+
+/* The signature of the cache tree extension (see cache-tree.c). */
+#define CACHE_EXT_TREE "TREE"
+/* The signature of the split index extension (see split-index.c). */
+#define CACHE_EXT_LINK "LINK"
+
+/*
+ * The longest object name any hash algorithm gives, in bytes and in
+ * hexadecimal. Arrays that hold object names are this long, and only the
+ * first `object_hash()->rawsz` bytes are used.
+ */
+#define MAX_RAWSZ 32
+#define MAX_HEXSZ (2 * MAX_RAWSZ)
+
 /* Template of the header structure that identifies a set of cache entries. */
 struct cache_header {
     /* Constant across all headers, to validate authenticity. */
@@ -100,7 +138,11 @@ struct cache_header {
     unsigned int version; 
     /* The number of cache entries in the cache. */
     unsigned int entries; 
-    /* The SHA1 hash that identifies the cache. */
+    /*
+     * The SHA1 hash that identifies the cache, or from version 4 on, the
+     * kind of checksum in the first byte and the checksum at
+     * INDEX_CHECKSUM_OFFSET.
+     */
     unsigned char sha1[20]; 
 };
 
@@ -138,7 +180,7 @@ struct cache_entry {
     unsigned int st_uid;      /* The user ID of the file’s owner. */
     unsigned int st_gid;      /* The group ID of the file. */
     unsigned int st_size;     /* The size of a regular file in bytes. */
-    unsigned char sha1[20];   /* The SHA1 hash of deflated blob object. */
+    unsigned char sha1[MAX_RAWSZ];   /* The name of the blob object. */
     unsigned short namelen;   /* The filename or path length. */
     unsigned char name[0];    /* The filename or path. */
 };
@@ -168,6 +210,23 @@ unsigned int active_alloc;
  */
 #define DEFAULT_DB_ENVIRONMENT ".dircache/objects"
 
+/*
+ * The repository configuration file, written by `init-db` (see config.c).
+ */
+#define CONFIG_FILE ".dircache/config"
+
+/*
+ * Repository format version in which objects are named by the SHA1 hash of
+ * their uncompressed contents instead of their compressed contents.
+ */
+#define REPOSITORY_FORMAT_CONTENT_IDS 1
+
+/*
+ * Independently of the repository format version, `core.objectformat` in
+ * the configuration file chooses the hash algorithm objects are named with:
+ * "sha1" (the default), "sha256" or "blake3" (see hash.c).
+ */
+
 /*
  * These macros are used to calculate the size to be allocated to a cache 
  * entry. 
@@ -194,12 +253,69 @@ unsigned int active_alloc;
 */
 extern int read_cache(void);
 
+/*
+ * Find where a path is, or would go, in the sorted `active_cache` array.
+ * `cache_name_pos()` returns `-pos-1` if the path is at `pos`.
+ */
+extern int cache_name_compare(const char *name1, int len1, const char *name2,
+                              int len2);
+extern int cache_name_pos(const char *name, int namelen);
+
+/* Read the next path of a list given on standard input (`--stdin`). */
+extern char *read_path(FILE *in, int term);
+
+/*
+ * Write the index: the header, the entries and the extensions. This is
+ * defined in read-cache.c.
+ */
+extern int write_cache(int newfd, struct cache_entry **cache, int entries);
+
+/*
+ * Template of a node of the cache tree, which remembers the tree object of
+ * a directory of the index until an entry below it changes. These are
+ * defined in cache-tree.c.
+ */
+struct cache_tree_sub;
+struct cache_tree {
+    int entry_count;                 /* Entries below, or -1 if invalid. */
+    unsigned char sha1[MAX_RAWSZ];   /* The tree object, if valid. */
+    int subtree_nr, subtree_alloc;   /* The subdirectories, by name. */
+    struct cache_tree_sub **down;
+};
+struct cache_tree_sub {
+    struct cache_tree *cache_tree;
+    int used;                        /* Seen by `write-tree`, not stored. */
+    int namelen;
+    char name[0];
+};
+extern struct cache_tree *active_cache_tree;
+extern struct cache_tree *cache_tree_new(void);
+extern void cache_tree_free(struct cache_tree *it);
+extern struct cache_tree_sub *cache_tree_sub(struct cache_tree *it,
+                                             const char *name, int len,
+                                             int create);
+extern void cache_tree_invalidate_path(struct cache_tree *it,
+                                       const char *path);
+extern void cache_tree_read(const char *buf, unsigned long size);
+extern void *cache_tree_write(struct cache_tree *it, unsigned long *size);
+
+/* Return the path to the object store. */
+extern const char *get_object_directory(void);
+
 /*
  * Linus Torvalds: Return a statically allocated filename matching the SHA1 
  * signature 
  */
 extern char *sha1_file_name(unsigned char *sha1);
 
+/* Map an open file into memory read-only. Returns NULL on failure. */
+extern void *map_fd(int fd, unsigned long size);
+
+/* Call `fn` for every loose object in the object store. */
+extern int for_each_loose_object(int (*fn)(unsigned char *sha1,
+                                           const char *path, void *data),
+                                 void *data);
+
 /* Linus Torvalds: Write a memory buffer out to the SHA1 file. */
 extern int write_sha1_buffer(unsigned char *sha1, void *buf, 
                              unsigned int size);
@@ -212,12 +328,274 @@ extern void *read_sha1_file(unsigned char *sha1, char *type,
                             unsigned long *size);
 extern int write_sha1_file(char *buf, unsigned len);
 
+/* Write an object like `write_sha1_file()`, and return its name in `sha1`. */
+extern int write_object_file(char *buf, unsigned len, unsigned char *sha1);
+
+/*
+ * Keep recently read objects in memory, so that reading them again does
+ * not inflate them again. These are defined in object-cache.c.
+ */
+extern void *lookup_object_cache(const unsigned char *sha1, char *type,
+                                 unsigned long *size);
+extern void add_object_cache(const unsigned char *sha1, const char *type,
+                             const void *data, unsigned long size);
+
+/*
+ * The same, for objects shared by all processes using the object store.
+ * These are defined in shared-cache.c.
+ */
+extern void *lookup_shared_cache(const unsigned char *sha1, char *type,
+                                 unsigned long *size);
+extern void add_shared_cache(const unsigned char *sha1, const char *type,
+                             const void *data, unsigned long size);
+
+/* Check whether an object exists, packed or loose. */
+extern int has_sha1_file(unsigned char *sha1);
+
+/*
+ * A Bloom filter of the loose objects, which can tell that an object does
+ * not exist without a system call. These are defined in object-filter.c.
+ */
+extern int object_filter_contains(const unsigned char *sha1);
+extern void object_filter_add(const unsigned char *sha1);
+extern int write_object_filter(void);
+
 /* Linus Torvalds: Convert to/from hex/sha1 representation. */
 extern int get_sha1_hex(char *hex, unsigned char *sha1);
 /* Linus Torvalds: static buffer! */
 extern char *sha1_to_hex(unsigned char *sha1);
 
+/*
+ * Convert between bytes and hexadecimal, one or many SHA1 hashes at a time
+ * and into buffers given by the caller. These are defined in hex.c.
+ */
+extern void hex_encode(char *out, const unsigned char *in, unsigned long len);
+extern int hex_decode(unsigned char *out, const char *hex, unsigned long len);
+extern char *sha1_to_hex_r(char *buf, const unsigned char *sha1);
+extern void sha1s_to_hex(char *out, const unsigned char *sha1s,
+                         unsigned long nr, int term);
+extern unsigned long hex_to_sha1s(unsigned char *sha1s, const char *hex,
+                                  unsigned long stride, unsigned long nr);
+
+/*
+ * Template of the state of an SHA1 hash being computed a piece at a time:
+ * the five state words, the length hashed so far, and the part of a block
+ * waiting for more data.
+ */
+struct sha1_ctx {
+    unsigned int h[5];
+    unsigned long long len;
+    unsigned char buf[64];
+};
+
+/*
+ * Compute SHA1 hashes, one a piece at a time or many in one call, with the
+ * fastest instructions the CPU has. These are defined in sha1.c.
+ */
+extern void sha1_init(struct sha1_ctx *c);
+extern void sha1_update(struct sha1_ctx *c, const void *data,
+                        unsigned long len);
+extern void sha1_final(unsigned char *sha1, struct sha1_ctx *c);
+extern void sha1_batch(unsigned char *sha1s, const void **bufs,
+                       const unsigned long *lens, unsigned long nr);
+
+/*
+ * Template of the state of a BLAKE3 hash being computed a piece at a time:
+ * the current chunk, and the chaining values of finished subtrees (see
+ * blake3.c). 54 of them are enough for 2^64 bytes.
+ */
+struct blake3_ctx {
+    unsigned int cv[8];
+    unsigned long long chunk_counter;
+    unsigned char buf[64];
+    unsigned int buf_len;
+    unsigned int blocks_compressed;
+    unsigned int cv_stack[54][8];
+    unsigned int cv_stack_len;
+};
+
+/* Compute BLAKE3 hashes. These are defined in blake3.c. */
+extern void blake3_init(struct blake3_ctx *c);
+extern void blake3_update(struct blake3_ctx *c, const void *data,
+                          unsigned long len);
+extern void blake3_final(unsigned char *out, struct blake3_ctx *c);
+
+/* The state of a hash being computed with any of the algorithms. */
+struct hash_ctx {
+    union {
+        struct sha1_ctx sha1;
+        void *evp;
+        struct blake3_ctx blake3;
+    } u;
+};
+
+/*
+ * Template of a hash algorithm objects can be named with: its name in the
+ * configuration file, the length of its hashes in bytes and in
+ * hexadecimal, whether it hashes one large update on several threads, and
+ * the functions that compute them.
+ */
+struct hash_algo {
+    const char *name;
+    int rawsz;
+    int hexsz;
+    int parallel;
+    void (*init)(struct hash_ctx *c);
+    void (*update)(struct hash_ctx *c, const void *data, unsigned long len);
+    void (*final)(unsigned char *out, struct hash_ctx *c);
+};
+
+/*
+ * Choose and describe the hash algorithm of the repository. These are
+ * defined in hash.c.
+ */
+extern const struct hash_algo *hash_algo_by_name(const char *name);
+extern const struct hash_algo *object_hash(void);
+extern int hash_threads(void);
+
+/*
+ * The kinds of checksums of the index, and the state of one being
+ * computed. These are used in index-checksum.c.
+ */
+#define INDEX_CHECKSUM_SHA1   0
+#define INDEX_CHECKSUM_CRC32C 1
+#define INDEX_CHECKSUM_XXH3   2
+#define INDEX_CHECKSUM_OFFSET 4
+struct index_checksum {
+    int kind;
+    struct sha1_ctx sha1;
+    unsigned int crc;
+    void *xxh3;
+};
+
+/*
+ * Compute and check the checksum of the index. These are defined in
+ * index-checksum.c.
+ */
+extern int index_checksum_kind(void);
+extern int check_index_settings(void);
+extern void index_checksum_init(struct index_checksum *c, int kind);
+extern void index_checksum_update(struct index_checksum *c, const void *data,
+                                  unsigned long len);
+extern void index_checksum_final(unsigned char *field,
+                                 struct index_checksum *c);
+extern int verify_index_checksum(const char *path,
+                                 const struct cache_header *hdr,
+                                 unsigned long size, const struct stat *st);
+extern int finish_index_checksum(void);
+
+/*
+ * Split the index into a shared index and the differences from it. These
+ * are defined in split-index.c.
+ */
+extern int read_link_extension(const char *data, unsigned long size);
+extern int merge_shared_index(void);
+extern int split_cache(struct cache_entry ***cache, int *entries,
+                       void **link, unsigned long *link_size);
+
 /* Print usage message to standard error stream. */
 extern void usage(const char *err);
 
+/* Print an error message to standard error stream and return -1. */
+extern int error(const char *string);
+
+/*
+ * Read the repository configuration. These are defined in config.c.
+ */
+extern const char *get_config(const char *key);
+extern int get_config_int(const char *key, int def);
+extern const char *get_config_env(const char *key);
+extern int get_config_env_int(const char *key, int def);
+extern int repository_format_version(void);
+
+/*
+ * Choose how hard to compress an object, and record the outcome for the
+ * compression report. These are defined in compress.c.
+ */
+extern int compression_level(const char *type, const void *data,
+                             unsigned long size, int *policy);
+extern int compression_level_fd(const char *type, int fd, unsigned long size,
+                                int *policy);
+extern int compression_threads(void);
+extern unsigned long long compression_clock(void);
+extern void compression_done(int policy, int level, unsigned long in,
+                             unsigned long out, unsigned long long start,
+                             unsigned long long helper_cpu);
+
+/*
+ * The codecs that loose objects can be compressed with. These are defined
+ * in codec.c.
+ */
+#define CODEC_ZLIB       0
+#define CODEC_LIBDEFLATE 1
+#define CODEC_ZSTD       2
+#define NR_CODECS        3
+
+extern const char *codec_name(int codec);
+extern int codec_from_name(const char *name);
+extern int codec_available(int codec);
+extern int object_codec(void);
+extern void *codec_compress(int codec, int level, const void *hdr,
+                            unsigned long hdr_len, const void *data,
+                            unsigned long len, unsigned long *out_len);
+
+/* Template of a compressor that is handed an object a piece at a time. */
+struct codec_stream {
+    int codec;     /* The codec compressing the object. */
+    z_stream z;    /* The zlib state. */
+    void *zstd;    /* The zstd state, if zstd is the codec. */
+    struct parallel_deflate *parallel;   /* Set if deflating on threads. */
+    unsigned long long helper_cpu;   /* CPU time of those threads, in */
+                                     /* nanoseconds, once it has ended. */
+};
+extern int codec_stream_init(struct codec_stream *s, int codec, int level,
+                             unsigned long total);
+extern int codec_stream_compress(struct codec_stream *s, const void *in,
+                                 unsigned long len, int finish,
+                                 int (*out)(const void *buf,
+                                            unsigned long len, void *data),
+                                 void *data);
+extern void codec_stream_end(struct codec_stream *s);
+extern int codec_detect(const unsigned char *buf, unsigned long len);
+extern int codec_decodes(const unsigned char *buf, unsigned long len);
+extern void *codec_unpack(const unsigned char *buf, unsigned long len,
+                          char *type, unsigned long *size);
+
+/*
+ * Deflate one large object on several threads. These are defined in
+ * parallel-deflate.c.
+ */
+extern struct parallel_deflate *parallel_deflate_start(int level,
+                                                       int nr_threads);
+extern int parallel_deflate_write(struct parallel_deflate *pd,
+                                  const void *in, unsigned long len,
+                                  int finish,
+                                  int (*out)(const void *buf,
+                                             unsigned long len, void *data),
+                                  void *data);
+extern unsigned long long parallel_deflate_end(struct parallel_deflate *pd);
+
+/*
+ * Read an object a piece at a time instead of all at once. These are
+ * defined in stream.c.
+ */
+struct object_stream;
+extern struct object_stream *open_object_stream(unsigned char *sha1,
+                                                char *type,
+                                                unsigned long *size);
+extern long read_object_stream(struct object_stream *st, void *buf,
+                               unsigned long len);
+extern void close_object_stream(struct object_stream *st);
+
+/*
+ * List the files below a directory, reading directories on several threads.
+ * This is defined in dir-walk.c.
+ */
+extern int walk_directory(const char *dir, int nr_threads,
+                          int (*want)(char *path), char ***paths);
+
+/* Learn the type and size of an object without reading its data. */
+extern int sha1_object_info(unsigned char *sha1, char *type,
+                            unsigned long *size);
+
 #endif /* Linus Torvalds: CACHE_H */
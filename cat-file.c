@@ -32,6 +32,13 @@
  *  index and committed into the repository using the `update-cache`,
  *  `write-tree`, and `commit-tree` commands consecutively.
  *
+ *  With `-t` or `-s` before the hash, `cat-file` instead prints only the
+ *  type or only the size of the object. Both are read from the object's
+ *  header, without decompressing the object data at all:
+ *
+ *      cat-file -t <sha1>
+ *      cat-file -s <sha1>
+ *
  *  This whole file (i.e. everything in the main function) will run
  *  when ./cat-file executable is run from the command line.
  */
@@ -48,17 +55,26 @@
 
    -usage(): Print an error message and exit.
 
-   -read_sha1_file(): Locate an object in the object database, read and 
-                      inflate it, then return the inflated object data 
-                      (without the prepended metadata).
+   -strcmp(str1, str2): Compare two strings. Sourced from <string.h>.
+
+   -sha1_object_info(): Read the type and size of an object from its header.
+                        Sourced from "cache.h" (defined in stream.c).
+
+   -open_object_stream(): Open an object in the object database for
+                          reading a piece at a time. Sourced from "cache.h"
+                          (defined in stream.c).
 
    -mkstemp(template): Modifies `template` to generate a unique filename, then
                        opens the file for reading and writing and returns a 
                        file descriptorfor the file. Sourced from <stdlib.h>.
 
+   -read_object_stream(): Inflate the next piece of the object data.
+
    -write(fd, buf, n): Write `n` bytes from buffer `buf` to file associated
                        with file descriptor `fd`.
 
+   -close_object_stream(): Release an object stream.
+
    -strcpy(str1, str2): Copy string str2 to string str1, including the
                         terminating null character.
 
@@ -79,10 +95,16 @@
 
    -sha1: 20-byte representation of an SHA1 hash.
 
+   -opt: The `-t` or `-s` option, or NULL.
+
    -type: The type of the object that was read from the object store (blob, 
           tree, or commit).
 
-   -buf: A buffer to store the object data.
+   -st: The object stream the object data is read from.
+
+   -buf: A buffer to store a piece of the object data.
+
+   -n: The number of bytes in `buf`.
 
    -size: The size in bytes of the object data.
 
@@ -103,18 +125,36 @@
  */
 int main(int argc, char **argv)
 {
-    /* Used to store the 20-byte representation of an SHA1 hash. */
-    unsigned char sha1[20];
+    /* Used to store the raw form of an object name, such as an SHA1 hash. */
+    unsigned char sha1[MAX_RAWSZ];
     /* Used to store the object type (blob, tree, or commit). */
     char type[20];
-    /* Buffer to store the object data. */
-    void *buf;
+    /* The object being read. */
+    struct object_stream *st;
+    /*
+     * Buffer to store a piece of the object data. The object is copied to
+     * the output file a piece at a time, so even objects larger than the
+     * memory of the machine can be read.
+     */
+    static char buf[64 * 1024];
+    /* The number of bytes in `buf`. */
+    long n;
     /* The size in bytes of the object data. */
     unsigned long size;
     /* A template string used to generate a unique output filename. */
     char template[] = "temp_git_file_XXXXXX";
     /* File descriptor for the output file. */
     int fd;
+    /* The `-t` or `-s` option, if one was given. */
+    const char *opt = NULL;
+
+    if (argc == 3) {
+        opt = argv[1];
+        if (strcmp(opt, "-t") && strcmp(opt, "-s"))
+            usage("cat-file: cat-file [-t | -s] <sha1>");
+        argv++;
+        argc--;
+    }
 
     /*  
      * Validate the number of command line arguments and convert the given 
@@ -123,21 +163,34 @@ int main(int argc, char **argv)
      * and exit.
      */
     if (argc != 2 || get_sha1_hex(argv[1], sha1))
-        usage("cat-file: cat-file <sha1>");
+        usage("cat-file: cat-file [-t | -s] <sha1>");
+
+    /*
+     * To print only the type or the size, read just the object header
+     * instead of the whole object.
+     */
+    if (opt) {
+        if (sha1_object_info(sha1, type, &size) < 0)
+            exit(1);
+        if (opt[1] == 't')
+            printf("%s\n", type);
+        else
+            printf("%lu\n", size);
+        return 0;
+    }
 
     /*
-     * Read the object whose SHA1 hash is `sha1` from the object store, 
-     * inflate it, and return a pointer to the object data (without the 
-     * prepended metadata). Store the object type and object data size in 
-     * `type` and `size` respectively.
+     * Open the object whose SHA1 hash is `sha1` in the object store for
+     * reading. Store the object type and object data size in `type` and
+     * `size` respectively.
      */
-    buf = read_sha1_file(sha1, type, &size);
+    st = open_object_stream(sha1, type, &size);
     
     /*
-     * Exit if `buf` is a null pointer, i.e., if reading the object from the
+     * Exit if `st` is a null pointer, i.e., if opening the object in the
      * object store failed.
      */
-    if (!buf)
+    if (!st)
         exit(1);
 
     /*
@@ -153,12 +206,17 @@ int main(int argc, char **argv)
         usage("unable to create tempfile");
 
     /*
-     * Write the object data, which has length `size` bytes, to the output
-     * file associated with `fd`. If the number of bytes written does not 
-     * equal the object data size, then set object `type` to "bad".
+     * Inflate the object data, which has length `size` bytes, a piece at a
+     * time and write each piece to the output file associated with `fd`. If
+     * the object is corrupt or the number of bytes written does not equal
+     * the number read, then set object `type` to "bad".
      */
-    if (write(fd, buf, size) != size)
+    while ((n = read_object_stream(st, buf, sizeof(buf))) > 0)
+        if (write(fd, buf, n) != n)
+            break;
+    if (n)
         strcpy(type, "bad");
+    close_object_stream(st);
 
     /* Print the output filename and object type to screen. */
     printf("%s: %s\n", template, type);
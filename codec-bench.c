@@ -0,0 +1,296 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to be compiled into an executable
+ *  called `codec-bench`. When `codec-bench` is run from the command line it
+ *  compresses a set of objects with every codec built into the executable
+ *  (see codec.c), decompresses them again, and prints for each codec the
+ *  compression ratio and the encode and decode speed in MB/s:
+ *
+ *  ./codec-bench [-l <level>] [<file>...]
+ *
+ *  The objects are the given files, stored as blobs, or if no file is
+ *  given, all loose objects in the object store. `-l` chooses the
+ *  compression level (-1 to 9, default -1 for zlib's default), which is
+ *  mapped to each codec's own levels like `compression.level` is.
+ *
+ *  Each object is compressed and decompressed several times, so that small
+ *  objects are measured over a useful amount of CPU time. The result of every
+ *  decompression is compared with the original.
+ */
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -read_sha1_file(): Read and decompress an object from the object store.
+
+   -realloc()/malloc()/free(): Manage memory. Sourced from <stdlib.h>.
+
+   -OPEN_FILE(): Open a file. Sourced from "cache.h".
+
+   -usage(): Print an error message and exit.
+
+   -for_each_loose_object(): Call a function for every loose object.
+
+   -codec_available(): Check whether a codec is built in. Sourced from
+                       "cache.h" (defined in codec.c).
+
+   -clock(): Return the CPU time used by the process. Sourced from <time.h>.
+
+   -codec_compress(): Compress an object with a codec.
+
+   -uncompress(): Decompress a zlib stream in one call. Sourced from
+                  <zlib.h>.
+
+   -codec_unpack(): Decompress an object in one call.
+
+   -codec_name(): Return the name of a codec.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -samples: The objects to compress.
+
+   -add_sample(): Add an object to `samples`.
+
+   -add_loose_sample(): Add a loose object to `samples`.
+
+   -add_file_sample(): Add a file to `samples` as a blob object.
+
+   -decode(): Decompress one object the way a codec would.
+
+   -bench(): Measure one codec.
+
+   -main(): The main function runs each time ./codec-bench is run.
+*/
+
+/* How many times each object is compressed and decompressed. */
+#define ROUNDS 5
+
+/*
+ * An object to compress: the "<type> <size>\0" header followed by the data,
+ * as it is stored in an object file.
+ */
+struct sample {
+    char *buf;
+    unsigned long len;
+};
+
+static struct sample *samples;
+static unsigned int nr_samples, alloc_samples;
+static unsigned long long total_bytes;
+
+/*
+ * Function: `add_sample`
+ * Parameters:
+ *      -type: The object type.
+ *      -data, size: The object data.
+ * Purpose: Add an object to `samples`, with its header in front.
+ */
+static void add_sample(const char *type, const void *data, unsigned long size)
+{
+    struct sample *s;
+    char hdr[50];
+    int hdr_len = 1 + sprintf(hdr, "%s %lu", type, size);
+
+    if (nr_samples == alloc_samples) {
+        alloc_samples = alloc_samples * 2 + 64;
+        samples = realloc(samples, alloc_samples * sizeof(*samples));
+    }
+    s = samples + nr_samples++;
+    s->len = hdr_len + size;
+    s->buf = malloc(s->len);
+    memcpy(s->buf, hdr, hdr_len);
+    memcpy(s->buf + hdr_len, data, size);
+    total_bytes += s->len;
+}
+
+/*
+ * Function: `add_loose_sample`
+ * Parameters:
+ *      -sha1: The SHA1 hash of a loose object.
+ *      -path: The path of the loose object file (not used).
+ *      -data: Not used.
+ * Purpose: Callback for `for_each_loose_object()`. Reads the object and adds
+ *          it to `samples`.
+ */
+static int add_loose_sample(unsigned char *sha1, const char *path, void *data)
+{
+    char type[20];
+    unsigned long size;
+    void *buf = read_sha1_file(sha1, type, &size);
+
+    if (buf) {
+        add_sample(type, buf, size);
+        free(buf);
+    }
+    return 0;
+}
+
+/*
+ * Function: `add_file_sample`
+ * Parameters:
+ *      -path: The path of a file.
+ * Purpose: Read a file and add it to `samples` as a blob object.
+ */
+static void add_file_sample(const char *path)
+{
+    struct stat st;
+    void *buf;
+    int fd = OPEN_FILE(path, O_RDONLY, 0);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    buf = malloc(st.st_size + 1);
+    if (read(fd, buf, st.st_size) != st.st_size) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    add_sample("blob", buf, st.st_size);
+    free(buf);
+}
+
+/*
+ * Function: `decode`
+ * Parameters:
+ *      -codec: The codec that compressed the object.
+ *      -buf, len: The compressed object.
+ *      -s: The original object.
+ * Purpose: Decompress an object and check the result. Objects compressed
+ *          with zlib are decompressed with zlib itself, even when libdeflate
+ *          is built in, so that the two can be compared.
+ */
+static int decode(int codec, void *buf, unsigned long len, struct sample *s)
+{
+    char type[20];
+    unsigned long size;
+    char *out;
+    int ok;
+
+    if (codec == CODEC_ZLIB) {
+        uLongf out_len = s->len;
+        out = malloc(s->len);
+        ok = uncompress((void *)out, &out_len, buf, len) == Z_OK &&
+             out_len == s->len && !memcmp(out, s->buf, s->len);
+        free(out);
+        return ok;
+    }
+
+    out = codec_unpack(buf, len, type, &size);
+    ok = out && size + strlen(s->buf) + 1 == s->len &&
+         !memcmp(out, s->buf + strlen(s->buf) + 1, size);
+    free(out);
+    return ok;
+}
+
+/*
+ * Function: `bench`
+ * Parameters:
+ *      -codec: The codec to measure.
+ *      -level: The compression level.
+ * Purpose: Compress and decompress all samples with a codec, and print the
+ *          compression ratio and the speeds in MB/s of the uncompressed data.
+ */
+static void bench(int codec, int level)
+{
+    unsigned long long packed = 0;
+    clock_t start, enc = 0, dec = 0;
+    unsigned int i, r;
+    double mb = (double)total_bytes * ROUNDS / (1024 * 1024);
+
+    for (i = 0; i < nr_samples; i++) {
+        struct sample *s = samples + i;
+        unsigned long len = 0;
+        void *buf = NULL;
+
+        start = clock();
+        for (r = 0; r < ROUNDS; r++) {
+            free(buf);
+            buf = codec_compress(codec, level, NULL, 0, s->buf, s->len, &len);
+            if (!buf)
+                usage("compression failed");
+        }
+        enc += clock() - start;
+        packed += len;
+
+        start = clock();
+        for (r = 0; r < ROUNDS; r++)
+            if (!decode(codec, buf, len, s))
+                usage("decompression gave a different object");
+        dec += clock() - start;
+        free(buf);
+    }
+
+    printf("%-10s %12llu %12llu %6.3f %10.1f %10.1f\n", codec_name(codec),
+           total_bytes, packed,
+           total_bytes ? (double)packed / total_bytes : 0.0,
+           enc ? mb / ((double)enc / CLOCKS_PER_SEC) : 0.0,
+           dec ? mb / ((double)dec / CLOCKS_PER_SEC) : 0.0);
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the
+ *             command itself.
+ *      -argv: An array of the command line arguments, including the command
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable
+ *          `codec-bench` is run from the command line.
+ */
+int main(int argc, char **argv)
+{
+    int i, level = Z_DEFAULT_COMPRESSION;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            level = atoi(argv[++i]);
+            if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+                usage("compression level must be between -1 and 9");
+        } else {
+            usage("codec-bench [-l <level>] [<file>...]");
+        }
+    }
+
+    if (i < argc)
+        for (; i < argc; i++)
+            add_file_sample(argv[i]);
+    else
+        for_each_loose_object(add_loose_sample, NULL);
+    if (!nr_samples)
+        usage("no objects to compress");
+
+    printf("%u objects, level %d\n", nr_samples, level);
+    printf("%-10s %12s %12s %6s %10s %10s\n", "codec", "bytes", "compressed",
+           "ratio", "enc MB/s", "dec MB/s");
+    for (i = 0; i < NR_CODECS; i++)
+        if (codec_available(i))
+            bench(i, level);
+    return 0;
+}
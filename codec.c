@@ -0,0 +1,651 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the codec layer that compresses
+ *  and decompresses loose objects. Three codecs are known:
+ *
+ *  zlib:       The zlib library. Always available, and what every object
+ *              was written with before this layer existed.
+ *
+ *  libdeflate: The libdeflate library, which writes and reads the same zlib
+ *              format, but in one call over the whole object and much
+ *              faster. Built in with `make USE_LIBDEFLATE=1`.
+ *
+ *  zstd:       The Zstandard format, which decompresses several times
+ *              faster than zlib. Built in with `make USE_ZSTD=1`.
+ *
+ *  An object file does not record which codec wrote it in a separate
+ *  field: the first bytes of the file are the tag. A zlib stream starts
+ *  with a two-byte header whose low four bits are 8 ("deflate") and which
+ *  is a multiple of 31, and a zstd frame starts with the magic number
+ *  0xFD2FB528 (stored little-endian). So objects written before this layer
+ *  existed are read unchanged, and a store can mix objects written with
+ *  every codec. When libdeflate is built in, it is used to read all zlib
+ *  objects, whichever library wrote them.
+ *
+ *  The codec used for writing is chosen with the `compression.codec`
+ *  setting (see config.c). In a repository of format 0, an object's name is
+ *  the hash of its compressed bytes, and only the zlib library is allowed,
+ *  since any other codec would give the same contents a new name.
+ *
+ *  The `codec-bench` command compares the codecs on the objects of a
+ *  repository.
+ */
+#include "cache.h"
+#ifdef BGIT_LIBDEFLATE
+    #include <libdeflate.h>
+#endif
+#ifdef BGIT_ZSTD
+    #include <zstd.h>
+#endif
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h", <libdeflate.h> and <zstd.h> header files,
+   ranked in order of first use in this file. Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -get_config_env(): Return the value of a setting.
+
+   -repository_format_version(): Return how objects are named in this
+                                 repository.
+
+   -usage(): Print an error message and exit.
+
+   -deflateInit()/deflateBound()/deflate()/deflateEnd(): Compress data with
+        zlib. Sourced from <zlib.h>.
+
+   -libdeflate_alloc_compressor()/libdeflate_zlib_compress_bound()/
+    libdeflate_zlib_compress()/libdeflate_free_compressor(): Compress data
+        in the zlib format in one call. Sourced from <libdeflate.h>.
+
+   -ZSTD_compressBound()/ZSTD_compress()/ZSTD_isError(): Compress data in
+        the zstd format in one call. Sourced from <zstd.h>.
+
+   -compression_threads(): Return how many threads may deflate one object.
+                           Sourced from "cache.h" (defined in compress.c).
+
+   -parallel_deflate_start()/parallel_deflate_write()/parallel_deflate_end():
+        Deflate an object on several threads. Sourced from "cache.h"
+        (defined in parallel-deflate.c).
+
+   -ZSTD_createCCtx()/ZSTD_CCtx_setParameter()/ZSTD_CCtx_setPledgedSrcSize()/
+    ZSTD_compressStream2()/ZSTD_freeCCtx(): Compress data in the zstd format
+        a piece at a time. Sourced from <zstd.h>.
+
+   -inflateInit()/inflate()/inflateEnd(): Decompress zlib data. Sourced from
+                                          <zlib.h>.
+
+   -libdeflate_alloc_decompressor()/libdeflate_zlib_decompress()/
+    libdeflate_free_decompressor(): Decompress zlib data in one call.
+        Sourced from <libdeflate.h>.
+
+   -ZSTD_getFrameContentSize()/ZSTD_decompress(): Decompress a zstd frame in
+        one call. Sourced from <zstd.h>.
+
+   -error(): Print an error message and return -1.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -codec_names: The names of the codecs.
+
+   -codec_from_name(): Convert a codec name to a codec number.
+
+   -codec_available(): Check whether a codec is built in.
+
+   -object_codec(): Return the codec to write objects with.
+
+   -codec_compress(): Compress an object.
+
+   -codec_stream_init(): Start compressing an object a piece at a time.
+
+   -codec_stream_compress(): Compress the next piece of an object.
+
+   -codec_stream_end(): Release a compressor.
+
+   -codec_detect(): Tell from its first bytes which codec wrote an object.
+
+   -codec_decodes(): Check whether `codec_unpack()` should read an object.
+
+   -codec_unpack(): Decompress an object and parse its header.
+*/
+
+/* Objects smaller than this are not worth deflating on several threads. */
+#define PARALLEL_DEFLATE_MIN (1024 * 1024)
+
+/* The names of the codecs, indexed by codec number. */
+static const char *codec_names[] = { "zlib", "libdeflate", "zstd" };
+
+/*
+ * Function: `codec_name`
+ * Parameters:
+ *      -codec: A codec number.
+ * Purpose: Return the name of a codec.
+ */
+const char *codec_name(int codec)
+{
+    if (codec < 0 || codec >= NR_CODECS)
+        return "unknown";
+    return codec_names[codec];
+}
+
+/*
+ * Function: `codec_from_name`
+ * Parameters:
+ *      -name: A codec name.
+ * Purpose: Return the number of the codec called `name`, or -1.
+ */
+int codec_from_name(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NR_CODECS; i++)
+        if (!strcmp(name, codec_names[i]))
+            return i;
+    return -1;
+}
+
+/*
+ * Function: `codec_available`
+ * Parameters:
+ *      -codec: A codec number.
+ * Purpose: Return 1 if the codec is built into this executable.
+ */
+int codec_available(int codec)
+{
+    switch (codec) {
+    case CODEC_ZLIB:
+        return 1;
+#ifdef BGIT_LIBDEFLATE
+    case CODEC_LIBDEFLATE:
+        return 1;
+#endif
+#ifdef BGIT_ZSTD
+    case CODEC_ZSTD:
+        return 1;
+#endif
+    }
+    return 0;
+}
+
+/*
+ * Function: `object_codec`
+ * Parameters: none
+ * Purpose: Return the codec that new objects are written with, from the
+ *          `compression.codec` setting. Defaults to zlib.
+ */
+int object_codec(void)
+{
+    static int codec = -1;
+    const char *name;
+
+    if (codec >= 0)
+        return codec;
+    codec = CODEC_ZLIB;
+    name = get_config_env("compression.codec");
+    if (!name)
+        return codec;
+
+    codec = codec_from_name(name);
+    if (codec < 0)
+        usage("unknown compression.codec");
+    if (!codec_available(codec))
+        usage("compression.codec is not built into this executable");
+    if (codec != CODEC_ZLIB &&
+        repository_format_version() != REPOSITORY_FORMAT_CONTENT_IDS)
+        usage("compression.codec other than zlib needs a repository "
+              "created with init-db --content-ids");
+    return codec;
+}
+
+#ifdef BGIT_ZSTD
+/*
+ * Function: `zstd_level`
+ * Parameters:
+ *      -level: A zlib compression level (-1 to 9).
+ * Purpose: Return the zstd level with a similar trade-off between speed and
+ *          size. zstd has no "store" level; its fastest levels store data
+ *          that does not compress as raw blocks.
+ */
+static int zstd_level(int level)
+{
+    static const int levels[10] = { 1, 1, 2, 3, 4, 5, 6, 9, 12, 15 };
+
+    return levels[level < 0 ? 6 : level];
+}
+#endif
+
+/*
+ * Function: `zlib_compress`
+ * Parameters: see `codec_compress()`.
+ * Purpose: Compress the header and the data with zlib as one stream, without
+ *          first copying them together.
+ */
+static void *zlib_compress(int level, const void *hdr, unsigned long hdr_len,
+                           const void *data, unsigned long len,
+                           unsigned long *out_len)
+{
+    z_stream stream;
+    unsigned long bound;
+    void *out;
+
+    memset(&stream, 0, sizeof(stream));
+    deflateInit(&stream, level);
+    bound = deflateBound(&stream, hdr_len + len);
+    out = malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_out = out;
+    stream.avail_out = bound;
+
+    stream.next_in = (void *)hdr;
+    stream.avail_in = hdr_len;
+    while (hdr_len && deflate(&stream, 0) == Z_OK && stream.avail_in)
+        /* nothing */;
+    stream.next_in = (void *)data;
+    stream.avail_in = len;
+    while (deflate(&stream, Z_FINISH) == Z_OK)
+        /* nothing */;
+    deflateEnd(&stream);
+    *out_len = stream.total_out;
+    return out;
+}
+
+/*
+ * Function: `codec_compress`
+ * Parameters:
+ *      -codec: The codec to compress with.
+ *      -level: The zlib compression level (-1 to 9) chosen for the object
+ *              (see compress.c). The other codecs map it to their own
+ *              range of levels.
+ *      -hdr, hdr_len: The "<type> <size>\0" header, if it is not at the
+ *                     start of `data`.
+ *      -data, len: The data to compress.
+ *      -out_len: Filled in with the size of the result.
+ * Purpose: Compress an object and return the result in newly allocated
+ *          memory, or NULL on failure. The one-call codecs need the header
+ *          and the data in one buffer, so they are copied together first.
+ */
+void *codec_compress(int codec, int level, const void *hdr,
+                     unsigned long hdr_len, const void *data,
+                     unsigned long len, unsigned long *out_len)
+{
+    void *in, *out = NULL;
+    unsigned long in_len = hdr_len + len;
+
+    if (codec == CODEC_ZLIB || !codec_available(codec))
+        return zlib_compress(level, hdr, hdr_len, data, len, out_len);
+
+    if (hdr_len) {
+        in = malloc(in_len);
+        if (!in)
+            return NULL;
+        memcpy(in, hdr, hdr_len);
+        memcpy((char *)in + hdr_len, data, len);
+    } else {
+        in = (void *)data;
+    }
+
+#ifdef BGIT_LIBDEFLATE
+    if (codec == CODEC_LIBDEFLATE) {
+        struct libdeflate_compressor *c;
+        unsigned long bound;
+
+        c = libdeflate_alloc_compressor(level < 0 ? 6 : level);
+        if (c) {
+            bound = libdeflate_zlib_compress_bound(c, in_len);
+            out = malloc(bound);
+            if (out)
+                *out_len = libdeflate_zlib_compress(c, in, in_len, out, bound);
+            if (out && !*out_len) {
+                free(out);
+                out = NULL;
+            }
+            libdeflate_free_compressor(c);
+        }
+    }
+#endif
+#ifdef BGIT_ZSTD
+    if (codec == CODEC_ZSTD) {
+        unsigned long bound = ZSTD_compressBound(in_len);
+
+        out = malloc(bound);
+        if (out) {
+            size_t ret = ZSTD_compress(out, bound, in, in_len,
+                                       zstd_level(level));
+            if (ZSTD_isError(ret)) {
+                free(out);
+                out = NULL;
+            } else {
+                *out_len = ret;
+            }
+        }
+    }
+#endif
+
+    if (in != data)
+        free(in);
+    return out;
+}
+
+/*
+ * Function: `codec_stream_init`
+ * Parameters:
+ *      -s: The compressor to set up.
+ *      -codec: The codec to compress with.
+ *      -level: The zlib compression level, as for `codec_compress()`.
+ *      -total: The size of the whole object, header included. zstd records
+ *              it in the frame, where `codec_unpack()` looks for it.
+ * Purpose: Start compressing an object that is handed over a piece at a time
+ *          with `codec_stream_compress()`, for objects too large to hold in
+ *          memory. libdeflate can only compress a whole buffer at once, so
+ *          for it the zlib library writes the same zlib format instead.
+ *          Objects of PARALLEL_DEFLATE_MIN bytes or more may be deflated on
+ *          several threads.
+ */
+int codec_stream_init(struct codec_stream *s, int codec, int level,
+                      unsigned long total)
+{
+    memset(s, 0, sizeof(*s));
+    s->codec = codec == CODEC_ZSTD ? CODEC_ZSTD : CODEC_ZLIB;
+#ifdef BGIT_ZSTD
+    if (s->codec == CODEC_ZSTD) {
+        s->zstd = ZSTD_createCCtx();
+        if (!s->zstd)
+            return -1;
+        ZSTD_CCtx_setParameter(s->zstd, ZSTD_c_compressionLevel,
+                               zstd_level(level));
+        ZSTD_CCtx_setPledgedSrcSize(s->zstd, total);
+        return 0;
+    }
+#endif
+    /*
+     * Large objects are deflated on several threads where that is allowed
+     * (see compress.c and parallel-deflate.c). If the threads cannot be
+     * started, the object is deflated here instead.
+     */
+    if (total >= PARALLEL_DEFLATE_MIN && compression_threads() > 1) {
+        s->parallel = parallel_deflate_start(level, compression_threads());
+        if (s->parallel)
+            return 0;
+    }
+    if (deflateInit(&s->z, level) != Z_OK)
+        return -1;
+    return 0;
+}
+
+/*
+ * Function: `codec_stream_compress`
+ * Parameters:
+ *      -s: A compressor set up with `codec_stream_init()`.
+ *      -in, len: The next piece of the object.
+ *      -finish: Whether this is the last piece.
+ *      -out: Called with each piece of compressed output.
+ *      -data: Passed on to `out`.
+ * Purpose: Compress the next piece of an object, handing the output to `out`
+ *          through a fixed-size buffer as it is produced. Returns -1 if
+ *          compressing fails or `out` returns an error.
+ */
+int codec_stream_compress(struct codec_stream *s, const void *in,
+                          unsigned long len, int finish,
+                          int (*out)(const void *buf, unsigned long len,
+                                     void *data),
+                          void *data)
+{
+    /*
+     * Room for a whole stored block (at level 0, zlib writes blocks of up
+     * to 65535 bytes, limited by the room left for output), so that level
+     * 0 output is the same as when compressing in one call.
+     */
+    unsigned char buf[65536 + 1024];
+
+#ifdef BGIT_ZSTD
+    if (s->codec == CODEC_ZSTD) {
+        ZSTD_inBuffer zin = { in, len, 0 };
+        size_t left;
+
+        do {
+            ZSTD_outBuffer zout = { buf, sizeof(buf), 0 };
+            left = ZSTD_compressStream2(s->zstd, &zout, &zin,
+                                        finish ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left))
+                return -1;
+            if (zout.pos && out(buf, zout.pos, data) < 0)
+                return -1;
+        } while (zin.pos < zin.size || (finish && left));
+        return 0;
+    }
+#endif
+    if (s->parallel)
+        return parallel_deflate_write(s->parallel, in, len, finish, out,
+                                      data);
+    s->z.next_in = (void *)in;
+    s->z.avail_in = len;
+    for (;;) {
+        int ret;
+
+        s->z.next_out = buf;
+        s->z.avail_out = sizeof(buf);
+        ret = deflate(&s->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return -1;
+        if (s->z.avail_out < sizeof(buf) &&
+            out(buf, sizeof(buf) - s->z.avail_out, data) < 0)
+            return -1;
+        if (finish ? ret == Z_STREAM_END : !s->z.avail_in && s->z.avail_out)
+            return 0;
+    }
+}
+
+/*
+ * Function: `codec_stream_end`
+ * Parameters:
+ *      -s: A compressor set up with `codec_stream_init()`.
+ * Purpose: Release the state of a compressor. If it deflated on threads,
+ *          the CPU time they used is left in `s->helper_cpu`.
+ */
+void codec_stream_end(struct codec_stream *s)
+{
+#ifdef BGIT_ZSTD
+    if (s->zstd)
+        ZSTD_freeCCtx(s->zstd);
+#endif
+    if (s->parallel)
+        s->helper_cpu = parallel_deflate_end(s->parallel);
+    else if (s->codec == CODEC_ZLIB)
+        deflateEnd(&s->z);
+}
+
+/*
+ * Function: `codec_detect`
+ * Parameters:
+ *      -buf: The start of an object file.
+ *      -len: Its size.
+ * Purpose: Return the codec of the data in an object file from its first
+ *          bytes, or -1 if it is neither a zlib stream nor a zstd frame.
+ *          Objects in the zlib format are reported as `CODEC_ZLIB`, whether
+ *          zlib or libdeflate wrote them.
+ */
+int codec_detect(const unsigned char *buf, unsigned long len)
+{
+    if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 && buf[2] == 0x2f &&
+        buf[3] == 0xfd)
+        return CODEC_ZSTD;
+    if (len >= 2 && (buf[0] & 0x0f) == 8 && (buf[0] >> 4) <= 7 &&
+        !(((buf[0] << 8) | buf[1]) % 31))
+        return CODEC_ZLIB;
+    return -1;
+}
+
+/*
+ * Function: `codec_decodes`
+ * Parameters:
+ *      -buf, len: The contents of an object file.
+ * Purpose: Return 1 if `codec_unpack()` should read this object, and 0 if
+ *          the plain zlib code in `read_sha1_file()` reads it just as fast,
+ *          which is the case for zlib objects when libdeflate is not built
+ *          in.
+ */
+int codec_decodes(const unsigned char *buf, unsigned long len)
+{
+    int codec = codec_detect(buf, len);
+
+    if (codec == CODEC_ZLIB)
+        return codec_available(CODEC_LIBDEFLATE);
+    return 1;
+}
+
+#if defined(BGIT_LIBDEFLATE) || defined(BGIT_ZSTD)
+/*
+ * Function: `parse_header`
+ * Parameters:
+ *      -buf, len: The start of a decompressed object.
+ *      -type: Filled in with the object type.
+ *      -size: Filled in with the size of the object data.
+ * Purpose: Parse the "<type> <size>\0" header of an object, and return its
+ *          length including the null byte, or -1 if it is malformed.
+ */
+static int parse_header(const char *buf, unsigned long len, char *type,
+                        unsigned long *size)
+{
+    const char *nul = memchr(buf, 0, len < 64 ? len : 64);
+
+    if (!nul || sscanf(buf, "%10s %lu", type, size) != 2)
+        return -1;
+    return nul - buf + 1;
+}
+
+/*
+ * Function: `zlib_header`
+ * Parameters:
+ *      -buf, len: A zlib stream.
+ *      -type, size: Filled in from the object header.
+ * Purpose: Inflate just enough of a zlib stream to read the object header,
+ *          so that the one-call decoder knows how much room the object
+ *          needs. Returns the length of the header, or -1.
+ */
+static int zlib_header(const unsigned char *buf, unsigned long len,
+                       char *type, unsigned long *size)
+{
+    char hdr[64];
+    z_stream stream;
+    int ret;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = (void *)buf;
+    stream.avail_in = len;
+    stream.next_out = (void *)hdr;
+    stream.avail_out = sizeof(hdr);
+    inflateInit(&stream);
+    inflate(&stream, 0);
+    ret = parse_header(hdr, stream.total_out, type, size);
+    inflateEnd(&stream);
+    return ret;
+}
+#endif
+
+/*
+ * Function: `codec_unpack`
+ * Parameters:
+ *      -buf, len: The contents of an object file.
+ *      -type: Filled in with the object type.
+ *      -size: Filled in with the size of the object data.
+ * Purpose: Decompress an object in one call into a buffer of the size the
+ *          object needs, then move the data over the header so that the
+ *          result is, like the result of `read_sha1_file()`, the object data
+ *          alone in memory the caller can free.
+ */
+void *codec_unpack(const unsigned char *buf, unsigned long len, char *type,
+                   unsigned long *size)
+{
+    int codec = codec_detect(buf, len);
+    char *out = NULL;
+    int hdr_len = -1;
+
+    if (codec < 0) {
+        error("object file is not in a known format");
+        return NULL;
+    }
+    if (!codec_available(codec == CODEC_ZLIB ? CODEC_LIBDEFLATE : codec)) {
+        error(codec == CODEC_ZSTD ?
+              "object is compressed with zstd, which is not built in" :
+              "object codec is not built in");
+        return NULL;
+    }
+
+#ifdef BGIT_LIBDEFLATE
+    if (codec == CODEC_ZLIB) {
+        struct libdeflate_decompressor *d;
+        unsigned long total;
+        size_t actual;
+
+        hdr_len = zlib_header(buf, len, type, size);
+        if (hdr_len < 0)
+            return NULL;
+        total = hdr_len + *size;
+        out = malloc(total + 1);
+        d = libdeflate_alloc_decompressor();
+        if (!out || !d ||
+            libdeflate_zlib_decompress(d, buf, len, out, total, &actual) !=
+            LIBDEFLATE_SUCCESS || actual != total) {
+            free(out);
+            out = NULL;
+        }
+        if (d)
+            libdeflate_free_decompressor(d);
+    }
+#endif
+#ifdef BGIT_ZSTD
+    if (codec == CODEC_ZSTD) {
+        unsigned long long n = ZSTD_getFrameContentSize(buf, len);
+        unsigned long total;
+
+        if (n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR)
+            n = 0;
+        total = n;
+        out = n ? malloc(total + 1) : NULL;
+        if (out) {
+            size_t ret = ZSTD_decompress(out, total, buf, len);
+            if (ZSTD_isError(ret) || ret != total) {
+                free(out);
+                out = NULL;
+            }
+        }
+        if (out)
+            hdr_len = parse_header(out, total, type, size);
+        if (out && (hdr_len < 0 || hdr_len + *size != total)) {
+            free(out);
+            out = NULL;
+        }
+    }
+#endif
+
+    if (!out) {
+        error("corrupt object file");
+        return NULL;
+    }
+    memmove(out, out + hdr_len, *size);
+    return out;
+}
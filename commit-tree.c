@@ -402,10 +402,10 @@ int main(int argc, char **argv)
     int len;           /* The length of the user's login name. */
     int parents = 0;   /* The number of parent commit objects. */
 
-    /* The SHA1 hash of the tree to be committed. */
-    unsigned char tree_sha1[20];
-    /* An array of SHA1 hashes of parent commit objects. */
-    unsigned char parent_sha1[MAXPARENT][20];
+    /* The name of the tree to be committed. */
+    unsigned char tree_sha1[MAX_RAWSZ];
+    /* An array of names of parent commit objects. */
+    unsigned char parent_sha1[MAXPARENT][MAX_RAWSZ];
     /* Used to store user information. */
     char *gecos, *realgecos;
     /* Used to store the user's email address. */
@@ -436,16 +436,17 @@ int main(int argc, char **argv)
 
     /*
      * Show usage message if there are less than 2 command line arguments or 
-     * if the tree hash given in the command line is not a valid 40-character
-     * representation of an SHA1 hash value. Then exit.
+     * if the tree hash given in the command line is not a valid hexadecimal
+     * representation of an object name (40 characters for an SHA1 hash, 64
+     * for the other hash algorithms). Then exit.
      */
     if (argc < 2 || get_sha1_hex(argv[1], tree_sha1) < 0)
         usage("commit-tree <sha1> [-p <sha1>]* < changelog");
 
     /*
      * Loop through the parent commit hashes given in the command line
-     * arguments. Check that each hash is a valid 40-character representation
-     * of an SHA1 hash value. If not, or if the command line arguments are not
+     * arguments. Check that each hash is a valid hexadecimal representation
+     * of an object name. If not, or if the command line arguments are not
      * given correctly, show usage and exit. Otherwise, increment the parent 
      * counter.
      */
@@ -0,0 +1,485 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to decide how hard each object is
+ *  compressed, instead of always using `Z_BEST_COMPRESSION`, which is the
+ *  slowest zlib level and often saves little over the faster ones.
+ *
+ *  The level is chosen from these settings, read from `.dircache/config`
+ *  and overridable from the environment (see `get_config_env()`):
+ *
+ *  compression.level             The level for all objects (0-9, or -1
+ *                                for zlib's default).
+ *  compression.blob/tree/commit  The level for one type of object.
+ *  compression.bigfilethreshold  Objects at least this many bytes large...
+ *  compression.bigfilelevel      ...use this level instead.
+ *  compression.sample            If 1, objects that look incompressible are
+ *                                stored with level 0 (no compression).
+ *  compression.threads           How many threads deflate one large object
+ *                                (see parallel-deflate.c).
+ *
+ *  Whether an object is incompressible (for example, already compressed
+ *  images, video or archives) is guessed by compressing up to three 4KB
+ *  samples taken from its start, middle and end with the fastest level. If
+ *  they shrink by less than 5%, compressing the whole object is not worth
+ *  the CPU time.
+ *
+ *  In a repository of format 0, an object's name is the hash of its
+ *  compressed bytes, so the level is part of the name: changing it means
+ *  that unchanged files get new names. There, the defaults reproduce the
+ *  original behaviour exactly (level 9, no sampling, one thread), and more
+ *  than one thread is refused, since deflating on threads gives different
+ *  bytes. In a repository of format 1, the defaults are zlib's default level
+ *  6, level 1 for objects of 1MB or more, sampling, and one thread per
+ *  online CPU.
+ *
+ *  If the environment variable `BGIT_COMPRESSION_STATS` is set, a report
+ *  of the objects compressed under each policy, the bytes saved and the CPU
+ *  time spent is printed to standard error when the command exits.
+ */
+#include "cache.h"
+#include <pthread.h>
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <pthread.h> header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -repository_format_version(): Return how objects are named in this
+                                 repository. Sourced from "cache.h" (defined
+                                 in config.c).
+
+   -get_config_env_int(): Return the value of a setting as a number.
+
+   -usage(): Print an error message and exit.
+
+   -compressBound(len)/compress2(dst, dst_len, src, src_len, level): Compress
+        a buffer in one call. Sourced from <zlib.h>.
+
+   -pread(fd, buf, n, offset): Read from a file at an offset. Sourced from
+                               <unistd.h>.
+
+   -sysconf(_SC_NPROCESSORS_ONLN): Return the number of online CPUs.
+                                   Sourced from <unistd.h>.
+
+   -clock_gettime(clock, ts): Read a clock, here the CPU time used by the
+                              calling thread. Sourced from <time.h>.
+
+   -clock(): Return the CPU time used by the process. Sourced from <time.h>.
+
+   -pthread_mutex_lock()/pthread_mutex_unlock(): Lock and unlock a mutex.
+                                                 Sourced from <pthread.h>.
+
+   -getenv(name): Get the value of an environment variable. Sourced from
+                  <stdlib.h>.
+
+   -atexit(fn): Call a function when the process exits. Sourced from
+                <stdlib.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -type_level: The configured level for each type of object.
+
+   -read_policy(): Read the compression settings once.
+
+   -samples_incompressible(): Check whether samples of data compress.
+
+   -sample_offsets(): Decide where to take the samples.
+
+   -looks_incompressible(): Guess from samples whether data is worth
+                            compressing.
+
+   -file_looks_incompressible(): The same for data in a file.
+
+   -choose_level(): Apply the settings to one object.
+
+   -compression_level(): Choose the level for one object.
+
+   -compression_level_fd(): Choose the level for an object read from a file.
+
+   -compression_threads(): Return how many threads may deflate one object.
+
+   -compression_clock(): Return the CPU time used by the calling thread.
+
+   -compression_stats: Counters for the report.
+
+   -stats_lock: Protects the counters from several threads at once.
+
+   -print_compression_stats(): Print the report.
+
+   -compression_done(): Record the result of compressing one object.
+*/
+
+/* Size of each sample, and the smallest object worth sampling. */
+#define SAMPLE_SIZE 4096
+#define SAMPLE_MIN_SIZE (4 * SAMPLE_SIZE)
+
+/* The object types, as indexes into the tables below. */
+static const char *type_names[] = { "blob", "tree", "commit", "other" };
+#define NR_TYPES 4
+
+/* The reasons a level was chosen, as indexes into the tables below. */
+static const char *reason_names[] = { "type", "big file", "incompressible" };
+#define NR_REASONS 3
+
+/* The settings, once read. */
+static int policy_read;
+static int type_level[NR_TYPES];
+static long big_file_threshold;
+static int big_file_level;
+static int sample;
+static int threads;
+
+/*
+ * Function: `read_level`
+ * Parameters:
+ *      -key: The setting to read.
+ *      -def: Its default.
+ * Purpose: Read one compression level and check that zlib accepts it.
+ */
+static int read_level(const char *key, int def)
+{
+    int level = get_config_env_int(key, def);
+
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+        usage("compression level must be between -1 and 9");
+    return level;
+}
+
+/*
+ * Function: `read_policy`
+ * Parameters: none
+ * Purpose: Read the compression settings the first time they are needed.
+ *          The defaults depend on the repository format, see above.
+ */
+static void read_policy(void)
+{
+    int content_ids = repository_format_version() ==
+                      REPOSITORY_FORMAT_CONTENT_IDS;
+    int level, i;
+
+    if (policy_read)
+        return;
+    policy_read = 1;
+
+    level = read_level("compression.level", content_ids ?
+                       Z_DEFAULT_COMPRESSION : Z_BEST_COMPRESSION);
+    for (i = 0; i < NR_TYPES - 1; i++) {
+        char key[40];
+        sprintf(key, "compression.%s", type_names[i]);
+        type_level[i] = read_level(key, level);
+    }
+    type_level[NR_TYPES - 1] = level;
+
+    big_file_threshold = get_config_env_int("compression.bigfilethreshold",
+                                            content_ids ? 1024 * 1024 : 0);
+    big_file_level = read_level("compression.bigfilelevel", Z_BEST_SPEED);
+    sample = get_config_env_int("compression.sample", content_ids);
+
+    threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    if (content_ids)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    threads = get_config_env_int("compression.threads", threads);
+    if (threads < 1)
+        threads = 1;
+    if (threads > 1 && !content_ids)
+        usage("compression.threads above 1 needs a repository created with "
+              "init-db --content-ids");
+}
+
+/*
+ * Function: `samples_incompressible`
+ * Parameters:
+ *      -samples: Three samples of SAMPLE_SIZE bytes each.
+ * Purpose: Compress the samples with the fastest level, and return 1 if they
+ *          shrink by less than 5%.
+ */
+static int samples_incompressible(const unsigned char *samples[3])
+{
+    unsigned char out[SAMPLE_SIZE + 1024];
+    unsigned long in_total = 0, out_total = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        uLongf out_len = sizeof(out);
+        if (compress2(out, &out_len, samples[i], SAMPLE_SIZE,
+                      Z_BEST_SPEED) != Z_OK)
+            return 0;
+        in_total += SAMPLE_SIZE;
+        out_total += out_len;
+    }
+    return out_total * 100 >= in_total * 95;
+}
+
+/*
+ * Function: `sample_offsets`
+ * Parameters:
+ *      -size: The size of the data.
+ *      -offsets: Filled in with the offsets of the three samples.
+ * Purpose: Place the samples at the start, the middle and the end of the
+ *          data. Returns 0 for small data, which is never considered
+ *          incompressible, since compressing it costs little anyway.
+ */
+static int sample_offsets(unsigned long size, unsigned long offsets[3])
+{
+    if (size < SAMPLE_MIN_SIZE)
+        return 0;
+    offsets[0] = 0;
+    offsets[1] = size / 2 - SAMPLE_SIZE / 2;
+    offsets[2] = size - SAMPLE_SIZE;
+    return 1;
+}
+
+/*
+ * Function: `looks_incompressible`
+ * Parameters:
+ *      -data: The object data.
+ *      -size: Its size.
+ * Purpose: Return 1 if samples from the start, the middle and the end of the
+ *          data shrink by less than 5% at the fastest level.
+ */
+static int looks_incompressible(const unsigned char *data, unsigned long size)
+{
+    const unsigned char *samples[3];
+    unsigned long offsets[3];
+    int i;
+
+    if (!sample_offsets(size, offsets))
+        return 0;
+    for (i = 0; i < 3; i++)
+        samples[i] = data + offsets[i];
+    return samples_incompressible(samples);
+}
+
+/*
+ * Function: `file_looks_incompressible`
+ * Parameters:
+ *      -fd: An open file holding the object data.
+ *      -size: Its size.
+ * Purpose: Like `looks_incompressible()`, but read just the samples from a
+ *          file that is too large to have in memory.
+ */
+static int file_looks_incompressible(int fd, unsigned long size)
+{
+    unsigned char buf[3][SAMPLE_SIZE];
+    const unsigned char *samples[3];
+    unsigned long offsets[3];
+    int i;
+
+    if (!sample_offsets(size, offsets))
+        return 0;
+    for (i = 0; i < 3; i++) {
+        if (pread(fd, buf[i], SAMPLE_SIZE, offsets[i]) != SAMPLE_SIZE)
+            return 0;
+        samples[i] = buf[i];
+    }
+    return samples_incompressible(samples);
+}
+
+/*
+ * Function: `type_index`
+ * Parameters:
+ *      -type: An object type name.
+ * Purpose: Return the index of a type in `type_names`.
+ */
+static int type_index(const char *type)
+{
+    int i;
+
+    for (i = 0; i < NR_TYPES - 1; i++)
+        if (!strcmp(type, type_names[i]))
+            return i;
+    return NR_TYPES - 1;
+}
+
+/*
+ * Function: `choose_level`
+ * Parameters:
+ *      -type: The type of the object.
+ *      -incompressible: Whether samples of the data did not compress.
+ *      -size: The size of the object data.
+ *      -policy: Filled in with the policy that chose the level.
+ * Purpose: Apply the settings to one object.
+ */
+static int choose_level(const char *type, int incompressible,
+                        unsigned long size, int *policy)
+{
+    int t = type_index(type);
+
+    if (incompressible) {
+        *policy = t * NR_REASONS + 2;
+        return Z_NO_COMPRESSION;
+    }
+    if (big_file_threshold > 0 && size >= big_file_threshold) {
+        *policy = t * NR_REASONS + 1;
+        return big_file_level;
+    }
+    *policy = t * NR_REASONS;
+    return type_level[t];
+}
+
+/*
+ * Function: `compression_level`
+ * Parameters:
+ *      -type: The type of the object ("blob", "tree" or "commit").
+ *      -data: The object data, without the "<type> <size>\0" header, or
+ *             NULL if it is not available for sampling.
+ *      -size: The size of the object data.
+ *      -policy: Filled in with the policy that chose the level, to be passed
+ *               to `compression_done()`.
+ * Purpose: Return the zlib level to compress an object with.
+ */
+int compression_level(const char *type, const void *data, unsigned long size,
+                      int *policy)
+{
+    read_policy();
+    return choose_level(type, sample && data &&
+                        looks_incompressible(data, size), size, policy);
+}
+
+/*
+ * Function: `compression_level_fd`
+ * Parameters:
+ *      -type, size, policy: As for `compression_level()`.
+ *      -fd: An open file holding the object data, which is sampled with
+ *           `pread()` so that the file offset does not change.
+ * Purpose: Like `compression_level()`, for an object that is compressed
+ *          from a file a piece at a time.
+ */
+int compression_level_fd(const char *type, int fd, unsigned long size,
+                         int *policy)
+{
+    read_policy();
+    return choose_level(type, sample && file_looks_incompressible(fd, size),
+                        size, policy);
+}
+
+/*
+ * Function: `compression_threads`
+ * Parameters: none
+ * Purpose: Return how many threads may deflate one large object.
+ */
+int compression_threads(void)
+{
+    read_policy();
+    return threads;
+}
+
+/*
+ * Function: `compression_clock`
+ * Parameters: none
+ * Purpose: Return the CPU time used so far by the calling thread, in
+ *          nanoseconds. Objects are compressed on several threads at once
+ *          (see update-cache.c and parallel-deflate.c), and the CPU time of
+ *          the whole process, as `clock()` returns it, would count the work
+ *          of every other thread too. Where there is no clock per thread,
+ *          `clock()` is used after all.
+ */
+unsigned long long compression_clock(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    return clock() * (1000000000ULL / CLOCKS_PER_SEC);
+}
+
+/* Counters for the report, one set per type and reason. */
+static struct {
+    unsigned long objects;
+    unsigned long long bytes_in, bytes_out;
+    unsigned long long cpu;   /* In nanoseconds. */
+    int level;
+} compression_stats[NR_TYPES * NR_REASONS];
+static int stats_registered;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: `print_compression_stats`
+ * Parameters: none
+ * Purpose: Print one line per policy that was used: the number of objects,
+ *          the bytes before and after compression, the share of the bytes
+ *          saved and the CPU time spent compressing.
+ */
+static void print_compression_stats(void)
+{
+    int i;
+
+    for (i = 0; i < NR_TYPES * NR_REASONS; i++) {
+        unsigned long long in = compression_stats[i].bytes_in;
+        unsigned long long out = compression_stats[i].bytes_out;
+
+        if (!compression_stats[i].objects)
+            continue;
+        fprintf(stderr, "compression: %-6s %-14s level %2d: %lu objects, "
+                "%llu -> %llu bytes (saved %.1f%%), %.3fs cpu\n",
+                type_names[i / NR_REASONS], reason_names[i % NR_REASONS],
+                compression_stats[i].level, compression_stats[i].objects,
+                in, out, in ? 100.0 * ((double)in - (double)out) / in : 0.0,
+                compression_stats[i].cpu / 1e9);
+    }
+}
+
+/*
+ * Function: `compression_done`
+ * Parameters:
+ *      -policy: The policy returned by `compression_level()`.
+ *      -level: The level that was used.
+ *      -in: The number of bytes compressed.
+ *      -out: The number of compressed bytes.
+ *      -start: The value of `compression_clock()` before compressing, on
+ *              the thread that compressed the object.
+ *      -helper_cpu: The CPU time, in nanoseconds, that other threads spent
+ *                   compressing the object (see parallel-deflate.c).
+ * Purpose: Record the result of compressing one object for the report,
+ *          if one was asked for. `update-cache` compresses objects on
+ *          several threads at once (see update-cache.c), so the counters are
+ *          updated under a lock.
+ */
+void compression_done(int policy, int level, unsigned long in,
+                      unsigned long out, unsigned long long start,
+                      unsigned long long helper_cpu)
+{
+    unsigned long long cpu = compression_clock() - start + helper_cpu;
+
+    pthread_mutex_lock(&stats_lock);
+    if (!stats_registered) {
+        stats_registered = getenv("BGIT_COMPRESSION_STATS") ? 1 : -1;
+        if (stats_registered > 0)
+            atexit(print_compression_stats);
+    }
+    if (stats_registered > 0 && policy >= 0 &&
+        policy < NR_TYPES * NR_REASONS) {
+        compression_stats[policy].objects++;
+        compression_stats[policy].bytes_in += in;
+        compression_stats[policy].bytes_out += out;
+        compression_stats[policy].cpu += cpu;
+        compression_stats[policy].level = level;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,279 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the functions that read the
+ *  repository configuration file, `.dircache/config`. It is written by
+ *  `init-db` and consists of lines of the form
+ *
+ *      key = value
+ *
+ *  Blank lines and lines starting with `#` are ignored, as is whitespace
+ *  around the key and the value. A key that is not in the file has no
+ *  value, and every command falls back to its built-in default.
+ *
+ *  The most important key is `core.repositoryformatversion`, which says how
+ *  objects are named in this repository (see `repository_format_version()`
+ *  below), together with `core.objectformat`, which says with which hash
+ *  algorithm (see hash.c).
+ */
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -CONFIG_FILE: The path of the configuration file. Sourced from "cache.h".
+
+   -OPEN_FILE(): Open a file. Sourced from "cache.h".
+
+   -read(fd, buf, n): Read from a file. Sourced from <unistd.h>.
+
+   -strchr()/strncmp()/strlen()/memcpy(): String functions. Sourced from
+                                          <string.h>.
+
+   -strtol(s, end, base): Convert a string to a number. Sourced from
+                          <stdlib.h>.
+
+   -usage(): Print an error message and exit.
+
+   -getenv(name): Get the value of an environment variable. Sourced from
+                  <stdlib.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -config_buf: The contents of the configuration file.
+
+   -read_config(): Read the configuration file into memory once.
+
+   -get_config(): Return the value of a key.
+
+   -parse_config_int(): Convert a value to a number.
+
+   -get_config_int(): Return the value of a key as a number.
+
+   -get_config_env(): Return the value of a key, which can be overridden
+                      from the environment.
+
+   -get_config_env_int(): Return the value of such a key as a number.
+
+   -repository_format_version(): Return how objects are named in this
+                                 repository.
+*/
+
+/*
+ * The contents of the configuration file, with every line ended by a null
+ * byte, and the end of those contents.
+ */
+static char *config_buf, *config_end;
+
+/*
+ * Function: `read_config`
+ * Parameters: none
+ * Purpose: Read the whole configuration file into `config_buf` the first time
+ *          it is needed, and split it into null-terminated lines. A missing
+ *          file is the same as an empty one.
+ */
+static void read_config(void)
+{
+    struct stat st;
+    char *p;
+    int fd;
+
+    if (config_buf)
+        return;
+    config_buf = config_end = "";
+
+    fd = OPEN_FILE(CONFIG_FILE, O_RDONLY, 0);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || !st.st_size) {
+        close(fd);
+        return;
+    }
+    p = malloc(st.st_size + 1);
+    if (read(fd, p, st.st_size) != st.st_size) {
+        close(fd);
+        free(p);
+        return;
+    }
+    close(fd);
+    p[st.st_size] = 0;
+    config_buf = p;
+    config_end = p + st.st_size;
+    for (; p < config_end; p++)
+        if (*p == '\n')
+            *p = 0;
+}
+
+/*
+ * Function: `get_config`
+ * Parameters:
+ *      -key: The key to look up, for example "core.repositoryformatversion".
+ * Purpose: Return the value of the last line that sets `key`, or NULL if no
+ *          line does. The value is returned in a static buffer.
+ */
+const char *get_config(const char *key)
+{
+    static char value[256];
+    const char *found = NULL;
+    int keylen = strlen(key), found_len = 0;
+    char *line;
+
+    read_config();
+    for (line = config_buf; line < config_end; line += strlen(line) + 1) {
+        char *p = line, *end;
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || strncmp(p, key, keylen))
+            continue;
+        p += keylen;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p++ != '=')
+            continue;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        end = p + strlen(p);
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t' ||
+                           end[-1] == '\r'))
+            end--;
+        found = p;
+        found_len = end - p;
+    }
+    if (!found)
+        return NULL;
+    if (found_len >= sizeof(value))
+        found_len = sizeof(value) - 1;
+    memcpy(value, found, found_len);
+    value[found_len] = 0;
+    return value;
+}
+
+/*
+ * Function: `parse_config_int`
+ * Parameters:
+ *      -key: The key the value belongs to, for error messages.
+ *      -value: The value, or NULL if the key is not set.
+ *      -def: The value to return if the key is not set.
+ * Purpose: Convert a value to a number. A value that is not a number is an
+ *          error, since silently using the default could, for example, write
+ *          objects under the wrong names.
+ */
+static int parse_config_int(const char *key, const char *value, int def)
+{
+    char *end;
+    long n;
+
+    if (!value)
+        return def;
+    n = strtol(value, &end, 0);
+    if (end == value || *end) {
+        fprintf(stderr, "bad number for %s in %s: %s\n", key, CONFIG_FILE,
+                value);
+        exit(1);
+    }
+    return n;
+}
+
+/*
+ * Function: `get_config_int`
+ * Parameters:
+ *      -key: The key to look up.
+ *      -def: The value to return if the key is not set.
+ * Purpose: Return the value of a key as a number.
+ */
+int get_config_int(const char *key, int def)
+{
+    return parse_config_int(key, get_config(key), def);
+}
+
+/*
+ * Function: `get_config_env`
+ * Parameters:
+ *      -key: The key to look up.
+ * Purpose: Like `get_config()`, but an environment variable named after the
+ *          key takes precedence over the configuration file. The variable's
+ *          name is the key in upper case with dots replaced by underscores
+ *          and "BGIT_" in front, so "compression.level" can be overridden
+ *          with `BGIT_COMPRESSION_LEVEL`. This is only used for settings
+ *          that do not change how objects are named.
+ */
+const char *get_config_env(const char *key)
+{
+    char name[100];
+    const char *value;
+    int i;
+
+    strcpy(name, "BGIT_");
+    for (i = 0; key[i] && i < sizeof(name) - 6; i++) {
+        char ch = key[i];
+        if (ch == '.')
+            ch = '_';
+        else if (ch >= 'a' && ch <= 'z')
+            ch -= 'a' - 'A';
+        name[5 + i] = ch;
+    }
+    name[5 + i] = 0;
+    value = getenv(name);
+    return value ? value : get_config(key);
+}
+
+/*
+ * Function: `get_config_env_int`
+ * Parameters:
+ *      -key: The key to look up.
+ *      -def: The value to return if the key is not set.
+ * Purpose: Like `get_config_int()`, but see `get_config_env()`.
+ */
+int get_config_env_int(const char *key, int def)
+{
+    return parse_config_int(key, get_config_env(key), def);
+}
+
+/*
+ * Function: `repository_format_version`
+ * Parameters: none
+ * Purpose: Return how objects are named in this repository:
+ *
+ *          0: The SHA1 hash of the compressed object (the original format).
+ *          1: The SHA1 hash of the uncompressed object, i.e. of the
+ *             "<type> <size>\0" header followed by the data. Since that
+ *             hash is known before compressing, objects that already exist
+ *             are never compressed again.
+ *
+ *          Repositories without a configuration file use format 0.
+ */
+int repository_format_version(void)
+{
+    static int version = -1;
+
+    if (version < 0) {
+        version = get_config_int("core.repositoryformatversion", 0);
+        if (version != 0 && version != REPOSITORY_FORMAT_CONTENT_IDS)
+            usage("unknown repository format version");
+    }
+    return version;
+}
@@ -0,0 +1,533 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the functions that create and
+ *  apply deltas. A delta describes a target buffer in terms of a source
+ *  buffer, so that a new revision of a file can be stored as a short list
+ *  of instructions against the previous revision instead of in full.
+ *
+ *  A delta starts with the size of the source and the size of the target,
+ *  each stored 7 bits per byte, least significant bits first, with the high
+ *  bit of a byte meaning that another byte follows. Then come instructions:
+ *
+ *  1xxxxxxx: Copy from the source. Bits 0-3 say which of the following
+ *            (up to 4) bytes hold the little-endian source offset, and bits
+ *            4-6 say which of the following (up to 3) bytes hold the size.
+ *            Bytes that are not present are 0, and a size of 0 means
+ *            0x10000.
+ *
+ *  0xxxxxxx: Insert the following `xxxxxxx` (1 to 127) literal bytes.
+ *
+ *  The instruction byte 0 is reserved and never valid.
+ */
+#include "pack.h"
+/* The above 'include' allows use of the following functions and
+   variables from "pack.h" and "cache.h" header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -malloc(size)/realloc(ptr, size)/free(ptr): Manage dynamic memory.
+                                               Sourced from <stdlib.h>.
+
+   -memcmp(str1, str2, n): Compare the first n bytes of two buffers. Sourced
+                           from <string.h>.
+
+   -memcpy(s1, s2, n): Copy n bytes from s2 to s1. Sourced from <string.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -create_delta_index(): Index the blocks of a source buffer.
+
+   -free_delta_index(): Free a delta index.
+
+   -create_delta(): Create a delta from an indexed source to a target.
+
+   -diff_delta(): Create a delta between two buffers.
+
+   -get_delta_hdr_size(): Decode one size from the delta header.
+
+   -delta_result_size(): Read the size of a delta's target from its header.
+
+   -patch_delta(): Apply a delta to a source buffer.
+*/
+
+/* The source is indexed in blocks of this many bytes. */
+#define BLOCK 16
+
+/* Multiplier of the rolling hash over BLOCK bytes. */
+#define HASH_MULT 0x01000193
+
+/* Never look at more than this many source blocks with the same hash. */
+#define MAX_CHAIN 64
+
+/* The largest copy a single instruction can express. */
+#define MAX_COPY 0xffffff
+
+/*
+ * Template of an index over the source buffer: every BLOCK-aligned block of
+ * the source is hashed into `buckets`, and blocks with the same hash are
+ * chained through `next`. Block numbers are stored plus one, so that 0 can
+ * mean "no block".
+ */
+struct delta_index {
+    const unsigned char *src;
+    unsigned long src_size;
+    unsigned int hash_mask;
+    unsigned int *buckets;
+    unsigned int *next;
+};
+
+/*
+ * Template of the growing output buffer of `create_delta()`.
+ */
+struct delta_out {
+    unsigned char *buf;
+    unsigned long len, alloc, max_size;
+};
+
+/*
+ * Function: `block_hash`
+ * Parameters:
+ *      -p: Pointer to BLOCK bytes.
+ * Purpose: Hash one block the same way the rolling hash in `create_delta()`
+ *          hashes a block of the target.
+ */
+static unsigned int block_hash(const unsigned char *p)
+{
+    unsigned int h = 0;
+    int i;
+
+    for (i = 0; i < BLOCK; i++)
+        h = h * HASH_MULT + p[i];
+    return h;
+}
+
+/*
+ * Function: `create_delta_index`
+ * Parameters:
+ *      -src: The source buffer.
+ *      -src_size: The size of the source buffer.
+ * Purpose: Build an index of the source buffer that `create_delta()` can use
+ *          to find matches quickly. The same index can be used to create
+ *          deltas against many targets. Returns NULL if the source is too
+ *          small to be useful.
+ */
+struct delta_index *create_delta_index(const void *src, unsigned long src_size)
+{
+    struct delta_index *index;
+    unsigned int nr_blocks, hsize, i;
+
+    /* Copy offsets are limited to 32 bits, so only index the first 4GB. */
+    if (src_size > 0xffffffffUL - BLOCK)
+        src_size = 0xffffffffUL - BLOCK;
+    nr_blocks = src_size / BLOCK;
+    if (!nr_blocks)
+        return NULL;
+
+    /* Use a power of two that is at least the number of blocks. */
+    for (hsize = 16; hsize < nr_blocks && hsize < (1U << 30); hsize <<= 1)
+        /* nothing */;
+
+    index = malloc(sizeof(*index));
+    index->src = src;
+    index->src_size = src_size;
+    index->hash_mask = hsize - 1;
+    index->buckets = calloc(hsize, sizeof(unsigned int));
+    index->next = malloc(nr_blocks * sizeof(unsigned int));
+    if (!index->buckets || !index->next) {
+        free_delta_index(index);
+        return NULL;
+    }
+
+    /*
+     * Insert the blocks from last to first, so that each chain starts with
+     * the earliest block and copies favour small source offsets.
+     */
+    for (i = nr_blocks; i > 0; i--) {
+        unsigned int h = block_hash(index->src + (i - 1) * BLOCK) &
+                         index->hash_mask;
+        index->next[i - 1] = index->buckets[h];
+        index->buckets[h] = i;
+    }
+    return index;
+}
+
+/*
+ * Function: `free_delta_index`
+ * Parameters:
+ *      -index: The delta index to free.
+ * Purpose: Free a delta index created by `create_delta_index()`.
+ */
+void free_delta_index(struct delta_index *index)
+{
+    if (!index)
+        return;
+    free(index->buckets);
+    free(index->next);
+    free(index);
+}
+
+/*
+ * Function: `out_grow`
+ * Parameters:
+ *      -out: The output buffer.
+ *      -len: The number of bytes about to be appended.
+ * Purpose: Make room for `len` more bytes in the output buffer. Returns -1 if
+ *          the delta would exceed its maximum size.
+ */
+static int out_grow(struct delta_out *out, unsigned long len)
+{
+    if (out->max_size && out->len + len > out->max_size)
+        return -1;
+    if (out->len + len > out->alloc) {
+        out->alloc = alloc_nr(out->len + len);
+        out->buf = realloc(out->buf, out->alloc);
+    }
+    return 0;
+}
+
+/*
+ * Function: `out_size`
+ * Parameters:
+ *      -out: The output buffer.
+ *      -size: A size to append to the delta header.
+ * Purpose: Append a size in the delta header format (7 bits per byte, least
+ *          significant bits first).
+ */
+static int out_size(struct delta_out *out, unsigned long size)
+{
+    if (out_grow(out, 10) < 0)
+        return -1;
+    while (size >= 0x80) {
+        out->buf[out->len++] = (size & 0x7f) | 0x80;
+        size >>= 7;
+    }
+    out->buf[out->len++] = size;
+    return 0;
+}
+
+/*
+ * Function: `out_insert`
+ * Parameters:
+ *      -out: The output buffer.
+ *      -data: The literal bytes to insert.
+ *      -len: The number of literal bytes.
+ * Purpose: Append insert instructions for literal target bytes, at most 127
+ *          bytes per instruction.
+ */
+static int out_insert(struct delta_out *out, const unsigned char *data,
+                      unsigned long len)
+{
+    while (len) {
+        unsigned long n = len > 127 ? 127 : len;
+        if (out_grow(out, n + 1) < 0)
+            return -1;
+        out->buf[out->len++] = n;
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Function: `out_copy`
+ * Parameters:
+ *      -out: The output buffer.
+ *      -offset: The offset of the bytes to copy in the source.
+ *      -len: The number of bytes to copy.
+ * Purpose: Append copy instructions, leaving out the offset and size bytes
+ *          that are zero.
+ */
+static int out_copy(struct delta_out *out, unsigned long offset,
+                    unsigned long len)
+{
+    while (len) {
+        unsigned long n = len > MAX_COPY ? MAX_COPY : len;
+        unsigned char *op;
+        int i;
+
+        if (out_grow(out, 8) < 0)
+            return -1;
+        op = out->buf + out->len++;
+        *op = 0x80;
+        for (i = 0; i < 4; i++) {
+            unsigned char byte = offset >> (8 * i);
+            if (byte) {
+                *op |= 1 << i;
+                out->buf[out->len++] = byte;
+            }
+        }
+        for (i = 0; i < 3; i++) {
+            unsigned char byte = n >> (8 * i);
+            if (byte) {
+                *op |= 0x10 << i;
+                out->buf[out->len++] = byte;
+            }
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Function: `create_delta`
+ * Parameters:
+ *      -index: Index of the source buffer from `create_delta_index()`.
+ *      -trg: The target buffer.
+ *      -trg_size: The size of the target buffer.
+ *      -delta_size: Filled in with the size of the delta.
+ *      -max_size: Give up once the delta grows beyond this size (0 means no
+ *                 limit).
+ * Purpose: Create a delta that turns the indexed source into the target.
+ *          A rolling hash over BLOCK bytes of the target is looked up in the
+ *          source index at every position; a verified match is extended as
+ *          far as it goes in both directions and becomes a copy, and bytes
+ *          without a match become inserts. Returns the delta in a newly
+ *          allocated buffer, or NULL if it would exceed `max_size`.
+ */
+void *create_delta(struct delta_index *index, const void *trg_buf,
+                   unsigned long trg_size, unsigned long *delta_size,
+                   unsigned long max_size)
+{
+    const unsigned char *src = index->src, *trg = trg_buf;
+    struct delta_out out;
+    unsigned long i = 0, literal = 0;
+    unsigned int h = 0, top = 1;
+    int j;
+
+    memset(&out, 0, sizeof(out));
+    out.max_size = max_size;
+    if (out_size(&out, index->src_size) < 0 || out_size(&out, trg_size) < 0)
+        goto fail;
+
+    /* `top` is HASH_MULT to the power BLOCK-1, to roll bytes out. */
+    for (j = 1; j < BLOCK; j++)
+        top *= HASH_MULT;
+    if (trg_size >= BLOCK)
+        h = block_hash(trg);
+
+    while (i + BLOCK <= trg_size) {
+        unsigned long best_len = 0, best_off = 0, best_back = 0;
+        unsigned int block = index->buckets[h & index->hash_mask];
+        int chain = 0;
+
+        for (; block && chain < MAX_CHAIN; block = index->next[block - 1]) {
+            unsigned long off = (unsigned long)(block - 1) * BLOCK;
+            unsigned long len = BLOCK, back = 0;
+
+            chain++;
+            if (memcmp(src + off, trg + i, BLOCK))
+                continue;
+            while (off + len < index->src_size && i + len < trg_size &&
+                   src[off + len] == trg[i + len])
+                len++;
+            /* Take back pending literal bytes that also match. */
+            while (back < i - literal && back < off &&
+                   src[off - back - 1] == trg[i - back - 1])
+                back++;
+            if (len + back > best_len + best_back) {
+                best_len = len;
+                best_off = off;
+                best_back = back;
+            }
+        }
+
+        if (!best_len) {
+            /* No match: roll the hash one byte forward. */
+            if (i + BLOCK < trg_size)
+                h = (h - trg[i] * top) * HASH_MULT + trg[i + BLOCK];
+            i++;
+            continue;
+        }
+
+        i -= best_back;
+        if (out_insert(&out, trg + literal, i - literal) < 0 ||
+            out_copy(&out, best_off - best_back, best_len + best_back) < 0)
+            goto fail;
+        i += best_len + best_back;
+        literal = i;
+        if (i + BLOCK <= trg_size)
+            h = block_hash(trg + i);
+    }
+
+    if (out_insert(&out, trg + literal, trg_size - literal) < 0)
+        goto fail;
+    *delta_size = out.len;
+    return out.buf;
+
+fail:
+    free(out.buf);
+    return NULL;
+}
+
+/*
+ * Function: `diff_delta`
+ * Parameters:
+ *      -src, src_size: The source buffer and its size.
+ *      -trg, trg_size: The target buffer and its size.
+ *      -delta_size: Filled in with the size of the delta.
+ *      -max_size: Give up once the delta grows beyond this size (0 means no
+ *                 limit).
+ * Purpose: Create a delta between two buffers when the source is only used
+ *          once.
+ */
+void *diff_delta(const void *src, unsigned long src_size, const void *trg,
+                 unsigned long trg_size, unsigned long *delta_size,
+                 unsigned long max_size)
+{
+    struct delta_index *index = create_delta_index(src, src_size);
+    void *delta;
+
+    if (!index)
+        return NULL;
+    delta = create_delta(index, trg, trg_size, delta_size, max_size);
+    free_delta_index(index);
+    return delta;
+}
+
+/*
+ * Function: `get_delta_hdr_size`
+ * Parameters:
+ *      -data: Pointer to the current position in the delta; advanced past
+ *             the size.
+ *      -end: The end of the delta.
+ * Purpose: Decode one size from the delta header.
+ */
+static unsigned long get_delta_hdr_size(const unsigned char **data,
+                                        const unsigned char *end)
+{
+    const unsigned char *p = *data;
+    unsigned long size = 0;
+    int shift = 0;
+    unsigned char c;
+
+    do {
+        if (p >= end || shift > 8 * sizeof(long) - 7)
+            return ~0UL;
+        c = *p++;
+        size |= (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *data = p;
+    return size;
+}
+
+/*
+ * Function: `delta_result_size`
+ * Parameters:
+ *      -delta_buf: The start of a delta. Only the header is needed.
+ *      -len: The number of bytes available at `delta_buf`.
+ * Purpose: Return the size of the target that applying the delta produces,
+ *          without applying it, or ~0UL if the header is cut off.
+ */
+unsigned long delta_result_size(const void *delta_buf, unsigned long len)
+{
+    const unsigned char *data = delta_buf, *end = data + len;
+
+    if (get_delta_hdr_size(&data, end) == ~0UL)
+        return ~0UL;
+    return get_delta_hdr_size(&data, end);
+}
+
+/*
+ * Function: `patch_delta`
+ * Parameters:
+ *      -src, src_size: The source buffer the delta was made against.
+ *      -delta, delta_size: The delta.
+ *      -dst_size: Filled in with the size of the result.
+ * Purpose: Apply a delta to its source and return the target in a newly
+ *          allocated buffer (with a terminating null byte that is not
+ *          counted in the size), or NULL if the delta is corrupt.
+ */
+void *patch_delta(const void *src_buf, unsigned long src_size,
+                  const void *delta_buf, unsigned long delta_size,
+                  unsigned long *dst_size)
+{
+    const unsigned char *src = src_buf;
+    const unsigned char *data = delta_buf, *end = data + delta_size;
+    unsigned char *dst, *out;
+    unsigned long size;
+
+    if (get_delta_hdr_size(&data, end) != src_size)
+        return NULL;
+    size = get_delta_hdr_size(&data, end);
+    if (size == ~0UL)
+        return NULL;
+    dst = malloc(size + 1);
+    if (!dst)
+        return NULL;
+    out = dst;
+
+    while (data < end) {
+        unsigned char cmd = *data++;
+
+        if (cmd & 0x80) {
+            unsigned long off = 0, len = 0;
+            int i;
+
+            for (i = 0; i < 4; i++)
+                if (cmd & (1 << i)) {
+                    if (data >= end)
+                        goto corrupt;
+                    off |= (unsigned long)*data++ << (8 * i);
+                }
+            for (i = 0; i < 3; i++)
+                if (cmd & (0x10 << i)) {
+                    if (data >= end)
+                        goto corrupt;
+                    len |= (unsigned long)*data++ << (8 * i);
+                }
+            if (!len)
+                len = 0x10000;
+            if (off + len < off || off + len > src_size ||
+                len > size - (out - dst))
+                goto corrupt;
+            memcpy(out, src + off, len);
+            out += len;
+        } else if (cmd) {
+            if (cmd > end - data || cmd > size - (out - dst))
+                goto corrupt;
+            memcpy(out, data, cmd);
+            out += cmd;
+            data += cmd;
+        } else {
+            goto corrupt;
+        }
+    }
+
+    /* The delta must produce exactly the target size. */
+    if (out - dst != size)
+        goto corrupt;
+    *out = '\0';
+    *dst_size = size;
+    return dst;
+
+corrupt:
+    free(dst);
+    return NULL;
+}
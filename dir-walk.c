@@ -0,0 +1,390 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to list the files below a directory, for
+ *  `update-cache -r`. Large trees have many directories and each one costs
+ *  a few system calls, so the directories are read on a pool of threads:
+ *
+ *  -A directory is read by one thread, which queues the directories it
+ *   finds for any thread to read and keeps the files for the result.
+ *
+ *  -On Linux, a directory is read with the `getdents64` system call, which
+ *   hands over many entries, with their types, per call. Elsewhere
+ *   `readdir()` is used. Only when the type of an entry is not known is
+ *   `lstat()` called.
+ *
+ *  -Entries whose names start with `.` are skipped, as `update-cache` never
+ *   adds such paths, which also keeps the walk out of `.dircache`. Only
+ *   regular files are listed; symbolic links are not followed.
+ *
+ *  The files are sorted by path once the walk is done, which is the order
+ *  of the index, so the result does not depend on which thread read which
+ *  directory.
+ */
+#include "cache.h"
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h", <pthread.h> and <sys/syscall.h> header files,
+   ranked in order of first use in this file. Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -realloc(ptr, size): Resize an allocated block of memory. Sourced from
+                        <stdlib.h>.
+
+   -strlen(s): Return the length of a string. Sourced from <string.h>.
+
+   -malloc(size): Allocate memory. Sourced from <stdlib.h>.
+
+   -memcpy(dest, src, n): Copy memory. Sourced from <string.h>.
+
+   -lstat(path, buf): Get information about a file, without following a
+                      symbolic link. Sourced from <sys/stat.h>.
+
+   -free(ptr): Free allocated memory. Sourced from <stdlib.h>.
+
+   -open(path, flags): Open a file. Sourced from <fcntl.h>.
+
+   -syscall(SYS_getdents64, fd, buf, size): Read directory entries. Sourced
+                                            from <sys/syscall.h>.
+
+   -close(fd): Close a file descriptor. Sourced from <unistd.h>.
+
+   -opendir()/readdir()/closedir(): Read a directory. Sourced from
+                                    <dirent.h>.
+
+   -pthread_mutex_lock()/pthread_mutex_unlock(): Lock and unlock a mutex.
+                                                 Sourced from <pthread.h>.
+
+   -pthread_cond_wait()/pthread_cond_broadcast(): Wait for and announce a
+                                                  change. Sourced from
+                                                  <pthread.h>.
+
+   -fprintf(stream, format, ...): Print to a stream. Sourced from <stdio.h>.
+
+   -strcmp(s1, s2): Compare two strings. Sourced from <string.h>.
+
+   -memset(s, c, n): Fill memory with a byte. Sourced from <string.h>.
+
+   -pthread_mutex_init()/pthread_cond_init()/pthread_mutex_destroy()/
+    pthread_cond_destroy(): Set up and release a mutex and a condition.
+        Sourced from <pthread.h>.
+
+   -pthread_create()/pthread_join(): Start and wait for a thread.
+
+   -qsort(base, nmemb, size, compar): Sort an array. Sourced from
+                                      <stdlib.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -path_list: A growing array of paths.
+
+   -dir_walk: The state of a walk.
+
+   -linux_dirent64: An entry returned by `getdents64`.
+
+   -add_path(): Append a path to a list.
+
+   -add_entry(): Sort a directory entry into files and directories.
+
+   -read_dir(): Read one directory.
+
+   -walk_worker(): The function each thread runs.
+
+   -compare_paths(): Order two paths for `qsort()`.
+
+   -walk_directory(): List the files below a directory.
+*/
+
+/* The size of the buffer `getdents64` fills with entries. */
+#define DIRENT_BUF (32 * 1024)
+
+/* Template of a growing array of paths. */
+struct path_list {
+    char **paths;
+    int nr, alloc;
+};
+
+/* Template of the state of a walk. */
+struct dir_walk {
+    int (*want)(char *path);       /* Which files to list. */
+    pthread_mutex_t lock;
+    pthread_cond_t more;           /* Signalled when a directory is queued */
+                                   /* or the walk ends. */
+    struct path_list dirs;         /* Directories waiting to be read. */
+    struct path_list files;        /* The files found. */
+    int busy;                      /* Threads reading a directory. */
+    int failed;                    /* Whether a directory could not be read. */
+};
+
+#ifdef __linux__
+/* Template of an entry returned by `getdents64`. */
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/*
+ * Function: `add_path`
+ * Parameters:
+ *      -list: The list to append to.
+ *      -path: The path, which the list takes over.
+ * Purpose: Append a path to a list, growing it when it is full.
+ */
+static void add_path(struct path_list *list, char *path)
+{
+    if (list->nr == list->alloc) {
+        list->alloc = list->alloc ? 2 * list->alloc : 64;
+        list->paths = realloc(list->paths, list->alloc * sizeof(char *));
+    }
+    list->paths[list->nr++] = path;
+}
+
+/*
+ * Function: `add_entry`
+ * Parameters:
+ *      -w: The walk.
+ *      -dir: The path of the directory being read, with a trailing slash,
+ *            or "" for the current directory.
+ *      -name: The name of the entry.
+ *      -is_dir, is_file: What the directory entry says the entry is. When
+ *                        it says neither, `lstat()` is asked.
+ *      -dirs, files: Where to put the path of the entry.
+ * Purpose: Build the path of a directory entry and add it to the
+ *          directories to read or to the files found, or drop it.
+ */
+static void add_entry(struct dir_walk *w, const char *dir, const char *name,
+                      int is_dir, int is_file, struct path_list *dirs,
+                      struct path_list *files)
+{
+    int dirlen = strlen(dir), namelen = strlen(name);
+    char *path;
+    struct stat st;
+
+    /* Skip `.`, `..`, `.dircache` and every other hidden entry. */
+    if (name[0] == '.')
+        return;
+
+    path = malloc(dirlen + namelen + 2);
+    memcpy(path, dir, dirlen);
+    memcpy(path + dirlen, name, namelen + 1);
+    if (!is_dir && !is_file && !lstat(path, &st)) {
+        is_dir = S_ISDIR(st.st_mode);
+        is_file = S_ISREG(st.st_mode);
+    }
+
+    if (is_dir) {
+        path[dirlen + namelen] = '/';
+        path[dirlen + namelen + 1] = '\0';
+        add_path(dirs, path);
+    } else if (is_file && w->want(path)) {
+        add_path(files, path);
+    } else {
+        free(path);
+    }
+}
+
+/*
+ * Function: `read_dir`
+ * Parameters:
+ *      -w: The walk.
+ *      -dir: The directory to read, with a trailing slash, or "" for the
+ *            current directory.
+ * Purpose: Read a directory, then queue the directories in it and add the
+ *          files in it to the result, all at once, so that the lock is only
+ *          taken once per directory. Returns -1 if it could not be read.
+ */
+static int read_dir(struct dir_walk *w, const char *dir)
+{
+    struct path_list dirs = { NULL, 0, 0 }, files = { NULL, 0, 0 };
+    const char *open_path = *dir ? dir : ".";
+    int i;
+#ifdef __linux__
+    char *buf;
+    long n, pos;
+    int fd;
+
+    fd = open(open_path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    buf = malloc(DIRENT_BUF);
+    while ((n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF)) > 0) {
+        for (pos = 0; pos < n; ) {
+            struct linux_dirent64 *de = (struct linux_dirent64 *)(buf + pos);
+
+            add_entry(w, dir, de->d_name, de->d_type == DT_DIR,
+                      de->d_type == DT_REG, &dirs, &files);
+            pos += de->d_reclen;
+        }
+    }
+    free(buf);
+    close(fd);
+    if (n < 0)
+        return -1;
+#else
+    struct dirent *de;
+    DIR *d;
+
+    d = opendir(open_path);
+    if (!d)
+        return -1;
+    while ((de = readdir(d)) != NULL)
+        add_entry(w, dir, de->d_name, 0, 0, &dirs, &files);
+    closedir(d);
+#endif
+
+    pthread_mutex_lock(&w->lock);
+    for (i = 0; i < dirs.nr; i++)
+        add_path(&w->dirs, dirs.paths[i]);
+    for (i = 0; i < files.nr; i++)
+        add_path(&w->files, files.paths[i]);
+    if (dirs.nr)
+        pthread_cond_broadcast(&w->more);
+    pthread_mutex_unlock(&w->lock);
+    free(dirs.paths);
+    free(files.paths);
+    return 0;
+}
+
+/*
+ * Function: `walk_worker`
+ * Parameters:
+ *      -data: The walk.
+ * Purpose: The function each thread runs: read queued directories until
+ *          none are queued and no thread is reading one, which is when the
+ *          walk is done.
+ */
+static void *walk_worker(void *data)
+{
+    struct dir_walk *w = data;
+    char *dir;
+    int failed;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        if (w->dirs.nr) {
+            dir = w->dirs.paths[--w->dirs.nr];
+            w->busy++;
+            pthread_mutex_unlock(&w->lock);
+            failed = read_dir(w, dir) < 0;
+            if (failed)
+                fprintf(stderr, "unable to read directory %s\n", dir);
+            free(dir);
+            pthread_mutex_lock(&w->lock);
+            w->failed |= failed;
+            /* The last thread to finish with nothing queued ends the walk. */
+            if (!--w->busy && !w->dirs.nr)
+                pthread_cond_broadcast(&w->more);
+        } else if (!w->busy) {
+            break;
+        } else {
+            pthread_cond_wait(&w->more, &w->lock);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * Function: `compare_paths`
+ * Parameters:
+ *      -a, b: Pointers to two paths.
+ * Purpose: Order two paths by their bytes, as the index does.
+ */
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Function: `walk_directory`
+ * Parameters:
+ *      -dir: The directory to walk, "." for the current directory.
+ *      -nr_threads: How many threads to read directories on, the calling
+ *                   thread included.
+ *      -want: Called with the path of each regular file found; the file is
+ *             listed if it returns nonzero.
+ *      -paths: Set to the array of paths found, sorted. The array and the
+ *              paths are allocated with `malloc()`.
+ * Purpose: List the regular files below a directory, with paths relative to
+ *          the current directory. Returns the number of files, or -1 if a
+ *          directory could not be read.
+ */
+int walk_directory(const char *dir, int nr_threads, int (*want)(char *path),
+                   char ***paths)
+{
+    struct dir_walk w;
+    pthread_t *threads;
+    int len = strlen(dir), i, started = 0;
+    char *root;
+
+    memset(&w, 0, sizeof(w));
+    w.want = want;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.more, NULL);
+
+    /* Directories are queued with a trailing slash, the current one as "". */
+    while (len > 1 && dir[len - 1] == '/')
+        len--;
+    root = malloc(len + 2);
+    if (len == 1 && dir[0] == '.') {
+        root[0] = '\0';
+    } else {
+        memcpy(root, dir, len);
+        root[len] = '/';
+        root[len + 1] = '\0';
+    }
+    add_path(&w.dirs, root);
+
+    threads = malloc(nr_threads * sizeof(pthread_t));
+    for (i = 0; i < nr_threads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, walk_worker, &w))
+            break;
+        started++;
+    }
+    walk_worker(&w);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(w.dirs.paths);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.more);
+
+    if (w.failed) {
+        for (i = 0; i < w.files.nr; i++)
+            free(w.files.paths[i]);
+        free(w.files.paths);
+        return -1;
+    }
+    qsort(w.files.paths, w.files.nr, sizeof(char *), compare_paths);
+    *paths = w.files.paths;
+    return w.files.nr;
+}
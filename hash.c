@@ -0,0 +1,229 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define the hash algorithms a repository
+ *  can name its objects with. `init-db --object-format=<name>` records the
+ *  choice as `core.objectformat` in the configuration file, and every
+ *  command asks `object_hash()` which algorithm that is:
+ *
+ *  sha1:   20-byte names (40 hexadecimal digits). The original algorithm,
+ *          and the one used when no choice was recorded (see sha1.c).
+ *
+ *  sha256: 32-byte names, computed by OpenSSL.
+ *
+ *  blake3: 32-byte names. BLAKE3 hashes large objects on several threads
+ *          (see blake3.c), which SHA1 and SHA256 cannot do.
+ *
+ *  The length of object names is the only difference the rest of the code
+ *  sees: the index, tree objects, commits and the object store all hold
+ *  names of `object_hash()->rawsz` bytes or `object_hash()->hexsz`
+ *  hexadecimal digits. Pack files, their indexes and bitmaps only exist for
+ *  SHA1 repositories.
+ *
+ *  The checksums of the index and of pack files are not object names, and
+ *  remain SHA1 in every repository.
+ */
+#include "cache.h"
+#include <openssl/evp.h>
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <openssl/evp.h> header files, ranked in
+   order of first use in this file. Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -sha1_init()/sha1_update()/sha1_final(): Calculate an SHA1 hash. Sourced
+                                             from "cache.h" (defined in
+                                             sha1.c).
+
+   -EVP_MD_CTX_new()/EVP_DigestInit_ex()/EVP_DigestUpdate()/
+    EVP_DigestFinal_ex()/EVP_MD_CTX_free(): Calculate a hash with OpenSSL.
+        Sourced from <openssl/evp.h>.
+
+   -EVP_sha256(): The SHA256 algorithm of OpenSSL.
+
+   -blake3_init()/blake3_update()/blake3_final(): Calculate a BLAKE3 hash.
+        Sourced from "cache.h" (defined in blake3.c).
+
+   -strcmp(s1, s2): Compare two strings. Sourced from <string.h>.
+
+   -get_config(): Return the value of a key in the configuration file.
+                  Sourced from "cache.h" (defined in config.c).
+
+   -usage(): Print an error message and exit.
+
+   -get_config_env_int(): Return the value of a key as a number, which can be
+                          overridden from the environment.
+
+   -sysconf(name): Get a system limit, here the number of CPUs. Sourced from
+                   <unistd.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -init_sha1()/update_sha1()/final_sha1(): SHA1 for `struct hash_algo`.
+
+   -init_sha256()/update_sha256()/final_sha256(): SHA256 for `struct
+                                                  hash_algo`.
+
+   -init_blake3()/update_blake3()/final_blake3(): BLAKE3 for `struct
+                                                  hash_algo`.
+
+   -hash_algos: The hash algorithms.
+
+   -hash_algo_by_name(): Look up a hash algorithm by its name.
+
+   -object_hash(): Return the hash algorithm of the repository.
+
+   -hash_threads(): Return how many threads may hash one object.
+*/
+
+/*
+ * Functions: `init_sha1`, `update_sha1`, `final_sha1`
+ * Purpose: Compute SHA1 hashes with the engine in sha1.c.
+ */
+static void init_sha1(struct hash_ctx *c)
+{
+    sha1_init(&c->u.sha1);
+}
+
+static void update_sha1(struct hash_ctx *c, const void *data,
+                        unsigned long len)
+{
+    sha1_update(&c->u.sha1, data, len);
+}
+
+static void final_sha1(unsigned char *out, struct hash_ctx *c)
+{
+    sha1_final(out, &c->u.sha1);
+}
+
+/*
+ * Functions: `init_sha256`, `update_sha256`, `final_sha256`
+ * Purpose: Compute SHA256 hashes with OpenSSL, which uses the SHA
+ *          instructions of the CPU when it has them. The OpenSSL state is
+ *          allocated by `init_sha256()` and freed by `final_sha256()`.
+ */
+static void init_sha256(struct hash_ctx *c)
+{
+    c->u.evp = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(c->u.evp, EVP_sha256(), NULL);
+}
+
+static void update_sha256(struct hash_ctx *c, const void *data,
+                          unsigned long len)
+{
+    EVP_DigestUpdate(c->u.evp, data, len);
+}
+
+static void final_sha256(unsigned char *out, struct hash_ctx *c)
+{
+    EVP_DigestFinal_ex(c->u.evp, out, NULL);
+    EVP_MD_CTX_free(c->u.evp);
+}
+
+/*
+ * Functions: `init_blake3`, `update_blake3`, `final_blake3`
+ * Purpose: Compute BLAKE3 hashes with blake3.c.
+ */
+static void init_blake3(struct hash_ctx *c)
+{
+    blake3_init(&c->u.blake3);
+}
+
+static void update_blake3(struct hash_ctx *c, const void *data,
+                          unsigned long len)
+{
+    blake3_update(&c->u.blake3, data, len);
+}
+
+static void final_blake3(unsigned char *out, struct hash_ctx *c)
+{
+    blake3_final(out, &c->u.blake3);
+}
+
+/* The hash algorithms, the default first. */
+static const struct hash_algo hash_algos[] = {
+    { "sha1", 20, 40, 0, init_sha1, update_sha1, final_sha1 },
+    { "sha256", 32, 64, 0, init_sha256, update_sha256, final_sha256 },
+    { "blake3", 32, 64, 1, init_blake3, update_blake3, final_blake3 },
+};
+
+/*
+ * Function: `hash_algo_by_name`
+ * Parameters:
+ *      -name: The name of a hash algorithm, such as "sha256".
+ * Purpose: Return the hash algorithm with that name, or NULL if there is
+ *          none.
+ */
+const struct hash_algo *hash_algo_by_name(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(hash_algos) / sizeof(hash_algos[0]); i++)
+        if (!strcmp(hash_algos[i].name, name))
+            return &hash_algos[i];
+    return NULL;
+}
+
+/*
+ * Function: `object_hash`
+ * Parameters: none
+ * Purpose: Return the hash algorithm that names the objects of this
+ *          repository, from `core.objectformat` in the configuration file.
+ *          Repositories that do not record one use SHA1.
+ */
+const struct hash_algo *object_hash(void)
+{
+    static const struct hash_algo *algo;
+
+    if (!algo) {
+        const char *name = get_config("core.objectformat");
+
+        algo = name ? hash_algo_by_name(name) : &hash_algos[0];
+        if (!algo)
+            usage("unknown object format");
+    }
+    return algo;
+}
+
+/*
+ * Function: `hash_threads`
+ * Parameters: none
+ * Purpose: Return how many threads may hash one large object, which only
+ *          BLAKE3 can do. `core.hashthreads` sets it, and by default every
+ *          CPU is used.
+ */
+int hash_threads(void)
+{
+    static int threads;
+
+    if (!threads) {
+        int cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        threads = get_config_env_int("core.hashthreads", cpus);
+        if (threads < 1)
+            threads = 1;
+    }
+    return threads;
+}
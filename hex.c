@@ -0,0 +1,567 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define the functions that convert
+ *  between bytes and their hexadecimal representation, which every command
+ *  does for every object name it reads or prints. `get_sha1_hex()`,
+ *  `sha1_to_hex()` and `sha1_file_name()` in read-cache.c use them.
+ *
+ *  Converting one byte at a time through a lookup table costs a few
+ *  instructions per character, which shows up in commands that print
+ *  millions of names. So the work is done on 16 bytes at a time with SSE2
+ *  instructions, or 32 at a time with AVX2, when the CPU has them:
+ *
+ *  Encoding: The high and low four bits of each byte are split into two
+ *            vectors and interleaved, so each byte becomes two values from
+ *            0 to 15. Adding '0' to every value, and another 39 to values
+ *            above 9, gives '0'-'9' and 'a'-'f'.
+ *
+ *  Decoding: Each character is compared against the ranges '0'-'9' and
+ *            'a'-'f' (after setting bit 5, which makes 'A'-'F' lower
+ *            case) to get its value and to check that every character is
+ *            a hex digit. Each pair of values, seen as one 16-bit number,
+ *            is then combined into a byte with shifts.
+ *
+ *  Which version is used is decided the first time one is needed, by
+ *  asking the CPU what it supports, so one binary runs everywhere. On
+ *  other CPUs and compilers only the plain C version is built.
+ *
+ *  Besides converting one name at a time, `sha1s_to_hex()` and
+ *  `hex_to_sha1s()` convert arrays of names into buffers given by the
+ *  caller, and `sha1_to_hex_r()` writes one name into a buffer given by
+ *  the caller instead of the static buffer of `sha1_to_hex()`.
+ */
+#include "cache.h"
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define HEX_X86
+    #include <immintrin.h>
+#endif
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <immintrin.h> header files, ranked in order
+   of first use in this file. Function names are followed by parenthesis
+   whereas variable/struct names are not:
+
+   -_mm_loadu_si128()/_mm_storeu_si128(): Load and store 16 bytes. Sourced
+                                          from <immintrin.h>.
+
+   -_mm_srli_epi16()/_mm_slli_epi16(): Shift 16-bit numbers.
+
+   -_mm_and_si128()/_mm_or_si128(): Bitwise AND and OR.
+
+   -_mm_unpacklo_epi8()/_mm_unpackhi_epi8(): Interleave the bytes of two
+                                             vectors.
+
+   -_mm_cmpgt_epi8()/_mm_cmplt_epi8(): Compare bytes as signed numbers.
+
+   -_mm_add_epi8()/_mm_sub_epi8(): Add and subtract bytes.
+
+   -_mm_movemask_epi8(): Gather the top bit of every byte.
+
+   -_mm_packus_epi16(): Pack 16-bit numbers into bytes.
+
+   -_mm256_*(): The same operations on 32 bytes, and
+                `_mm256_permute2x128_si256()`/`_mm256_permute4x64_epi64()`
+                to reorder the two halves of a vector.
+
+   -__builtin_cpu_supports(feature): Ask the CPU whether it supports an
+                                     instruction set. Built into GCC and
+                                     Clang.
+
+   -memcpy(s1, s2, n): Copy memory. Sourced from <string.h>.
+
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -hex_digits: The hexadecimal digits.
+
+   -hexval(): Convert a hexadecimal digit to its value.
+
+   -encode_scalar()/decode_scalar(): Convert a byte at a time.
+
+   -encode16_sse2()/decode16_sse2(): Convert one block of 16 bytes.
+
+   -encode_sse2()/decode_sse2(): Convert 16 bytes at a time.
+
+   -encode32_avx2()/decode32_avx2(): Convert one block of 32 bytes.
+
+   -encode_avx2()/decode_avx2(): Convert 32 bytes at a time.
+
+   -encode_fn/decode_fn: The versions the CPU supports.
+
+   -choose_hex(): Decide which versions to use.
+
+   -hex_encode(): Convert bytes to hexadecimal.
+
+   -hex_decode(): Convert hexadecimal to bytes.
+
+   -sha1_to_hex_r(): Convert an SHA1 hash into a buffer given by the caller.
+
+   -sha1s_to_hex(): Convert an array of SHA1 hashes.
+
+   -hex_to_sha1s(): Convert an array of hexadecimal SHA1 hashes.
+*/
+
+/* How many SHA1 hashes `sha1s_to_hex()` converts in one go. */
+#define HEX_BATCH 128
+
+/* The hexadecimal digits, indexed by their value. */
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * Function: `hexval`
+ * Parameters:
+ *      -c: Hexadecimal character to convert to decimal.
+ * Purpose: Convert a hexadecimal symbol to its value, or to ~0 if it is not
+ *          a hexadecimal symbol.
+ */
+static unsigned hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return ~0;
+}
+
+/*
+ * Function: `encode_scalar`
+ * Parameters:
+ *      -out: Where to store `2 * len` hexadecimal characters.
+ *      -in: The bytes to convert.
+ *      -len: The number of bytes.
+ * Purpose: Convert bytes to hexadecimal one at a time, the high four bits
+ *          of each byte first.
+ */
+static void encode_scalar(char *out, const unsigned char *in,
+                          unsigned long len)
+{
+    while (len--) {
+        unsigned int val = *in++;
+        *out++ = hex_digits[val >> 4];
+        *out++ = hex_digits[val & 0xf];
+    }
+}
+
+/*
+ * Function: `decode_scalar`
+ * Parameters:
+ *      -out: Where to store `len` bytes.
+ *      -hex: The `2 * len` hexadecimal characters to convert.
+ *      -len: The number of bytes.
+ * Purpose: Convert hexadecimal to bytes one at a time. Returns -1 if a
+ *          character is not a hexadecimal digit.
+ */
+static int decode_scalar(unsigned char *out, const char *hex,
+                         unsigned long len)
+{
+    while (len--) {
+        unsigned int val = (hexval(hex[0]) << 4) | hexval(hex[1]);
+        if (val & ~0xff)
+            return -1;
+        *out++ = val;
+        hex += 2;
+    }
+    return 0;
+}
+
+#ifdef HEX_X86
+
+/*
+ * Function: `encode16_sse2`
+ * Parameters:
+ *      -out: Where to store 32 hexadecimal characters.
+ *      -in: 16 bytes to convert.
+ * Purpose: Convert 16 bytes with SSE2 instructions.
+ */
+__attribute__((target("sse2")))
+static void encode16_sse2(char *out, const unsigned char *in)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    __m128i a = _mm_unpacklo_epi8(hi, lo);
+    __m128i b = _mm_unpackhi_epi8(hi, lo);
+
+    a = _mm_add_epi8(_mm_add_epi8(a, zero),
+                     _mm_and_si128(_mm_cmpgt_epi8(a, nine), alpha));
+    b = _mm_add_epi8(_mm_add_epi8(b, zero),
+                     _mm_and_si128(_mm_cmpgt_epi8(b, nine), alpha));
+    _mm_storeu_si128((__m128i *)out, a);
+    _mm_storeu_si128((__m128i *)(out + 16), b);
+}
+
+/*
+ * Function: `encode_sse2`
+ * Parameters: As for `encode_scalar()`.
+ * Purpose: Convert 16 bytes at a time with SSE2 instructions. If the length
+ *          is not a multiple of 16, the last block overlaps the one before
+ *          it and simply writes some characters twice, which is much faster
+ *          than converting the rest a byte at a time. An SHA1 hash (20
+ *          bytes) takes two blocks.
+ */
+__attribute__((target("sse2")))
+static void encode_sse2(char *out, const unsigned char *in, unsigned long len)
+{
+    unsigned long i;
+
+    if (len < 16) {
+        encode_scalar(out, in, len);
+        return;
+    }
+    for (i = 0; i + 16 <= len; i += 16)
+        encode16_sse2(out + 2 * i, in + i);
+    if (i < len)
+        encode16_sse2(out + 2 * (len - 16), in + len - 16);
+}
+
+/*
+ * Function: `decode16_sse2`
+ * Parameters:
+ *      -out: Where to store 16 bytes.
+ *      -hex: 32 hexadecimal characters to convert.
+ * Purpose: Convert 32 hexadecimal characters with SSE2 instructions.
+ *          Returns -1 if one of them is not a hexadecimal digit.
+ */
+__attribute__((target("sse2")))
+static int decode16_sse2(unsigned char *out, const char *hex)
+{
+    __m128i v[2];
+    int i, valid = 0xffff;
+
+    for (i = 0; i < 2; i++) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(hex + 16 * i));
+        __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i digit = _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        __m128i letter = _mm_and_si128(
+            _mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+        __m128i val = _mm_or_si128(
+            _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+            _mm_and_si128(letter, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+
+        valid &= _mm_movemask_epi8(_mm_or_si128(digit, letter));
+        /* The first character of each pair is the low byte of the pair. */
+        v[i] = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(val, _mm_set1_epi16(0x00ff)), 4),
+            _mm_srli_epi16(val, 8));
+    }
+    if (valid != 0xffff)
+        return -1;
+    _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(v[0], v[1]));
+    return 0;
+}
+
+/*
+ * Function: `decode_sse2`
+ * Parameters: As for `decode_scalar()`.
+ * Purpose: Convert 32 characters at a time with SSE2 instructions, with an
+ *          overlapping last block as in `encode_sse2()`.
+ */
+__attribute__((target("sse2")))
+static int decode_sse2(unsigned char *out, const char *hex, unsigned long len)
+{
+    unsigned long i;
+
+    if (len < 16)
+        return decode_scalar(out, hex, len);
+    for (i = 0; i + 16 <= len; i += 16)
+        if (decode16_sse2(out + i, hex + 2 * i) < 0)
+            return -1;
+    if (i < len)
+        return decode16_sse2(out + len - 16, hex + 2 * (len - 16));
+    return 0;
+}
+
+/*
+ * Function: `encode32_avx2`
+ * Parameters:
+ *      -out: Where to store 64 hexadecimal characters.
+ *      -in: 32 bytes to convert.
+ * Purpose: Convert 32 bytes with AVX2 instructions. The AVX2 byte
+ *          interleaving works within each 16-byte half, so the halves are
+ *          put back in order at the end.
+ */
+__attribute__((target("avx2")))
+static void encode32_avx2(char *out, const unsigned char *in)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i alpha = _mm256_set1_epi8('a' - '0' - 10);
+    __m256i v = _mm256_loadu_si256((const __m256i *)in);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+    __m256i lo = _mm256_and_si256(v, mask);
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+
+    a = _mm256_add_epi8(_mm256_add_epi8(a, zero),
+                        _mm256_and_si256(_mm256_cmpgt_epi8(a, nine), alpha));
+    b = _mm256_add_epi8(_mm256_add_epi8(b, zero),
+                        _mm256_and_si256(_mm256_cmpgt_epi8(b, nine), alpha));
+    _mm256_storeu_si256((__m256i *)out,
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+}
+
+/*
+ * Function: `encode_avx2`
+ * Parameters: As for `encode_scalar()`.
+ * Purpose: Convert 32 bytes at a time with AVX2 instructions, with an
+ *          overlapping last block as in `encode_sse2()`. Less than 32 bytes,
+ *          such as a single SHA1 hash, are left to SSE2.
+ */
+__attribute__((target("avx2")))
+static void encode_avx2(char *out, const unsigned char *in, unsigned long len)
+{
+    unsigned long i;
+
+    if (len < 32) {
+        encode_sse2(out, in, len);
+        return;
+    }
+    for (i = 0; i + 32 <= len; i += 32)
+        encode32_avx2(out + 2 * i, in + i);
+    if (i < len)
+        encode32_avx2(out + 2 * (len - 32), in + len - 32);
+}
+
+/*
+ * Function: `decode32_avx2`
+ * Parameters:
+ *      -out: Where to store 32 bytes.
+ *      -hex: 64 hexadecimal characters to convert.
+ * Purpose: Convert 64 hexadecimal characters with AVX2 instructions, as in
+ *          `decode16_sse2()`. Packing works within each 16-byte half, so the
+ *          four 8-byte quarters are put back in order at the end.
+ */
+__attribute__((target("avx2")))
+static int decode32_avx2(unsigned char *out, const char *hex)
+{
+    __m256i v[2];
+    unsigned int valid = 0xffffffff;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(hex + 32 * i));
+        __m256i l = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        __m256i digit = _mm256_and_si256(
+            _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+        __m256i letter = _mm256_and_si256(
+            _mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l));
+        __m256i val = _mm256_or_si256(
+            _mm256_and_si256(digit,
+                             _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+            _mm256_and_si256(letter,
+                             _mm256_sub_epi8(l, _mm256_set1_epi8('a' - 10))));
+
+        valid &= _mm256_movemask_epi8(_mm256_or_si256(digit, letter));
+        v[i] = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_and_si256(val,
+                                               _mm256_set1_epi16(0x00ff)), 4),
+            _mm256_srli_epi16(val, 8));
+    }
+    if (valid != 0xffffffff)
+        return -1;
+    _mm256_storeu_si256((__m256i *)out, _mm256_permute4x64_epi64(
+                            _mm256_packus_epi16(v[0], v[1]), 0xd8));
+    return 0;
+}
+
+/*
+ * Function: `decode_avx2`
+ * Parameters: As for `decode_scalar()`.
+ * Purpose: Convert 64 characters at a time with AVX2 instructions, with an
+ *          overlapping last block as in `encode_sse2()`. Less than 32 bytes
+ *          are left to SSE2.
+ */
+__attribute__((target("avx2")))
+static int decode_avx2(unsigned char *out, const char *hex, unsigned long len)
+{
+    unsigned long i;
+
+    if (len < 32)
+        return decode_sse2(out, hex, len);
+    for (i = 0; i + 32 <= len; i += 32)
+        if (decode32_avx2(out + i, hex + 2 * i) < 0)
+            return -1;
+    if (i < len)
+        return decode32_avx2(out + len - 32, hex + 2 * (len - 32));
+    return 0;
+}
+
+#endif
+
+/* The versions of the conversions this CPU supports, once chosen. */
+static void (*encode_fn)(char *out, const unsigned char *in,
+                         unsigned long len);
+static int (*decode_fn)(unsigned char *out, const char *hex,
+                        unsigned long len);
+
+/*
+ * Function: `choose_hex`
+ * Parameters: none
+ * Purpose: Use the fastest versions of the conversions that the CPU
+ *          supports.
+ */
+static void choose_hex(void)
+{
+    encode_fn = encode_scalar;
+    decode_fn = decode_scalar;
+#ifdef HEX_X86
+    if (__builtin_cpu_supports("avx2")) {
+        encode_fn = encode_avx2;
+        decode_fn = decode_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        encode_fn = encode_sse2;
+        decode_fn = decode_sse2;
+    }
+#endif
+}
+
+/*
+ * Function: `hex_encode`
+ * Parameters:
+ *      -out: Where to store `2 * len` hexadecimal characters. No null byte
+ *            is added.
+ *      -in: The bytes to convert.
+ *      -len: The number of bytes.
+ * Purpose: Convert bytes to lower case hexadecimal.
+ */
+void hex_encode(char *out, const unsigned char *in, unsigned long len)
+{
+    if (!encode_fn)
+        choose_hex();
+    encode_fn(out, in, len);
+}
+
+/*
+ * Function: `hex_decode`
+ * Parameters:
+ *      -out: Where to store `len` bytes.
+ *      -hex: The `2 * len` hexadecimal characters to convert, in upper or
+ *            lower case. All of them must be there: the SIMD versions load
+ *            them before checking any, so a NUL does not stop them.
+ *      -len: The number of bytes.
+ * Purpose: Convert hexadecimal to bytes. Returns -1 if a character is not a
+ *          hexadecimal digit, in which case `out` may have been changed.
+ */
+int hex_decode(unsigned char *out, const char *hex, unsigned long len)
+{
+    if (!decode_fn)
+        choose_hex();
+    return decode_fn(out, hex, len);
+}
+
+/*
+ * Function: `sha1_to_hex_r`
+ * Parameters:
+ *      -buf: Where to store the hexadecimal characters and a null byte,
+ *            `MAX_HEXSZ + 1` at most.
+ *      -sha1: An object name.
+ * Purpose: Like `sha1_to_hex()`, but into a buffer given by the caller, so
+ *          that it can be used for more than one hash at a time. Returns
+ *          `buf`.
+ */
+char *sha1_to_hex_r(char *buf, const unsigned char *sha1)
+{
+    const struct hash_algo *algo = object_hash();
+
+    hex_encode(buf, sha1, algo->rawsz);
+    buf[algo->hexsz] = 0;
+    return buf;
+}
+
+/*
+ * Function: `sha1s_to_hex`
+ * Parameters:
+ *      -out: Where to store `(object_hash()->hexsz + 1) * nr` characters.
+ *      -sha1s: `nr` object names, one after the other.
+ *      -nr: The number of hashes.
+ *      -term: The character stored after each hash, for example '\n' to
+ *             build lines to print or '\0' to build strings.
+ * Purpose: Convert an array of SHA1 hashes to hexadecimal. The hashes are
+ *          converted HEX_BATCH at a time with one call to the conversion
+ *          function, so the wide versions get long runs to work on, and
+ *          then copied into place with their terminators.
+ */
+void sha1s_to_hex(char *out, const unsigned char *sha1s, unsigned long nr,
+                  int term)
+{
+    int rawsz = object_hash()->rawsz, hexsz = 2 * rawsz;
+    char hex[HEX_BATCH * MAX_HEXSZ];
+
+    while (nr) {
+        unsigned long n = nr < HEX_BATCH ? nr : HEX_BATCH, i;
+
+        hex_encode(hex, sha1s, n * rawsz);
+        for (i = 0; i < n; i++) {
+            memcpy(out, hex + i * hexsz, hexsz);
+            out[hexsz] = term;
+            out += hexsz + 1;
+        }
+        sha1s += n * rawsz;
+        nr -= n;
+    }
+}
+
+/*
+ * Function: `hex_to_sha1s`
+ * Parameters:
+ *      -sha1s: Where to store `nr` object names, one after the other.
+ *      -hex: The first hexadecimal SHA1 hash.
+ *      -stride: The distance from the start of one hexadecimal hash to the
+ *               start of the next, for example 41 for lines of a file
+ *               listing SHA1 hashes.
+ *      -nr: The number of hashes.
+ * Purpose: Convert an array of hexadecimal SHA1 hashes to bytes. Returns
+ *          the number of hashes converted, which is less than `nr` only if
+ *          the one after them is not valid hexadecimal.
+ */
+unsigned long hex_to_sha1s(unsigned char *sha1s, const char *hex,
+                           unsigned long stride, unsigned long nr)
+{
+    int rawsz = object_hash()->rawsz;
+    unsigned long i;
+
+    if (!decode_fn)
+        choose_hex();
+    for (i = 0; i < nr; i++, hex += stride, sha1s += rawsz)
+        if (decode_fn(sha1s, hex, rawsz) < 0)
+            break;
+    return i;
+}
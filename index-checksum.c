@@ -0,0 +1,705 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define the checksums that protect the
+ *  index (`.dircache/index`) against corruption, and how much of that
+ *  protection `read_cache()` pays for each time a command starts.
+ *
+ *  The checksum covers the header and everything after it, and is stored
+ *  in the header. `write_cache()` computes it with the kind chosen by
+ *  `index.checksum`:
+ *
+ *  sha1:   The original checksum. The index is written as version 3, which
+ *          older versions of the programs can read.
+ *
+ *  crc32c: A 32-bit CRC (the Castagnoli polynomial). x86 CPUs with SSE4.2
+ *          compute it with the `crc32` instruction, 8 bytes at a time, many
+ *          times faster than SHA1; other CPUs use tables.
+ *
+ *  xxh3:   The 64-bit XXH3 hash of the xxHash library, which is as fast
+ *          on every CPU. Only built with `make USE_XXHASH=1`.
+ *
+ *  The other kinds are written as version 4, which names the kind in the
+ *  first byte of the checksum field of the header and stores the checksum
+ *  from its fifth byte on. They detect the damage a disk or a bad copy
+ *  does as well as SHA1; the index needs no protection against forgery.
+ *
+ *  `read_cache()` checks the checksum as `index.verify` says:
+ *
+ *  full:       Before the entries are read (the default).
+ *
+ *  background: On another thread, while the command reads and uses the
+ *              entries. The thread is waited for before an index is
+ *              written, and before a command that read the index reports
+ *              success: a command that read a damaged index then fails,
+ *              and writes nothing derived from it into the index.
+ *
+ *  stat:       Not at all when the index has not been replaced since it was
+ *              last checked, which is known when its size, times, inode
+ *              and checksum are those recorded in `.dircache/index.stat`
+ *              after the last check. A shared index (see split-index.c)
+ *              is recorded in its own file name with ".stat" added. This
+ *              trusts the local file system, which is what makes it fast.
+ */
+#include "cache.h"
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+    #define CRC32C_X86
+    #include <immintrin.h>
+#endif
+#ifdef BGIT_XXHASH
+    #include <xxhash.h>
+#endif
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h", <pthread.h>, <immintrin.h> and <xxhash.h>
+   header files, ranked in order of first use in this file. Function names
+   are followed by parenthesis whereas variable/struct names are not:
+
+   -_mm_crc32_u64()/_mm_crc32_u8(): Add 8 bytes or 1 byte to a CRC32C.
+                                    Sourced from <immintrin.h>.
+
+   -__builtin_cpu_supports(feature): Ask the CPU whether it supports an
+                                     instruction set. Built into GCC and
+                                     Clang.
+
+   -pthread_once(once, fn): Call `fn` once, even from several threads.
+                            Sourced from <pthread.h>.
+
+   -memcpy(s1, s2, n): Copy memory. Sourced from <string.h>.
+
+   -get_config_env(): Return the value of a key in the configuration file,
+                      which can be overridden from the environment. Sourced
+                      from "cache.h" (defined in config.c).
+
+   -strcmp(s1, s2): Compare two strings. Sourced from <string.h>.
+
+   -error(): Print an error message. Sourced from "cache.h" (defined in
+             read-cache.c).
+
+   -sha1_init()/sha1_update()/sha1_final(): Calculate an SHA1 hash. Sourced
+                                             from "cache.h" (defined in
+                                             sha1.c).
+
+   -XXH3_createState()/XXH3_64bits_reset()/XXH3_64bits_update()/
+    XXH3_64bits_digest()/XXH3_freeState(): Calculate an XXH3 hash. Sourced
+        from <xxhash.h>.
+
+   -XXH64_canonicalFromHash(): Store a 64-bit hash in big-endian order.
+
+   -memset(s, c, n): Fill memory with a byte. Sourced from <string.h>.
+
+   -offsetof(type, member): The offset of a member in a structure. Sourced
+                            from <stddef.h>.
+
+   -memcmp(s1, s2, n): Compare memory. Sourced from <string.h>.
+
+   -pthread_join(): Wait for a thread.
+
+   -STAT_TIME_SEC()/STAT_TIME_NSEC(): The times of a stat structure.
+                                      Sourced from "cache.h".
+
+   -snprintf(s, n, format, ...): Print to a string of at most `n` bytes.
+                                 Sourced from <stdio.h>.
+
+   -OPEN_FILE(): Open a file. Sourced from "cache.h".
+
+   -read(fd, buf, n)/write(fd, buf, n)/close(fd): Read and write a file.
+        Sourced from <unistd.h>.
+
+   -pthread_create(): Start a thread.
+
+   -atexit(fn): Call a function when the process exits. Sourced from
+                <stdlib.h>.
+
+   -unlink(path): Remove a file. Sourced from <unistd.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -crc32c_table: The tables of the CRC32C computed without SSE4.2.
+
+   -crc32c_init_table(): Build the tables.
+
+   -crc32c_scalar(): Compute a CRC32C with the tables.
+
+   -crc32c_sse42(): Compute a CRC32C with the `crc32` instruction.
+
+   -crc32c_fn/crc32c_once: The version the CPU supports, chosen once.
+
+   -crc32c_init(): Choose it.
+
+   -crc32c(): Add data to a CRC32C.
+
+   -index_checksum_names: The names of the kinds of checksums.
+
+   -index_checksum_available(): Whether a kind is built in.
+
+   -index_checksum_kind(): The kind `write_cache()` uses.
+
+   -index_checksum_init()/index_checksum_update()/index_checksum_final():
+        Compute the checksum of an index a piece at a time.
+
+   -checksum_matches(): Check the checksum of an index in memory.
+
+   -verify_job: Template of a check running in the background.
+
+   -verify_jobs/nr_verifying/verify_ok: The checks running in the
+                                        background, and their result.
+
+   -verify_in_background(): The thread that checks a checksum.
+
+   -finish_index_checksum(): Wait for the checks in the background.
+
+   -finish_at_exit(): Wait for them when the command exits early.
+
+   -index_stat: Template of `.dircache/index.stat`.
+
+   -fill_index_stat(): Describe an index file.
+
+   -index_verify_mode(): Read `index.verify`.
+
+   -check_index_settings(): Check both settings before the index is locked.
+
+   -verify_index_checksum(): Check the checksum of the index as
+                             `index.verify` says.
+*/
+
+/* The CRC32C tables, for eight bytes at a time ("slicing by 8"). */
+static unsigned int crc32c_table[8][256];
+
+/*
+ * Function: `crc32c_init_table`
+ * Parameters: none
+ * Purpose: Build the tables: `crc32c_table[0][b]` is the CRC of the byte
+ *          `b`, and `crc32c_table[k][b]` that of `b` followed by `k` zero
+ *          bytes, so that eight bytes are added with eight lookups.
+ */
+static void crc32c_init_table(void)
+{
+    unsigned int i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+                crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+/*
+ * Function: `crc32c_scalar`
+ * Parameters:
+ *      -crc: The CRC of the data before, inverted (~0 to start with).
+ *      -data: The data to add.
+ *      -len: The length of the data.
+ * Purpose: Add data to a CRC32C with the tables. Returns the new CRC, still
+ *          inverted.
+ */
+static unsigned int crc32c_scalar(unsigned int crc, const unsigned char *data,
+                                  unsigned long len)
+{
+    while (len >= 8) {
+        unsigned int lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+                                 (unsigned int) data[3] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^
+              crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^
+              crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]] ^
+              crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/*
+ * Function: `crc32c_sse42`
+ * Parameters: see `crc32c_scalar()`.
+ * Purpose: Add data to a CRC32C with the `crc32` instruction of SSE4.2,
+ *          which adds 8 bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *data,
+                                 unsigned long len)
+{
+    unsigned long long crc64 = crc;
+
+    while (len >= 8) {
+        unsigned long long word;
+
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+/* The version of the CRC32C the CPU supports, chosen once. */
+static unsigned int (*crc32c_fn)(unsigned int crc, const unsigned char *data,
+                                 unsigned long len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Function: `crc32c_init`
+ * Parameters: none
+ * Purpose: Choose the version of the CRC32C the CPU supports, and build the
+ *          tables if that is `crc32c_scalar()`.
+ */
+static void crc32c_init(void)
+{
+#ifdef CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_sse42;
+        return;
+    }
+#endif
+    crc32c_init_table();
+    crc32c_fn = crc32c_scalar;
+}
+
+/*
+ * Function: `crc32c`
+ * Parameters: see `crc32c_scalar()`.
+ * Purpose: Add data to a CRC32C, with SSE4.2 if the CPU has it. The checks
+ *          in the background (see below) may get here at the same time on
+ *          two threads, so the setup is run once with pthread_once(), and
+ *          neither thread sees half-built tables.
+ */
+static unsigned int crc32c(unsigned int crc, const void *data,
+                           unsigned long len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_fn(crc, data, len);
+}
+
+/* The names of the kinds of checksums, in `index.checksum`. */
+static const char *index_checksum_names[] = { "sha1", "crc32c", "xxh3" };
+
+/*
+ * Function: `index_checksum_available`
+ * Parameters:
+ *      -kind: A kind of checksum (INDEX_CHECKSUM_*).
+ * Purpose: Return whether this executable can compute that kind.
+ */
+static int index_checksum_available(int kind)
+{
+    switch (kind) {
+    case INDEX_CHECKSUM_SHA1:
+    case INDEX_CHECKSUM_CRC32C:
+        return 1;
+#ifdef BGIT_XXHASH
+    case INDEX_CHECKSUM_XXH3:
+        return 1;
+#endif
+    }
+    return 0;
+}
+
+/*
+ * Function: `index_checksum_kind`
+ * Parameters: none
+ * Purpose: Return the kind of checksum `write_cache()` uses, from the
+ *          `index.checksum` setting. Defaults to SHA1. Returns -1, after
+ *          reporting it once, if the setting names a kind that is unknown
+ *          or not built in.
+ */
+int index_checksum_kind(void)
+{
+    static int kind = -2;
+    const char *name;
+    int i;
+
+    if (kind != -2)
+        return kind;
+    kind = INDEX_CHECKSUM_SHA1;
+    name = get_config_env("index.checksum");
+    if (!name)
+        return kind;
+
+    for (i = 0; i <= INDEX_CHECKSUM_XXH3; i++)
+        if (!strcmp(name, index_checksum_names[i]))
+            break;
+    if (i > INDEX_CHECKSUM_XXH3)
+        kind = error("unknown index.checksum");
+    else if (!index_checksum_available(i))
+        kind = error("index.checksum is not built into this executable");
+    else
+        kind = i;
+    return kind;
+}
+
+/*
+ * Function: `index_checksum_init`
+ * Parameters:
+ *      -c: The state of the checksum to start.
+ *      -kind: The kind of checksum (INDEX_CHECKSUM_*), which must be
+ *             available.
+ * Purpose: Start computing the checksum of an index.
+ */
+void index_checksum_init(struct index_checksum *c, int kind)
+{
+    c->kind = kind;
+    switch (kind) {
+    case INDEX_CHECKSUM_SHA1:
+        sha1_init(&c->sha1);
+        break;
+    case INDEX_CHECKSUM_CRC32C:
+        c->crc = ~0;
+        break;
+#ifdef BGIT_XXHASH
+    case INDEX_CHECKSUM_XXH3:
+        c->xxh3 = XXH3_createState();
+        XXH3_64bits_reset(c->xxh3);
+        break;
+#endif
+    }
+}
+
+/*
+ * Function: `index_checksum_update`
+ * Parameters:
+ *      -c: The state of the checksum.
+ *      -data: The next part of the index.
+ *      -len: Its length.
+ * Purpose: Add part of the index to the checksum.
+ */
+void index_checksum_update(struct index_checksum *c, const void *data,
+                           unsigned long len)
+{
+    switch (c->kind) {
+    case INDEX_CHECKSUM_SHA1:
+        sha1_update(&c->sha1, data, len);
+        break;
+    case INDEX_CHECKSUM_CRC32C:
+        c->crc = crc32c(c->crc, data, len);
+        break;
+#ifdef BGIT_XXHASH
+    case INDEX_CHECKSUM_XXH3:
+        XXH3_64bits_update(c->xxh3, data, len);
+        break;
+#endif
+    }
+}
+
+/*
+ * Function: `index_checksum_final`
+ * Parameters:
+ *      -field: The 20-byte checksum field of the header to fill in.
+ *      -c: The state of the checksum, which is released.
+ * Purpose: Finish the checksum and store it the way the header holds it:
+ *          the whole field for SHA1, or else the kind in the first byte and
+ *          the checksum, big-endian, from INDEX_CHECKSUM_OFFSET on.
+ */
+void index_checksum_final(unsigned char *field, struct index_checksum *c)
+{
+    unsigned int crc;
+#ifdef BGIT_XXHASH
+    XXH64_canonical_t canonical;
+#endif
+
+    if (c->kind == INDEX_CHECKSUM_SHA1) {
+        sha1_final(field, &c->sha1);
+        return;
+    }
+    memset(field, 0, 20);
+    field[0] = c->kind;
+    switch (c->kind) {
+    case INDEX_CHECKSUM_CRC32C:
+        crc = ~c->crc;
+        field[INDEX_CHECKSUM_OFFSET] = crc >> 24;
+        field[INDEX_CHECKSUM_OFFSET + 1] = crc >> 16;
+        field[INDEX_CHECKSUM_OFFSET + 2] = crc >> 8;
+        field[INDEX_CHECKSUM_OFFSET + 3] = crc;
+        break;
+#ifdef BGIT_XXHASH
+    case INDEX_CHECKSUM_XXH3:
+        XXH64_canonicalFromHash(&canonical, XXH3_64bits_digest(c->xxh3));
+        memcpy(field + INDEX_CHECKSUM_OFFSET, canonical.digest, 8);
+        XXH3_freeState(c->xxh3);
+        break;
+#endif
+    }
+}
+
+/*
+ * Function: `checksum_matches`
+ * Parameters:
+ *      -hdr: The header of an index in memory, followed by the rest of it.
+ *      -size: The size of the index in bytes.
+ * Purpose: Compute the checksum of an index, with the kind its header
+ *          names, and compare it to the one in the header. The kind must be
+ *          available.
+ */
+static int checksum_matches(const struct cache_header *hdr,
+                            unsigned long size)
+{
+    struct index_checksum c;
+    unsigned char field[20];
+    int kind = hdr->version >= 4 ? hdr->sha1[0] : INDEX_CHECKSUM_SHA1;
+
+    index_checksum_init(&c, kind);
+    index_checksum_update(&c, hdr, offsetof(struct cache_header, sha1));
+    index_checksum_update(&c, hdr + 1, size - sizeof(*hdr));
+    index_checksum_final(field, &c);
+    return !memcmp(field, hdr->sha1, 20);
+}
+
+/*
+ * Template of a check running in the background: the index being checked
+ * and the result. The index and the shared index it is split from (see
+ * split-index.c) may be checked at the same time.
+ */
+struct verify_job {
+    pthread_t thread;
+    const struct cache_header *hdr;
+    unsigned long size;
+    int ok;
+};
+#define MAX_VERIFY_JOBS 2
+
+/* The checks running in the background, and whether all of them passed. */
+static struct verify_job verify_jobs[MAX_VERIFY_JOBS];
+static int nr_verifying;
+static int verify_ok = 1;
+
+/*
+ * Function: `verify_in_background`
+ * Parameters:
+ *      -arg: The check to run.
+ * Purpose: Thread function that checks the checksum of an index that
+ *          `read_cache()` mapped, which stays mapped until the command
+ *          exits.
+ */
+static void *verify_in_background(void *arg)
+{
+    struct verify_job *job = arg;
+
+    job->ok = checksum_matches(job->hdr, job->size);
+    return NULL;
+}
+
+/*
+ * Function: `finish_index_checksum`
+ * Parameters: none
+ * Purpose: Wait for the checksums being checked in the background, if any.
+ *          Returns -1 if one did not match, then and every time after.
+ *          `write_cache()` calls it before writing an index, which may hold
+ *          entries read from the damaged one.
+ */
+int finish_index_checksum(void)
+{
+    int i;
+
+    for (i = 0; i < nr_verifying; i++) {
+        pthread_join(verify_jobs[i].thread, NULL);
+        if (!verify_jobs[i].ok) {
+            if (verify_ok)
+                error("bad index checksum");
+            verify_ok = 0;
+        }
+    }
+    nr_verifying = 0;
+    return verify_ok ? 0 : -1;
+}
+
+/*
+ * Function: `finish_at_exit`
+ * Parameters: none
+ * Purpose: Wait for the checks in the background when the command exits
+ *          without asking for their result, and report a damaged index.
+ *          The exit status is left alone, so that the other exit handlers,
+ *          such as the one removing a lock file, still run: the commands
+ *          call `finish_index_checksum()` themselves before they succeed.
+ */
+static void finish_at_exit(void)
+{
+    finish_index_checksum();
+}
+
+/*
+ * Template of `.dircache/index.stat`: the stat data and the checksum of
+ * the index when it was last checked.
+ */
+struct index_stat {
+    unsigned int size;
+    unsigned int mtime_sec, mtime_nsec;
+    unsigned int ctime_sec, ctime_nsec;
+    unsigned int ino, dev;
+    unsigned char checksum[20];
+};
+
+/*
+ * Function: `fill_index_stat`
+ * Parameters:
+ *      -is: The structure to fill in.
+ *      -hdr: The header of the index.
+ *      -st: The stat data of the index file.
+ * Purpose: Describe an index file the way `.dircache/index.stat` does.
+ */
+static void fill_index_stat(struct index_stat *is,
+                            const struct cache_header *hdr,
+                            const struct stat *st)
+{
+    memset(is, 0, sizeof(*is));
+    is->size = st->st_size;
+    is->mtime_sec = STAT_TIME_SEC(st, st_mtim);
+    is->mtime_nsec = STAT_TIME_NSEC(st, st_mtim);
+    is->ctime_sec = STAT_TIME_SEC(st, st_ctim);
+    is->ctime_nsec = STAT_TIME_NSEC(st, st_ctim);
+    is->ino = st->st_ino;
+    is->dev = st->st_dev;
+    memcpy(is->checksum, hdr->sha1, 20);
+}
+
+/* The values of `index.verify`. */
+#define VERIFY_FULL 0
+#define VERIFY_BACKGROUND 1
+#define VERIFY_STAT 2
+
+/*
+ * Function: `index_verify_mode`
+ * Parameters: none
+ * Purpose: Return how the checksum of the index is checked, from the
+ *          `index.verify` setting. Defaults to a full check. Returns -1,
+ *          after reporting it once, if the setting is unknown.
+ */
+static int index_verify_mode(void)
+{
+    static int verify_mode = -2;
+    const char *mode;
+
+    if (verify_mode != -2)
+        return verify_mode;
+    mode = get_config_env("index.verify");
+    if (!mode || !strcmp(mode, "full"))
+        verify_mode = VERIFY_FULL;
+    else if (!strcmp(mode, "background"))
+        verify_mode = VERIFY_BACKGROUND;
+    else if (!strcmp(mode, "stat"))
+        verify_mode = VERIFY_STAT;
+    else
+        verify_mode = error("unknown index.verify");
+    return verify_mode;
+}
+
+/*
+ * Function: `check_index_settings`
+ * Parameters: none
+ * Purpose: Read `index.checksum` and `index.verify`, and return -1 if one
+ *          of them is wrong. Commands call it before they take the index
+ *          lock, so that a bad setting is reported before there is a lock
+ *          file to clean up.
+ */
+int check_index_settings(void)
+{
+    if (index_checksum_kind() < 0 || index_verify_mode() < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Function: `verify_index_checksum`
+ * Parameters:
+ *      -path: The path of the index file. The stat data of the last check
+ *             is recorded in a file named after it, with ".stat" added.
+ *      -hdr: The header of the index, followed by the rest of it, mapped
+ *            until the command exits.
+ *      -size: The size of the index in bytes.
+ *      -st: The stat data of the index file.
+ * Purpose: Check the checksum of the index, as `index.verify` says. Returns
+ *          -1 if it does not match, or if it cannot be computed. When it is
+ *          checked in the background, 0 is returned at once and the result
+ *          comes from `finish_index_checksum()`.
+ */
+int verify_index_checksum(const char *path, const struct cache_header *hdr,
+                          unsigned long size, const struct stat *st)
+{
+    static int exit_handler;
+    int mode = index_verify_mode(), fd;
+    struct index_stat is, recorded;
+    int kind = hdr->version >= 4 ? hdr->sha1[0] : INDEX_CHECKSUM_SHA1;
+    char stat_path[PATH_MAX];
+
+    if (mode < 0)
+        return -1;
+    if (!index_checksum_available(kind))
+        return error("index checksum not built into this executable");
+
+    /* Trust an index that was checked before and not replaced since. */
+    snprintf(stat_path, sizeof(stat_path), "%s.stat", path);
+    if (mode == VERIFY_STAT) {
+        fill_index_stat(&is, hdr, st);
+        fd = OPEN_FILE(stat_path, O_RDONLY, 0);
+        if (fd >= 0) {
+            int n = read(fd, &recorded, sizeof(recorded));
+
+            close(fd);
+            if (n == sizeof(recorded) && !memcmp(&is, &recorded, sizeof(is)))
+                return 0;
+        }
+    }
+
+    /* Check it on another thread, unless one cannot be started. */
+    if (mode == VERIFY_BACKGROUND && nr_verifying < MAX_VERIFY_JOBS) {
+        struct verify_job *job = &verify_jobs[nr_verifying];
+
+        job->hdr = hdr;
+        job->size = size;
+        if (!pthread_create(&job->thread, NULL, verify_in_background, job)) {
+            nr_verifying++;
+            if (!exit_handler++)
+                atexit(finish_at_exit);
+            return 0;
+        }
+    }
+
+    if (!checksum_matches(hdr, size))
+        return error("bad index checksum");
+
+    /*
+     * Record the index as checked. A record cut short by a crash does not
+     * match any index, and only costs the next command a full check.
+     */
+    if (mode == VERIFY_STAT) {
+        fd = OPEN_FILE(stat_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd >= 0) {
+            if (write(fd, &is, sizeof(is)) != sizeof(is))
+                unlink(stat_path);
+            close(fd);
+        }
+    }
+    return 0;
+}
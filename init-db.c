@@ -28,6 +28,17 @@
  *  which will store the content that users commit in order to
  *  track the history of the repository over time.
  *
+ *  ./init-db [--content-ids] [--object-format=<sha1|sha256|blake3>]
+ *
+ *  It also writes the repository configuration file, `.dircache/config`.
+ *  With `--content-ids`, the repository names objects by the SHA1 hash of
+ *  their uncompressed contents rather than of their compressed contents
+ *  (repository format version 1, see config.c). This lets commands skip
+ *  compressing objects that already exist.
+ *
+ *  With `--object-format`, objects are named with another hash algorithm
+ *  than SHA1 (see hash.c), which is recorded as `core.objectformat`.
+ *
  *  This whole file (i.e. everything in the main function) will run
  *  when ./init-db executable is run from the command line.
  */
@@ -99,6 +110,15 @@
                               variable `s` followed by the null character 
                               '\0'. Sourced from <stdio.h>.
 
+   -strncmp(s1, s2, n): Compare the first `n` bytes of two strings. Sourced
+                        from <string.h>.
+
+   -hash_algo_by_name(): Look up a hash algorithm by its name. Sourced from
+                         "cache.h" (defined in hash.c).
+
+   -write_object_filter(): Create the filter of loose objects. Sourced from
+                           "cache.h" (defined in object-filter.c).
+
    ****************************************************************
 
    The following variables and functions are defined in this source file:
@@ -123,7 +143,14 @@
 
    -i: For loop counter used to create subdirectories in object store.
 
-   -fd: Declared but not used. Linus Torvalds is mortal too :D.
+   -fd: File descriptor of the configuration file.
+
+   -version: The repository format version to record in the configuration
+             file.
+
+   -config: The contents of the configuration file.
+
+   -algo: The hash algorithm to record in the configuration file.
 
    -st: `stat` structure used to store file information obtained from `stat()` 
         function call.
@@ -148,8 +175,23 @@ int main(int argc, char **argv)
      */
     char *sha1_dir, *path;
 
-    /* Declaring three integers to be used later. */
-    int len, i, fd;
+    /* Declaring four integers to be used later. */
+    int len, i, fd, version = 0;
+    /* The contents of the configuration file. */
+    char config[100];
+    /* The hash algorithm given with `--object-format`, if any. */
+    const struct hash_algo *algo = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--content-ids"))
+            version = REPOSITORY_FORMAT_CONTENT_IDS;
+        else if (!strncmp(argv[i], "--object-format=", 16) &&
+                 (algo = hash_algo_by_name(argv[i] + 16)) != NULL)
+            continue;
+        else
+            usage("init-db [--content-ids] "
+                  "[--object-format=<sha1|sha256|blake3>]");
+    }
 
     /*
      * Attempt to create a directory called `.dircache` in the current 
@@ -160,6 +202,24 @@ int main(int argc, char **argv)
         perror("unable to create .dircache");
         exit(1);
     }
+
+    /*
+     * Record the repository format version and the hash algorithm, which
+     * every command needs in order to know how objects are named.
+     */
+    fd = OPEN_FILE(CONFIG_FILE, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        perror(CONFIG_FILE);
+        exit(1);
+    }
+    len = sprintf(config, "core.repositoryformatversion = %d\n", version);
+    if (algo)
+        len += sprintf(config + len, "core.objectformat = %s\n", algo->name);
+    if (write(fd, config, len) != len) {
+        perror(CONFIG_FILE);
+        exit(1);
+    }
+    close(fd);
     
     /*
      * Set `sha1_dir` (i.e. the path to the object store) to the value of the
@@ -250,5 +310,25 @@ int main(int argc, char **argv)
             }
         }
     }
+
+    /*
+     * Create the `.dircache/objects/pack` directory, which will hold the pack
+     * files written by `pack-objects`.
+     */
+    sprintf(path+len, "/pack");
+    if (MKDIR(path) < 0) {
+        if (errno != EEXIST) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    /*
+     * Create the empty filter of loose objects (see object-filter.c), which
+     * lets commands tell that an object does not exist without looking for
+     * its file.
+     */
+    if (write_object_filter() < 0)
+        exit(1);
     return 0;
 }
@@ -0,0 +1,188 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to be compiled into an executable
+ *  called `list-objects`. When `list-objects` is run from the command
+ *  line it takes the hashes of one or more commits and prints the hashes
+ *  of all objects reachable from them, one per line: the commits and all
+ *  their ancestors, their trees, and the blobs named by those trees.
+ *
+ *  ./list-objects [--count] [--no-bitmaps] <commit>...
+ *
+ *  With `--count`, only the number of objects is printed.
+ *
+ *  If a pack has a bitmap file (see bitmap.c and `pack-objects --bitmaps`),
+ *  the bitmaps stored in it are used instead of reading the commits and
+ *  trees they cover. `--no-bitmaps` ignores them and walks the whole
+ *  history, which gives the same answer more slowly.
+ */
+
+#include "pack.h"
+/* The above 'include' allows use of the following functions and
+   variables from "pack.h" and "cache.h" header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -usage(): Print an error message and exit.
+
+   -open_bitmap_index(): Map the bitmap file of the first pack that has one.
+                         Sourced from "pack.h" (defined in bitmap.c).
+
+   -bitmap_new()/bitmap_get()/bitmap_free(): Manage an uncompressed bitmap.
+
+   -get_sha1_hex(): Convert a hexadecimal object name to its raw form.
+
+   -walk_reachable(): Add the objects reachable from a commit to a set.
+
+   -nth_packed_object_sha1(): Return the SHA1 hash of the nth object in a
+                              pack index.
+
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
+   -memcpy(s1, s2, n): Copy memory. Sourced from <string.h>.
+
+   -sha1s_to_hex(): Convert an array of SHA1 hashes to lines of hexadecimal.
+                    Sourced from "cache.h" (defined in hex.c).
+
+   -fwrite(buf, size, n, stream): Write to an output stream. Sourced from
+                                  <stdio.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -pending/nr_pending: The hashes waiting to be printed.
+
+   -flush_sha1s(): Print the waiting hashes.
+
+   -print_sha1(): Print one hash, in a batch with others.
+
+   -main(): The main function runs each time ./list-objects is run.
+*/
+
+/* How many hashes are printed with one conversion and one write. */
+#define PRINT_BATCH 1024
+
+/* The hashes waiting to be printed. */
+static unsigned char pending[PRINT_BATCH * MAX_RAWSZ];
+static unsigned int nr_pending;
+
+/*
+ * Function: `flush_sha1s`
+ * Parameters: none
+ * Purpose: Convert the waiting hashes to hexadecimal lines in one go (see
+ *          hex.c) and write them all at once.
+ */
+static void flush_sha1s(void)
+{
+    static char out[PRINT_BATCH * (MAX_HEXSZ + 1)];
+
+    sha1s_to_hex(out, pending, nr_pending, '\n');
+    fwrite(out, object_hash()->hexsz + 1, nr_pending, stdout);
+    nr_pending = 0;
+}
+
+/*
+ * Function: `print_sha1`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object to list.
+ * Purpose: Print a hash on its own line. Printing millions of hashes one
+ *          `printf()` at a time is slow, so they are collected and printed
+ *          PRINT_BATCH at a time.
+ */
+static void print_sha1(const unsigned char *sha1)
+{
+    int rawsz = object_hash()->rawsz;
+
+    memcpy(pending + nr_pending * rawsz, sha1, rawsz);
+    if (++nr_pending == PRINT_BATCH)
+        flush_sha1s();
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the
+ *             command itself.
+ *      -argv: An array of the command line arguments, including the command
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable
+ *          `list-objects` is run from the command line.
+ */
+int main(int argc, char **argv)
+{
+    struct bitmap_index *bi = NULL;
+    struct reachable r;
+    unsigned long count;
+    unsigned int i;
+    int only_count = 0, use_bitmaps = 1, nr_commits = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "--count"))
+            only_count = 1;
+        else if (!strcmp(argv[i], "--no-bitmaps"))
+            use_bitmaps = 0;
+        else
+            usage("list-objects [--count] [--no-bitmaps] <commit>...");
+    }
+    if (i == argc)
+        usage("list-objects [--count] [--no-bitmaps] <commit>...");
+
+    /* Objects in the pack with the bitmaps get a bit, all others a slot. */
+    if (use_bitmaps)
+        bi = open_bitmap_index();
+    memset(&r, 0, sizeof(r));
+    r.pack = bi ? bi->pack : NULL;
+    r.bits = bitmap_new(r.pack ? r.pack->num_objects : 0);
+
+    for (; i < argc; i++) {
+        unsigned char sha1[MAX_RAWSZ];
+
+        if (get_sha1_hex(argv[i], sha1))
+            usage("list-objects [--count] [--no-bitmaps] <commit>...");
+        if (walk_reachable(&r, bi, sha1) < 0)
+            exit(1);
+        nr_commits++;
+    }
+
+    count = r.extra.nr;
+    for (i = 0; r.pack && i < r.pack->num_objects; i++)
+        if (bitmap_get(r.bits, i))
+            count++;
+    if (only_count) {
+        printf("%lu\n", count);
+        return 0;
+    }
+
+    for (i = 0; r.pack && i < r.pack->num_objects; i++)
+        if (bitmap_get(r.bits, i))
+            print_sha1(nth_packed_object_sha1(r.pack, i));
+    for (i = 0; i < r.extra.alloc; i++)
+        if (r.extra.used[i])
+            print_sha1(r.extra.sha1s + i * object_hash()->rawsz);
+    flush_sha1s();
+    bitmap_free(r.bits);
+    return 0;
+}
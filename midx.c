@@ -0,0 +1,516 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the functions that read and write
+ *  the multi-pack index, `.dircache/objects/pack/multi-pack-index`. With
+ *  many packs, looking an object up means a binary search in every pack
+ *  index in turn. The multi-pack index holds the objects of all packs in
+ *  one sorted table, so that a lookup is a single fanout step and binary
+ *  search no matter how many packs there are.
+ *
+ *  The file consists of:
+ *
+ *  -A header: the signature "MIDX", the version, the number of packs, the
+ *   number of objects and the size of the pack name table (all 4-byte
+ *   big-endian integers).
+ *
+ *  -The names of the packs ("pack-<hex>"), each ending with a null byte,
+ *   padded with null bytes to a multiple of 4 bytes. The position of a name
+ *   in this table is the pack's id.
+ *
+ *  -A 256-entry fanout table, like the one in a pack index.
+ *
+ *  -The sorted SHA1 hashes of all objects.
+ *
+ *  -For each object, the id of the pack it is taken from and its offset in
+ *   that pack, where offsets with the high bit set point into a table of
+ *   8-byte offsets that follows.
+ *
+ *  -The SHA1 hash of everything before it.
+ *
+ *  The index is rewritten whenever `pack-objects` adds or removes packs.
+ *  That rewrite is incremental: the entries for packs that the old index
+ *  already covers are taken from the old index, and only the index files of
+ *  new packs are read.
+ */
+#include "pack.h"
+/* The above 'include' allows use of the following functions and
+   variables from "pack.h" and "cache.h" header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -pack_directory(): Return the path of the pack directory.
+
+   -map_fd(fd, size): Map the contents of an open file into memory.
+
+   -get_be32(p)/put_be32(p, val): Read and write 32-bit big-endian integers.
+
+   -error(message): Print an error message and return -1.
+
+   -munmap(addr, len): Remove a mapping made with mmap(). Sourced from
+                       <sys/mman.h>.
+
+   -packed_git: The list of packs in the pack directory.
+
+   -nth_packed_object_sha1()/nth_packed_object_offset(): Read the entries of
+        a pack index.
+
+   -sha1_init()/sha1_update()/sha1_final(): Calculate an SHA1 hash. Sourced
+                                             from "cache.h" (defined in
+                                             sha1.c).
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -midx: The multi-pack index, if there is a usable one.
+
+   -pack_basename(): Return the name of a pack without directory or suffix.
+
+   -load_multi_pack_index(): Map and validate the multi-pack index.
+
+   -midx_find_entry(): Look an object up in the multi-pack index.
+
+   -write_multi_pack_index(): Write a new multi-pack index covering all
+                              packs.
+*/
+
+#ifndef BGIT_WINDOWS
+    #define RENAME( src_file, target_file ) rename( src_file, target_file )
+    #define RENAME_FAIL -1
+#else
+    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
+                                                target_file, \
+                                                MOVEFILE_REPLACE_EXISTING )
+    #define RENAME_FAIL 0
+#endif
+
+/* Size of the multi-pack index header. */
+#define MIDX_HDR_SIZE 20
+
+/*
+ * Template of the structure describing the mapped multi-pack index.
+ */
+struct multi_pack_index {
+    unsigned char *map;              /* Mapped contents of the file. */
+    unsigned long size;              /* Size of the file in bytes. */
+    unsigned int num_packs;          /* Number of packs it covers. */
+    unsigned int num_objects;        /* Number of objects it covers. */
+    struct packed_git **packs;       /* The packs, indexed by pack id. */
+    unsigned char *fanout;           /* The fanout table. */
+    unsigned char *sha1s;            /* The sorted SHA1 hashes. */
+    unsigned char *entries;          /* Pack ids and offsets. */
+    unsigned char *large;            /* The table of 8-byte offsets. */
+};
+
+/* The multi-pack index, if there is a usable one. */
+static struct multi_pack_index *midx;
+
+/*
+ * Function: `midx_path`
+ * Parameters: none
+ * Purpose: Return the path of the multi-pack index file.
+ */
+static const char *midx_path(void)
+{
+    static char *path;
+
+    if (!path) {
+        const char *dir = pack_directory();
+        path = malloc(strlen(dir) + 20);
+        sprintf(path, "%s/multi-pack-index", dir);
+    }
+    return path;
+}
+
+/*
+ * Function: `pack_basename`
+ * Parameters:
+ *      -p: A pack.
+ *      -len: Filled in with the length of the name.
+ * Purpose: Return a pointer to the name of a pack without its directory, and
+ *          the length of that name without the `.pack` suffix.
+ */
+static const char *pack_basename(struct packed_git *p, int *len)
+{
+    const char *name = strrchr(p->pack_name, '/');
+
+    name = name ? name + 1 : p->pack_name;
+    *len = strlen(name) - 5;
+    return name;
+}
+
+/*
+ * Function: `load_multi_pack_index`
+ * Parameters: none
+ * Purpose: Map the multi-pack index and check that it is consistent and that
+ *          every pack it names is in the `packed_git` list. The packs it
+ *          covers are marked, so that `find_pack_entry()` only has to search
+ *          the others separately. Called by `prepare_packed_git()`.
+ */
+void load_multi_pack_index(void)
+{
+    struct multi_pack_index *m;
+    struct stat st;
+    unsigned char *map, *names, *end;
+    unsigned long size, names_size, min_size;
+    unsigned int i;
+    int fd;
+
+    fd = OPEN_FILE(midx_path(), O_RDONLY, 0);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size < MIDX_HDR_SIZE + 256 * 4 + 20) {
+        close(fd);
+        return;
+    }
+    size = st.st_size;
+    map = map_fd(fd, size);
+    close(fd);
+    if (!map)
+        return;
+
+    if (get_be32(map) != MIDX_SIGNATURE || get_be32(map + 4) != MIDX_VERSION) {
+        error("unknown multi-pack index format");
+        goto unmap;
+    }
+
+    m = calloc(1, sizeof(*m));
+    m->map = map;
+    m->size = size;
+    m->num_packs = get_be32(map + 8);
+    m->num_objects = get_be32(map + 12);
+    names_size = get_be32(map + 16);
+    min_size = MIDX_HDR_SIZE + names_size + 256 * 4 +
+               (unsigned long)m->num_objects * 28 + 20;
+    if (names_size & 3 || size < min_size) {
+        error("multi-pack index truncated");
+        free(m);
+        goto unmap;
+    }
+
+    names = map + MIDX_HDR_SIZE;
+    end = names + names_size;
+    m->fanout = end;
+    m->sha1s = m->fanout + 256 * 4;
+    m->entries = m->sha1s + (unsigned long)m->num_objects * 20;
+    m->large = m->entries + (unsigned long)m->num_objects * 8;
+    if (get_be32(m->fanout + 255 * 4) != m->num_objects) {
+        error("multi-pack index fanout is corrupt");
+        free(m);
+        goto unmap;
+    }
+
+    /* Find the pack for every name; a missing pack makes the index stale. */
+    m->packs = calloc(m->num_packs ? m->num_packs : 1, sizeof(*m->packs));
+    for (i = 0; i < m->num_packs; i++) {
+        struct packed_git *p;
+        int len = strnlen((char *)names, end - names);
+
+        if (names + len >= end)
+            break;
+        for (p = packed_git; p; p = p->next) {
+            int plen;
+            const char *base = pack_basename(p, &plen);
+            if (plen == len && !memcmp(base, names, len))
+                break;
+        }
+        if (!p)
+            break;
+        m->packs[i] = p;
+        names += len + 1;
+    }
+    if (i < m->num_packs) {
+        free(m->packs);
+        free(m);
+        goto unmap;
+    }
+
+    for (i = 0; i < m->num_packs; i++)
+        m->packs[i]->in_midx = 1;
+    midx = m;
+    return;
+
+/* The index is not usable: remove the mapping made above. */
+unmap:
+    #ifndef BGIT_WINDOWS
+    munmap(map, size);
+    #else
+    UnmapViewOfFile( map );
+    #endif
+}
+
+/*
+ * Function: `midx_find_entry`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object to look up.
+ *      -e: Filled in with the pack and offset of the object if found.
+ * Purpose: Look an object up in the multi-pack index. Returns 1 if found.
+ */
+int midx_find_entry(unsigned char *sha1, struct pack_entry *e)
+{
+    unsigned int first, last;
+
+    if (!midx)
+        return 0;
+    first = sha1[0] ? get_be32(midx->fanout + (sha1[0] - 1) * 4) : 0;
+    last = get_be32(midx->fanout + sha1[0] * 4);
+
+    while (last > first) {
+        unsigned int next = (first + last) >> 1;
+        int cmp = memcmp(midx->sha1s + (unsigned long)next * 20, sha1, 20);
+        if (!cmp) {
+            unsigned char *ent = midx->entries + (unsigned long)next * 8;
+            unsigned int pack_id = get_be32(ent);
+            unsigned long offset = get_be32(ent + 4);
+
+            if (pack_id >= midx->num_packs)
+                return 0;
+            if (offset & 0x80000000) {
+                unsigned char *large = midx->large +
+                                       (offset & 0x7fffffff) * 8;
+                if (large + 8 > midx->map + midx->size - 20)
+                    return 0;
+                offset = ((unsigned long)get_be32(large) << 32) |
+                         get_be32(large + 4);
+            }
+            e->p = midx->packs[pack_id];
+            e->offset = offset;
+            return 1;
+        }
+        if (cmp > 0)
+            last = next;
+        else
+            first = next + 1;
+    }
+    return 0;
+}
+
+/* Template of one row of the multi-pack index being written. */
+struct midx_entry {
+    const unsigned char *sha1;
+    unsigned int pack_id;
+    unsigned long offset;
+};
+
+/*
+ * Function: `midx_entry_compare`
+ * Parameters:
+ *      -a, b: Pointers to two rows.
+ * Purpose: `qsort()` comparison function ordering rows by SHA1 hash.
+ */
+static int midx_entry_compare(const void *a, const void *b)
+{
+    const struct midx_entry *x = a, *y = b;
+    return memcmp(x->sha1, y->sha1, 20);
+}
+
+/*
+ * Function: `pack_name_compare`
+ * Parameters:
+ *      -a, b: Pointers to two pointers to packs.
+ * Purpose: `qsort()` comparison function ordering packs by name.
+ */
+static int pack_name_compare(const void *a, const void *b)
+{
+    struct packed_git *x = *(struct packed_git **)a;
+    struct packed_git *y = *(struct packed_git **)b;
+    return strcmp(x->pack_name, y->pack_name);
+}
+
+/*
+ * Function: `write_multi_pack_index`
+ * Parameters:
+ *      -incremental: If nonzero, reuse the rows of the current multi-pack
+ *                    index for the packs it already covers.
+ * Purpose: Write a multi-pack index covering every pack whose `.pack` file
+ *          still exists. Rows for packs that are new since the old index
+ *          was written are read from their pack indexes, sorted and merged
+ *          with the rows taken over from the old index. When the same object
+ *          is in more than one pack, the first row wins.
+ */
+int write_multi_pack_index(int incremental)
+{
+    struct packed_git *p, **packs;
+    struct midx_entry *old = NULL, *fresh = NULL, *rows;
+    unsigned int nr_packs = 0, nr_old = 0, nr_fresh = 0, nr = 0, nr_large = 0;
+    unsigned int i, j, *remap = NULL;
+    unsigned long names_size = 0, size, pos;
+    unsigned char *buf, *q;
+    char *tmp;
+    struct sha1_ctx c;
+    int fd, b;
+
+    prepare_packed_git();
+
+    /* Only packs that have not been deleted in the meantime count. */
+    for (p = packed_git; p; p = p->next)
+        nr_packs++;
+    packs = malloc((nr_packs ? nr_packs : 1) * sizeof(*packs));
+    nr_packs = 0;
+    for (p = packed_git; p; p = p->next) {
+        struct stat st;
+        if (stat(p->pack_name, &st) < 0)
+            continue;
+        packs[nr_packs++] = p;
+    }
+    qsort(packs, nr_packs, sizeof(*packs), pack_name_compare);
+
+    /* Take over the rows of the old index for packs that still exist. */
+    if (incremental && midx) {
+        remap = malloc((midx->num_packs + 1) * sizeof(*remap));
+        for (i = 0; i < midx->num_packs; i++) {
+            remap[i] = ~0U;
+            for (j = 0; j < nr_packs; j++)
+                if (packs[j] == midx->packs[i])
+                    remap[i] = j;
+        }
+        old = malloc((midx->num_objects + 1) * sizeof(*old));
+        for (i = 0; i < midx->num_objects; i++) {
+            struct pack_entry e;
+            unsigned char *sha1 = midx->sha1s + (unsigned long)i * 20;
+            unsigned int id = get_be32(midx->entries + (unsigned long)i * 8);
+
+            if (id >= midx->num_packs || remap[id] == ~0U)
+                continue;
+            if (!midx_find_entry(sha1, &e))
+                continue;
+            old[nr_old].sha1 = sha1;
+            old[nr_old].pack_id = remap[id];
+            old[nr_old].offset = e.offset;
+            nr_old++;
+        }
+    }
+
+    /* Read the pack indexes of the packs the old index did not cover. */
+    for (j = 0; j < nr_packs; j++) {
+        if (old && packs[j]->in_midx)
+            continue;
+        fresh = realloc(fresh, (nr_fresh + packs[j]->num_objects + 1) *
+                               sizeof(*fresh));
+        for (i = 0; i < packs[j]->num_objects; i++) {
+            fresh[nr_fresh].sha1 = nth_packed_object_sha1(packs[j], i);
+            fresh[nr_fresh].pack_id = j;
+            fresh[nr_fresh].offset = nth_packed_object_offset(packs[j], i);
+            nr_fresh++;
+        }
+    }
+    qsort(fresh, nr_fresh, sizeof(*fresh), midx_entry_compare);
+
+    /* Merge the two sorted runs, dropping duplicates. */
+    rows = malloc((nr_old + nr_fresh + 1) * sizeof(*rows));
+    i = j = 0;
+    while (i < nr_old || j < nr_fresh) {
+        struct midx_entry *next;
+        if (j >= nr_fresh ||
+            (i < nr_old && midx_entry_compare(&old[i], &fresh[j]) <= 0))
+            next = &old[i++];
+        else
+            next = &fresh[j++];
+        if (nr && !memcmp(rows[nr - 1].sha1, next->sha1, 20))
+            continue;
+        rows[nr] = *next;
+        if (next->offset > 0x7fffffff)
+            nr_large++;
+        nr++;
+    }
+
+    /* Lay out the whole file in memory. */
+    for (j = 0; j < nr_packs; j++) {
+        int len;
+        pack_basename(packs[j], &len);
+        names_size += len + 1;
+    }
+    names_size = (names_size + 3) & ~3UL;
+    size = MIDX_HDR_SIZE + names_size + 256 * 4 + (unsigned long)nr * 28 +
+           (unsigned long)nr_large * 8 + 20;
+    buf = calloc(1, size);
+
+    put_be32(buf, MIDX_SIGNATURE);
+    put_be32(buf + 4, MIDX_VERSION);
+    put_be32(buf + 8, nr_packs);
+    put_be32(buf + 12, nr);
+    put_be32(buf + 16, names_size);
+    q = buf + MIDX_HDR_SIZE;
+    for (j = 0; j < nr_packs; j++) {
+        int len;
+        const char *name = pack_basename(packs[j], &len);
+        memcpy(q, name, len);
+        q += len + 1;
+    }
+
+    q = buf + MIDX_HDR_SIZE + names_size;
+    pos = 0;
+    for (b = 0; b < 256; b++) {
+        while (pos < nr && rows[pos].sha1[0] <= b)
+            pos++;
+        put_be32(q + b * 4, pos);
+    }
+    q += 256 * 4;
+    for (i = 0; i < nr; i++)
+        memcpy(q + (unsigned long)i * 20, rows[i].sha1, 20);
+    q += (unsigned long)nr * 20;
+    nr_large = 0;
+    for (i = 0; i < nr; i++) {
+        unsigned char *ent = q + (unsigned long)i * 8;
+        unsigned char *large = q + (unsigned long)nr * 8 +
+                               (unsigned long)nr_large * 8;
+        put_be32(ent, rows[i].pack_id);
+        if (rows[i].offset <= 0x7fffffff) {
+            put_be32(ent + 4, rows[i].offset);
+            continue;
+        }
+        put_be32(ent + 4, 0x80000000 | nr_large++);
+        put_be32(large, (unsigned int)(rows[i].offset >> 16 >> 16));
+        put_be32(large + 4, (unsigned int)rows[i].offset);
+    }
+
+    sha1_init(&c);
+    sha1_update(&c, buf, size - 20);
+    sha1_final(buf + size - 20, &c);
+
+    /* Write it next to the old one, then rename it into place. */
+    tmp = malloc(strlen(midx_path()) + 8);
+    sprintf(tmp, "%s.lock", midx_path());
+    fd = OPEN_FILE(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, buf, size) != size) {
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+        return error("unable to write multi-pack index");
+    }
+    close(fd);
+    if (RENAME(tmp, midx_path()) == RENAME_FAIL) {
+        unlink(tmp);
+        return error("unable to rename multi-pack index");
+    }
+
+    free(tmp);
+    free(buf);
+    free(rows);
+    free(fresh);
+    free(old);
+    free(remap);
+    free(packs);
+    return 0;
+}
@@ -0,0 +1,373 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define a cache of recently read objects,
+ *  so that a command that reads the same tree or blob many times (a tree
+ *  walk that meets the same subtree under several commits, or a checkout
+ *  of files with the same contents) inflates it only once. Without it,
+ *  every `read_sha1_file()` opens, maps and inflates the object again.
+ *
+ *  The cache holds inflated objects keyed by their SHA1 hash, up to a
+ *  budget in bytes. When adding an object would go over the budget, the
+ *  objects used least recently are dropped first. Objects larger than the
+ *  whole budget are never cached. The budget is set with the
+ *  `core.objectcache` setting, in bytes, which can be overridden with the
+ *  environment variable `BGIT_CORE_OBJECTCACHE` (see `get_config_env()`).
+ *  The default is OBJECT_CACHE_DEFAULT, and 0 turns the cache off.
+ *
+ *  Callers of `read_sha1_file()` own and free the buffer they get, so the
+ *  cache hands out a copy of the cached data. Copying memory is still many
+ *  times faster than inflating.
+ *
+ *  If the environment variable `BGIT_OBJECT_CACHE_STATS` is set, the number
+ *  of hits, misses and evictions is printed to standard error when the
+ *  command exits.
+ */
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -fprintf(stream, message, ...): Write `message` to the output `stream`.
+                                   Sourced from <stdio.h>.
+
+   -get_config_env_int(): Return the value of a setting as a number.
+                          Sourced from "cache.h" (defined in config.c).
+
+   -getenv(name): Get the value of an environment variable. Sourced from
+                  <stdlib.h>.
+
+   -atexit(fn): Call a function when the process exits. Sourced from
+                <stdlib.h>.
+
+   -calloc(n, size)/malloc(size)/free(ptr): Manage dynamic memory. Sourced
+                                            from <stdlib.h>.
+
+   -memcmp(s1, s2, n)/memcpy(s1, s2, n): Compare and copy memory. Sourced
+                                         from <string.h>.
+
+   -object_hash(): Return the hash algorithm of the repository, whose
+                   `rawsz` is the length of object names. Sourced from
+                   "cache.h" (defined in hash.c).
+
+   -strcpy(str1, str2)/strlen(str): Copy a string, and return its length.
+                                    Sourced from <string.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -cached_object: One object in the cache.
+
+   -buckets: The hash table the objects are found in.
+
+   -lru: The list of cached objects, most recently used first.
+
+   -print_object_cache_stats(): Print the hit and miss counts.
+
+   -object_cache_budget(): Read the cache settings once.
+
+   -bucket_of(): Return the hash table bucket of an object.
+
+   -unlink_lru()/link_lru(): Take an object out of the list, or put it first.
+
+   -evict(): Drop the object used least recently.
+
+   -grow_buckets(): Make the hash table larger.
+
+   -copy_object(): Copy the data of a cached object for the caller.
+
+   -lookup_object_cache(): Look an object up in the cache.
+
+   -add_object_cache(): Add an object to the cache.
+*/
+
+/* The budget, in bytes, when `core.objectcache` is not set. */
+#define OBJECT_CACHE_DEFAULT (32 * 1024 * 1024)
+
+/* Template of one object in the cache. */
+struct cached_object {
+    unsigned char sha1[MAX_RAWSZ];
+    char type[20];                  /* blob, tree, or commit. */
+    unsigned long size;             /* The size of the object data. */
+    void *data;                     /* The object data. */
+    struct cached_object *next;     /* Next object in the same bucket. */
+    struct cached_object *newer;    /* Neighbours in the LRU list. */
+    struct cached_object *older;
+};
+
+/* The hash table: `nr_buckets` (a power of 2) chains of objects. */
+static struct cached_object **buckets;
+static unsigned long nr_buckets, nr_cached;
+
+/*
+ * The list of cached objects, from the most recently used (`lru_newest`)
+ * to the least recently used (`lru_oldest`).
+ */
+static struct cached_object *lru_newest, *lru_oldest;
+
+/* The budget and the bytes of object data cached. -1 until read. */
+static long budget = -1;
+static unsigned long cached_bytes;
+
+/* Counters for the report. */
+static unsigned long hits, misses, evictions;
+
+/*
+ * Function: `print_object_cache_stats`
+ * Parameters: none
+ * Purpose: Print the number of hits, misses and evictions.
+ */
+static void print_object_cache_stats(void)
+{
+    fprintf(stderr, "object cache: %lu hits, %lu misses, %lu evictions, "
+            "%lu objects (%lu bytes) cached of %ld\n", hits, misses,
+            evictions, nr_cached, cached_bytes, budget);
+}
+
+/*
+ * Function: `object_cache_budget`
+ * Parameters: none
+ * Purpose: Read the budget the first time the cache is used, and ask for
+ *          the report if `BGIT_OBJECT_CACHE_STATS` is set.
+ */
+static long object_cache_budget(void)
+{
+    if (budget < 0) {
+        budget = get_config_env_int("core.objectcache", OBJECT_CACHE_DEFAULT);
+        if (budget < 0)
+            budget = 0;
+        if (getenv("BGIT_OBJECT_CACHE_STATS"))
+            atexit(print_object_cache_stats);
+    }
+    return budget;
+}
+
+/*
+ * Function: `bucket_of`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Return the hash table bucket an object belongs in. The bytes of
+ *          an SHA1 hash are already random, so its first four are used as
+ *          they are.
+ */
+static struct cached_object **bucket_of(const unsigned char *sha1)
+{
+    unsigned int hash;
+
+    memcpy(&hash, sha1, sizeof(hash));
+    return &buckets[hash & (nr_buckets - 1)];
+}
+
+/*
+ * Function: `unlink_lru`
+ * Parameters:
+ *      -obj: A cached object.
+ * Purpose: Take an object out of the LRU list.
+ */
+static void unlink_lru(struct cached_object *obj)
+{
+    if (obj->newer)
+        obj->newer->older = obj->older;
+    else
+        lru_newest = obj->older;
+    if (obj->older)
+        obj->older->newer = obj->newer;
+    else
+        lru_oldest = obj->newer;
+}
+
+/*
+ * Function: `link_lru`
+ * Parameters:
+ *      -obj: A cached object that is not in the LRU list.
+ * Purpose: Put an object at the front of the LRU list, as the most recently
+ *          used.
+ */
+static void link_lru(struct cached_object *obj)
+{
+    obj->newer = NULL;
+    obj->older = lru_newest;
+    if (lru_newest)
+        lru_newest->newer = obj;
+    else
+        lru_oldest = obj;
+    lru_newest = obj;
+}
+
+/*
+ * Function: `evict`
+ * Parameters: none
+ * Purpose: Drop the object that was used least recently from the cache.
+ */
+static void evict(void)
+{
+    struct cached_object *obj = lru_oldest, **pos;
+
+    for (pos = bucket_of(obj->sha1); *pos != obj; pos = &(*pos)->next)
+        ;
+    *pos = obj->next;
+    unlink_lru(obj);
+    cached_bytes -= obj->size;
+    nr_cached--;
+    evictions++;
+    free(obj->data);
+    free(obj);
+}
+
+/*
+ * Function: `grow_buckets`
+ * Parameters: none
+ * Purpose: Double the number of hash table buckets (starting with 1024),
+ *          so that chains stay short however many small objects fit in the
+ *          budget.
+ */
+static void grow_buckets(void)
+{
+    struct cached_object **old = buckets, *obj, *next;
+    unsigned long i, old_nr = nr_buckets;
+
+    nr_buckets = old_nr ? old_nr * 2 : 1024;
+    buckets = calloc(nr_buckets, sizeof(*buckets));
+    if (!buckets) {
+        buckets = old;
+        nr_buckets = old_nr;
+        return;
+    }
+    for (i = 0; i < old_nr; i++)
+        for (obj = old[i]; obj; obj = next) {
+            struct cached_object **pos = bucket_of(obj->sha1);
+
+            next = obj->next;
+            obj->next = *pos;
+            *pos = obj;
+        }
+    free(old);
+}
+
+/*
+ * Function: `copy_object`
+ * Parameters:
+ *      -obj: A cached object.
+ *      -type: Filled in with the object type.
+ *      -size: Filled in with the size of the object data.
+ * Purpose: Return a newly allocated copy of the data of a cached object,
+ *          with a terminating null byte that is not counted in the size.
+ */
+static void *copy_object(struct cached_object *obj, char *type,
+                         unsigned long *size)
+{
+    char *buf = malloc(obj->size + 1);
+
+    if (!buf)
+        return NULL;
+    memcpy(buf, obj->data, obj->size);
+    buf[obj->size] = 0;
+    strcpy(type, obj->type);
+    *size = obj->size;
+    return buf;
+}
+
+/*
+ * Function: `lookup_object_cache`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object to look up.
+ *      -type: Filled in with the object type.
+ *      -size: Filled in with the size of the object data.
+ * Purpose: Return a copy of a cached object, which the caller must free,
+ *          and make it the most recently used. Returns NULL if the object
+ *          is not cached.
+ */
+void *lookup_object_cache(const unsigned char *sha1, char *type,
+                          unsigned long *size)
+{
+    struct cached_object *obj;
+
+    if (!object_cache_budget() || !nr_cached) {
+        misses++;
+        return NULL;
+    }
+    for (obj = *bucket_of(sha1); obj; obj = obj->next)
+        if (!memcmp(obj->sha1, sha1, object_hash()->rawsz))
+            break;
+    if (!obj) {
+        misses++;
+        return NULL;
+    }
+    hits++;
+    unlink_lru(obj);
+    link_lru(obj);
+    return copy_object(obj, type, size);
+}
+
+/*
+ * Function: `add_object_cache`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object.
+ *      -type: The object type.
+ *      -data, size: The object data, which is copied.
+ * Purpose: Add an object that was just read to the cache, dropping the
+ *          least recently used objects until it fits in the budget. Objects
+ *          larger than the budget, and objects already cached, are left
+ *          alone.
+ */
+void add_object_cache(const unsigned char *sha1, const char *type,
+                      const void *data, unsigned long size)
+{
+    struct cached_object *obj, **pos;
+    long limit = object_cache_budget();
+
+    if (!limit || size > (unsigned long)limit ||
+        strlen(type) >= sizeof(obj->type))
+        return;
+    if (nr_cached >= nr_buckets)
+        grow_buckets();
+    if (!nr_buckets)
+        return;
+    for (obj = *bucket_of(sha1); obj; obj = obj->next)
+        if (!memcmp(obj->sha1, sha1, object_hash()->rawsz))
+            return;
+
+    while (cached_bytes + size > (unsigned long)limit)
+        evict();
+
+    obj = malloc(sizeof(*obj));
+    if (!obj)
+        return;
+    obj->data = malloc(size ? size : 1);
+    if (!obj->data) {
+        free(obj);
+        return;
+    }
+    memcpy(obj->sha1, sha1, object_hash()->rawsz);
+    strcpy(obj->type, type);
+    obj->size = size;
+    memcpy(obj->data, data, size);
+
+    pos = bucket_of(sha1);
+    obj->next = *pos;
+    *pos = obj;
+    link_lru(obj);
+    cached_bytes += size;
+    nr_cached++;
+}
@@ -0,0 +1,414 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define a Bloom filter of the loose
+ *  objects in the object store, so that asking whether an object exists
+ *  usually needs no system call when the answer is no. Without it,
+ *  `has_sha1_file()` calls `access()` on the object's path every time. On
+ *  a network file system, one round trip per object adds up quickly when
+ *  `update-cache` or `write-tree` checks thousands of new objects.
+ *
+ *  A Bloom filter is an array of bits. Adding an object sets
+ *  OBJECT_FILTER_HASHES bits, chosen from its SHA1 hash. If any of an
+ *  object's bits is clear, the object was never added, so the answer "no"
+ *  is always right. If all of them are set, the object was probably
+ *  added, but the bits may all have been set by other objects. So a "yes"
+ *  must still be confirmed with `access()`. With OBJECT_FILTER_BITS bits
+ *  per object, this happens for about 1 in 2000 absent objects.
+ *
+ *  Packed objects are found without any system call once the pack indexes
+ *  are mapped, and are looked for first, so the filter only needs to hold
+ *  the loose objects. It is the file `object-filter` in the object store:
+ *  a header (magic number, number of bits, number of objects added), then
+ *  the bits. Every process that writes a loose object sets the object's
+ *  bits in the mapped file with atomic OR operations, so processes can
+ *  add objects at the same time without a lock. Bits are never cleared.
+ *
+ *  `init-db` creates an empty filter, and `pack-objects` builds a new one,
+ *  sized for the loose objects left, every time it runs. In an object
+ *  store without the file, nothing changes and `access()` is always used.
+ *  A loose object written by a program that does not know the filter is
+ *  missing from it until the next `pack-objects`. Until then it is seen as
+ *  absent, which only means it is written again. `write-tree` checks again
+ *  with `access()` before it reports an object missing. Objects written
+ *  while `pack-objects` replaces the filter can also be lost from it in the
+ *  same way.
+ */
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -get_object_directory(): Return the path to the object store. Sourced
+                            from "cache.h" (defined in read-cache.c).
+
+   -malloc(size)/calloc(n, size)/free(ptr): Manage dynamic memory. Sourced
+                                            from <stdlib.h>.
+
+   -sprintf(str, format, ...): Write formatted output to a string. Sourced
+                               from <stdio.h>.
+
+   -open(path, flags, perms)/close(fd): Open and close a file.
+
+   -pread(fd, buf, n, offset): Read a file at an offset. Sourced from
+                               <unistd.h>.
+
+   -fstat(fd, buf): Get information about an open file. Sourced from
+                    <sys/stat.h>.
+
+   -mmap(addr, len, prot, flags, fd, offset)/munmap(addr, len): Map a file
+        into memory, and remove the mapping. Sourced from <sys/mman.h>.
+
+   -memcpy(s1, s2, n)/strlen(str): Copy memory, and return the length of
+                                   a string. Sourced from <string.h>.
+
+   -__atomic_load_n()/__atomic_fetch_or()/__atomic_fetch_add(): Read and
+        change memory shared with other processes atomically. Built into
+        GCC and Clang.
+
+   -for_each_loose_object(): Call a function for every loose object.
+
+   -mkstemp(template): Create and open a uniquely named temporary file.
+                       Sourced from <stdlib.h>.
+
+   -umask(mask): Set the file creation mask, returning the old one.
+                 Sourced from <sys/stat.h>.
+
+   -write(fd, buf, n): Write to a file. Sourced from <unistd.h>.
+
+   -fchmod(fd, mode): Change the permissions of an open file. Sourced from
+                      <sys/stat.h>.
+
+   -rename(old, new)/unlink(path): Rename and remove a file. Sourced from
+                                   <stdio.h> and <unistd.h>.
+
+   -error(): Print an error message and return -1.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -object_filter_header: The header of the filter file.
+
+   -object_filter_path(): Return the path of the filter file.
+
+   -open_object_filter(): Map the filter file the first time it is needed.
+
+   -filter_bit(): Return the position of one of an object's bits.
+
+   -object_filter_contains(): Check whether an object may be in the filter.
+
+   -object_filter_add(): Add an object to the filter.
+
+   -count_loose_object()/add_loose_object(): Callbacks for building a new
+                                             filter.
+
+   -write_object_filter(): Build a new filter of all loose objects.
+*/
+
+/* The magic number at the start of the filter file: "BGOF". */
+#define OBJECT_FILTER_MAGIC 0x42474f46
+#define OBJECT_FILTER_VERSION 1
+
+/* The number of bits set for each object. */
+#define OBJECT_FILTER_HASHES 11
+
+/*
+ * Bits per object when a filter is built. 16 bits with 11 hashes gives a
+ * false "yes" for about 1 in 2000 absent objects. The filter still works
+ * well after its objects grow to 1.5 times as many.
+ */
+#define OBJECT_FILTER_BITS 16
+
+/* The smallest filter, in bits (128KB). */
+#define OBJECT_FILTER_MIN_BITS (1024 * 1024)
+
+/* Template of the header of the filter file. */
+struct object_filter_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long nr_bits;       /* A power of 2, multiple of 64. */
+    unsigned long long nr_objects;    /* Objects added, roughly. */
+};
+
+#ifndef BGIT_WINDOWS
+
+/*
+ * Function: `object_filter_path`
+ * Parameters: none
+ * Purpose: Return the path of the filter file, `<object store>/object-filter`.
+ */
+static const char *object_filter_path(void)
+{
+    static char *path;
+
+    if (!path) {
+        const char *dir = get_object_directory();
+        path = malloc(strlen(dir) + 15);
+        sprintf(path, "%s/object-filter", dir);
+    }
+    return path;
+}
+
+/* The mapped filter file and its bits, once opened. */
+static struct object_filter_header *filter;
+static unsigned long long *filter_bits;
+static unsigned long filter_size;
+/* 0 until the filter is opened, then 1, or -1 if there is none. */
+static int filter_state;
+
+/*
+ * Function: `open_object_filter`
+ * Parameters: none
+ * Purpose: Map the filter file the first time it is needed. Returns -1 if
+ *          there is no usable filter. A filter this process cannot write to
+ *          is not used either, since objects this process writes would be
+ *          missing from it.
+ */
+static int open_object_filter(void)
+{
+    struct object_filter_header hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (filter_state)
+        return filter_state > 0 ? 0 : -1;
+    filter_state = -1;
+
+    fd = OPEN_FILE(object_filter_path(), O_RDWR, 0);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != OBJECT_FILTER_MAGIC ||
+        hdr.version != OBJECT_FILTER_VERSION ||
+        hdr.nr_bits < 64 || (hdr.nr_bits & (hdr.nr_bits - 1)) ||
+        st.st_size != sizeof(hdr) + hdr.nr_bits / 8) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    filter = map;
+    filter_bits = (unsigned long long *)(filter + 1);
+    filter_size = st.st_size;
+    filter_state = 1;
+    return 0;
+}
+
+/*
+ * Function: `filter_bit`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ *      -i: Which of the object's bits, from 0 to OBJECT_FILTER_HASHES - 1.
+ *      -nr_bits: The number of bits in the filter.
+ * Purpose: Return the position of the object's `i`th bit. The bytes of an
+ *          SHA1 hash are already random, so two 64-bit numbers are taken
+ *          from it and combined as `a + i * b` ("double hashing"), which is
+ *          as good as `i` independent hash functions.
+ */
+static unsigned long long filter_bit(const unsigned char *sha1, int i,
+                                     unsigned long long nr_bits)
+{
+    unsigned long long a, b;
+
+    memcpy(&a, sha1, 8);
+    memcpy(&b, sha1 + 8, 8);
+    return (a + i * (b | 1)) & (nr_bits - 1);
+}
+
+/*
+ * Function: `object_filter_contains`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Return 0 if the object is certainly not a loose object, 1 if it
+ *          may be one, or -1 if there is no filter to tell.
+ */
+int object_filter_contains(const unsigned char *sha1)
+{
+    int i;
+
+    if (open_object_filter() < 0)
+        return -1;
+    for (i = 0; i < OBJECT_FILTER_HASHES; i++) {
+        unsigned long long bit = filter_bit(sha1, i, filter->nr_bits);
+        unsigned long long word = __atomic_load_n(&filter_bits[bit / 64],
+                                                  __ATOMIC_RELAXED);
+
+        if (!(word & (1ULL << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function: `object_filter_add`
+ * Parameters:
+ *      -sha1: The SHA1 hash of a loose object that was just written.
+ * Purpose: Set the object's bits in the filter, if there is one.
+ */
+void object_filter_add(const unsigned char *sha1)
+{
+    int i, added = 0;
+
+    if (open_object_filter() < 0)
+        return;
+    for (i = 0; i < OBJECT_FILTER_HASHES; i++) {
+        unsigned long long bit = filter_bit(sha1, i, filter->nr_bits);
+        unsigned long long mask = 1ULL << (bit % 64);
+
+        if (!(__atomic_fetch_or(&filter_bits[bit / 64], mask,
+                                __ATOMIC_RELAXED) & mask))
+            added = 1;
+    }
+    /* An object whose bits were all set already is not counted again. */
+    if (added)
+        __atomic_fetch_add(&filter->nr_objects, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: `count_loose_object`
+ * Parameters:
+ *      -sha1, path: A loose object (not used).
+ *      -data: Pointer to the count.
+ * Purpose: Count one loose object, to size a new filter.
+ */
+static int count_loose_object(unsigned char *sha1, const char *path,
+                              void *data)
+{
+    (*(unsigned long *)data)++;
+    return 0;
+}
+
+/*
+ * Function: `add_loose_object`
+ * Parameters:
+ *      -sha1: The SHA1 hash of a loose object.
+ *      -path: The path of the object file (not used).
+ *      -data: The header of the new filter, followed by its bits.
+ * Purpose: Set the bits of one loose object in a new filter.
+ */
+static int add_loose_object(unsigned char *sha1, const char *path,
+                            void *data)
+{
+    struct object_filter_header *hdr = data;
+    unsigned long long *bits = (unsigned long long *)(hdr + 1);
+    int i;
+
+    for (i = 0; i < OBJECT_FILTER_HASHES; i++) {
+        unsigned long long bit = filter_bit(sha1, i, hdr->nr_bits);
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    hdr->nr_objects++;
+    return 0;
+}
+
+/*
+ * Function: `write_object_filter`
+ * Parameters: none
+ * Purpose: Build a new filter holding every loose object, with about
+ *          OBJECT_FILTER_BITS bits per object, and put it in place of the
+ *          old one. The file is written under a temporary name and then
+ *          renamed, so readers never see half a filter.
+ */
+int write_object_filter(void)
+{
+    struct object_filter_header *hdr;
+    unsigned long long nr_bits = OBJECT_FILTER_MIN_BITS;
+    unsigned long nr_loose = 0, size;
+    const char *path = object_filter_path();
+    char *tmp;
+    mode_t mask;
+    int fd, ret;
+
+    for_each_loose_object(count_loose_object, &nr_loose);
+    while (nr_bits < (unsigned long long)nr_loose * OBJECT_FILTER_BITS)
+        nr_bits *= 2;
+
+    size = sizeof(*hdr) + nr_bits / 8;
+    hdr = calloc(1, size);
+    tmp = malloc(strlen(path) + 8);
+    if (!hdr || !tmp) {
+        free(hdr);
+        free(tmp);
+        return error("out of memory for the object filter");
+    }
+    hdr->magic = OBJECT_FILTER_MAGIC;
+    hdr->version = OBJECT_FILTER_VERSION;
+    hdr->nr_bits = nr_bits;
+    for_each_loose_object(add_loose_object, hdr);
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(hdr);
+        free(tmp);
+        return error("unable to create object filter");
+    }
+    /*
+     * Other processes must be able to add the objects they write, so the
+     * file gets the permissions of a new file instead of mkstemp()'s 0600.
+     */
+    mask = umask(0);
+    umask(mask);
+    ret = write(fd, hdr, size) == size ? 0 : -1;
+    if (fchmod(fd, 0666 & ~mask) < 0)
+        ret = -1;
+    if (close(fd) < 0)
+        ret = -1;
+    if (ret || rename(tmp, path) < 0) {
+        unlink(tmp);
+        ret = error("unable to write object filter");
+    }
+    free(hdr);
+    free(tmp);
+
+    /* Use the new filter from now on. */
+    if (filter_state > 0)
+        munmap(filter, filter_size);
+    filter_state = 0;
+    return ret;
+}
+
+#else
+
+/* Without `MAP_SHARED`, there is no filter and `access()` is always used. */
+int object_filter_contains(const unsigned char *sha1)
+{
+    return -1;
+}
+
+void object_filter_add(const unsigned char *sha1)
+{
+}
+
+int write_object_filter(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,1062 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to be compiled into an executable
+ *  called `pack-objects`. When `pack-objects` is run from the command
+ *  line it collects every loose object in the object store that is not
+ *  already in a pack, writes them all into a single new pack file and
+ *  pack index in `.dircache/objects/pack/`, and prints the SHA1 hash that
+ *  names the new pack.
+ *
+ *  ./pack-objects [-d] [--window=<n>] [--depth=<n>] [--write-midx]
+ *                 [--geometric[=<factor>]] [--bitmaps]
+ *
+ *  With `-d`, the loose object files that were just packed are deleted, so
+ *  the object store ends up with one file per pack instead of one file per
+ *  object. `read_sha1_file()` looks in the packs before the loose objects,
+ *  so every other command keeps working unchanged.
+ *
+ *  Objects that are similar to one another are stored as deltas (see
+ *  delta.c). The objects are sorted so that objects of the same type and
+ *  with the same path (as named by the trees being packed) end up next to
+ *  each other, largest first, and each object is compared against the
+ *  previous `--window` objects (10 by default). The smallest delta wins, as
+ *  long as it is less than half the size of the object and the chain of
+ *  deltas leading to it is no longer than `--depth` (50 by default).
+ *
+ *  After the new pack is in place, the multi-pack index (see midx.c) is
+ *  updated to cover it as well. `--write-midx` rebuilds the multi-pack index
+ *  from all pack indexes instead of updating it, and does so even if there
+ *  is nothing new to pack.
+ *
+ *  With `--geometric[=<factor>]`, some of the existing packs are merged into
+ *  the new pack as well, and then deleted, so that the packs that remain
+ *  form a geometric progression where each pack holds at least `factor`
+ *  times (2 times by default) as many objects as the next smaller one. Only
+ *  the smallest packs are ever rewritten, so repeated runs keep the number
+ *  of packs logarithmic in the number of objects while the work done by
+ *  each run stays proportional to the new objects.
+ *
+ *  With `--bitmaps`, a reachability bitmap file is written for the new pack
+ *  (see bitmap.c). Only commits whose whole history is in the new pack get
+ *  a bitmap, so this is most useful when the new pack holds everything.
+ *
+ *  Packs name their objects with SHA1, so repositories that use another
+ *  hash algorithm (see hash.c) keep all their objects loose.
+ */
+
+#include "pack.h"
+/* The above 'include' allows use of the following functions and
+   variables from "pack.h" and "cache.h" header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -sha1_init()/sha1_update()/sha1_final(): Calculate an SHA1 hash. Sourced
+                                             from "cache.h" (defined in
+                                             sha1.c).
+
+   -object_hash(): Return the hash algorithm of the repository. Sourced from
+                   "cache.h" (defined in hash.c).
+
+   -put_be32(p, val): Write a 32-bit big-endian integer. Sourced from
+                      "pack.h".
+
+   -sha1_object_info(): Read the type and size of an object from its header.
+                        Sourced from "cache.h" (defined in stream.c).
+
+   -read_sha1_file(): Read and inflate an object from the object store.
+
+   -pack_type_from_name(): Convert a type name to a pack object type number.
+
+   -deflateInit()/deflateBound()/deflate()/deflateEnd(): Compress data with
+                                                         zlib. Sourced from
+                                                         <zlib.h>.
+
+   -compression_level()/compression_clock()/compression_done(): Choose the
+        compression level for an object, and record the outcome and the CPU
+        time it took. Sourced from "cache.h" (defined in compress.c).
+
+   -find_pack_entry(): Search the existing packs for an object.
+
+   -for_each_loose_object(): Call a function for every loose object.
+
+   -create_delta_index()/create_delta(): Create a delta against a source
+                                         object. Sourced from "pack.h"
+                                         (defined in delta.c).
+
+   -pack_directory(): Return the path of the pack directory.
+
+   -mkstemp(template): Create and open a uniquely named temporary file.
+
+   -sha1_to_hex(): Convert an SHA1 hash to its hexadecimal representation.
+
+   -sha1_file_name(): Build the path of a loose object.
+
+   -nth_packed_object_sha1(): Return the SHA1 hash of the nth object in a
+                              pack index.
+
+   -add_packed_git(): Map a pack index and return a `packed_git` for it.
+
+   -write_multi_pack_index(): Write the multi-pack index. Sourced from
+                              "pack.h" (defined in midx.c).
+
+   -write_bitmap_index(): Write the reachability bitmaps of a pack. Sourced
+                          from "pack.h" (defined in bitmap.c).
+
+   -write_object_filter(): Build a new filter of the loose objects. Sourced
+                           from "cache.h" (defined in object-filter.c).
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -main(): The main function runs each time ./pack-objects is run.
+
+   -objects: Array of the objects that go into the new pack.
+
+   -sha1write(): Write to a pack or index file through a buffer, updating the
+                 running SHA1 hash of the file.
+
+   -sha1close(): Flush the buffer and append the file's SHA1 hash.
+
+   -add_object(): Append an object to `objects`.
+
+   -add_loose_object(): Add a loose object to `objects` unless it is already
+                        packed.
+
+   -pack_compare(): Order packs by number of objects.
+
+   -geometric_rollup(): Choose the packs to merge into the new pack.
+
+   -locate_object(): Find an object in `objects` by SHA1 hash.
+
+   -name_hash(): Hash a path for sorting delta candidates.
+
+   -get_object_details(): Find the type, size and path of every object.
+
+   -type_size_sort(): Order objects for the delta search.
+
+   -try_delta(): Try to store one object as a delta against another.
+
+   -find_deltas(): Run the sliding window delta search.
+
+   -encode_header(): Encode the type and size of a pack entry.
+
+   -write_object(): Write one object (and first its delta base) to the pack
+                    file.
+
+   -write_pack_file(): Write all objects to a new pack file.
+
+   -write_index_file(): Write the index of the new pack.
+*/
+
+#ifndef BGIT_WINDOWS
+    #define MKDIR( path ) ( mkdir( path, 0700 ) )
+    #define RENAME( src_file, target_file ) rename( src_file, target_file )
+    #define RENAME_FAIL -1
+#else
+    #define MKDIR( path ) ( _mkdir( path ) )
+    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
+                                                target_file, \
+                                                MOVEFILE_REPLACE_EXISTING )
+    #define RENAME_FAIL 0
+#endif
+
+/* Template of the structure describing one object in the new pack. */
+struct object_entry {
+    unsigned char sha1[20];      /* The SHA1 hash of the object. */
+    unsigned long offset;        /* The offset of its entry in the new */
+                                 /* pack, or 0 if not written yet. */
+    int type;                    /* The pack object type number. */
+    unsigned long size;          /* The size of the object data. */
+    unsigned int name_hash;      /* Hash of the object's path, if known. */
+    struct object_entry *delta;  /* The delta base, if stored as a delta. */
+    void *delta_data;            /* The delta, if it was kept in memory. */
+    unsigned long delta_size;    /* The size of the delta. */
+    int depth;                   /* The length of the delta chain. */
+};
+
+/* The objects that go into the new pack, and how many there are. */
+static struct object_entry *objects;
+static unsigned int nr_objects, nr_alloc;
+
+/* How many objects to compare each object with, and the longest chain. */
+static int window = 10;
+static int depth = 50;
+
+/* Objects larger than this are never compared with each other. */
+#define DELTA_SIZE_LIMIT (512UL * 1024 * 1024)
+
+/*
+ * Deltas found during the search are kept in memory for writing, until they
+ * add up to this many bytes. Deltas beyond that are computed again when the
+ * pack is written.
+ */
+#define DELTA_CACHE_LIMIT (256UL * 1024 * 1024)
+static unsigned long delta_cache_size;
+
+/* Template of an object in the delta search window. */
+struct unpacked {
+    struct object_entry *entry;   /* The object. */
+    void *data;                   /* Its inflated data. */
+    struct delta_index *index;    /* Index of `data`, once needed. */
+};
+
+/*
+ * Template of a buffered output file whose contents are hashed as they are
+ * written, so that the hash can be appended without reading the file back.
+ */
+struct sha1file {
+    int fd;                        /* The file being written. */
+    const char *name;              /* Its name, for error messages. */
+    unsigned long offset;          /* Bytes written so far. */
+    unsigned int used;             /* Bytes waiting in `buffer`. */
+    struct sha1_ctx ctx;           /* Running hash of the contents. */
+    unsigned char buffer[8192];
+};
+
+/*
+ * Function: `flush_sha1file`
+ * Parameters:
+ *      -f: The buffered file to flush.
+ * Purpose: Hash and write out the bytes waiting in the buffer.
+ */
+static void flush_sha1file(struct sha1file *f)
+{
+    unsigned char *buf = f->buffer;
+    unsigned int left = f->used;
+
+    sha1_update(&f->ctx, f->buffer, f->used);
+    while (left) {
+        int ret = write(f->fd, buf, left);
+        if (ret <= 0)
+            usage("unable to write pack file");
+        buf += ret;
+        left -= ret;
+    }
+    f->used = 0;
+}
+
+/*
+ * Function: `sha1write`
+ * Parameters:
+ *      -f: The buffered file to write to.
+ *      -buf: The data to write.
+ *      -len: The number of bytes to write.
+ * Purpose: Append data to a pack or index file through its buffer.
+ */
+static void sha1write(struct sha1file *f, const void *buf, unsigned long len)
+{
+    const unsigned char *p = buf;
+
+    f->offset += len;
+    while (len) {
+        unsigned long n = sizeof(f->buffer) - f->used;
+        if (n > len)
+            n = len;
+        memcpy(f->buffer + f->used, p, n);
+        f->used += n;
+        p += n;
+        len -= n;
+        if (f->used == sizeof(f->buffer))
+            flush_sha1file(f);
+    }
+}
+
+/*
+ * Function: `sha1close`
+ * Parameters:
+ *      -f: The buffered file to finish.
+ *      -sha1: Filled in with the SHA1 hash of the file's contents.
+ * Purpose: Flush the buffer, append the SHA1 hash of everything written so
+ *          far to the file, and close it.
+ */
+static void sha1close(struct sha1file *f, unsigned char *sha1)
+{
+    flush_sha1file(f);
+    sha1_final(sha1, &f->ctx);
+    if (write(f->fd, sha1, 20) != 20)
+        usage("unable to write pack file");
+    close(f->fd);
+}
+
+/*
+ * Function: `sha1create`
+ * Parameters:
+ *      -f: The buffered file structure to initialize.
+ *      -template: A path ending in `XXXXXX` from which to create a unique
+ *                 temporary file.
+ * Purpose: Create a temporary file and start writing it through `f`.
+ */
+static void sha1create(struct sha1file *f, char *template)
+{
+    f->fd = mkstemp(template);
+    if (f->fd < 0)
+        usage("unable to create temporary pack file");
+    f->name = template;
+    f->offset = 0;
+    f->used = 0;
+    sha1_init(&f->ctx);
+}
+
+/*
+ * Function: `add_object`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Append an object to the list of objects to pack.
+ */
+static void add_object(const unsigned char *sha1)
+{
+    if (nr_objects == nr_alloc) {
+        nr_alloc = alloc_nr(nr_alloc);
+        objects = realloc(objects, nr_alloc * sizeof(*objects));
+    }
+    memset(&objects[nr_objects], 0, sizeof(*objects));
+    memcpy(objects[nr_objects].sha1, sha1, 20);
+    nr_objects++;
+}
+
+/*
+ * Function: `add_loose_object`
+ * Parameters:
+ *      -sha1: The SHA1 hash of a loose object.
+ *      -path: The path of the loose object file (not used).
+ *      -data: Not used.
+ * Purpose: Callback for `for_each_loose_object()`. Adds the object to the
+ *          list of objects to pack unless it is already in a pack.
+ */
+static int add_loose_object(unsigned char *sha1, const char *path, void *data)
+{
+    struct pack_entry e;
+
+    if (find_pack_entry(sha1, &e))
+        return 0;
+    add_object(sha1);
+    return 0;
+}
+
+/*
+ * Function: `pack_compare`
+ * Parameters:
+ *      -a, b: Pointers to two pointers to packs.
+ * Purpose: `qsort()` comparison function ordering packs by number of
+ *          objects, smallest first.
+ */
+static int pack_compare(const void *a, const void *b)
+{
+    struct packed_git *x = *(struct packed_git **)a;
+    struct packed_git *y = *(struct packed_git **)b;
+
+    if (x->num_objects != y->num_objects)
+        return x->num_objects < y->num_objects ? -1 : 1;
+    return strcmp(x->pack_name, y->pack_name);
+}
+
+/*
+ * Function: `geometric_rollup`
+ * Parameters:
+ *      -factor: The ratio that each pack must have to the next smaller one.
+ *      -nr_rollup: Filled in with the number of packs to merge.
+ * Purpose: Decide which packs to merge with the new loose objects so that
+ *          the packs that remain form a geometric progression, each holding
+ *          at least `factor` times as many objects as the next smaller one.
+ *          Returns the packs sorted by size; the first `*nr_rollup` of them
+ *          are the ones to merge.
+ *
+ *          Starting from the largest pack, the first pack that is not at
+ *          least `factor` times the size of the one below it marks the end of
+ *          the progression: it and everything smaller is merged. Then, since
+ *          the merged pack may itself be too big to sit below the next pack,
+ *          packs are added to the merge for as long as that is the case. The
+ *          large packs at the top of the progression are never rewritten, so
+ *          the work done by each repack stays proportional to the new data.
+ */
+static struct packed_git **geometric_rollup(int factor, unsigned int *nr_rollup)
+{
+    struct packed_git *p, **packs;
+    unsigned int nr = 0, split = 0, i;
+    unsigned long total;
+
+    for (p = packed_git; p; p = p->next)
+        nr++;
+    packs = malloc((nr ? nr : 1) * sizeof(*packs));
+    nr = 0;
+    for (p = packed_git; p; p = p->next)
+        packs[nr++] = p;
+    qsort(packs, nr, sizeof(*packs), pack_compare);
+
+    for (i = nr; i > 1; i--) {
+        if ((unsigned long)packs[i - 2]->num_objects * factor >
+            packs[i - 1]->num_objects) {
+            split = i - 1;
+            break;
+        }
+    }
+
+    total = nr_objects;
+    for (i = 0; i < split; i++)
+        total += packs[i]->num_objects;
+    for (i = split; i < nr; i++) {
+        if (packs[i]->num_objects >= total * factor)
+            break;
+        total += packs[i]->num_objects;
+        split = i + 1;
+    }
+
+    /* Merging a single pack with nothing new would only rewrite it. */
+    if (split == 1 && !nr_objects)
+        split = 0;
+    *nr_rollup = split;
+    return packs;
+}
+
+/*
+ * Function: `locate_object`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Binary search the (sorted) `objects` array for an object. Returns
+ *          NULL if the object is not being packed.
+ */
+static struct object_entry *locate_object(const unsigned char *sha1)
+{
+    unsigned int first = 0, last = nr_objects;
+
+    while (last > first) {
+        unsigned int next = (first + last) >> 1;
+        int cmp = memcmp(objects[next].sha1, sha1, 20);
+        if (!cmp)
+            return &objects[next];
+        if (cmp > 0)
+            last = next;
+        else
+            first = next + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Function: `name_hash`
+ * Parameters:
+ *      -name: The path of an object.
+ * Purpose: Hash a path so that the last characters count the most. Files
+ *          with the same name (and with the same extension) then sort next
+ *          to each other, which is where good delta bases are found.
+ */
+static unsigned int name_hash(const char *name)
+{
+    unsigned int c, hash = 0;
+
+    while ((c = (unsigned char)*name++) != 0) {
+        if (c == ' ' || c == '\t' || c == '\n')
+            continue;
+        hash = (hash >> 2) + (c << 24);
+    }
+    return hash;
+}
+
+/*
+ * Function: `name_tree_entries`
+ * Parameters:
+ *      -buf: The data of a tree object.
+ *      -size: The size of the tree data.
+ * Purpose: Give every object listed in a tree the hash of its path, unless it
+ *          already got one from another tree.
+ */
+static void name_tree_entries(char *buf, unsigned long size)
+{
+    char *end = buf + size;
+
+    while (buf < end) {
+        char *path = memchr(buf, ' ', end - buf);
+        char *nul = memchr(buf, '\0', end - buf);
+        struct object_entry *entry;
+
+        if (!path || !nul || path > nul || nul + 21 > end)
+            break;
+        entry = locate_object((unsigned char *)nul + 1);
+        if (entry && !entry->name_hash)
+            entry->name_hash = name_hash(path + 1);
+        buf = nul + 21;
+    }
+}
+
+/*
+ * Function: `get_object_details`
+ * Parameters: none
+ * Purpose: Learn the type and size of every object to be packed, and read
+ *          the trees among them to learn the paths of the blobs. Only the
+ *          object headers are read for blobs and commits.
+ */
+static void get_object_details(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_objects; i++) {
+        struct object_entry *entry = &objects[i];
+        char type[20];
+        void *buf;
+
+        if (sha1_object_info(entry->sha1, type, &entry->size) < 0)
+            usage("unable to read object to pack");
+        entry->type = pack_type_from_name(type);
+        if (entry->type < 0)
+            usage("unknown object type");
+        if (entry->type != OBJ_TREE)
+            continue;
+        buf = read_sha1_file(entry->sha1, type, &entry->size);
+        if (!buf)
+            usage("unable to read object to pack");
+        name_tree_entries(buf, entry->size);
+        free(buf);
+    }
+}
+
+/*
+ * Function: `type_size_sort`
+ * Parameters:
+ *      -a, b: Pointers to two pointers to object entries.
+ * Purpose: `qsort()` comparison function ordering objects by type, then by
+ *          path hash, then from largest to smallest.
+ */
+static int type_size_sort(const void *a, const void *b)
+{
+    const struct object_entry *x = *(struct object_entry **)a;
+    const struct object_entry *y = *(struct object_entry **)b;
+
+    if (x->type != y->type)
+        return x->type < y->type ? -1 : 1;
+    if (x->name_hash != y->name_hash)
+        return x->name_hash < y->name_hash ? -1 : 1;
+    if (x->size != y->size)
+        return x->size > y->size ? -1 : 1;
+    return memcmp(x->sha1, y->sha1, 20);
+}
+
+/*
+ * Function: `try_delta`
+ * Parameters:
+ *      -trg: The object that might be stored as a delta.
+ *      -src: The candidate base object from the window.
+ * Purpose: Create a delta from `src` to `trg` and keep it if it is smaller
+ *          than half of `trg` and smaller than any delta found so far.
+ */
+static void try_delta(struct unpacked *trg, struct unpacked *src)
+{
+    struct object_entry *t = trg->entry, *s = src->entry;
+    unsigned long max_size, sizediff, delta_size;
+    void *delta;
+
+    if (t->type != s->type || s->depth >= depth)
+        return;
+    if (s->size > DELTA_SIZE_LIMIT || t->size < 64)
+        return;
+
+    /* A delta is only worth it if it saves at least half the object. */
+    max_size = t->size / 2 - 20;
+    if (t->delta)
+        max_size = t->delta_size - 1;
+    sizediff = s->size < t->size ? t->size - s->size : 0;
+    if (sizediff >= max_size || t->size < s->size / 32)
+        return;
+
+    if (!src->index) {
+        src->index = create_delta_index(src->data, s->size);
+        if (!src->index)
+            return;
+    }
+    delta = create_delta(src->index, trg->data, t->size, &delta_size,
+                         max_size);
+    if (!delta)
+        return;
+
+    if (t->delta_data) {
+        free(t->delta_data);
+        delta_cache_size -= t->delta_size;
+        t->delta_data = NULL;
+    }
+    t->delta = s;
+    t->delta_size = delta_size;
+    t->depth = s->depth + 1;
+    if (delta_cache_size + delta_size <= DELTA_CACHE_LIMIT) {
+        t->delta_data = delta;
+        delta_cache_size += delta_size;
+    } else {
+        free(delta);
+    }
+}
+
+/*
+ * Function: `find_deltas`
+ * Parameters:
+ *      -list: The objects to pack, in the order of `type_size_sort()`.
+ * Purpose: Slide a window over the sorted objects, comparing each object
+ *          with the objects in the window before it joins the window itself.
+ *          Returns the number of objects that will be stored as deltas.
+ */
+static unsigned int find_deltas(struct object_entry **list)
+{
+    struct unpacked *array;
+    unsigned int i, idx = 0, nr_deltas = 0;
+    int j;
+
+    if (window <= 0)
+        return 0;
+    array = calloc(window, sizeof(*array));
+
+    for (i = 0; i < nr_objects; i++) {
+        struct unpacked *n = array + idx;
+        struct object_entry *entry = list[i];
+        char type[20];
+        unsigned long size;
+
+        /* Drop the oldest object from the window to make room. */
+        free(n->data);
+        free_delta_index(n->index);
+        n->index = NULL;
+        n->entry = entry;
+        n->data = read_sha1_file(entry->sha1, type, &size);
+        if (!n->data)
+            usage("unable to read object to pack");
+
+        /* Try the most recent window entries first. */
+        for (j = 1; j < window; j++) {
+            struct unpacked *m = array + (idx + window - j) % window;
+            if (!m->entry)
+                break;
+            if (m->entry->type != entry->type)
+                break;
+            try_delta(n, m);
+        }
+        if (entry->delta)
+            nr_deltas++;
+
+        /* A huge object would only crowd the window out. */
+        if (entry->size > DELTA_SIZE_LIMIT) {
+            free(n->data);
+            n->data = NULL;
+            n->entry = NULL;
+            continue;
+        }
+        idx = (idx + 1) % window;
+    }
+
+    for (j = 0; j < window; j++) {
+        free(array[j].data);
+        free_delta_index(array[j].index);
+    }
+    free(array);
+    return nr_deltas;
+}
+
+/*
+ * Function: `encode_header`
+ * Parameters:
+ *      -hdr: Buffer of at least 10 bytes for the encoded header.
+ *      -type: The pack object type number.
+ *      -size: The size in bytes of the inflated object data.
+ * Purpose: Encode a pack entry header: the type and the low 4 bits of the
+ *          size go in the first byte, and the rest of the size follows 7 bits
+ *          at a time. The high bit of each byte says whether another byte
+ *          follows. Returns the number of bytes used.
+ */
+static int encode_header(unsigned char *hdr, int type, unsigned long size)
+{
+    int n = 1;
+    unsigned char c = (type << 4) | (size & 15);
+
+    size >>= 4;
+    while (size) {
+        *hdr++ = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+        n++;
+    }
+    *hdr = c;
+    return n;
+}
+
+/*
+ * Function: `get_delta`
+ * Parameters:
+ *      -entry: An object that is stored as a delta.
+ * Purpose: Compute the delta of an object against its base again, because it
+ *          did not fit in the delta cache during the search.
+ */
+static void *get_delta(struct object_entry *entry)
+{
+    unsigned long size, base_size, delta_size;
+    char type[20];
+    void *buf, *base, *delta;
+
+    buf = read_sha1_file(entry->sha1, type, &size);
+    base = read_sha1_file(entry->delta->sha1, type, &base_size);
+    if (!buf || !base)
+        usage("unable to read object to pack");
+    delta = diff_delta(base, base_size, buf, size, &delta_size, 0);
+    if (!delta || delta_size != entry->delta_size)
+        usage("delta size changed");
+    free(buf);
+    free(base);
+    return delta;
+}
+
+/*
+ * Function: `write_object`
+ * Parameters:
+ *      -f: The pack file being written.
+ *      -entry: The object to write.
+ * Purpose: Append an object's entry header and its deflated data (without
+ *          the "<type> <size>\0" prefix) to the pack. An object stored as a
+ *          delta gets its base written first, then a header giving the
+ *          distance back to the base, then the deflated delta.
+ */
+static void write_object(struct sha1file *f, struct object_entry *entry)
+{
+    unsigned char hdr[10], ofs[10];
+    unsigned long size, bound;
+    char type[20];
+    z_stream stream;
+    void *buf, *out;
+    int kind, pos, level, policy;
+    unsigned long long start;
+
+    if (entry->offset)
+        return;
+    if (entry->delta) {
+        write_object(f, entry->delta);
+        buf = entry->delta_data ? entry->delta_data : get_delta(entry);
+        entry->delta_data = NULL;
+        size = entry->delta_size;
+        kind = OBJ_OFS_DELTA;
+    } else {
+        buf = read_sha1_file(entry->sha1, type, &size);
+        if (!buf)
+            usage("unable to read object to pack");
+        kind = entry->type;
+    }
+
+    /*
+     * Compress the object data at the level loose objects of its type get
+     * (see compress.c). Deltas are not sampled, since they are mostly
+     * literal data only when they are small.
+     */
+    level = compression_level(pack_type_name(entry->type),
+                              entry->delta ? NULL : buf, size, &policy);
+    start = compression_clock();
+    memset(&stream, 0, sizeof(stream));
+    deflateInit(&stream, level);
+    bound = deflateBound(&stream, size);
+    out = malloc(bound);
+    stream.next_in = buf;
+    stream.avail_in = size;
+    stream.next_out = out;
+    stream.avail_out = bound;
+    while (deflate(&stream, Z_FINISH) == Z_OK)
+        /* nothing */;
+    deflateEnd(&stream);
+    compression_done(policy, level, size, stream.total_out, start, 0);
+
+    entry->offset = f->offset;
+    sha1write(f, hdr, encode_header(hdr, kind, size));
+    if (entry->delta) {
+        /* Encode the distance back to the base, most significant first. */
+        unsigned long distance = entry->offset - entry->delta->offset;
+        pos = sizeof(ofs) - 1;
+        ofs[pos] = distance & 127;
+        while (distance >>= 7)
+            ofs[--pos] = 128 | (--distance & 127);
+        sha1write(f, ofs + pos, sizeof(ofs) - pos);
+    }
+    sha1write(f, out, stream.total_out);
+    free(out);
+    free(buf);
+}
+
+/*
+ * Function: `write_pack_file`
+ * Parameters:
+ *      -template: Temporary file name template for the pack.
+ *      -list: The objects in the order they should be written.
+ *      -pack_sha1: Filled in with the SHA1 hash of the pack's contents.
+ * Purpose: Write the pack header, one entry per object, and the trailing
+ *          SHA1 hash of the pack.
+ */
+static void write_pack_file(char *template, struct object_entry **list,
+                            unsigned char *pack_sha1)
+{
+    struct sha1file f;
+    unsigned char hdr[PACK_HDR_SIZE];
+    unsigned int i;
+
+    sha1create(&f, template);
+    put_be32(hdr, PACK_SIGNATURE);
+    put_be32(hdr + 4, PACK_VERSION);
+    put_be32(hdr + 8, nr_objects);
+    sha1write(&f, hdr, sizeof(hdr));
+
+    for (i = 0; i < nr_objects; i++)
+        write_object(&f, list[i]);
+    sha1close(&f, pack_sha1);
+}
+
+/*
+ * Function: `sha1_compare`
+ * Parameters:
+ *      -a, b: Pointers to two object entries.
+ * Purpose: `qsort()` comparison function ordering objects by SHA1 hash.
+ */
+static int sha1_compare(const void *a, const void *b)
+{
+    const struct object_entry *x = a, *y = b;
+    return memcmp(x->sha1, y->sha1, 20);
+}
+
+/*
+ * Function: `write_index_file`
+ * Parameters:
+ *      -template: Temporary file name template for the index.
+ *      -pack_sha1: The SHA1 hash of the pack the index describes.
+ * Purpose: Write the pack index of the objects, which are already sorted by
+ *          SHA1 hash: header, fanout table, hashes, offsets, 8-byte offsets
+ *          for entries beyond 2GB, and finally the pack's hash and the
+ *          index's own hash.
+ */
+static void write_index_file(char *template, unsigned char *pack_sha1)
+{
+    struct sha1file f;
+    unsigned char buf[8], idx_sha1[20];
+    unsigned int i, nr_large = 0, fanout = 0;
+    int b;
+
+    sha1create(&f, template);
+    put_be32(buf, PACK_IDX_SIGNATURE);
+    put_be32(buf + 4, PACK_IDX_VERSION);
+    sha1write(&f, buf, PACK_IDX_HDR_SIZE);
+
+    /* Entry `b` counts the objects whose first byte is at most `b`. */
+    for (b = 0; b < 256; b++) {
+        while (fanout < nr_objects && objects[fanout].sha1[0] <= b)
+            fanout++;
+        put_be32(buf, fanout);
+        sha1write(&f, buf, 4);
+    }
+
+    for (i = 0; i < nr_objects; i++)
+        sha1write(&f, objects[i].sha1, 20);
+
+    for (i = 0; i < nr_objects; i++) {
+        unsigned long offset = objects[i].offset;
+        if (offset > 0x7fffffff)
+            put_be32(buf, 0x80000000 | nr_large++);
+        else
+            put_be32(buf, offset);
+        sha1write(&f, buf, 4);
+    }
+
+    for (i = 0; i < nr_objects; i++) {
+        unsigned long offset = objects[i].offset;
+        if (offset <= 0x7fffffff)
+            continue;
+        put_be32(buf, (unsigned int)(offset >> 16 >> 16));
+        put_be32(buf + 4, (unsigned int)offset);
+        sha1write(&f, buf, 8);
+    }
+
+    sha1write(&f, pack_sha1, 20);
+    sha1close(&f, idx_sha1);
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the
+ *             command itself.
+ *      -argv: An array of the command line arguments, including the command
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable
+ *          `pack-objects` is run from the command line.
+ */
+int main(int argc, char **argv)
+{
+    const char *dir;
+    char *tmp_pack, *tmp_idx, *name;
+    unsigned char pack_sha1[20];
+    struct object_entry **list;
+    unsigned int nr_deltas;
+    struct packed_git *p, **packs = NULL;
+    int remove_loose = 0, rebuild_midx = 0, factor = 0, bitmaps = 0;
+    unsigned int i, j, nr_rollup = 0;
+    int len;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d"))
+            remove_loose = 1;
+        else if (!strncmp(argv[i], "--window=", 9))
+            window = atoi(argv[i] + 9);
+        else if (!strncmp(argv[i], "--depth=", 8))
+            depth = atoi(argv[i] + 8);
+        else if (!strcmp(argv[i], "--write-midx"))
+            rebuild_midx = 1;
+        else if (!strcmp(argv[i], "--bitmaps"))
+            bitmaps = 1;
+        else if (!strcmp(argv[i], "--geometric"))
+            factor = 2;
+        else if (!strncmp(argv[i], "--geometric=", 12))
+            factor = atoi(argv[i] + 12);
+        else
+            usage("pack-objects [-d] [--window=<n>] [--depth=<n>] "
+                  "[--write-midx] [--geometric[=<factor>]] [--bitmaps]");
+    }
+    if (factor < 0 || factor == 1)
+        usage("the geometric factor must be at least 2");
+
+    /* Packs, their indexes and bitmaps name objects with SHA1 only. */
+    if (object_hash()->rawsz != 20)
+        usage("packs are only supported in sha1 repositories");
+
+    /* Collect the loose objects that are not in any pack yet. */
+    prepare_packed_git();
+    for_each_loose_object(add_loose_object, NULL);
+
+    /* Add the objects of the small packs that are merged into the new one. */
+    if (factor) {
+        packs = geometric_rollup(factor, &nr_rollup);
+        for (j = 0; j < nr_rollup; j++)
+            for (i = 0; i < packs[j]->num_objects; i++)
+                add_object(nth_packed_object_sha1(packs[j], i));
+    }
+    if (!nr_objects) {
+        fprintf(stderr, "Nothing new to pack\n");
+        if (rebuild_midx && packed_git && write_multi_pack_index(0) < 0)
+            exit(1);
+        write_object_filter();
+        return 0;
+    }
+
+    /*
+     * Sort the objects by SHA1 hash, which is the order of the index and
+     * lets trees find the objects they name, then search for deltas.
+     */
+    qsort(objects, nr_objects, sizeof(*objects), sha1_compare);
+    if (nr_rollup) {
+        /* The same object may be in more than one of the merged packs. */
+        for (i = j = 1; i < nr_objects; i++)
+            if (memcmp(objects[i].sha1, objects[j - 1].sha1, 20))
+                objects[j++] = objects[i];
+        nr_objects = j;
+    }
+    get_object_details();
+    list = malloc(nr_objects * sizeof(*list));
+    for (i = 0; i < nr_objects; i++)
+        list[i] = &objects[i];
+    qsort(list, nr_objects, sizeof(*list), type_size_sort);
+    nr_deltas = find_deltas(list);
+
+    dir = pack_directory();
+    if (MKDIR(dir) < 0 && errno != EEXIST) {
+        perror(dir);
+        exit(1);
+    }
+
+    /* Room for "/tmp_pack_XXXXXX" or "/pack-<40 hex digits>.pack". */
+    len = strlen(dir);
+    tmp_pack = malloc(len + 60);
+    tmp_idx = malloc(len + 60);
+    name = malloc(len + 60);
+    sprintf(tmp_pack, "%s/tmp_pack_XXXXXX", dir);
+    sprintf(tmp_idx, "%s/tmp_idx_XXXXXX", dir);
+
+    write_pack_file(tmp_pack, list, pack_sha1);
+    write_index_file(tmp_idx, pack_sha1);
+
+    /*
+     * Move the pack into place before its index, so that a reader never
+     * finds an index whose pack is missing.
+     */
+    sprintf(name, "%s/pack-%s.pack", dir, sha1_to_hex(pack_sha1));
+    if (RENAME(tmp_pack, name) == RENAME_FAIL)
+        usage("unable to rename pack file");
+    sprintf(name, "%s/pack-%s.idx", dir, sha1_to_hex(pack_sha1));
+    if (RENAME(tmp_idx, name) == RENAME_FAIL)
+        usage("unable to rename pack index");
+
+    /* Make the multi-pack index cover the new pack too. */
+    p = add_packed_git(name);
+    if (!p)
+        usage("unable to read back new pack index");
+    p->next = packed_git;
+    packed_git = p;
+
+    /*
+     * The merged packs are now redundant. Each index is removed before its
+     * pack, for the same reason as above.
+     */
+    for (j = 0; j < nr_rollup; j++) {
+        char *pack_name = packs[j]->pack_name;
+        int n = strlen(pack_name);
+
+        if (!strcmp(pack_name, p->pack_name))
+            continue;
+        strcpy(name, pack_name);
+        strcpy(name + n - 5, ".bitmap");
+        unlink(name);
+        strcpy(name + n - 5, ".idx");
+        unlink(name);
+        unlink(pack_name);
+    }
+    if (write_multi_pack_index(!rebuild_midx) < 0)
+        exit(1);
+
+    /* Give the commits in the new pack reachability bitmaps if asked. */
+    if (bitmaps) {
+        unsigned char **commits = malloc(nr_objects * sizeof(*commits));
+        unsigned int nr_commits = 0;
+
+        for (i = 0; i < nr_objects; i++)
+            if (objects[i].type == OBJ_COMMIT)
+                commits[nr_commits++] = objects[i].sha1;
+        if (write_bitmap_index(p, commits, nr_commits) < 0)
+            exit(1);
+        free(commits);
+    }
+
+    /* Now that they are safely packed, drop the loose copies if asked. */
+    if (remove_loose)
+        for (i = 0; i < nr_objects; i++)
+            unlink(sha1_file_name(objects[i].sha1));
+
+    /*
+     * Build a new filter of the loose objects that are left (see
+     * object-filter.c). This also creates the filter in object stores made
+     * before it existed. A failure is reported but is not fatal, since
+     * without a filter every check simply looks for the object file.
+     */
+    write_object_filter();
+
+    if (nr_rollup)
+        fprintf(stderr, "Merged %u pack%s\n", nr_rollup,
+                nr_rollup == 1 ? "" : "s");
+    fprintf(stderr, "Total %u (delta %u)\n", nr_objects, nr_deltas);
+    printf("%s\n", sha1_to_hex(pack_sha1));
+    return 0;
+}
@@ -0,0 +1,889 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the helper functions that read
+ *  objects out of pack files. It is compiled together with read-cache.c
+ *  into every executable, and `read_sha1_file()` calls `find_pack_entry()`
+ *  before falling back to the loose object files, so that a packed object
+ *  costs a binary search in an already mapped index instead of an `open()`,
+ *  `fstat()`, `mmap()` and `close()` of its own file.
+ *
+ *  See "pack.h" for a description of the pack and pack index formats.
+ */
+#include "pack.h"
+/* The above 'include' allows use of the following functions and
+   variables from "pack.h" and "cache.h" header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -get_object_directory(): Return the path to the object store.
+
+   -object_hash(): Return the hash algorithm of the repository. Sourced from
+                   "cache.h" (defined in hash.c).
+
+   -opendir(path)/readdir(dir)/closedir(dir): Iterate over the entries of a
+        directory. Sourced from <dirent.h>.
+
+   -map_fd(fd, size): Map the contents of an open file into memory. Sourced
+                      from "cache.h" (defined in read-cache.c).
+
+   -get_be32(p): Read a 32-bit big-endian integer. Sourced from "pack.h".
+
+   -error(message): Print an error message and return -1. Sourced from
+                    "cache.h" (defined in read-cache.c).
+
+   -munmap(addr, len): Remove a mapping made with mmap(). Sourced from
+                       <sys/mman.h>.
+
+   -load_multi_pack_index(): Map the multi-pack index. Sourced from "pack.h"
+                             (defined in midx.c).
+
+   -midx_find_entry(): Look an object up in the multi-pack index. Sourced
+                       from "pack.h" (defined in midx.c).
+
+   -inflateInit(z_stream)/inflate(z_stream, flush)/inflateEnd(z_stream):
+        Decompress zlib data. Sourced from <zlib.h>.
+
+   -delta_result_size(): Read the size of a delta's target from its header.
+                         Sourced from "pack.h" (defined in delta.c).
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -packed_git: The list of packs found in the pack directory.
+
+   -pack_directory(): Return the path of the pack directory.
+
+   -pack_type_name(): Convert a pack object type number to a type name.
+
+   -pack_type_from_name(): Convert a type name to a pack object type number.
+
+   -add_packed_git(): Map and validate a pack index file.
+
+   -prepare_packed_git(): Find all pack index files in the pack directory.
+
+   -find_pack_index_pos(): Binary search one pack index for an object.
+
+   -nth_packed_object_sha1(): Return the SHA1 hash of the nth indexed object.
+
+   -nth_packed_object_offset(): Return the pack offset of the nth indexed
+                                object.
+
+   -find_pack_entry(): Search all packs for an object.
+
+   -use_pack(): Map the pack data file the first time it is needed.
+
+   -unpack_object_header(): Decode the type and size of a pack entry.
+
+   -unpack_compressed(): Inflate the data of a pack entry.
+
+   -delta_base_cache: A small cache of recently used delta bases.
+
+   -add_delta_base(): Add a delta base to the cache.
+
+   -delta_base_offset(): Find the base entry of a delta entry.
+
+   -unpack_delta(): Rebuild an object from its delta and base.
+
+   -unpack_object(): Rebuild the object stored in a pack entry.
+
+   -unpack_entry(): Read and inflate a packed object.
+
+   -packed_object_data(): Locate the deflated data of a packed object, so
+                          that it can be inflated in pieces.
+
+   -packed_delta_size(): Read the size of a delta's target from its start.
+
+   -packed_object_info(): Learn the type and size of a packed object
+                          without inflating it.
+*/
+
+/* The list of packs found in the pack directory. */
+struct packed_git *packed_git = NULL;
+
+/* Non-zero once the pack directory has been scanned. */
+static int packed_git_prepared = 0;
+
+/* Names of the object types, indexed by pack object type number. */
+static const char *type_names[] = {
+    NULL, "commit", "tree", "blob"
+};
+
+/*
+ * Function: `pack_directory`
+ * Parameters: none
+ * Purpose: Return the path of the pack directory, which is the `pack`
+ *          subdirectory of the object store.
+ */
+const char *pack_directory(void)
+{
+    static char *path;
+
+    if (!path) {
+        const char *dir = get_object_directory();
+        path = malloc(strlen(dir) + 6);
+        sprintf(path, "%s/pack", dir);
+    }
+    return path;
+}
+
+/*
+ * Function: `pack_type_name`
+ * Parameters:
+ *      -type: A pack object type number.
+ * Purpose: Return the object type name (blob, tree, or commit) of a pack
+ *          object type number, or NULL if the number is not a base type.
+ */
+const char *pack_type_name(int type)
+{
+    if (type < OBJ_COMMIT || type > OBJ_BLOB)
+        return NULL;
+    return type_names[type];
+}
+
+/*
+ * Function: `pack_type_from_name`
+ * Parameters:
+ *      -type: An object type name.
+ * Purpose: Return the pack object type number of an object type name, or -1
+ *          if the name is not known.
+ */
+int pack_type_from_name(const char *type)
+{
+    int i;
+
+    for (i = OBJ_COMMIT; i <= OBJ_BLOB; i++)
+        if (!strcmp(type, type_names[i]))
+            return i;
+    return -1;
+}
+
+/*
+ * Function: `add_packed_git`
+ * Parameters:
+ *      -idx_path: The path of a `.idx` file in the pack directory.
+ * Purpose: Map a pack index file, check that its header, fanout table and
+ *          size are consistent, and return a new `packed_git` structure
+ *          describing the pack. Returns NULL if the index is not usable.
+ */
+struct packed_git *add_packed_git(const char *idx_path)
+{
+    struct packed_git *p;
+    struct stat st;
+    unsigned char *map;
+    unsigned long size, min_size;
+    unsigned int nr, i, prev;
+    int len = strlen(idx_path);
+    int fd;
+
+    /* Only `pack-<hex>.idx` files describe packs. */
+    if (len < 4 || strcmp(idx_path + len - 4, ".idx"))
+        return NULL;
+
+    fd = OPEN_FILE(idx_path, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+
+    /* The header, the fanout table and the two trailing hashes. */
+    if (size < PACK_IDX_HDR_SIZE + 256 * 4 + 40) {
+        close(fd);
+        error("pack index too small");
+        return NULL;
+    }
+    map = map_fd(fd, size);
+    close(fd);
+    if (!map)
+        return NULL;
+
+    if (get_be32(map) != PACK_IDX_SIGNATURE ||
+        get_be32(map + 4) != PACK_IDX_VERSION) {
+        error("unknown pack index format");
+        goto unmap;
+    }
+
+    /* The fanout table must never decrease. */
+    prev = 0;
+    for (i = 0; i < 256; i++) {
+        unsigned int n = get_be32(map + PACK_IDX_HDR_SIZE + i * 4);
+        if (n < prev) {
+            error("non-monotonic pack index fanout");
+            goto unmap;
+        }
+        prev = n;
+    }
+    nr = prev;
+
+    /*
+     * Every object needs a 20-byte hash and a 4-byte offset; the table of
+     * 8-byte offsets may add more, but never less.
+     */
+    min_size = PACK_IDX_HDR_SIZE + 256 * 4 + (unsigned long)nr * 24 + 40;
+    if (size < min_size) {
+        error("pack index truncated");
+        goto unmap;
+    }
+
+    /* The pack file has the same name as the index, ending in `.pack`. */
+    p = malloc(sizeof(*p) + len + 2);
+    memset(p, 0, sizeof(*p));
+    memcpy(p->pack_name, idx_path, len - 4);
+    strcpy(p->pack_name + len - 4, ".pack");
+    p->index_map = map;
+    p->index_size = size;
+    p->num_objects = nr;
+    return p;
+
+/* The index is not usable: remove the mapping made above. */
+unmap:
+    #ifndef BGIT_WINDOWS
+    munmap(map, size);
+    #else
+    UnmapViewOfFile( map );
+    #endif
+    return NULL;
+}
+
+/*
+ * Function: `prepare_packed_git`
+ * Parameters: none
+ * Purpose: Scan the pack directory once and add every pack index found there
+ *          to the `packed_git` list. A missing pack directory simply means
+ *          that there are no packs, and so does a repository that does not
+ *          name its objects with SHA1.
+ */
+void prepare_packed_git(void)
+{
+    const char *dir;
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+
+    if (packed_git_prepared)
+        return;
+    packed_git_prepared = 1;
+
+    /* Packs name their objects with SHA1, so other repositories have none. */
+    if (object_hash()->rawsz != 20)
+        return;
+
+    dir = pack_directory();
+    d = opendir(dir);
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        struct packed_git *p;
+
+        if (strncmp(de->d_name, "pack-", 5))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        p = add_packed_git(path);
+        if (!p)
+            continue;
+        p->next = packed_git;
+        packed_git = p;
+    }
+    closedir(d);
+
+    /* Let the multi-pack index answer for the packs it covers. */
+    load_multi_pack_index();
+}
+
+/*
+ * Function: `find_pack_index_pos`
+ * Parameters:
+ *      -p: The pack whose index to search.
+ *      -sha1: The SHA1 hash of the object to look up.
+ * Purpose: Use the fanout table to narrow the search down to the objects that
+ *          share the first byte of `sha1`, then binary search the sorted
+ *          hashes. Returns the position of the object in the index, or -1.
+ */
+int find_pack_index_pos(struct packed_git *p, unsigned char *sha1)
+{
+    unsigned char *fanout = p->index_map + PACK_IDX_HDR_SIZE;
+    unsigned char *sha1s = fanout + 256 * 4;
+    unsigned int first, last;
+
+    /* Objects starting with byte `b` are at [fanout[b-1], fanout[b]). */
+    first = sha1[0] ? get_be32(fanout + (sha1[0] - 1) * 4) : 0;
+    last = get_be32(fanout + sha1[0] * 4);
+
+    while (last > first) {
+        unsigned int next = (first + last) >> 1;   /* Division by 2. */
+        int cmp = memcmp(sha1s + next * 20, sha1, 20);
+        if (!cmp)
+            return next;
+        if (cmp > 0) {
+            last = next;
+            continue;
+        }
+        first = next + 1;
+    }
+    return -1;
+}
+
+/*
+ * Function: `nth_packed_object_sha1`
+ * Parameters:
+ *      -p: The pack whose index to read.
+ *      -n: The position of the object in the index.
+ * Purpose: Return a pointer to the SHA1 hash of the nth object in the index.
+ */
+unsigned char *nth_packed_object_sha1(struct packed_git *p, unsigned int n)
+{
+    return p->index_map + PACK_IDX_HDR_SIZE + 256 * 4 + n * 20;
+}
+
+/*
+ * Function: `nth_packed_object_offset`
+ * Parameters:
+ *      -p: The pack whose index to read.
+ *      -n: The position of the object in the index.
+ * Purpose: Return the offset of the nth object's entry in the pack file.
+ *          Offsets that do not fit in 31 bits are stored in a separate table
+ *          of 8-byte offsets, which the 4-byte entry then points into.
+ */
+unsigned long nth_packed_object_offset(struct packed_git *p, unsigned int n)
+{
+    unsigned char *offsets = p->index_map + PACK_IDX_HDR_SIZE + 256 * 4 +
+                             (unsigned long)p->num_objects * 20;
+    unsigned int off = get_be32(offsets + n * 4);
+    unsigned char *large;
+
+    if (!(off & 0x80000000))
+        return off;
+
+    /* The large offset table comes right after the 4-byte offsets. */
+    large = offsets + (unsigned long)p->num_objects * 4 +
+            (unsigned long)(off & 0x7fffffff) * 8;
+    if (large + 8 > p->index_map + p->index_size - 40)
+        return 0;
+    return ((unsigned long)get_be32(large) << 32) | get_be32(large + 4);
+}
+
+/*
+ * Function: `find_pack_entry`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object to look up.
+ *      -e: Filled in with the pack and offset of the object if found.
+ * Purpose: Search the indexes of all packs for an object. The multi-pack
+ *          index is searched first, so that the packs it covers cost a single
+ *          binary search between them. Of the remaining packs, the one in
+ *          which the previous object was found is tried first, since objects
+ *          that are used together tend to be packed together.
+ */
+int find_pack_entry(unsigned char *sha1, struct pack_entry *e)
+{
+    static struct packed_git *last_found;
+    struct packed_git *p;
+    int pos;
+
+    prepare_packed_git();
+    if (!packed_git)
+        return 0;
+    if (midx_find_entry(sha1, e))
+        return 1;
+
+    if (last_found) {
+        pos = find_pack_index_pos(last_found, sha1);
+        if (pos >= 0) {
+            e->p = last_found;
+            e->offset = nth_packed_object_offset(last_found, pos);
+            return 1;
+        }
+    }
+    for (p = packed_git; p; p = p->next) {
+        if (p == last_found || p->in_midx)
+            continue;
+        pos = find_pack_index_pos(p, sha1);
+        if (pos < 0)
+            continue;
+        e->p = p;
+        e->offset = nth_packed_object_offset(p, pos);
+        last_found = p;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: `use_pack`
+ * Parameters:
+ *      -p: The pack whose data file to map.
+ * Purpose: Map the pack data file the first time an object is read from it,
+ *          and check that it is the pack the index was made for. Returns -1
+ *          if the pack file is missing or does not match its index.
+ */
+static int use_pack(struct packed_git *p)
+{
+    struct stat st;
+    unsigned char *map;
+    int fd;
+
+    if (p->pack_map)
+        return 0;
+
+    fd = OPEN_FILE(p->pack_name, O_RDONLY, 0);
+    if (fd < 0)
+        return error("unable to open pack file");
+    if (fstat(fd, &st) < 0 || st.st_size < PACK_HDR_SIZE + 20) {
+        close(fd);
+        return error("pack file too small");
+    }
+    map = map_fd(fd, st.st_size);
+    close(fd);
+    if (!map)
+        return error("unable to map pack file");
+
+    /*
+     * The header must match, and the pack's trailing SHA1 hash must be the
+     * one recorded in its index.
+     */
+    if (get_be32(map) != PACK_SIGNATURE ||
+        get_be32(map + 4) != PACK_VERSION ||
+        get_be32(map + 8) != p->num_objects ||
+        memcmp(map + st.st_size - 20, p->index_map + p->index_size - 40, 20)) {
+        #ifndef BGIT_WINDOWS
+        munmap(map, st.st_size);
+        #else
+        UnmapViewOfFile( map );
+        #endif
+        return error("pack file does not match its index");
+    }
+
+    p->pack_map = map;
+    p->pack_size = st.st_size;
+    return 0;
+}
+
+/*
+ * Function: `unpack_object_header`
+ * Parameters:
+ *      -p: The pack containing the entry.
+ *      -offset: The offset of the entry in the pack.
+ *      -type: Filled in with the pack object type number.
+ *      -size: Filled in with the size of the inflated object data.
+ * Purpose: Decode a pack entry header. The first byte holds a continuation
+ *          bit, the 3-bit type and the low 4 bits of the size; every
+ *          following byte holds a continuation bit and 7 more size bits.
+ *          Returns the offset of the data following the header, or 0.
+ */
+static unsigned long unpack_object_header(struct packed_git *p,
+                                          unsigned long offset, int *type,
+                                          unsigned long *size)
+{
+    /* The trailing SHA1 hash is never part of an entry. */
+    unsigned long end = p->pack_size - 20;
+    unsigned char c;
+    int shift;
+
+    if (offset < PACK_HDR_SIZE || offset >= end)
+        return 0;
+    c = p->pack_map[offset++];
+    *type = (c >> 4) & 7;
+    *size = c & 15;
+    shift = 4;
+    while (c & 0x80) {
+        if (offset >= end || shift > 8 * sizeof(long) - 7)
+            return 0;
+        c = p->pack_map[offset++];
+        *size += (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    return offset;
+}
+
+/*
+ * Function: `unpack_compressed`
+ * Parameters:
+ *      -p: The pack containing the data.
+ *      -offset: The offset of the deflated data in the pack.
+ *      -size: The expected size of the inflated data.
+ * Purpose: Inflate `size` bytes of entry data starting at `offset` into a
+ *          newly allocated buffer with a terminating null byte. Returns NULL
+ *          if the data does not inflate to exactly `size` bytes.
+ */
+static void *unpack_compressed(struct packed_git *p, unsigned long offset,
+                               unsigned long size)
+{
+    z_stream stream;
+    void *buf;
+    int ret;
+
+    /* Allocate one extra byte so that empty objects still get a buffer. */
+    buf = malloc(size + 1);
+    if (!buf)
+        return NULL;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = p->pack_map + offset;
+    stream.avail_in = p->pack_size - 20 - offset;
+    stream.next_out = buf;
+    stream.avail_out = size + 1;
+
+    inflateInit(&stream);
+    ret = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+
+    if (ret != Z_STREAM_END || stream.total_out != size) {
+        free(buf);
+        return NULL;
+    }
+    ((char *)buf)[size] = '\0';
+    return buf;
+}
+
+/*
+ * Delta chains usually share their bases: every revision of a file is a
+ * delta against a neighbouring revision. To avoid rebuilding the same bases
+ * over and over, the most recently used bases are kept in a small cache,
+ * indexed by their pack and offset and limited to DELTA_BASE_CACHE_LIMIT
+ * bytes in total.
+ */
+#define DELTA_BASE_CACHE 256
+#define DELTA_BASE_CACHE_LIMIT (16 * 1024 * 1024)
+
+/* Template of one cached delta base. */
+struct delta_base_cache_entry {
+    struct packed_git *p;
+    unsigned long offset;
+    int type;
+    unsigned long size;
+    void *data;
+};
+
+static struct delta_base_cache_entry delta_base_cache[DELTA_BASE_CACHE];
+static unsigned long delta_base_cached;
+
+/*
+ * Function: `delta_base_slot`
+ * Parameters:
+ *      -p: The pack containing the base.
+ *      -offset: The offset of the base entry in the pack.
+ * Purpose: Return the cache slot used for a base.
+ */
+static struct delta_base_cache_entry *delta_base_slot(struct packed_git *p,
+                                                      unsigned long offset)
+{
+    unsigned long hash = offset + (unsigned long)p;
+    hash += (hash >> 8) + (hash >> 16);
+    return delta_base_cache + (hash % DELTA_BASE_CACHE);
+}
+
+/*
+ * Function: `release_delta_base`
+ * Parameters:
+ *      -ent: A cache slot.
+ * Purpose: Empty a cache slot.
+ */
+static void release_delta_base(struct delta_base_cache_entry *ent)
+{
+    if (!ent->data)
+        return;
+    free(ent->data);
+    delta_base_cached -= ent->size;
+    ent->data = NULL;
+}
+
+/*
+ * Function: `add_delta_base`
+ * Parameters:
+ *      -p, offset: The location of the base entry.
+ *      -type: The pack object type number of the base.
+ *      -data, size: The inflated base object. The cache takes ownership.
+ * Purpose: Remember a base object, evicting whatever used its slot and, if
+ *          the cache is over its size limit, other slots as well.
+ */
+static void add_delta_base(struct packed_git *p, unsigned long offset,
+                           int type, void *data, unsigned long size)
+{
+    struct delta_base_cache_entry *ent = delta_base_slot(p, offset);
+    static unsigned int evict;
+    int i;
+
+    release_delta_base(ent);
+    for (i = 0; i < DELTA_BASE_CACHE &&
+         delta_base_cached + size > DELTA_BASE_CACHE_LIMIT; i++)
+        release_delta_base(&delta_base_cache[evict++ % DELTA_BASE_CACHE]);
+
+    ent->p = p;
+    ent->offset = offset;
+    ent->type = type;
+    ent->size = size;
+    ent->data = data;
+    delta_base_cached += size;
+}
+
+/*
+ * Function: `delta_base_offset`
+ * Parameters:
+ *      -p: The pack containing the entry.
+ *      -entry: The offset of the delta entry's header.
+ *      -offset: The offset right after the entry header; advanced past the
+ *               distance to the base.
+ * Purpose: Decode the distance back to the base of a delta entry and return
+ *          the offset of the base entry, or 0 if the distance is corrupt.
+ */
+static unsigned long delta_base_offset(struct packed_git *p,
+                                       unsigned long entry,
+                                       unsigned long *offset)
+{
+    unsigned long pos = *offset, base_offset;
+    unsigned char c;
+
+    if (pos >= p->pack_size - 20)
+        return 0;
+    c = p->pack_map[pos++];
+    base_offset = c & 127;
+    while (c & 128) {
+        if (pos >= p->pack_size - 20 || base_offset >> (8 * sizeof(long) - 8))
+            return 0;
+        c = p->pack_map[pos++];
+        base_offset = ((base_offset + 1) << 7) | (c & 127);
+    }
+    if (!base_offset || base_offset >= entry)
+        return 0;
+    *offset = pos;
+    return entry - base_offset;
+}
+
+static void *unpack_object(struct packed_git *p, unsigned long offset,
+                           int *type, unsigned long *size, int depth);
+
+/*
+ * Function: `unpack_delta`
+ * Parameters:
+ *      -p: The pack containing the entry.
+ *      -entry: The offset of the delta entry's header.
+ *      -offset: The offset right after the entry header.
+ *      -delta_size: The size of the inflated delta.
+ *      -type: Filled in with the type of the rebuilt object.
+ *      -size: Filled in with the size of the rebuilt object.
+ *      -depth: How many deltas deep this entry is.
+ * Purpose: Find the base of a delta entry (in the cache, or by unpacking it,
+ *          which may involve more deltas), inflate the delta and apply it.
+ */
+static void *unpack_delta(struct packed_git *p, unsigned long entry,
+                          unsigned long offset, unsigned long delta_size,
+                          int *type, unsigned long *size, int depth)
+{
+    struct delta_base_cache_entry *ent;
+    unsigned long base_offset, base_size;
+    void *base, *delta, *result;
+    int base_type;
+
+    base_offset = delta_base_offset(p, entry, &offset);
+    if (!base_offset)
+        return NULL;
+
+    /* Look for the base in the cache before unpacking it. */
+    ent = delta_base_slot(p, base_offset);
+    if (ent->data && ent->p == p && ent->offset == base_offset) {
+        base = ent->data;
+        base_type = ent->type;
+        base_size = ent->size;
+    } else {
+        base = unpack_object(p, base_offset, &base_type, &base_size,
+                             depth + 1);
+        if (!base)
+            return NULL;
+        add_delta_base(p, base_offset, base_type, base, base_size);
+    }
+
+    delta = unpack_compressed(p, offset, delta_size);
+    if (!delta)
+        return NULL;
+    result = patch_delta(base, base_size, delta, delta_size, size);
+    free(delta);
+    *type = base_type;
+    return result;
+}
+
+/*
+ * Function: `unpack_object`
+ * Parameters:
+ *      -p: The pack containing the entry.
+ *      -offset: The offset of the entry in the pack.
+ *      -type: Filled in with the pack object type number.
+ *      -size: Filled in with the size of the inflated object data.
+ *      -depth: How many deltas deep this entry is.
+ * Purpose: Rebuild the object stored in a pack entry, whether it is stored
+ *          in full or as a delta.
+ */
+static void *unpack_object(struct packed_git *p, unsigned long offset,
+                           int *type, unsigned long *size, int depth)
+{
+    unsigned long data;
+
+    /* A chain this long can only come from a corrupt (circular) pack. */
+    if (depth > 10000)
+        return NULL;
+    data = unpack_object_header(p, offset, type, size);
+    if (!data)
+        return NULL;
+    if (*type == OBJ_OFS_DELTA)
+        return unpack_delta(p, offset, data, *size, type, size, depth);
+    if (!pack_type_name(*type))
+        return NULL;
+    return unpack_compressed(p, data, *size);
+}
+
+/*
+ * Function: `unpack_entry`
+ * Parameters:
+ *      -e: The location of the object in a pack.
+ *      -type: Filled in with the object type (blob, tree, or commit).
+ *      -size: Filled in with the size in bytes of the object data.
+ * Purpose: Read and inflate a packed object, and return the inflated object
+ *          data just like `read_sha1_file()` does for loose objects.
+ */
+void *unpack_entry(struct pack_entry *e, char *type, unsigned long *size)
+{
+    void *buf;
+    int kind;
+
+    if (use_pack(e->p) < 0)
+        return NULL;
+    buf = unpack_object(e->p, e->offset, &kind, size, 0);
+    if (!buf) {
+        error("corrupt packed object");
+        return NULL;
+    }
+    strcpy(type, pack_type_name(kind));
+    return buf;
+}
+
+/*
+ * Function: `packed_object_data`
+ * Parameters:
+ *      -e: The location of the object in a pack.
+ *      -type: Filled in with the object type (blob, tree, or commit).
+ *      -size: Filled in with the size in bytes of the object data.
+ *      -avail: Filled in with the number of pack bytes from the returned
+ *              position to the end of the pack data.
+ * Purpose: Return a pointer to the deflated data of a packed object that is
+ *          stored in full, so that a caller can inflate it a piece at a time
+ *          instead of all at once (see stream.c). Returns NULL if the object
+ *          is stored as a delta, which can only be rebuilt in memory, or if
+ *          the entry is corrupt.
+ */
+unsigned char *packed_object_data(struct pack_entry *e, char *type,
+                                  unsigned long *size, unsigned long *avail)
+{
+    unsigned long data;
+    int kind;
+
+    if (use_pack(e->p) < 0)
+        return NULL;
+    data = unpack_object_header(e->p, e->offset, &kind, size);
+    if (!data || kind == OBJ_OFS_DELTA || !pack_type_name(kind))
+        return NULL;
+    strcpy(type, pack_type_name(kind));
+    *avail = e->p->pack_size - 20 - data;
+    return e->p->pack_map + data;
+}
+
+/*
+ * Function: `packed_delta_size`
+ * Parameters:
+ *      -p: The pack containing the delta.
+ *      -offset: The offset of the deflated delta in the pack.
+ * Purpose: Inflate just the start of a delta, which holds the sizes of its
+ *          source and target, and return the size of the target, or ~0UL if
+ *          the delta is corrupt.
+ */
+static unsigned long packed_delta_size(struct packed_git *p,
+                                       unsigned long offset)
+{
+    /* Two sizes of at most 10 bytes each. */
+    unsigned char hdr[20];
+    z_stream stream;
+    int ret;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = p->pack_map + offset;
+    stream.avail_in = p->pack_size - 20 - offset;
+    stream.next_out = hdr;
+    stream.avail_out = sizeof(hdr);
+
+    inflateInit(&stream);
+    ret = inflate(&stream, Z_SYNC_FLUSH);
+    inflateEnd(&stream);
+
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+        return ~0UL;
+    return delta_result_size(hdr, sizeof(hdr) - stream.avail_out);
+}
+
+/*
+ * Function: `packed_object_info`
+ * Parameters:
+ *      -e: The location of the object in a pack.
+ *      -type: Filled in with the object type (blob, tree, or commit).
+ *      -size: Filled in with the size in bytes of the object data.
+ * Purpose: Learn the type and size of a packed object without inflating its
+ *          data. An object stored in full has both in its entry header. For
+ *          a delta, the type is that of the entry at the end of its chain of
+ *          bases, whose headers are read without unpacking anything, and the
+ *          size is at the start of the delta itself. Returns -1 if the entry
+ *          is corrupt.
+ */
+int packed_object_info(struct pack_entry *e, char *type, unsigned long *size)
+{
+    struct packed_git *p = e->p;
+    unsigned long entry = e->offset, data, base_size;
+    int kind, depth;
+
+    if (use_pack(p) < 0)
+        return -1;
+    data = unpack_object_header(p, entry, &kind, size);
+    if (!data)
+        return error("corrupt packed object");
+    if (kind == OBJ_OFS_DELTA) {
+        unsigned long delta_data = data;
+
+        if (!delta_base_offset(p, entry, &delta_data))
+            return error("corrupt packed object");
+        *size = packed_delta_size(p, delta_data);
+        if (*size == ~0UL)
+            return error("corrupt packed object");
+    }
+
+    /* Follow the chain of bases to the object that is stored in full. */
+    for (depth = 0; kind == OBJ_OFS_DELTA; depth++) {
+        if (depth > 10000 || !(entry = delta_base_offset(p, entry, &data)))
+            return error("corrupt packed object");
+        data = unpack_object_header(p, entry, &kind, &base_size);
+        if (!data)
+            return error("corrupt packed object");
+    }
+    if (!pack_type_name(kind))
+        return error("corrupt packed object");
+    strcpy(type, pack_type_name(kind));
+    return 0;
+}
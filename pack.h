@@ -0,0 +1,264 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define the on-disk layout of pack files
+ *  and pack index files, and the function signatures used to read them and
+ *  to create and apply deltas. It is included by read-cache.c, pack.c,
+ *  midx.c, bitmap.c, delta.c, pack-objects.c and list-objects.c.
+ *
+ *  A pack is a pair of files in the `.dircache/objects/pack/` directory:
+ *
+ *  pack-<hex>.pack: A header ("PACK", version, number of objects), then
+ *                   one entry per object, then the SHA1 hash of everything
+ *                   before it. Each entry is a small variable-length header
+ *                   holding the object type and inflated size, followed by
+ *                   the zlib-deflated object data (without the "<type>
+ *                   <size>\0" prefix that loose objects carry), or by a
+ *                   reference to an earlier entry and the deflated delta
+ *                   that rebuilds the object from it.
+ *
+ *  pack-<hex>.idx:  A header (magic, version), a 256-entry fanout table
+ *                   where entry `n` counts the objects whose first SHA1
+ *                   byte is <= `n`, the sorted SHA1 hashes of all objects,
+ *                   a 4-byte offset for each object (pointing into a table
+ *                   of 8-byte offsets when the high bit is set), then the
+ *                   pack's SHA1 hash and the SHA1 hash of the index itself.
+ *
+ *  pack-<hex>.bitmap: Optional. For some of the commits in the pack, a
+ *                   compressed bitmap of the objects in the pack that are
+ *                   reachable from the commit (see bitmap.c).
+ *
+ *  multi-pack-index: The objects of all packs in one sorted table, so that
+ *                   looking an object up does not have to search every
+ *                   pack index in turn (see midx.c).
+ *
+ *  Unlike the directory cache, all integers in these files are stored in
+ *  network (big-endian) byte order so that packs can be copied between
+ *  machines.
+ */
+#ifndef PACK_H
+#define PACK_H
+
+#include "cache.h"
+
+/* The signature at the start of every pack file: "PACK". */
+#define PACK_SIGNATURE 0x5041434b
+#define PACK_VERSION 2
+
+/* The signature at the start of every pack index file: "\377tOc". */
+#define PACK_IDX_SIGNATURE 0xff744f63
+#define PACK_IDX_VERSION 2
+
+/* The signature at the start of the multi-pack index: "MIDX". */
+#define MIDX_SIGNATURE 0x4d494458
+#define MIDX_VERSION 1
+
+/* The signature at the start of every bitmap file: "BITM". */
+#define BITMAP_SIGNATURE 0x4249544d
+#define BITMAP_VERSION 1
+
+/* Size in bytes of the pack header and the pack index header. */
+#define PACK_HDR_SIZE 12
+#define PACK_IDX_HDR_SIZE 8
+
+/*
+ * Object type numbers stored in pack entry headers. An OBJ_OFS_DELTA entry
+ * holds a delta (see delta.c) instead of the object data. Its header is
+ * followed by the distance back to the entry of its base object, encoded 7
+ * bits per byte with the most significant bits first, where each byte with
+ * the high bit set means another byte follows and adds one to the value
+ * before it is shifted.
+ */
+#define OBJ_COMMIT 1
+#define OBJ_TREE 2
+#define OBJ_BLOB 3
+#define OBJ_OFS_DELTA 6
+
+/*
+ * Read and write 32-bit big-endian integers without caring about the
+ * alignment of `p`.
+ */
+static inline unsigned int get_be32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put_be32(unsigned char *p, unsigned int val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+/*
+ * Template of the structure describing one pack in the object directory.
+ * The index is mapped when the pack is first found; the pack data itself is
+ * only mapped the first time an object is read from it.
+ */
+struct packed_git {
+    struct packed_git *next;     /* Next pack in the `packed_git` list. */
+    unsigned long index_size;    /* Size in bytes of the index file. */
+    unsigned long pack_size;     /* Size in bytes of the pack file. */
+    unsigned int num_objects;    /* Number of objects in the pack. */
+    unsigned char *index_map;    /* Mapped contents of the index file. */
+    unsigned char *pack_map;     /* Mapped contents of the pack file. */
+    int in_midx;                 /* Covered by the multi-pack index. */
+    char pack_name[0];           /* Path of the `.pack` file. */
+};
+
+/* The location of one object inside one pack. */
+struct pack_entry {
+    struct packed_git *p;
+    unsigned long offset;
+};
+
+/* The list of packs in the object directory. */
+extern struct packed_git *packed_git;
+
+/* Find all `.idx` files in the pack directory and add them to the list. */
+extern void prepare_packed_git(void);
+
+/* Map one pack index and return a new `packed_git` describing it. */
+extern struct packed_git *add_packed_git(const char *idx_path);
+
+/* Look up an object's position in one pack index, or -1 if absent. */
+extern int find_pack_index_pos(struct packed_git *p, unsigned char *sha1);
+
+/* Return the SHA1 hash and pack offset of the nth object in an index. */
+extern unsigned char *nth_packed_object_sha1(struct packed_git *p,
+                                             unsigned int n);
+extern unsigned long nth_packed_object_offset(struct packed_git *p,
+                                              unsigned int n);
+
+/* Look up an object in all packs. Returns 1 and fills `e` if found. */
+extern int find_pack_entry(unsigned char *sha1, struct pack_entry *e);
+
+/* Read and inflate the packed object at `e`, like read_sha1_file(). */
+extern void *unpack_entry(struct pack_entry *e, char *type,
+                          unsigned long *size);
+
+/* Locate the deflated data of a packed object that is not a delta. */
+extern unsigned char *packed_object_data(struct pack_entry *e, char *type,
+                                         unsigned long *size,
+                                         unsigned long *avail);
+
+/* Learn the type and size of a packed object without inflating its data. */
+extern int packed_object_info(struct pack_entry *e, char *type,
+                              unsigned long *size);
+
+/* Convert between object type names and pack object type numbers. */
+extern const char *pack_type_name(int type);
+extern int pack_type_from_name(const char *type);
+
+/* Return the path of the pack directory, `<object directory>/pack`. */
+extern const char *pack_directory(void);
+
+/*
+ * Read and write the multi-pack index. These are defined in midx.c.
+ */
+extern void load_multi_pack_index(void);
+extern int midx_find_entry(unsigned char *sha1, struct pack_entry *e);
+extern int write_multi_pack_index(int incremental);
+
+/*
+ * Reachability bitmaps. These are defined in bitmap.c.
+ */
+
+/* An uncompressed bitmap, one bit per object in a pack. */
+struct bitmap {
+    unsigned long long *words;
+    unsigned int nr_words;
+};
+
+/* A hash set of objects, for objects that have no bit in a bitmap. */
+struct object_set {
+    unsigned char *sha1s;        /* `alloc` slots of 20 bytes. */
+    unsigned char *used;         /* Whether each slot is taken. */
+    unsigned int nr, alloc;
+};
+
+/* The set of objects reachable from one or more commits. */
+struct reachable {
+    struct packed_git *pack;     /* The pack whose objects `bits` covers. */
+    struct bitmap *bits;         /* The objects in that pack. */
+    struct object_set extra;     /* All other objects. */
+};
+
+/* A commit that may get a bitmap while a bitmap file is being written. */
+struct bitmap_commit {
+    const unsigned char *sha1;   /* The SHA1 hash of the commit. */
+    int is_parent;               /* Named as a parent by another commit. */
+    int selected;                /* Chosen to get a bitmap. */
+    unsigned char *ewah;         /* The compressed bitmap, once built. */
+    unsigned long ewah_size;     /* Its size. */
+};
+
+/* A mapped bitmap file, or the bitmaps of one being written. */
+struct bitmap_index {
+    struct packed_git *pack;     /* The pack the bitmaps belong to. */
+    unsigned char *map;          /* Mapped contents of the file. */
+    unsigned long size;          /* Size of the file in bytes. */
+    unsigned int nr;             /* Number of bitmaps, or of `commits`. */
+    struct bitmap_commit *commits;  /* Sorted, if `map` is NULL. */
+};
+
+extern struct bitmap *bitmap_new(unsigned int nr_bits);
+extern void bitmap_set(struct bitmap *b, unsigned int pos);
+extern int bitmap_get(struct bitmap *b, unsigned int pos);
+extern void bitmap_free(struct bitmap *b);
+extern unsigned char *ewah_serialize(struct bitmap *b, unsigned int nr_bits,
+                                     unsigned long *size);
+extern int ewah_or(const unsigned char *buf, unsigned long size,
+                   struct bitmap *dst);
+extern int object_set_insert(struct object_set *set,
+                             const unsigned char *sha1);
+extern struct bitmap_index *open_bitmap_index(void);
+extern const unsigned char *lookup_bitmap(struct bitmap_index *bi,
+                                          const unsigned char *sha1,
+                                          unsigned long *size);
+extern int walk_reachable(struct reachable *r, struct bitmap_index *bi,
+                          const unsigned char *sha1);
+extern int write_bitmap_index(struct packed_git *p,
+                              unsigned char **commit_sha1s, unsigned int nr);
+
+/*
+ * Create and apply deltas between two buffers. These are defined in delta.c.
+ */
+struct delta_index;
+extern struct delta_index *create_delta_index(const void *src,
+                                              unsigned long src_size);
+extern void free_delta_index(struct delta_index *index);
+extern void *create_delta(struct delta_index *index, const void *trg,
+                          unsigned long trg_size, unsigned long *delta_size,
+                          unsigned long max_size);
+extern void *diff_delta(const void *src, unsigned long src_size,
+                        const void *trg, unsigned long trg_size,
+                        unsigned long *delta_size, unsigned long max_size);
+extern void *patch_delta(const void *src, unsigned long src_size,
+                         const void *delta, unsigned long delta_size,
+                         unsigned long *dst_size);
+extern unsigned long delta_result_size(const void *delta_buf,
+                                       unsigned long len);
+
+#endif /* PACK_H */
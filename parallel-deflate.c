@@ -0,0 +1,456 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to compress one large object on several
+ *  threads at once, the way the `pigz` program does. One deflate stream can
+ *  only use one CPU, so the input is cut into blocks of PD_BLOCK bytes and
+ *  each block is compressed by a separate deflate stream on a pool of
+ *  threads:
+ *
+ *  -Each block is compressed as raw deflate data (no zlib header). Its
+ *   stream is primed with the last 32KB of the block before it with
+ *   `deflateSetDictionary()`, so matches can reach back across the block
+ *   boundary just as in a single stream, and little compression is lost.
+ *
+ *  -Every block but the last ends with `Z_SYNC_FLUSH`, which pads the
+ *   output to a whole byte with an empty stored block, so the compressed
+ *   blocks can simply be written one after the other. The last block ends
+ *   with `Z_FINISH`, which marks the final deflate block.
+ *
+ *  -The result is wrapped in a zlib header and ends with the Adler-32
+ *   checksum of all the input. Each thread computes the checksum of its own
+ *   block, and they are joined with `adler32_combine()`.
+ *
+ *  The result is one ordinary zlib stream, which `read_sha1_file()` and
+ *  every other zlib decoder read unchanged. It is not the same bytes as
+ *  one deflate stream would produce, so it is only used where an object's
+ *  name does not depend on its compressed bytes (see compress.c).
+ *
+ *  At most PD_SLOTS_PER_THREAD blocks per thread are in memory at once:
+ *  blocks are written out in order as soon as they are done, and the input
+ *  of a block is only read once a slot is free, so the memory used does not
+ *  depend on the size of the object.
+ */
+#include "cache.h"
+#include <pthread.h>
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <pthread.h> header files, ranked in order of
+   first use in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -pthread_mutex_lock()/pthread_mutex_unlock(): Lock and unlock a mutex.
+                                                 Sourced from <pthread.h>.
+
+   -pthread_cond_wait()/pthread_cond_signal()/pthread_cond_broadcast(): Wait
+        for and announce a change. Sourced from <pthread.h>.
+
+   -deflateInit2(z_stream, level, method, window_bits, mem_level,
+                 strategy): Start a deflate stream; negative window bits ask
+        for raw deflate data. Sourced from <zlib.h>.
+
+   -deflateSetDictionary(): Prime a deflate stream with preceding data.
+
+   -deflate()/deflateEnd(): Compress data and release a deflate stream.
+
+   -adler32()/adler32_combine(): Compute and join Adler-32 checksums.
+                                 Sourced from <zlib.h>.
+
+   -compression_clock(): Return the CPU time used by the calling thread.
+                         Sourced from "cache.h" (defined in compress.c).
+
+   -pthread_create()/pthread_join(): Start and wait for a thread.
+
+   -deflateBound(): Return an upper bound on the compressed size.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -pd_block: A block of input and its compressed output.
+
+   -parallel_deflate: The state of a parallel compression.
+
+   -compress_block(): Compress one block.
+
+   -worker(): The function each thread runs.
+
+   -parallel_deflate_start(): Start the threads.
+
+   -write_block(): Wait for the oldest block and hand its output on.
+
+   -parallel_deflate_write(): Compress the next piece of an object.
+
+   -parallel_deflate_end(): Stop the threads and release everything.
+*/
+
+/* The size of a block, and of the dictionary taken from the one before. */
+#define PD_BLOCK (128 * 1024)
+#define PD_DICT  (32 * 1024)
+
+/* How many blocks each thread may have in memory at once. */
+#define PD_SLOTS_PER_THREAD 2
+
+/* The states of a block. */
+#define PD_FREE    0   /* Not in use. */
+#define PD_FILLING 1   /* Being filled with input. */
+#define PD_QUEUED  2   /* Waiting for a thread. */
+#define PD_BUSY    3   /* Being compressed. */
+#define PD_DONE    4   /* Compressed, waiting to be written out. */
+
+/* Template of a block of input and its compressed output. */
+struct pd_block {
+    int state;                     /* One of the PD_* states above. */
+    int last;                      /* Whether this is the final block. */
+    int failed;                    /* Whether compressing it failed. */
+    unsigned char *in;             /* The input, PD_BLOCK bytes. */
+    unsigned long in_len;
+    unsigned char dict[PD_DICT];   /* The end of the block before. */
+    unsigned int dict_len;
+    unsigned char *out;            /* The compressed output. */
+    unsigned long out_len, out_alloc;
+    uLong adler;                   /* The Adler-32 checksum of the input. */
+};
+
+/* Template of the state of a parallel compression. */
+struct parallel_deflate {
+    int level;
+    int nr_threads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;           /* Signalled when a block is queued. */
+    pthread_cond_t done;           /* Signalled when a block is done. */
+    int stop;                      /* Tells the threads to exit. */
+
+    struct pd_block *slots;
+    int nr_slots;
+    unsigned long next_in;         /* The number of the block being filled. */
+    int filling;                   /* Whether that block has been started. */
+    unsigned long next_out;        /* The next block to write out. */
+    unsigned long next_work;       /* The next block for a thread. */
+
+    uLong adler;                   /* The checksum of the blocks written. */
+    int header_written;
+    unsigned long long cpu;        /* CPU time of the threads that exited. */
+};
+
+/*
+ * Function: `compress_block`
+ * Parameters:
+ *      -pd: The parallel compression.
+ *      -b: The block to compress.
+ * Purpose: Compress one block as raw deflate data, primed with the end of
+ *          the previous block, and compute its checksum. Runs on a worker
+ *          thread without holding the lock.
+ */
+static void compress_block(struct parallel_deflate *pd, struct pd_block *b)
+{
+    z_stream stream;
+    int ret;
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, pd->level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        b->failed = 1;
+        return;
+    }
+    if (b->dict_len)
+        deflateSetDictionary(&stream, b->dict, b->dict_len);
+    stream.next_in = b->in;
+    stream.avail_in = b->in_len;
+    stream.next_out = b->out;
+    stream.avail_out = b->out_alloc;
+    ret = deflate(&stream, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (b->last ? ret != Z_STREAM_END : ret != Z_OK || stream.avail_in)
+        b->failed = 1;
+    b->out_len = stream.total_out;
+    deflateEnd(&stream);
+    b->adler = adler32(adler32(0L, Z_NULL, 0), b->in, b->in_len);
+}
+
+/*
+ * Function: `worker`
+ * Parameters:
+ *      -data: The parallel compression.
+ * Purpose: Take queued blocks in order and compress them, until told to
+ *          stop. The CPU time the thread used is added to `pd->cpu` when it
+ *          exits; waiting for work uses none.
+ */
+static void *worker(void *data)
+{
+    struct parallel_deflate *pd = data;
+    unsigned long long start = compression_clock();
+
+    pthread_mutex_lock(&pd->lock);
+    for (;;) {
+        struct pd_block *b = pd->slots + pd->next_work % pd->nr_slots;
+
+        if (pd->next_work < pd->next_in && b->state == PD_QUEUED) {
+            b->state = PD_BUSY;
+            pd->next_work++;
+            pthread_mutex_unlock(&pd->lock);
+            compress_block(pd, b);
+            pthread_mutex_lock(&pd->lock);
+            b->state = PD_DONE;
+            pthread_cond_broadcast(&pd->done);
+            continue;
+        }
+        if (pd->stop)
+            break;
+        pthread_cond_wait(&pd->work, &pd->lock);
+    }
+    pd->cpu += compression_clock() - start;
+    pthread_mutex_unlock(&pd->lock);
+    return NULL;
+}
+
+/*
+ * Function: `parallel_deflate_start`
+ * Parameters:
+ *      -level: The zlib compression level.
+ *      -nr_threads: How many threads to compress with.
+ * Purpose: Allocate the blocks and start the threads. Returns NULL if that
+ *          fails, in which case the caller compresses on its own.
+ */
+struct parallel_deflate *parallel_deflate_start(int level, int nr_threads)
+{
+    struct parallel_deflate *pd = calloc(1, sizeof(*pd));
+    z_stream stream;
+    int i;
+
+    if (!pd)
+        return NULL;
+    pd->level = level;
+    pd->nr_slots = nr_threads * PD_SLOTS_PER_THREAD;
+    pd->slots = calloc(pd->nr_slots, sizeof(*pd->slots));
+    pd->threads = calloc(nr_threads, sizeof(*pd->threads));
+    if (!pd->slots || !pd->threads)
+        goto fail;
+
+    /* Room for the worst case of one block, plus the flush marker. */
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    for (i = 0; i < pd->nr_slots; i++) {
+        struct pd_block *b = pd->slots + i;
+        b->out_alloc = deflateBound(&stream, PD_BLOCK) + 16;
+        b->in = malloc(PD_BLOCK);
+        b->out = malloc(b->out_alloc);
+        if (!b->in || !b->out) {
+            deflateEnd(&stream);
+            goto fail;
+        }
+    }
+    deflateEnd(&stream);
+
+    pthread_mutex_init(&pd->lock, NULL);
+    pthread_cond_init(&pd->work, NULL);
+    pthread_cond_init(&pd->done, NULL);
+    pd->adler = adler32(0L, Z_NULL, 0);
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(pd->threads + i, NULL, worker, pd))
+            break;
+        pd->nr_threads++;
+    }
+    if (!pd->nr_threads) {
+        parallel_deflate_end(pd);
+        return NULL;
+    }
+    return pd;
+
+fail:
+    for (i = 0; pd->slots && i < pd->nr_slots; i++) {
+        free(pd->slots[i].in);
+        free(pd->slots[i].out);
+    }
+    free(pd->slots);
+    free(pd->threads);
+    free(pd);
+    return NULL;
+}
+
+/*
+ * Function: `write_block`
+ * Parameters:
+ *      -pd, out, data: As for `parallel_deflate_write()`.
+ * Purpose: Wait until the oldest block that has not been written out yet
+ *          is compressed, hand its output to `out` and free its slot. The
+ *          zlib header goes out before the first block, and the checksum
+ *          after the last.
+ */
+static int write_block(struct parallel_deflate *pd,
+                       int (*out)(const void *buf, unsigned long len,
+                                  void *data),
+                       void *data)
+{
+    struct pd_block *b = pd->slots + pd->next_out % pd->nr_slots;
+    unsigned char trailer[4];
+    int ret = 0;
+
+    pthread_mutex_lock(&pd->lock);
+    while (b->state != PD_DONE)
+        pthread_cond_wait(&pd->done, &pd->lock);
+    pthread_mutex_unlock(&pd->lock);
+
+    if (!pd->header_written) {
+        /*
+         * The zlib header: deflate with a 32KB window, then the level
+         * class, with check bits making the pair a multiple of 31.
+         */
+        unsigned char hdr[2];
+        int flevel = pd->level < 0 ? 2 : pd->level < 2 ? 0 :
+                     pd->level < 6 ? 1 : pd->level == 6 ? 2 : 3;
+
+        hdr[0] = 0x78;
+        hdr[1] = flevel << 6;
+        hdr[1] += 31 - (hdr[0] * 256 + hdr[1]) % 31;
+        if (out(hdr, 2, data) < 0)
+            return -1;
+        pd->header_written = 1;
+    }
+    if (b->failed || out(b->out, b->out_len, data) < 0)
+        ret = -1;
+    pd->adler = adler32_combine(pd->adler, b->adler, b->in_len);
+    if (!ret && b->last) {
+        trailer[0] = pd->adler >> 24;
+        trailer[1] = pd->adler >> 16;
+        trailer[2] = pd->adler >> 8;
+        trailer[3] = pd->adler;
+        if (out(trailer, 4, data) < 0)
+            ret = -1;
+    }
+
+    pthread_mutex_lock(&pd->lock);
+    b->state = PD_FREE;
+    pd->next_out++;
+    pthread_mutex_unlock(&pd->lock);
+    return ret;
+}
+
+/*
+ * Function: `parallel_deflate_write`
+ * Parameters:
+ *      -pd: The parallel compression.
+ *      -in, len: The next piece of the object.
+ *      -finish: Whether this is the last piece.
+ *      -out: Called with each piece of compressed output, in order.
+ *      -data: Passed on to `out`.
+ * Purpose: Copy input into blocks, queue each full block for the threads,
+ *          and write out blocks that are done. With `finish`, queue the
+ *          last block and wait until everything has been written out.
+ */
+int parallel_deflate_write(struct parallel_deflate *pd, const void *in,
+                           unsigned long len, int finish,
+                           int (*out)(const void *buf, unsigned long len,
+                                      void *data),
+                           void *data)
+{
+    const unsigned char *p = in;
+
+    while (len || finish) {
+        struct pd_block *b = pd->slots + pd->next_in % pd->nr_slots;
+        unsigned long n;
+
+        /*
+         * Start a new block once the slot it needs has been written out,
+         * which bounds how much input is held in memory.
+         */
+        if (!pd->filling) {
+            struct pd_block *prev = pd->slots +
+                (pd->next_in + pd->nr_slots - 1) % pd->nr_slots;
+
+            while (pd->next_out + pd->nr_slots <= pd->next_in)
+                if (write_block(pd, out, data) < 0)
+                    return -1;
+            b->in_len = 0;
+            b->last = 0;
+            b->failed = 0;
+            b->dict_len = 0;
+            if (pd->next_in) {
+                /* The previous block's input is intact until it is done. */
+                b->dict_len = prev->in_len < PD_DICT ? prev->in_len : PD_DICT;
+                memcpy(b->dict, prev->in + prev->in_len - b->dict_len,
+                       b->dict_len);
+            }
+            b->state = PD_FILLING;
+            pd->filling = 1;
+        }
+
+        n = PD_BLOCK - b->in_len;
+        if (n > len)
+            n = len;
+        memcpy(b->in + b->in_len, p, n);
+        b->in_len += n;
+        p += n;
+        len -= n;
+
+        if (b->in_len == PD_BLOCK || (finish && !len)) {
+            b->last = finish && !len;
+            pd->filling = 0;
+            pthread_mutex_lock(&pd->lock);
+            b->state = PD_QUEUED;
+            pd->next_in++;
+            pthread_cond_signal(&pd->work);
+            pthread_mutex_unlock(&pd->lock);
+            if (b->last)
+                break;
+        }
+    }
+
+    /* Write out everything still being compressed. */
+    while (finish && pd->next_out < pd->next_in)
+        if (write_block(pd, out, data) < 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * Function: `parallel_deflate_end`
+ * Parameters:
+ *      -pd: The parallel compression.
+ * Purpose: Stop the threads and release the blocks. Returns the CPU time
+ *          the threads used, in nanoseconds, for the compression report
+ *          (see compress.c).
+ */
+unsigned long long parallel_deflate_end(struct parallel_deflate *pd)
+{
+    unsigned long long cpu;
+    int i;
+
+    pthread_mutex_lock(&pd->lock);
+    pd->stop = 1;
+    pthread_cond_broadcast(&pd->work);
+    pthread_mutex_unlock(&pd->lock);
+    for (i = 0; i < pd->nr_threads; i++)
+        pthread_join(pd->threads[i], NULL);
+    for (i = 0; i < pd->nr_slots; i++) {
+        free(pd->slots[i].in);
+        free(pd->slots[i].out);
+    }
+    pthread_mutex_destroy(&pd->lock);
+    pthread_cond_destroy(&pd->work);
+    pthread_cond_destroy(&pd->done);
+    cpu = pd->cpu;
+    free(pd->slots);
+    free(pd->threads);
+    free(pd);
+    return cpu;
+}
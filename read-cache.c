@@ -27,7 +27,8 @@
  *  the object store and index and validating existing cache_entries.
  */
 #include "cache.h"
-/* The above 'include' allows use of the following functions and
+#include "pack.h"
+/* The above 'include's allow use of the following functions and
    variables from "cache.h" header file, ranked in order of first use
    in this file. Most are functions/macros from standard C libraries
    that are `#included` in "cache.h". Function names are followed by
@@ -70,9 +71,6 @@
                  calling process and should not change the underlying object.
                  Sourced from <sys/mman.h>.
 
-   -SHA_CTX: SHA context structure used to store information related to the
-             process of hashing the content. Sourced from <openssl/sha.h>.
-
    -close(fd): Deallocate the file descriptor `fd`. The file descriptor `fd` 
                will be made available to subsequent calls to open() or other 
                function calls that allocate `fd`. Remove all locks owned by 
@@ -95,10 +93,21 @@
    -inflateInit(z_stream): Initializes the internal `z_stream` state for
                            decompression. Sourced from <zlib.h>.
 
-   -Z_BEST_COMPRESSION: Translates to compression level 9, which, as an input 
-                        to `deflateInit()`, indicates optimizing compression
-                        size as opposed to compression speed. Sourced from
-                        <zlib.h>.
+   -compression_level(): Choose the compression level for an object. Sourced
+                         from "cache.h" (defined in compress.c).
+
+   -compression_clock(): Return the CPU time used by the calling thread.
+                         Sourced from "cache.h" (defined in compress.c).
+
+   -compression_done(): Record the outcome of compressing an object for the
+                        compression report. Sourced from "cache.h" (defined
+                        in compress.c).
+
+   -codec_decodes()/codec_unpack(): Decompress an object that was written
+        with another codec. Sourced from "cache.h" (defined in codec.c).
+
+   -object_codec()/codec_compress(): Compress an object with the configured
+        codec. Sourced from "cache.h" (defined in codec.c).
 
    -deflate(z_stream, flush): Compresses as much data as possible and stops
                               when the input buffer becomes empty or the
@@ -119,17 +128,36 @@
    -deflateEnd(z_stream): All dynamically allocated data structures for
                           `z_stream` are freed. Sourced from <zlib.h>.
 
-   -SHA1_Init(): Initializes a SHA_CTX structure. Sourced from 
-                 <openssl/sha.h>. 
+   -strnlen(s, maxlen): Return the length of a string, looking at no more
+                        than `maxlen` characters. Sourced from <string.h>.
+
+   -hex_decode()/hex_encode()/sha1_to_hex_r(): Convert between bytes and
+        hexadecimal. Sourced from "cache.h" (defined in hex.c).
+
+   -find_pack_entry(sha1, e): Search the pack indexes for an object. Sourced
+                              from "pack.h" (defined in pack.c).
+
+   -unpack_entry(e, type, size): Read and inflate a packed object. Sourced
+                                 from "pack.h" (defined in pack.c).
 
-   -SHA1_Update(SHA_CTX *c, const void *data, size_t len): 
-        Can be called repeatedly to calculate the hash value of chunks of data 
-        (len bytes from data). Sourced from <openssl/sha.h>.
+   -object_filter_contains()/object_filter_add(): Check for and add an
+        object in the filter of loose objects. Sourced from "cache.h"
+        (defined in object-filter.c).
 
-   -SHA1_Final(unsigned char *md, SHA_CTX *c): 
-        Places the message digest in md, which must have space for 20 bytes of 
-        output, and erases the `c` SHA_CTX structure. Sourced from 
-        <openssl/sha.h>.
+   -munmap(addr, len): Remove a mapping made with mmap(). Sourced from
+                       <sys/mman.h>.
+
+   -lookup_object_cache()/add_object_cache(): Find an object in, and add an
+        object to, the cache of recently read objects. Sourced from "cache.h"
+        (defined in object-cache.c).
+
+   -lookup_shared_cache()/add_shared_cache(): The same for the cache shared
+        by all processes using the object store. Sourced from "cache.h"
+        (defined in shared-cache.c).
+
+   -repository_format_version(): Return how objects are named in this
+                                 repository. Sourced from "cache.h" (defined
+                                 in config.c).
 
    -stat: Structure pointer used by stat() function to store information
           related to a filesystem file. Sourced from <sys/stat.h>.
@@ -187,6 +215,37 @@
                                   input format `format`. Sourced from 
                                   <stdio.h>.
 
+   -getc(stream): Read the next character from `stream`. Sourced from
+                  <stdio.h>.
+
+   -verify_index_checksum(): Check the checksum of the index, as
+                             `index.verify` says. Sourced from "cache.h"
+                             (defined in index-checksum.c).
+
+   -cache_tree_read()/cache_tree_write(): Read and build the cache tree
+        extension. Sourced from "cache.h" (defined in cache-tree.c).
+
+   -read_link_extension()/merge_shared_index(): Read the split index
+        extension, and merge the entries of the shared index in. Sourced
+        from "cache.h" (defined in split-index.c).
+
+   -finish_index_checksum(): Wait for the checksum of the index that was
+                             read to be checked in the background.
+
+   -split_cache(): Leave only the entries that differ from the shared
+                   index, if the index is split.
+
+   -index_checksum_kind(): The kind of checksum to write the index with.
+
+   -index_checksum_init()/index_checksum_update()/index_checksum_final():
+        Compute the checksum of the index.
+
+   -write(fd, buf, n): Write `n` bytes from buffer `buf` to the file
+                       associated with `fd`. Sourced from <unistd.h>.
+
+   -realloc(ptr, size): Resize an allocated block of memory. Sourced from
+                        <stdlib.h>.
+
    ****************************************************************
 
    The following variables are external variables defined in this source file:
@@ -208,8 +267,6 @@
 
    -usage(): Print an error message and exit.
 
-   -hexval(): Convert a hexadecimal symbol to its decimal equivalent.
-
    -get_sha1_hex(): Convert a 40-character hexadecimal representation of an 
                     SHA1 hash value to the equivalent 20-byte representation.
 
@@ -219,13 +276,32 @@
    -sha1_file_name(): Build the path of an object in the object database
                       using the object's SHA1 hash value.
 
-   -read_sha1_file(): Locate an object in the object database, read and 
-                      inflate it, then return the inflated object data 
-                      (without the prepended metadata).
+   -get_object_directory(): Return the path to the object store.
+
+   -map_fd(): Map the contents of an open file into memory.
+
+   -for_each_loose_object(): Call a function for every loose object in the
+                             256 subdirectories of the object store.
 
-   -write_sha1_file(): Deflate an object, calculate the hash value, then call
-                       the write_sha1_buffer function to write the deflated
-                       object to the object database.
+   -read_object(): Locate an object in the object database, read and 
+                   inflate it, then return the inflated object data 
+                   (without the prepended metadata). Packs are searched
+                   before the loose object files.
+
+   -read_sha1_file(): Return the inflated data of an object, from the object
+                      caches if it was read recently.
+
+   -has_sha1_file(): Check whether an object exists in a pack or as a loose
+                     object file.
+
+   -write_object_file(): Deflate an object, calculate the hash value, then
+                         call the write_sha1_buffer function to write the
+                         deflated object to the object database. Objects
+                         that already exist are not deflated again in
+                         repositories that name objects by their
+                         uncompressed contents.
+
+   -write_sha1_file(): Write an object and display its name.
 
    -write_sha1_buffer(): Write an object to the object database, using the
                          object's SHA1 hash value as index.
@@ -234,8 +310,23 @@
 
    -verify_hdr(): Validate a cache header.
 
+   -convert_v1_entry(): Convert a cache entry from a version 1 index.
+
    -read_cache(): Reads the cache entries in the `.dircache/index` file into 
                   the `active_cache` array.
+
+   -cache_name_compare(): Compares the names of two cache entries
+                          lexicographically.
+
+   -cache_name_pos(): Determines the lexicographic position of a cache entry 
+                      in the active_cache array.
+
+   -read_path(): Read the next path of a list of paths given on standard
+                 input.
+
+   -write_cache(): Constructs the cache header, calculates the checksum of
+                   the cache, and then writes them with the extensions to
+                   the `.dircache/index.lock` file.
 */
 
 /* Used to store the path to the object store. */
@@ -263,32 +354,6 @@ void usage(const char *err)
     exit(1);
 }
 
-/* Function: `hexval`
- * Parameters:
- *      -c: Hexadecimal character to convert to decimal.
- * Purpose: Convert a hexadecimal symbol to its decimal equivalent.
- */
-static unsigned hexval(char c)
-{
-    /* If the character is 0-9, return it converted to an integer 0-9. */
-    if (c >= '0' && c <= '9')
-        return c - '0';
-
-    /* If the character is a-f, return it converted to an integer 10-15. */
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-
-    /* If the character is A-F, return it converted to an integer 10-15. */
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-
-    /*
-     * If `c` is not a valid hexadecimal symbol, return the one's complement 
-     * of 0. 
-     */
-    return ~0;
-}
-
 /*
  * Function: `get_sha1_hex`
  * Parameters:
@@ -297,29 +362,25 @@ static unsigned hexval(char c)
  *      -sha1: Array for storing the 20-byte representation of the SHA1 hash
  *             value.
  * Purpose: Convert a 40-character hexadecimal representation of an SHA1 hash 
- *          value to the equivalent 20-byte representation.
+ *          value to the equivalent 20-byte representation. Each two-digit
+ *          hexadecimal number (ranging from 00 to ff) becomes one byte
+ *          (ranging from 0 to 255). Returns -1 if a character is not a
+ *          hexadecimal digit, or if the string ends before the last one.
+ *          The conversion itself is done by `hex_decode()` (see hex.c),
+ *          which reads all of the characters at once, so a short string
+ *          (such as a command-line argument) is checked for first.
+ *
+ *          In a repository whose objects are named with another hash
+ *          algorithm (see hash.c), object names are `object_hash()->hexsz`
+ *          characters and `object_hash()->rawsz` bytes long instead.
  */
 int get_sha1_hex(char *hex, unsigned char *sha1)
 {
-    int i;
-    /*
-     * Convert each two-digit hexadecimal number (ranging from 00 to ff) to a 
-     * decimal number (ranging from 0 to 255). 
-     */
-    for (i = 0; i < 20; i++) {
-        /*
-         * The decimal equivalent of the first hexadecimal digit will form 
-         * the 4 high bits of val; that of the second hex digit will form the 
-         * 4 low bits.
-         */
-        unsigned int val = (hexval(hex[0]) << 4) | hexval(hex[1]);
-        /* Return -1 if val is larger than 255. */
-        if (val & ~0xff)
-            return -1;
-        *sha1++ = val;   /* Store val in sha1 array. */
-        hex += 2;        /* Get next two-digit hexadecimal number. */
-    }
-    return 0;
+    const struct hash_algo *algo = object_hash();
+
+    if (strnlen(hex, algo->hexsz) != algo->hexsz)
+        return -1;
+    return hex_decode(sha1, hex, algo->rawsz);
 }
 
 /*
@@ -327,31 +388,111 @@ int get_sha1_hex(char *hex, unsigned char *sha1)
  * Parameters:
  *      -sha1: Array containing 20-byte representation of an SHA1 hash value.
  * Purpose: Convert a 20-byte representation of an SHA1 hash value to the
- *          equivalent 40-character hexadecimal representation.
+ *          equivalent 40-character hexadecimal representation. The result is
+ *          in a static buffer, which the next call overwrites; use
+ *          `sha1_to_hex_r()` (see hex.c) to convert into a buffer of your
+ *          own.
  */
 char *sha1_to_hex(unsigned char *sha1)
 {
-    /* String for storing the 40-character hexadecimal representation. */
-    static char buffer[50];
-    /*
-     * Lookup array for getting the hexadecimal representation of a number
-     * from 0 to 15. 
-     */
-    static const char hex[] = "0123456789abcdef";
-    /* Pointer used for filling up the buffer string. */
-    char *buf = buffer;
-    int i;
+    /* String for storing the hexadecimal representation. */
+    static char buffer[MAX_HEXSZ + 1];
 
-    /*
-     * Get the two-digit hexadecimal representation (ranging from 00 to ff) of
-     * a number (ranging from 0 to 255).
-     */
-    for (i = 0; i < 20; i++) {
-        unsigned int val = *sha1++;   /* Get the current number. */
-        *buf++ = hex[val >> 4];       /* Convert the 4 high bits to hex. */
-        *buf++ = hex[val & 0xf];      /* Convert the 4 low bits to hex. */
+    return sha1_to_hex_r(buffer, sha1);
+}
+
+/*
+ * Function: `get_object_directory`
+ * Parameters: none
+ * Purpose: Return the path to the object store, which is taken from the
+ *          `DB_ENVIRONMENT` environment variable if it is set and defaults to
+ *          `.dircache/objects` otherwise.
+ */
+const char *get_object_directory(void)
+{
+    static const char *dir;
+
+    if (!dir)
+        dir = getenv(DB_ENVIRONMENT) ? : DEFAULT_DB_ENVIRONMENT;
+    return dir;
+}
+
+/*
+ * Function: `map_fd`
+ * Parameters:
+ *      -fd: File descriptor of an open file.
+ *      -size: The number of bytes of the file to map.
+ * Purpose: Map the contents of an open file read-only into memory and return
+ *          a pointer to it, or NULL if the mapping failed. The file descriptor
+ *          can be closed as soon as this returns.
+ */
+void *map_fd(int fd, unsigned long size)
+{
+    void *map;
+
+    #ifndef BGIT_WINDOWS
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    #else
+    void *fhandle = CreateFileMapping( (HANDLE) _get_osfhandle(fd), NULL,
+                                       PAGE_READONLY, 0, 0, NULL );
+    if (!fhandle)
+        return NULL;
+    map = MapViewOfFile( fhandle, FILE_MAP_READ, 0, 0, size );
+    CloseHandle( fhandle );
+    #endif
+    return map;
+}
+
+/*
+ * Function: `for_each_loose_object`
+ * Parameters:
+ *      -fn: Function to call for each loose object. It is given the object's
+ *           SHA1 hash, the path of the object file and `data`. A nonzero
+ *           return value stops the scan.
+ *      -data: Passed through to `fn`.
+ * Purpose: Walk the 256 subdirectories `00` to `ff` that `init-db` created in
+ *          the object store and call `fn` for every object file found there.
+ *          Returns the last nonzero value returned by `fn`, or 0.
+ */
+int for_each_loose_object(int (*fn)(unsigned char *sha1, const char *path,
+                                    void *data), void *data)
+{
+    const char *dir = get_object_directory();
+    int len = strlen(dir);
+    /* Object directory, slash, 2 hex digits, slash, the other hex digits. */
+    char *path = malloc(len + MAX_HEXSZ + 4);
+    /* The hex digits of the object's hash. */
+    char hex[MAX_HEXSZ + 1];
+    unsigned char sha1[MAX_RAWSZ];
+    int hexsz = object_hash()->hexsz;
+    int i, ret = 0;
+
+    memcpy(path, dir, len);
+    for (i = 0; i < 256 && !ret; i++) {
+        struct dirent *de;
+        DIR *d;
+
+        sprintf(path + len, "/%02x", i);
+        d = opendir(path);
+        if (!d)
+            continue;
+        while (!ret && (de = readdir(d)) != NULL) {
+            /* Skip `.`, `..` and anything else that is not an object. */
+            if (strlen(de->d_name) != hexsz - 2)
+                continue;
+            memcpy(hex, path + len + 1, 2);
+            memcpy(hex + 2, de->d_name, hexsz - 2);
+            if (get_sha1_hex(hex, sha1) < 0)
+                continue;
+            sprintf(path + len + 3, "/%s", de->d_name);
+            ret = fn(sha1, path, data);
+        }
+        closedir(d);
     }
-    return buffer;   /* Return the hexadecimal representation. */
+    free(path);
+    return ret;
 }
 
 /*
@@ -370,7 +511,6 @@ char *sha1_to_hex(unsigned char *sha1)
  */
 char *sha1_file_name(unsigned char *sha1)
 {
-    int i;
     /* `base` is a character array for storing the path to an object in the
      * object database. `name` is a pointer to the byte in `base` that is
      * after the object database path plus `/`.
@@ -380,16 +520,15 @@ char *sha1_file_name(unsigned char *sha1)
     /* If base has not been set. */
     if (!base) {
         /* Get the path to the object database. */
-        char *sha1_file_directory 
-                 = getenv(DB_ENVIRONMENT) ? : DEFAULT_DB_ENVIRONMENT;
+        const char *sha1_file_directory = get_object_directory();
         /* The length of the path. */
         int len = strlen(sha1_file_directory);
         /* Allocate space for the base string. */
-        base = malloc(len + 60);
+        base = malloc(len + MAX_HEXSZ + 4);
         /* Copy the object database path to the base string. */
         memcpy(base, sha1_file_directory, len);
         /* Initialize the rest of the base string to contain null bytes. */
-        memset(base+len, 0, 60);
+        memset(base+len, 0, MAX_HEXSZ + 4);
         /* Write a slash after the sha1_file_directory path. */
         base[len] = '/';
         /*
@@ -406,31 +545,17 @@ char *sha1_file_name(unsigned char *sha1)
      *
      * Convert each number in the sha1 array (ranging from 0 to 255) to a 
      * two-digit hexadecimal number (ranging from 00 to ff). The first 
-     * two-digit hexadecimal number will form part of the object directory. 
-     * The rest of the two-digit hexadecimal numbers will comprise the object 
-     * filename. 
+     * two-digit hexadecimal number will form part of the object directory
+     * at `name`. The rest of the two-digit hexadecimal numbers will comprise
+     * the object filename, after the slash at `name + 2`.
      */
-    for (i = 0; i < 20; i++) {
-        /*
-         * Lookup array for getting the hexadecimal representation of a 
-         * number from 0 to 15. 
-         */
-        static char hex[] = "0123456789abcdef";
-        /* Get the current number from sha1. */
-        unsigned int val = sha1[i];
-        /*
-         * Set the index of the base array. This will be name + 0, name + 3,
-         * name + 5, name + 7,..., name + 39.
-         */
-        char *pos = name + i*2 + (i > 0);
-        *pos++ = hex[val >> 4];   /* Convert the 4 high bits to hex. */
-        *pos = hex[val & 0xf];    /* Convert the 4 low bits to hex. */
-    }
+    hex_encode(name, sha1, 1);
+    hex_encode(name + 3, sha1 + 1, object_hash()->rawsz - 1);
     return base;   /* Return the path to the object. */
 }
 
 /*
- * Function: `read_sha1_file`
+ * Function: `read_object`
  * Parameters:
  *      -sha1: SHA1 hash value of an object.
  *      -type: The type of object that was read (blob, tree, or commit).
@@ -438,7 +563,7 @@ char *sha1_file_name(unsigned char *sha1)
  * Purpose: Locate an object in the object database, read and inflate it, then 
  *          return the inflated object data (without the prepended metadata).
  */
-void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
+static void *read_object(unsigned char *sha1, char *type, unsigned long *size)
 {
     z_stream stream;     /* Declare a zlib z_stream structure. */
     char buffer[8192];   /* Buffer for zlib inflated output. */
@@ -457,7 +582,22 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
      * Build the path of an object in the object database using the object's 
      * SHA1 hash value.
      */
-    char *filename = sha1_file_name(sha1); 
+    char *filename;
+    /* The location of the object if it is stored in a pack. */
+    struct pack_entry e;
+
+    /*
+     * Look for the object in the packs first. Searching an already mapped
+     * pack index is much cheaper than opening a file per object.
+     */
+    if (find_pack_entry(sha1, &e))
+        return unpack_entry(&e, type, size);
+
+    /*
+     * Fall back to the loose object. Build its path in the object database
+     * using the object's SHA1 hash value.
+     */
+    filename = sha1_file_name(sha1);
 
     /*
      * Open the object in the object store and associate `fd` with it. If the 
@@ -499,6 +639,21 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
     #endif
     close(fd);   /* Release the file descriptor. */
 
+    /*
+     * Objects written with another codec, and every object when a faster
+     * zlib decoder is built in, are decompressed by the codec layer (see
+     * codec.c). The code below reads zlib objects with zlib itself.
+     */
+    if (codec_decodes(map, st.st_size)) {
+        buf = codec_unpack(map, st.st_size, type, size);
+        #ifndef BGIT_WINDOWS
+        munmap(map, st.st_size);
+        #else
+        UnmapViewOfFile( map );
+        #endif
+        return buf;
+    }
+
     /* Initialize the zlib stream to contain null characters. */
     memset(&stream, 0, sizeof(stream));
     /* Set map as location of the next input to the inflation stream. */
@@ -520,8 +675,11 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
      * store them in variables type and size, respectively.  Return NULL if 
      * the two conversions were not successful.
      */
-    if (sscanf(buffer, "%10s %lu", type, size) != 2)
-        return NULL;
+    if (sscanf(buffer, "%10s %lu", type, size) != 2) {
+        inflateEnd(&stream);
+        buf = NULL;
+        goto unmap;
+    }
 
     /*
      * The size of the buffer up to the first null character, i.e., the size
@@ -531,8 +689,10 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
     /* Allocate space to `buf` that's equal to the object data size. */
     buf = malloc(*size); 
     /* Error if space could not be allocated. */
-    if (!buf)
-        return NULL;
+    if (!buf) {
+        inflateEnd(&stream);
+        goto unmap;
+    }
 
     /*
      * Copy the inflated object data from buffer to buf, i.e, without the 
@@ -550,73 +710,153 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
     }
     /* Free memory structures that were used for the inflation. */
     inflateEnd(&stream);
+
+unmap:
+    /* The compressed object is not needed any more. */
+    #ifndef BGIT_WINDOWS
+    munmap(map, st.st_size);
+    #else
+    UnmapViewOfFile( map );
+    #endif
     return buf;   /* Return the inflated object data. */
 }
 
 /*
- * Function: `write_sha1_file`
+ * Function: `read_sha1_file`
+ * Parameters:
+ *      -sha1: SHA1 hash value of an object.
+ *      -type: The type of object that was read (blob, tree, or commit).
+ *      -size: The size in bytes of the object data.
+ * Purpose: Return the inflated data of an object, which the caller must
+ *          free. Objects read recently are copied from the object cache (see
+ *          object-cache.c). Next comes the cache shared with other processes,
+ *          if it is turned on (see shared-cache.c). Only then is the object
+ *          read with `read_object()`, and added to both caches.
+ */
+void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
+{
+    void *buf = lookup_object_cache(sha1, type, size);
+
+    if (buf)
+        return buf;
+    buf = lookup_shared_cache(sha1, type, size);
+    if (!buf) {
+        buf = read_object(sha1, type, size);
+        if (!buf)
+            return NULL;
+        add_shared_cache(sha1, type, buf, *size);
+    }
+    add_object_cache(sha1, type, buf, *size);
+    return buf;
+}
+
+/*
+ * Function: `has_sha1_file`
+ * Parameters:
+ *      -sha1: SHA1 hash value of an object.
+ * Purpose: Check whether an object exists in the object database, either in
+ *          a pack or as a loose object file that the process can read.
+ *          Returns 1 if it does, 0 otherwise. When the filter of loose
+ *          objects (see object-filter.c) says that the object is not one of
+ *          them, the object file is not looked for at all.
+ */
+int has_sha1_file(unsigned char *sha1)
+{
+    struct pack_entry e;
+
+    if (find_pack_entry(sha1, &e))
+        return 1;
+    if (!object_filter_contains(sha1))
+        return 0;
+    return !access(sha1_file_name(sha1), R_OK);
+}
+
+/*
+ * Function: `write_object_file`
  * Parameters:
  *      -buf: The content to be deflated and written to the object store.
  *      -len: The length in bytes of the content pre-compression.
+ *      -sha1: Set to the name of the object.
  * Purpose: Deflate an object, calculate the hash value, then call the
  *          write_sha1_buffer function to write the deflated object to the 
  *          object database.
+ *
+ *          In a repository that names objects by their uncompressed
+ *          contents, the hash is calculated first, and an object that
+ *          already exists is not deflated at all.
  */
-int write_sha1_file(char *buf, unsigned len)
+int write_object_file(char *buf, unsigned len, unsigned char *sha1)
 {
-    int size;                 /* Total size of compressed output. */
+    unsigned long size;       /* Total size of compressed output. */
     char *compressed;         /* Used to store compressed output. */
-    z_stream stream;          /* Declare zlib z_stream structure. */
-    unsigned char sha1[20];   /* Array to store SHA1 hash. */
-    SHA_CTX c;                /* Declare an SHA context structure. */
-
-    /* Initialize the zlib stream to contain null characters. */
-    memset(&stream, 0, sizeof(stream));
+    /* The repository's hash algorithm (see hash.c), and its state. */
+    const struct hash_algo *algo = object_hash();
+    struct hash_ctx c;
+    int content_ids = repository_format_version() ==
+                      REPOSITORY_FORMAT_CONTENT_IDS;
+    int hdrlen, level, policy;   /* Header length and compression choice. */
+    char type[20];               /* The object type from the header. */
+    unsigned long long start;    /* CPU time before compressing. */
+
+    /* `buf` already starts with the "<type> <size>\0" header. */
+    if (content_ids) {
+        algo->init(&c);
+        algo->update(&c, buf, len);
+        algo->final(sha1, &c);
+        if (has_sha1_file(sha1))
+            return 0;
+    }
 
     /*
-     * Initialize compression stream for optimized compression 
-     * (as opposed to speed). 
+     * Choose the compression level from the object's type and data (see
+     * compress.c), which follow the "<type> <size>\0" header.
      */
-    deflateInit(&stream, Z_BEST_COMPRESSION);
-    /* Determine upper bound on compressed size. */
-    size = deflateBound(&stream, len); 
-    /* Allocate `size` bytes of space to store the next compressed output. */
-    compressed = malloc(size); 
-
-    /* Specify buf as location of the next input to the compression stream. */
-    stream.next_in = buf; 
-    /* Number of bytes available as input for next compression. */
-    stream.avail_in = len; 
-    /* Specify compressed as location to write the next compressed output. */
-    stream.next_out = compressed; 
-    /* Number of bytes available for storing the next compressed output. */
-    stream.avail_out = size; 
-
-    /* Compress the content of buf, i.e., compress the object. */
-    while (deflate(&stream, Z_FINISH) == Z_OK) 
-    /* Linus Torvalds: nothing */;
+    hdrlen = strlen(buf) + 1;
+    if (sscanf(buf, "%19[^ ]", type) != 1)
+        strcpy(type, "other");
+    level = compression_level(type, buf + hdrlen, len - hdrlen, &policy);
+    start = compression_clock();
 
     /*
-     * Free memory structures that were dynamically allocated for the
-     * compression. 
+     * Compress the object, header included, with the configured codec (see
+     * codec.c). With zlib, the default, the output is exactly what it
+     * always was, so objects keep their names in the original format.
      */
-    deflateEnd(&stream); 
-    /* Get size of total compressed output. */
-    size = stream.total_out; 
-
-    /* Initialize the SHA context structure. */
-    SHA1_Init(&c); 
-    /* Calculate hash of the compressed output. */
-    SHA1_Update(&c, compressed, size); 
-    /* Store the SHA1 hash of the compressed output in `sha1`. */
-    SHA1_Final(sha1, &c); 
+    compressed = codec_compress(object_codec(), level, NULL, 0, buf, len,
+                                &size);
+    if (!compressed)
+        return error("unable to compress object");
+    compression_done(policy, level, len, size, start, 0);
+
+    /* In the original format, the hash is that of the compressed output. */
+    if (!content_ids) {
+        /* Initialize the hash context structure. */
+        algo->init(&c); 
+        /* Calculate hash of the compressed output. */
+        algo->update(&c, compressed, size); 
+        /* Store the hash of the compressed output in `sha1`. */
+        algo->final(sha1, &c); 
+    }
 
     /* Write the compressed object to the object store. */
-    if (write_sha1_buffer(sha1, compressed, size) < 0)
+    return write_sha1_buffer(sha1, compressed, size);
+}
+
+/*
+ * Function: `write_sha1_file`
+ * Parameters:
+ *      -buf: The object, starting with its "<type> <size>\0" header.
+ *      -len: The length of the object.
+ * Purpose: Write an object with `write_object_file()` and display its name.
+ */
+int write_sha1_file(char *buf, unsigned len)
+{
+    unsigned char sha1[MAX_RAWSZ];
+
+    if (write_object_file(buf, len, sha1) < 0)
         return -1;
     /*
-     * Display the 40-character hexadecimal representation of the object's 
-     * SHA1 hash value.
+     * Display the hexadecimal representation of the object's hash value.
      */
     printf("%s\n", sha1_to_hex(sha1));
     return 0;
@@ -645,12 +885,22 @@ int write_sha1_buffer(unsigned char *sha1, void *buf, unsigned int size)
     /* Open a new file in the object store and associate it with `fd`. */
     fd = OPEN_FILE(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
 
-    /* Error if failure occurs when opening the file. */
-    if (fd < 0)
-        return (errno == EEXIST) ? 0 : -1;
+    /*
+     * Error if failure occurs when opening the file. If the object is
+     * already there, there is nothing to write, but make sure the filter
+     * of loose objects knows about it.
+     */
+    if (fd < 0) {
+        if (errno != EEXIST)
+            return -1;
+        object_filter_add(sha1);
+        return 0;
+    }
 
     write(fd, buf, size);   /* Write the object to the object store. */
     close(fd);              /* Release the file descriptor. */
+    /* Add the new object to the filter of loose objects. */
+    object_filter_add(sha1);
     return 0;
 }
 
@@ -660,7 +910,7 @@ int write_sha1_buffer(unsigned char *sha1, void *buf, unsigned int size)
  *      -string: The error message to print.
  * Purpose: Print an error message to the standard error stream.
  */
-static int error(const char * string)
+int error(const char * string)
 {
     fprintf(stderr, "error: %s\n", string);
     return -1;
@@ -671,13 +921,12 @@ static int error(const char * string)
  * Parameters:
  *      -hdr: A pointer to the cache header structure to validate.
  *      -size: The size in bytes of the cache file.
+ *      -st: The stat data of the cache file.
  * Purpose: Validate a cache_header.
  */
-static int verify_hdr(struct cache_header *hdr, unsigned long size)
+static int verify_hdr(struct cache_header *hdr, unsigned long size,
+                      struct stat *st)
 {
-    SHA_CTX c;                /* Declare a SHA context. */
-    unsigned char sha1[20];   /* Array to store SHA1 hash. */
-
     /*
      * Ensure the cache_header's signature matches the value defined in 
      * "cache.h". 
@@ -685,25 +934,54 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
     if (hdr->signature != CACHE_SIGNATURE)
         return error("bad signature");
 
-    /* Ensure the cache_header was created with the correct version of Git. */
-    if (hdr->version != 1)
+    /*
+     * Ensure the cache_header was created with the correct version of Git.
+     * Version 1 entries hold 20-byte SHA1 hashes, so they only make sense in
+     * a repository that names objects with SHA1.
+     */
+    if (hdr->version < 1 || hdr->version > CACHE_VERSION)
         return error("bad version");
-
-    /* Initialize the SHA context `c`. */
-    SHA1_Init(&c); 
-
-    /* Calculate the hash of the cache header and cache entries. */ 
-    SHA1_Update(&c, hdr, offsetof(struct cache_header, sha1));
-    SHA1_Update(&c, hdr+1, size - sizeof(*hdr));
-    SHA1_Final(sha1, &c);
+    if (hdr->version == 1 && object_hash()->rawsz != 20)
+        return error("version 1 index in a repository not using sha1");
 
     /*
-     * Compare the SHA1 hash calculated above to the SHA1 hash stored in the 
-     * cache header. If they match, then the cache is valid.
+     * Calculate the checksum of the cache header and cache entries and
+     * compare it to the one stored in the cache header. If they match, then
+     * the cache is valid. Depending on `index.verify`, this is done in the
+     * background or skipped for an index checked before (see
+     * index-checksum.c).
      */
-    if (memcmp(sha1, hdr->sha1, 20))
-        return error("bad header sha1");
-    return 0;
+    return verify_index_checksum(".dircache/index", hdr, size, st);
+}
+
+/*
+ * In version 1 of the index, cache entries held 20-byte SHA1 hashes, so the
+ * fields after the hash start 12 bytes earlier than in a `cache_entry`.
+ */
+#define V1_NAMELEN_OFFSET (offsetof(struct cache_entry, sha1) + 20)
+#define V1_NAME_OFFSET (V1_NAMELEN_OFFSET + 2)
+#define v1_entry_size(len) ((V1_NAME_OFFSET + (len) + 8) & ~7)
+
+/*
+ * Function: `convert_v1_entry`
+ * Parameters:
+ *      -v1: A cache entry in a version 1 index.
+ * Purpose: Copy a version 1 cache entry into a newly allocated
+ *          `cache_entry`, so that an index written before object names could
+ *          be longer than 20 bytes can still be read. It is written back as
+ *          version 2.
+ */
+static struct cache_entry *convert_v1_entry(const char *v1)
+{
+    unsigned short namelen;
+    struct cache_entry *ce;
+
+    memcpy(&namelen, v1 + V1_NAMELEN_OFFSET, sizeof(namelen));
+    ce = calloc(1, cache_entry_size(namelen));
+    memcpy(ce, v1, V1_NAMELEN_OFFSET);
+    ce->namelen = namelen;
+    memcpy(ce->name, v1 + V1_NAME_OFFSET, namelen);
+    return ce;
 }
 
 /*
@@ -848,7 +1126,7 @@ int read_cache(void)
      * valid, the code jumps to the `unmap` label at the end of this file.
      */
     hdr = map;
-    if (verify_hdr(hdr, size) < 0)
+    if (verify_hdr(hdr, size, &st) < 0)
         goto unmap;
 
     /* The number of cache entries in the cache. */
@@ -875,10 +1153,66 @@ int read_cache(void)
      */
     for (i = 0; i < hdr->entries; i++) {
         struct cache_entry *ce = map + offset;
-        offset = offset + ce_size(ce);
+        unsigned short namelen;
+        unsigned long len;
+
+        /*
+         * Make sure the entry is inside of the file. The checksum covers
+         * this, unless it is still being checked in the background.
+         */
+        if (size - offset < (hdr->version == 1 ? V1_NAME_OFFSET :
+                             offsetof(struct cache_entry, name)))
+            goto unmap;
+        if (hdr->version == 1) {
+            memcpy(&namelen, (char *) map + offset + V1_NAMELEN_OFFSET,
+                   sizeof(namelen));
+            len = v1_entry_size(namelen);
+        } else {
+            len = ce_size(ce);
+        }
+        if (len > size - offset)
+            goto unmap;
+
+        if (hdr->version == 1)
+            ce = convert_v1_entry(map + offset);
+        offset = offset + len;
         active_cache[i] = ce;
     }
-    
+
+    /*
+     * Since version 3, extensions follow the entries. Read the cache tree
+     * (see cache-tree.c), and skip the extensions that may be ignored.
+     */
+    while (hdr->version >= 3 && offset < size) {
+        struct cache_ext_header ext;
+
+        if (size - offset < sizeof(ext))
+            goto unmap;
+        memcpy(&ext, (char *) map + offset, sizeof(ext));
+        offset += sizeof(ext);
+        if (ext.size > size - offset)
+            goto unmap;
+        if (!memcmp(ext.signature, CACHE_EXT_TREE, 4)) {
+            cache_tree_read((char *) map + offset, ext.size);
+        } else if (!memcmp(ext.signature, CACHE_EXT_LINK, 4)) {
+            if (read_link_extension((char *) map + offset, ext.size) < 0)
+                goto unmap;
+        } else if (ext.signature[0] < 'A' || ext.signature[0] > 'Z') {
+            /* An extension that may not be ignored, from a newer version. */
+            error("unknown index extension");
+            goto unmap;
+        }
+        offset += ext.size;
+    }
+
+    /*
+     * A split index only holds the entries that differ from its shared
+     * index, which are merged with the entries of the shared index here
+     * (see split-index.c).
+     */
+    if (merge_shared_index() < 0)
+        goto unmap;
+
     /* Return the number of cache entries in the cache. */
     return active_nr;
 
@@ -889,6 +1223,10 @@ int read_cache(void)
  * and return -1.
  */
 unmap:
+    finish_index_checksum();
+    free(active_cache);
+    active_cache = NULL;
+    active_nr = 0;
     #ifndef BGIT_WINDOWS
     munmap(map, size);
     #else
@@ -898,3 +1236,220 @@ unmap:
     return error("verify header failed");
 }
 
+/*
+ * Function: `cache_name_compare`
+ * Parameters:
+ *      -name1: The name of the first file to compare.
+ *      -len1: The length of name1.
+ *      -name2: The name of the second file to compare.
+ *      -len2: The length of name2.
+ * Purpose: Compare the names of two cache entries lexicographically.
+ */
+int cache_name_compare(const char *name1, int len1, const char *name2,
+                       int len2)
+{
+    int len = len1 < len2 ? len1 : len2;   /* len is the shorter length. */
+    int cmp;
+
+    cmp = memcmp(name1, name2, len);
+    if (cmp)           /* First len characters are different. */
+        return cmp;
+    if (len1 < len2)   /* First len characters are the same. */
+        return -1;
+    if (len1 > len2)   /* First len characters are the same. */
+        return 1;
+    return 0;          /* Exact match. */
+}
+
+/*
+ * Function: `cache_name_pos`
+ * Parameters:
+ *      -name: The path of the file to be cached.
+ *      -namelen: The length of the path.
+ * Purpose: Determine the lexicographic position of a cache entry in the
+ *          active_cache array. Returns `-pos-1` if an entry with that name is
+ *          at `pos` already, or else the position where it would go.
+ */
+int cache_name_pos(const char *name, int namelen)
+{
+    /* Declare and initialize the indexes for the binary search. */
+    int first, last;
+    first = 0;
+    last = active_nr;
+
+    /*
+     * Perform a binary search to determine the lexicographic position of the 
+     * cache entry in the active_cache array.
+     */
+    while (last > first) {
+        int next = (last + first) >> 1;   /* Division by 2. */
+        struct cache_entry *ce = active_cache[next];
+        int cmp = cache_name_compare(name, namelen, ce->name, ce->namelen);
+        if (!cmp)            /* Exact match found. */
+            return -next-1;
+        if (cmp < 0) {
+            last = next;
+            continue;
+        }
+        first = next+1;
+    }
+    return first;
+}
+
+/*
+ * Function: `read_path`
+ * Parameters:
+ *      -in: The stream to read, such as standard input.
+ *      -term: The character that ends each path: '\n' for one path per
+ *             line, or '\0' for paths that may themselves hold newlines
+ *             (`-z`).
+ * Purpose: Read the next path of a list of paths, for the commands that
+ *          take `--stdin`. Returns the path in memory allocated with
+ *          `malloc()`, or NULL at the end of the list. The last path does
+ *          not need to be terminated.
+ */
+char *read_path(FILE *in, int term)
+{
+    char *path = NULL;
+    unsigned long len = 0, alloc = 0;
+    int c;
+
+    while ((c = getc(in)) != EOF && c != term) {
+        if (len + 1 >= alloc) {
+            alloc = alloc_nr(alloc);
+            path = realloc(path, alloc);
+        }
+        path[len++] = c;
+    }
+    if (c == EOF && !len)
+        return NULL;
+    if (!path)
+        path = malloc(1);
+    path[len] = '\0';
+    return path;
+}
+
+/*
+ * Function: `write_cache`
+ * Parameters:
+ *      -newfd: File descriptor associated with the index lock file.
+ *      -cache: The array of pointers to cache entry structures to write to 
+ *              the index lock file.
+ *      -entries: The number of cache entries in the `active_cache` array.
+ * Purpose: Construct the cache header, calculate the checksum of the cache 
+ *          header, the cache entries and the extensions, and then write them
+ *          to the `.dircache/index.lock` file. The only extension written is
+ *          the cache tree (see cache-tree.c), if there is one, and the link
+ *          to the shared index of a split index (see split-index.c). The
+ *          checksum is of the kind `index.checksum` asks for (see
+ *          index-checksum.c).
+ */
+int write_cache(int newfd, struct cache_entry **cache, int entries)
+{
+    struct index_checksum c;   /* The checksum being calculated. */
+    int kind = index_checksum_kind();   /* Its kind, or -1. */
+    struct cache_header hdr;   /* Declare a cache_header structure. */
+    int i;                     /* For loop iterator. */
+    /* The header and data of the cache tree extension. */
+    struct cache_ext_header ext;
+    void *tree = NULL;
+    unsigned long tree_size = 0;
+    /* The header and data of the split index extension. */
+    struct cache_ext_header link_ext;
+    void *link = NULL;
+    unsigned long link_size = 0;
+
+    /*
+     * The entries may come from an index whose checksum is still being
+     * checked in the background. Do not write them if it was damaged.
+     */
+    if (kind < 0 || finish_index_checksum() < 0)
+        return -1;
+
+    /*
+     * With a split index, only the entries that differ from the shared
+     * index are written (see split-index.c).
+     */
+    if (split_cache(&cache, &entries, &link, &link_size) < 0)
+        return -1;
+    if (link) {
+        memcpy(link_ext.signature, CACHE_EXT_LINK, 4);
+        link_ext.size = link_size;
+    }
+
+    /* Set this to the signature defined in "cache.h". */
+    hdr.signature = CACHE_SIGNATURE; 
+    /*
+     * The version that has extensions after the entries, and that names the
+     * kind of checksum if it is not SHA1.
+     */
+    hdr.version = kind == INDEX_CHECKSUM_SHA1 ? 3 : CACHE_VERSION; 
+    /*
+     * Store the number of cache entries in the `active_cache` array in the 
+     * cache header. 
+     */
+    hdr.entries = entries; 
+
+    if (active_cache_tree) {
+        tree = cache_tree_write(active_cache_tree, &tree_size);
+        memcpy(ext.signature, CACHE_EXT_TREE, 4);
+        ext.size = tree_size;
+    }
+
+    /* Initialize the `c` checksum structure. */
+    index_checksum_init(&c, kind); 
+    /* Update the running checksum calculation with the cache header. */
+    index_checksum_update(&c, &hdr, offsetof(struct cache_header, sha1));
+    /* Update the running checksum calculation with each cache entry. */
+    for (i = 0; i < entries; i++) {
+        struct cache_entry *ce = cache[i];
+        int size = ce_size(ce);
+        index_checksum_update(&c, ce, size);
+    }
+    /* And with the extensions. */
+    if (tree) {
+        index_checksum_update(&c, &ext, sizeof(ext));
+        index_checksum_update(&c, tree, tree_size);
+    }
+    if (link) {
+        index_checksum_update(&c, &link_ext, sizeof(link_ext));
+        index_checksum_update(&c, link, link_size);
+    }
+    /* Store the final checksum in the header. */
+    index_checksum_final(hdr.sha1, &c);
+
+    /* Write the cache header to the index lock file. */
+    if (write(newfd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto fail;
+
+    /* Write each of the cache entries to the index lock file. */
+    for (i = 0; i < entries; i++) {
+        struct cache_entry *ce = cache[i];
+        int size = ce_size(ce);
+        if (write(newfd, ce, size) != size)
+            goto fail;
+    }
+
+    /* Write the extensions. */
+    if (tree && (write(newfd, &ext, sizeof(ext)) != sizeof(ext) ||
+                 write(newfd, tree, tree_size) != tree_size))
+        goto fail;
+    if (link && (write(newfd, &link_ext, sizeof(link_ext)) !=
+                     sizeof(link_ext) ||
+                 write(newfd, link, link_size) != link_size))
+        goto fail;
+    free(tree);
+    if (link) {
+        free(link);
+        free(cache);
+    }
+    return 0;
+
+fail:
+    free(tree);
+    if (link) {
+        free(link);
+        free(cache);
+    }
+    return -1;
+}
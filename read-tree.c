@@ -35,6 +35,12 @@
  *      2) The name of the file that the tree object references.
  *      3) The hash of the blob that the tree object references.
  *
+ *  The trees of subdirectories, which the tree names with the mode 040000,
+ *  are printed in their place, with the paths of their files starting with
+ *  the name of the subdirectory. `./read-tree <key> <directory>` prints
+ *  only the files below one directory, and only reads the trees on the way
+ *  to it.
+ *
  *  This whole file (i.e. everything in the main function) will run
  *  when ./read-tree executable is run from the command line.
  */
@@ -61,6 +67,9 @@
 
    -strlen(string): Return the length of `string` in bytes.
 
+   -strnlen(string, n): Return the length of `string`, but at most `n`.
+                        Sourced from <string.h>.
+
    -strchr(string, c): Return pointer to the first occurrence of character `c` 
                        in `string`.
 
@@ -73,6 +82,20 @@
 
    -usage(): Print an error message and exit. 
 
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
+   -memcmp(s1, s2, n): Compare n bytes of two objects. Sourced from
+                       <string.h>.
+
+   -malloc(size): Allocate memory. Sourced from <stdlib.h>.
+
+   -sprintf(s, format, ...): Print to a string. Sourced from <stdio.h>.
+
+   -free(ptr): Release memory allocated by malloc(). Sourced from
+               <stdlib.h>.
+
    -sha1_to_hex(): Convert a 20-byte representation of an SHA1 hash value to 
                    the equivalent 40-character hexadecimal representation.
 
@@ -91,22 +114,43 @@
 
    -unpack(): Call the read_sha1_file() function to read and inflate a tree
               object from the object store, and then output the tree data to
-              the screen.
+              the screen, along with the trees of its subdirectories.
 */
 
 /*
  * Function: `unpack`
  * Parameters:
  *        -sha1: The SHA1 hash of a tree object in the object store. 
+ *        -base: The path of the directory of the tree, ending with a slash,
+ *               or "" for the root tree. It is printed before the names of
+ *               the files.
+ *        -want: The path of the directory to list, below this one, or NULL
+ *               to list everything.
  * Purpose: Call the read_sha1_file() function to read and inflate a tree
  *          object from the object store, and then output the tree data to
- *          the screen.
+ *          the screen. The trees of subdirectories (mode 040000) are read
+ *          the same way, so the files of every directory are listed with
+ *          their whole path. If `want` is set, only the trees on the way to
+ *          that directory are read.
  */
-static int unpack(unsigned char *sha1)
+static int unpack(unsigned char *sha1, const char *base, const char *want)
 {
     void *buffer;         /* The tree data buffer. */
+    void *data;           /* The start of the tree data, to be freed. */
     unsigned long size;   /* The size of the tree object data in bytes. */
     char type[20];        /* The object type. */
+    int rawsz = object_hash()->rawsz;   /* The length of object names. */
+    int baselen = strlen(base);
+    /* The length of the next directory in `want`, and whether it was found. */
+    int wantlen = 0, found = 0;
+
+    if (want && !*want)
+        want = NULL;
+    if (want) {
+        const char *slash = strchr(want, '/');
+
+        wantlen = slash ? slash - want : strlen(want);
+    }
 
     /*
      * Read an object with hash value `sha1` from the object store, inflate 
@@ -114,7 +158,7 @@ static int unpack(unsigned char *sha1)
      * metadata). Store the object type and object data size in `type` and 
      * `size` respectively.
      */
-    buffer = read_sha1_file(sha1, type, &size);
+    data = buffer = read_sha1_file(sha1, type, &size);
 
     /* Print usage message if `buffer` is empty or null, then exit. */
     if (!buffer)
@@ -132,14 +176,14 @@ static int unpack(unsigned char *sha1)
      */
     while (size) {
         /* Calculate offset to the current blob object's SHA1 hash. */
-        int len = strlen(buffer) + 1;           
+        int len = strnlen(buffer, size) + 1;
         /* Point to the current blob object's SHA1 hash. */
         unsigned char *sha1 = buffer + len;  
         /*
          * Point to the path of the file corresponding to the current blob
          * object. 
          */
-        char *path = strchr(buffer, ' ') + 1;   
+        char *path = strchr(buffer, ' ');
         unsigned int mode; 
         
         /*
@@ -147,27 +191,54 @@ static int unpack(unsigned char *sha1)
          * corresponding to the current blob object. If either fails, display 
          * error message then exit.
          */
-        if (size < len + 20 || sscanf(buffer, "%o", &mode) != 1)
+        if (size < len + rawsz || !path || sscanf(buffer, "%o", &mode) != 1)
             usage("corrupt 'tree' file");
+        path++;
 
         /*
          * Adjust buffer to point to the start of the next blob object's 
          * metadata. 
          */
-        buffer = sha1 + 20; 
+        buffer = sha1 + rawsz; 
         /*
          * Decrement `size` by the length of the metadata that was read for 
          * the current blob object. 
          */
-        size -= len + 20; 
+        size -= len + rawsz; 
+
+        /*
+         * Only the directory on the way to `want` is read, and the other
+         * entries are skipped.
+         */
+        if (want && (strlen(path) != wantlen ||
+                     memcmp(path, want, wantlen) || !S_ISDIR(mode)))
+            continue;
+
+        /*
+         * The tree of a subdirectory is listed in its place, with the name
+         * of the subdirectory added to the path.
+         */
+        if (S_ISDIR(mode)) {
+            char *subdir = malloc(baselen + strlen(path) + 2);
+
+            sprintf(subdir, "%s%s/", base, path);
+            unpack(sha1, subdir, want ? want + wantlen + !!want[wantlen] :
+                                        NULL);
+            free(subdir);
+            found = 1;
+            continue;
+        }
 
         /*
          * Display the mode and path of the file corresponding to the current
-         * blob object, and the 40-character representation of the current 
-         * blob object's SHA1 hash.
+         * blob object, and the hexadecimal representation of the current 
+         * blob object's name.
          */
-        printf("%o %s (%s)\n", mode, path, sha1_to_hex(sha1));
+        printf("%o %s%s (%s)\n", mode, base, path, sha1_to_hex(sha1));
     }
+    free(data);
+    if (want && !found)
+        usage("no such directory in the tree");
     return 0;
 }
 
@@ -188,15 +259,15 @@ int main(int argc, char **argv)
     /* A file descriptor. */
     int fd; 
     /* String to hold the 20-byte representation of a hash value. */
-    unsigned char sha1[20]; 
+    unsigned char sha1[MAX_RAWSZ]; 
 
     /*  
      * Validate the number of command line arguments, which should be equal to
-     * 2 since the command itself is also counted. If not, print a usage 
-     * message and exit.
+     * 2 since the command itself is also counted, or 3 with a directory to
+     * list. If not, print a usage message and exit.
      */
-    if (argc != 2)
-        usage("read-tree <key>");
+    if (argc != 2 && argc != 3)
+        usage("read-tree <key> [<directory>]");
 
     /* 
      * Convert the given 40-character hexadecimal representation of an SHA1 
@@ -206,7 +277,7 @@ int main(int argc, char **argv)
      * message and exit.
      */
     if (get_sha1_hex(argv[1], sha1) < 0)
-        usage("read-tree <key>");
+        usage("read-tree <key> [<directory>]");
 
     /*
      * Set `sha1_file_directory` (i.e. the path to the object store) to the 
@@ -227,9 +298,10 @@ int main(int argc, char **argv)
 
     /*
      * Call `unpack()` function with the binary SHA1 hash of the tree object
-     * as the function parameter. 
+     * as the function parameter, and the directory to list if one was
+     * given.
      */
-    if (unpack(sha1) < 0)
+    if (unpack(sha1, "", argc == 3 && argv[2][0] ? argv[2] : NULL) < 0)
         usage("unpack failed");
 
     return 0;
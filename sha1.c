@@ -0,0 +1,635 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define the SHA1 hashing engine that
+ *  names objects and checks the index and packs. `sha1_init()`,
+ *  `sha1_update()` and `sha1_final()` hash one message a piece at a time,
+ *  like OpenSSL's `SHA1_Init()`, `SHA1_Update()` and `SHA1_Final()`, and
+ *  `sha1_batch()` hashes many messages in one call.
+ *
+ *  SHA1 works on 64-byte blocks. Each block is mixed into a state of five
+ *  32-bit words in 80 rounds, and the final state is the hash. This file
+ *  has three versions of the function that processes blocks:
+ *
+ *  Plain C: Runs on any CPU.
+ *
+ *  SHA-NI: Recent x86 CPUs have instructions that do four SHA1 rounds at
+ *          a time (`sha1rnds4`) and compute the words the rounds consume
+ *          (`sha1msg1`, `sha1msg2`, `sha1nexte`). One message is hashed
+ *          several times faster than in plain C.
+ *
+ *  AVX2: The rounds of one message depend on each other, but the rounds
+ *        of different messages do not. With AVX2, each of the eight
+ *        32-bit lanes of a vector holds the state of a different message,
+ *        so eight messages are hashed for the cost of about one and a
+ *        half. This only helps `sha1_batch()`, and only when it is given
+ *        several messages, such as the small files `update-cache` adds.
+ *
+ *  Which versions are used is decided the first time a hash is needed, by
+ *  asking the CPU what it supports, so one binary runs everywhere. On
+ *  other CPUs and compilers only the plain C version is built.
+ */
+#include "cache.h"
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define SHA1_X86
+    #include <immintrin.h>
+#endif
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <immintrin.h> header files, ranked in order
+   of first use in this file. Function names are followed by parenthesis
+   whereas variable/struct names are not:
+
+   -memcpy(s1, s2, n): Copy n bytes from the object pointed to by s2 into the
+                       object pointed to by s1. Sourced from <string.h>.
+
+   -memset(void *s, int c, size_t n): Copies `c` (converted to an unsigned
+                                      char) into each of the first `n` bytes
+                                      of the object pointed to by `s`.
+
+   -_mm_*(): SSE and SHA-NI operations on 16-byte vectors, such as
+             `_mm_sha1rnds4_epu32()`, which does four SHA1 rounds. Sourced
+             from <immintrin.h>.
+
+   -_mm256_*(): AVX2 operations on 32-byte vectors.
+
+   -__builtin_cpu_supports(feature): Ask the CPU whether it supports an
+                                     instruction set. Built into GCC and
+                                     Clang.
+
+   -sha1_ctx: Structure holding the state of a hash being computed. Sourced
+              from "cache.h".
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -SHA1_LANES: How many messages the AVX2 version hashes at once.
+
+   -sha1_iv: The state a hash starts from.
+
+   -get_be32()/put_be32(): Read and write big-endian 32-bit words.
+
+   -blocks_scalar(): Process blocks in plain C.
+
+   -blocks_shani(): Process blocks with SHA-NI instructions.
+
+   -sha1_lanes: The state of each message being hashed by the AVX2 version.
+
+   -load_words_avx2(): Load one word of each lane's block.
+
+   -blocks_avx2(): Process one block of each of eight messages with AVX2.
+
+   -batch_avx2(): Hash many messages eight at a time with AVX2.
+
+   -blocks_fn: The version of `blocks_*()` the CPU supports.
+
+   -batch_fn: `batch_avx2()` if the CPU supports it.
+
+   -choose_sha1(): Decide which versions to use.
+
+   -sha1_init(): Start a hash.
+
+   -sha1_update(): Add data to a hash.
+
+   -sha1_final(): Finish a hash.
+
+   -sha1_batch(): Hash many messages.
+*/
+
+/* How many messages the AVX2 version hashes at once. */
+#define SHA1_LANES 8
+
+/* The state a hash starts from, as given by the SHA1 standard. */
+static const unsigned int sha1_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+/*
+ * Function: `get_be32`
+ * Parameters:
+ *      -p: Four bytes.
+ * Purpose: Read a big-endian 32-bit word, which is how SHA1 reads its
+ *          input.
+ */
+static unsigned int get_be32(const unsigned char *p)
+{
+    return (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Function: `put_be32`
+ * Parameters:
+ *      -p: Where to store four bytes.
+ *      -v: The word to store.
+ * Purpose: Store a big-endian 32-bit word.
+ */
+static void put_be32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Rotate a 32-bit word left by `n` bits. */
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * One round: `f` is the round's mixing function and `k` its constant. From
+ * round 16 on, each word the rounds consume is computed from four earlier
+ * ones, in a circular buffer of 16.
+ */
+#define ROUND(i, f, k)                                                    \
+    do {                                                                  \
+        if ((i) >= 16) {                                                  \
+            t = w[((i) - 3) & 15] ^ w[((i) - 8) & 15] ^                   \
+                w[((i) - 14) & 15] ^ w[(i) & 15];                         \
+            w[(i) & 15] = ROL(t, 1);                                      \
+        }                                                                 \
+        t = ROL(a, 5) + (f) + e + (k) + w[(i) & 15];                      \
+        e = d;                                                            \
+        d = c;                                                            \
+        c = ROL(b, 30);                                                   \
+        b = a;                                                            \
+        a = t;                                                            \
+    } while (0)
+
+/*
+ * Function: `blocks_scalar`
+ * Parameters:
+ *      -h: The five words of the state.
+ *      -p: The blocks.
+ *      -nr: The number of 64-byte blocks.
+ * Purpose: Mix blocks into the state in plain C.
+ */
+static void blocks_scalar(unsigned int *h, const unsigned char *p,
+                          unsigned long nr)
+{
+    unsigned int w[16], a, b, c, d, e, t;
+    int i;
+
+    for (; nr; nr--, p += 64) {
+        for (i = 0; i < 16; i++)
+            w[i] = get_be32(p + 4 * i);
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        e = h[4];
+        for (i = 0; i < 20; i++)
+            ROUND(i, (b & c) | (~b & d), 0x5a827999);
+        for (; i < 40; i++)
+            ROUND(i, b ^ c ^ d, 0x6ed9eba1);
+        for (; i < 60; i++)
+            ROUND(i, (b & c) | (d & (b | c)), 0x8f1bbcdc);
+        for (; i < 80; i++)
+            ROUND(i, b ^ c ^ d, 0xca62c1d6);
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+}
+
+#ifdef SHA1_X86
+
+/*
+ * Four rounds with SHA-NI instructions. `m0` holds the four words these
+ * rounds consume, and `m1`-`m3` the words of the next three groups of four
+ * rounds, which are computed from `m0` along the way. The fifth state word,
+ * `e`, is derived from the state four rounds back, so two variables take
+ * turns holding it. `k` is the number of the group, from 0 to 19; the tests
+ * on it are done by the compiler.
+ */
+#define SHANI_ROUNDS(k, ecur, enext, m0, m1, m2, m3)                      \
+    do {                                                                  \
+        if ((k) == 0)                                                     \
+            ecur = _mm_add_epi32(ecur, m0);                               \
+        else                                                              \
+            ecur = _mm_sha1nexte_epu32(ecur, m0);                         \
+        enext = abcd;                                                     \
+        if ((k) >= 3 && (k) <= 18)                                        \
+            m1 = _mm_sha1msg2_epu32(m1, m0);                              \
+        abcd = _mm_sha1rnds4_epu32(abcd, ecur, (k) / 5);                  \
+        if ((k) >= 1 && (k) <= 16)                                        \
+            m3 = _mm_sha1msg1_epu32(m3, m0);                              \
+        if ((k) >= 2 && (k) <= 17)                                        \
+            m2 = _mm_xor_si128(m2, m0);                                   \
+    } while (0)
+
+/*
+ * Function: `blocks_shani`
+ * Parameters: As for `blocks_scalar()`.
+ * Purpose: Mix blocks into the state with SHA-NI instructions. The state
+ *          words a-d are kept in one vector in reverse order, as the
+ *          instructions expect, and e in the top word of another.
+ */
+__attribute__((target("sha,sse4.1")))
+static void blocks_shani(unsigned int *h, const unsigned char *p,
+                         unsigned long nr)
+{
+    const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, e0, e1, abcd_save, e_save, m0, m1, m2, m3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    for (; nr; nr--, p += 64) {
+        abcd_save = abcd;
+        e_save = e0;
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), swap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+                              swap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)),
+                              swap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)),
+                              swap);
+
+        SHANI_ROUNDS(0, e0, e1, m0, m1, m2, m3);
+        SHANI_ROUNDS(1, e1, e0, m1, m2, m3, m0);
+        SHANI_ROUNDS(2, e0, e1, m2, m3, m0, m1);
+        SHANI_ROUNDS(3, e1, e0, m3, m0, m1, m2);
+        SHANI_ROUNDS(4, e0, e1, m0, m1, m2, m3);
+        SHANI_ROUNDS(5, e1, e0, m1, m2, m3, m0);
+        SHANI_ROUNDS(6, e0, e1, m2, m3, m0, m1);
+        SHANI_ROUNDS(7, e1, e0, m3, m0, m1, m2);
+        SHANI_ROUNDS(8, e0, e1, m0, m1, m2, m3);
+        SHANI_ROUNDS(9, e1, e0, m1, m2, m3, m0);
+        SHANI_ROUNDS(10, e0, e1, m2, m3, m0, m1);
+        SHANI_ROUNDS(11, e1, e0, m3, m0, m1, m2);
+        SHANI_ROUNDS(12, e0, e1, m0, m1, m2, m3);
+        SHANI_ROUNDS(13, e1, e0, m1, m2, m3, m0);
+        SHANI_ROUNDS(14, e0, e1, m2, m3, m0, m1);
+        SHANI_ROUNDS(15, e1, e0, m3, m0, m1, m2);
+        SHANI_ROUNDS(16, e0, e1, m0, m1, m2, m3);
+        SHANI_ROUNDS(17, e1, e0, m1, m2, m3, m0);
+        SHANI_ROUNDS(18, e0, e1, m2, m3, m0, m1);
+        SHANI_ROUNDS(19, e1, e0, m3, m0, m1, m2);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+
+/*
+ * Template of the state of the messages `batch_avx2()` is hashing, one per
+ * lane. The state words are stored a word at a time across the lanes, so
+ * that each can be loaded into a vector in one go.
+ */
+struct sha1_lanes {
+    unsigned int h[5][SHA1_LANES];           /* The states. */
+    const unsigned char *block[SHA1_LANES];  /* Each lane's next block. */
+};
+
+/*
+ * Function: `load_words_avx2`
+ * Parameters:
+ *      -w: Where to store eight vectors of words.
+ *      -block: The eight blocks.
+ *      -offset: Where the eight words start in each block.
+ * Purpose: Load eight consecutive words of each block, so that `w[i]` holds
+ *          word `offset / 4 + i` of every lane. The words are loaded a block
+ *          at a time, turned round with unpack and permute operations, and
+ *          their bytes put in big-endian order.
+ */
+__attribute__((target("avx2")))
+static void load_words_avx2(__m256i *w, const unsigned char **block,
+                            int offset)
+{
+    const __m256i swap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i r[8], s[8], t[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        r[i] = _mm256_loadu_si256((const __m256i *)(block[i] + offset));
+    for (i = 0; i < 8; i += 2) {
+        s[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        s[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+        t[i] = _mm256_unpacklo_epi64(s[i], s[i + 2]);
+        t[i + 1] = _mm256_unpackhi_epi64(s[i], s[i + 2]);
+        t[i + 2] = _mm256_unpacklo_epi64(s[i + 1], s[i + 3]);
+        t[i + 3] = _mm256_unpackhi_epi64(s[i + 1], s[i + 3]);
+    }
+    for (i = 0; i < 4; i++) {
+        w[i] = _mm256_permute2x128_si256(t[i], t[i + 4], 0x20);
+        w[i + 4] = _mm256_permute2x128_si256(t[i], t[i + 4], 0x31);
+    }
+    for (i = 0; i < 8; i++)
+        w[i] = _mm256_shuffle_epi8(w[i], swap);
+}
+
+/* Rotate each 32-bit word of a vector left by `n` bits. */
+#define ROL_AVX2(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), \
+                                       _mm256_srli_epi32(x, 32 - (n)))
+
+/*
+ * Function: `blocks_avx2`
+ * Parameters:
+ *      -l: The states and next blocks of eight messages.
+ * Purpose: Mix one block of each of eight messages into their states with
+ *          AVX2. This is `blocks_scalar()` with every variable a vector of
+ *          eight lanes.
+ */
+__attribute__((target("avx2")))
+static void blocks_avx2(struct sha1_lanes *l)
+{
+    __m256i w[16], a, b, c, d, e, k, t;
+    int i;
+
+    load_words_avx2(w, l->block, 0);
+    load_words_avx2(w + 8, l->block, 32);
+    a = _mm256_loadu_si256((const __m256i *)l->h[0]);
+    b = _mm256_loadu_si256((const __m256i *)l->h[1]);
+    c = _mm256_loadu_si256((const __m256i *)l->h[2]);
+    d = _mm256_loadu_si256((const __m256i *)l->h[3]);
+    e = _mm256_loadu_si256((const __m256i *)l->h[4]);
+
+    /* One round, as `ROUND()` above. */
+#define ROUND_AVX2(i, f, k)                                               \
+    do {                                                                  \
+        if ((i) >= 16) {                                                  \
+            t = _mm256_xor_si256(                                         \
+                _mm256_xor_si256(w[((i) - 3) & 15], w[((i) - 8) & 15]),   \
+                _mm256_xor_si256(w[((i) - 14) & 15], w[(i) & 15]));       \
+            w[(i) & 15] = ROL_AVX2(t, 1);                                 \
+        }                                                                 \
+        t = _mm256_add_epi32(_mm256_add_epi32(ROL_AVX2(a, 5), f),         \
+                             _mm256_add_epi32(_mm256_add_epi32(e, k),     \
+                                              w[(i) & 15]));              \
+        e = d;                                                            \
+        d = c;                                                            \
+        c = ROL_AVX2(b, 30);                                              \
+        b = a;                                                            \
+        a = t;                                                            \
+    } while (0)
+
+    k = _mm256_set1_epi32(0x5a827999);
+    for (i = 0; i < 20; i++)
+        ROUND_AVX2(i, _mm256_or_si256(_mm256_and_si256(b, c),
+                                      _mm256_andnot_si256(b, d)), k);
+    k = _mm256_set1_epi32(0x6ed9eba1);
+    for (; i < 40; i++)
+        ROUND_AVX2(i, _mm256_xor_si256(_mm256_xor_si256(b, c), d), k);
+    k = _mm256_set1_epi32(0x8f1bbcdc);
+    for (; i < 60; i++)
+        ROUND_AVX2(i, _mm256_or_si256(_mm256_and_si256(b, c),
+                                      _mm256_and_si256(d, _mm256_or_si256(b,
+                                                                       c))),
+                   k);
+    k = _mm256_set1_epi32(0xca62c1d6);
+    for (; i < 80; i++)
+        ROUND_AVX2(i, _mm256_xor_si256(_mm256_xor_si256(b, c), d), k);
+#undef ROUND_AVX2
+
+#define ADD_STATE(i, x) \
+    _mm256_storeu_si256((__m256i *)l->h[i], _mm256_add_epi32(x, \
+                        _mm256_loadu_si256((const __m256i *)l->h[i])))
+    ADD_STATE(0, a);
+    ADD_STATE(1, b);
+    ADD_STATE(2, c);
+    ADD_STATE(3, d);
+    ADD_STATE(4, e);
+#undef ADD_STATE
+}
+
+/*
+ * Function: `batch_avx2`
+ * Parameters: As for `sha1_batch()`.
+ * Purpose: Hash many messages eight at a time with AVX2. Each lane hashes
+ *          one message a block at a time, then its padding, which is built
+ *          in a small buffer for each lane. When a lane finishes, its hash
+ *          is stored and the next message takes the lane, so that messages
+ *          of different lengths keep all lanes busy. Lanes left with nothing
+ *          to do once the messages run out hash a block of zeroes, and the
+ *          result is thrown away.
+ */
+__attribute__((target("avx2")))
+static void batch_avx2(unsigned char *sha1s, const void **bufs,
+                       const unsigned long *lens, unsigned long nr)
+{
+    static const unsigned char zero_block[64];
+    struct sha1_lanes l;
+    /*
+     * The message in each lane, or -1, its number of whole blocks, and its
+     * blocks left to hash.
+     */
+    long job[SHA1_LANES];
+    unsigned long full[SHA1_LANES], left[SHA1_LANES];
+    /* Each lane's last one or two blocks, holding the padding. */
+    unsigned char pad[SHA1_LANES][128];
+    int pad_blocks[SHA1_LANES];
+    unsigned long next = 0, done = 0;
+    int i, j;
+
+    for (i = 0; i < SHA1_LANES; i++)
+        job[i] = -1;
+
+    while (done < nr) {
+        for (i = 0; i < SHA1_LANES; i++) {
+            /* Give an idle lane the next message. */
+            if (job[i] < 0 && next < nr) {
+                unsigned long len = lens[next];
+                unsigned long rest = len % 64;
+                unsigned long long bits = (unsigned long long) len << 3;
+                int n;
+
+                full[i] = len / 64;
+                pad_blocks[i] = rest + 9 <= 64 ? 1 : 2;
+                n = 64 * pad_blocks[i];
+                memset(pad[i], 0, n);
+                memcpy(pad[i], (const unsigned char *) bufs[next] + len -
+                       rest, rest);
+                pad[i][rest] = 0x80;
+                for (j = 0; j < 8; j++)
+                    pad[i][n - 1 - j] = bits >> (8 * j);
+                for (j = 0; j < 5; j++)
+                    l.h[j][i] = sha1_iv[j];
+                job[i] = next++;
+                left[i] = full[i] + pad_blocks[i];
+            }
+            /* Point the lane at its next block. */
+            if (job[i] < 0)
+                l.block[i] = zero_block;
+            else if (left[i] > (unsigned long) pad_blocks[i])
+                l.block[i] = (const unsigned char *) bufs[job[i]] +
+                             64 * (full[i] + pad_blocks[i] - left[i]);
+            else
+                l.block[i] = pad[i] + 64 * (pad_blocks[i] - left[i]);
+        }
+
+        blocks_avx2(&l);
+
+        for (i = 0; i < SHA1_LANES; i++) {
+            if (job[i] < 0 || --left[i])
+                continue;
+            for (j = 0; j < 5; j++)
+                put_be32(sha1s + 20 * job[i] + 4 * j, l.h[j][i]);
+            job[i] = -1;
+            done++;
+        }
+    }
+}
+
+#endif
+
+/* The versions of the block function and of batch hashing this CPU
+ * supports, once chosen. */
+static void (*blocks_fn)(unsigned int *h, const unsigned char *p,
+                         unsigned long nr);
+static void (*batch_fn)(unsigned char *sha1s, const void **bufs,
+                        const unsigned long *lens, unsigned long nr);
+
+/*
+ * Function: `choose_sha1`
+ * Parameters: none
+ * Purpose: Use the fastest versions of the block function and of batch
+ *          hashing that the CPU supports. Where a CPU has both SHA-NI and
+ *          AVX2, hashing eight messages at once with AVX2 is still faster
+ *          than hashing them one after another with SHA-NI, so both are
+ *          used.
+ */
+static void choose_sha1(void)
+{
+    blocks_fn = blocks_scalar;
+    batch_fn = NULL;
+#ifdef SHA1_X86
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        blocks_fn = blocks_shani;
+    if (__builtin_cpu_supports("avx2"))
+        batch_fn = batch_avx2;
+#endif
+}
+
+/*
+ * Function: `sha1_init`
+ * Parameters:
+ *      -c: The hash to start.
+ * Purpose: Start a hash.
+ */
+void sha1_init(struct sha1_ctx *c)
+{
+    if (!blocks_fn)
+        choose_sha1();
+    memcpy(c->h, sha1_iv, sizeof(c->h));
+    c->len = 0;
+}
+
+/*
+ * Function: `sha1_update`
+ * Parameters:
+ *      -c: The hash.
+ *      -data: The data to add.
+ *      -len: The length of the data.
+ * Purpose: Add data to a hash. Whole blocks are processed straight from
+ *          `data`; what is left over waits in the hash's buffer for more.
+ */
+void sha1_update(struct sha1_ctx *c, const void *data, unsigned long len)
+{
+    const unsigned char *p = data;
+    unsigned int used = c->len % 64;
+
+    c->len += len;
+    if (used) {
+        unsigned int n = 64 - used;
+        if (len < n) {
+            memcpy(c->buf + used, p, len);
+            return;
+        }
+        memcpy(c->buf + used, p, n);
+        blocks_fn(c->h, c->buf, 1);
+        p += n;
+        len -= n;
+    }
+    if (len >= 64) {
+        blocks_fn(c->h, p, len / 64);
+        p += len & ~63UL;
+        len %= 64;
+    }
+    memcpy(c->buf, p, len);
+}
+
+/*
+ * Function: `sha1_final`
+ * Parameters:
+ *      -sha1: Where to store the 20-byte hash.
+ *      -c: The hash.
+ * Purpose: Finish a hash. The message is padded with a 1 bit, zeroes, and
+ *          its length in bits, to a whole number of blocks.
+ */
+void sha1_final(unsigned char *sha1, struct sha1_ctx *c)
+{
+    unsigned long long bits = c->len << 3;
+    unsigned int used = c->len % 64;
+    int i;
+
+    c->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(c->buf + used, 0, 64 - used);
+        blocks_fn(c->h, c->buf, 1);
+        used = 0;
+    }
+    memset(c->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; i++)
+        c->buf[63 - i] = bits >> (8 * i);
+    blocks_fn(c->h, c->buf, 1);
+    for (i = 0; i < 5; i++)
+        put_be32(sha1 + 4 * i, c->h[i]);
+}
+
+/*
+ * Function: `sha1_batch`
+ * Parameters:
+ *      -sha1s: Where to store `nr` 20-byte hashes, one after another.
+ *      -bufs: The messages.
+ *      -lens: Their lengths.
+ *      -nr: The number of messages.
+ * Purpose: Hash many messages, several at a time when the CPU can. The
+ *          hashes are the same as hashing each message on its own.
+ */
+void sha1_batch(unsigned char *sha1s, const void **bufs,
+                const unsigned long *lens, unsigned long nr)
+{
+    struct sha1_ctx c;
+    unsigned long i;
+
+    if (!blocks_fn)
+        choose_sha1();
+    /* With fewer messages than lanes, most of the lanes would be idle. */
+    if (batch_fn && nr >= SHA1_LANES / 2) {
+        batch_fn(sha1s, bufs, lens, nr);
+        return;
+    }
+    for (i = 0; i < nr; i++) {
+        sha1_init(&c);
+        sha1_update(&c, bufs[i], lens[i]);
+        sha1_final(sha1s + 20 * i, &c);
+    }
+}
@@ -0,0 +1,448 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to define a cache of inflated objects that
+ *  is shared by all processes using the same object store. The object
+ *  cache in object-cache.c only lives as long as one process, but many
+ *  short `cat-file`, `read-tree` or `show-diff` processes run side by side
+ *  often inflate the same objects. With this cache, the first process to
+ *  read an object leaves the inflated data in memory shared with the
+ *  others.
+ *
+ *  The cache is the file `shared-cache` in the object store, mapped into
+ *  every process with `MAP_SHARED`. It is off unless the `core.sharedcache`
+ *  setting (or the `BGIT_CORE_SHAREDCACHE` environment variable, see
+ *  `get_config_env()`) gives its size in bytes. The file holds:
+ *
+ *  - A header: a magic number, the number of slots, the size of the data
+ *    area and how much of it is used.
+ *  - A table of slots. Each slot is empty, being filled or ready. A ready
+ *    slot holds an object's SHA1 hash, type, size and the position of its
+ *    data.
+ *  - The data area, where the data of each object is appended.
+ *
+ *  No process ever takes a lock to read or add an object. A process adds
+ *  an object like this:
+ *
+ *  1. It reserves room in the data area by atomically adding the object
+ *     size to the used count, and copies the data there.
+ *  2. It hashes the SHA1 hash to a slot and looks at that slot and the
+ *     ones after it. It claims the first empty one by atomically changing
+ *     its state from empty to being filled.
+ *  3. It fills in the slot, then marks it ready. Marking it ready has
+ *     release semantics, so another process that sees the slot ready also
+ *     sees everything written before.
+ *
+ *  Readers look at the same slots in the same order, skip slots that are
+ *  being filled, and stop at the first empty one. A slot is never emptied
+ *  again, and the data area only grows. Once either is full, objects are no
+ *  longer added, and removing the file starts a new cache. Objects never
+ *  change once written, so a cached object never goes stale.
+ *
+ *  The file is created, and its header written, while holding an `flock()`
+ *  lock, so that two processes starting at once do not both do it.
+ *  Windows has neither `flock()` nor `MAP_SHARED` with this meaning, so the
+ *  shared cache is not built there.
+ *
+ *  If the environment variable `BGIT_OBJECT_CACHE_STATS` is set, the hits
+ *  and misses of this cache are printed to standard error at exit, after
+ *  those of the object cache.
+ */
+#include "cache.h"
+#ifndef BGIT_WINDOWS
+    #include <sys/file.h>
+#endif
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <sys/file.h> header files, ranked in order
+   of first use in this file. Function names are followed by parenthesis
+   whereas variable/struct names are not:
+
+   -fprintf(stream, message, ...): Write `message` to the output `stream`.
+                                   Sourced from <stdio.h>.
+
+   -get_config_env_int(): Return the value of a setting as a number.
+                          Sourced from "cache.h" (defined in config.c).
+
+   -get_object_directory(): Return the path to the object store.
+
+   -sprintf(str, format, ...): Write formatted output to a string. Sourced
+                               from <stdio.h>.
+
+   -open(path, flags, perms): Open a file. Sourced from <fcntl.h>.
+
+   -flock(fd, operation): Lock or unlock an open file. Sourced from
+                          <sys/file.h>.
+
+   -fstat(fd, buf): Get information about an open file. Sourced from
+                    <sys/stat.h>.
+
+   -pread(fd, buf, n, offset)/pwrite(fd, buf, n, offset): Read and write a
+        file at an offset. Sourced from <unistd.h>.
+
+   -ftruncate(fd, length): Set the size of an open file. Sourced from
+                           <unistd.h>.
+
+   -mmap(addr, len, prot, flags, fd, offset)/munmap(addr, len): Map a file
+        into memory, and remove the mapping. Sourced from <sys/mman.h>.
+
+   -getenv(name)/atexit(fn): Read an environment variable, and call a
+                             function when the process exits. Sourced from
+                             <stdlib.h>.
+
+   -__atomic_load_n()/__atomic_store_n()/__atomic_fetch_add()/
+    __atomic_compare_exchange_n(): Read and change memory shared with other
+        processes atomically. Built into GCC and Clang.
+
+   -memcmp(s1, s2, n)/memcpy(s1, s2, n): Compare and copy memory. Sourced
+                                         from <string.h>.
+
+   -object_hash(): Return the hash algorithm of the repository. Sourced from
+                   "cache.h" (defined in hash.c).
+
+   -memset(s, c, n)/strlen(str): Fill memory with a byte, and return the
+                                 length of a string. Sourced from <string.h>.
+
+   -malloc(size): Allocate memory. Sourced from <stdlib.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -shared_cache_header: The header of the cache file.
+
+   -shared_cache_slot: One slot of the table.
+
+   -print_shared_cache_stats(): Print the hit and miss counts.
+
+   -init_shared_cache(): Size a new cache file and write its header.
+
+   -open_shared_cache(): Map the cache file the first time it is needed.
+
+   -first_slot(): Return the slot where looking for an object starts.
+
+   -lookup_shared_cache(): Look an object up in the shared cache.
+
+   -add_shared_cache(): Add an object to the shared cache.
+*/
+
+/*
+ * The magic number at the start of the cache file: "BGSC". Version 2 slots
+ * hold object names of up to `MAX_RAWSZ` bytes; a file of another version
+ * is started afresh.
+ */
+#define SHARED_CACHE_MAGIC 0x42475343
+#define SHARED_CACHE_VERSION 2
+
+/* The states of a slot. A new file is all zeros, so all slots are empty. */
+#define SLOT_EMPTY   0
+#define SLOT_FILLING 1
+#define SLOT_READY   2
+
+/* How many slots are looked at before giving up. */
+#define MAX_PROBES 64
+
+/*
+ * One slot for every this many bytes of the file, on the guess that most
+ * cached objects (trees, commits and small blobs) are a few KB.
+ */
+#define BYTES_PER_SLOT 4096
+
+/* Template of the header of the cache file. */
+struct shared_cache_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long nr_slots;     /* A power of 2. */
+    unsigned long long data_size;    /* Size of the data area. */
+    unsigned long long used;         /* Bytes of the data area handed out. */
+};
+
+/* Template of one slot of the table. */
+struct shared_cache_slot {
+    unsigned int state;              /* One of the SLOT_* values. */
+    unsigned char sha1[MAX_RAWSZ];
+    char type[8];                    /* blob, tree, or commit. */
+    unsigned long long offset;       /* Position in the data area. */
+    unsigned long long size;         /* The size of the object data. */
+};
+
+#ifndef BGIT_WINDOWS
+
+/* The mapped file, its slot table and its data area, once opened. */
+static struct shared_cache_header *header;
+static struct shared_cache_slot *slots;
+static unsigned char *data_area;
+/* 0 until the cache is opened, then 1, or -1 if it is not used. */
+static int shared_cache_state;
+
+/* Counters for the report. */
+static unsigned long hits, misses, added;
+
+/*
+ * Function: `print_shared_cache_stats`
+ * Parameters: none
+ * Purpose: Print the number of hits, misses and objects added, and how full
+ *          the data area is.
+ */
+static void print_shared_cache_stats(void)
+{
+    fprintf(stderr, "shared object cache: %lu hits, %lu misses, %lu added, "
+            "%llu of %llu bytes used\n", hits, misses, added,
+            __atomic_load_n(&header->used, __ATOMIC_RELAXED),
+            header->data_size);
+}
+
+/*
+ * Function: `init_shared_cache`
+ * Parameters:
+ *      -fd: The open cache file, locked.
+ *      -size: The size the file should have.
+ * Purpose: Give a new (or unusable) cache file its size and write its
+ *          header. Growing the file with `ftruncate()` fills it with zeros,
+ *          which makes every slot empty. Returns -1 on failure.
+ */
+static int init_shared_cache(int fd, unsigned long size)
+{
+    struct shared_cache_header hdr;
+    unsigned long long nr_slots = 1024;
+
+    while (nr_slots * 2 * BYTES_PER_SLOT <= size)
+        nr_slots *= 2;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SHARED_CACHE_MAGIC;
+    hdr.version = SHARED_CACHE_VERSION;
+    hdr.nr_slots = nr_slots;
+    if (size <= sizeof(hdr) + nr_slots * sizeof(struct shared_cache_slot))
+        return -1;
+    hdr.data_size = size - sizeof(hdr) -
+                    nr_slots * sizeof(struct shared_cache_slot);
+
+    /* Start from an empty file so that no old slot survives. */
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)
+        return -1;
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return -1;
+    return 0;
+}
+
+/*
+ * Function: `open_shared_cache`
+ * Parameters: none
+ * Purpose: The first time the cache is used, find out whether it is turned
+ *          on and, if so, open (creating it if needed) and map the cache
+ *          file. Returns 0 if the cache can be used.
+ */
+static int open_shared_cache(void)
+{
+    struct shared_cache_header hdr;
+    struct stat st;
+    const char *dir;
+    char *path;
+    long size;
+    void *map;
+    int fd;
+
+    if (shared_cache_state)
+        return shared_cache_state > 0 ? 0 : -1;
+    shared_cache_state = -1;
+
+    size = get_config_env_int("core.sharedcache", 0);
+    if (size <= 0)
+        return -1;
+
+    dir = get_object_directory();
+    path = malloc(strlen(dir) + 14);
+    if (!path)
+        return -1;
+    sprintf(path, "%s/shared-cache", dir);
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    free(path);
+    if (fd < 0)
+        return -1;
+
+    /*
+     * Another process may be creating the file right now. Wait for it, and
+     * write the header only if nobody has written a valid one yet.
+     */
+    if (flock(fd, LOCK_EX) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 ||
+        st.st_size < sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != SHARED_CACHE_MAGIC ||
+        hdr.version != SHARED_CACHE_VERSION ||
+        st.st_size != sizeof(hdr) + hdr.nr_slots *
+                      sizeof(struct shared_cache_slot) + hdr.data_size) {
+        if (init_shared_cache(fd, size) < 0) {
+            flock(fd, LOCK_UN);
+            close(fd);
+            return -1;
+        }
+        st.st_size = size;
+    }
+    flock(fd, LOCK_UN);
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    header = map;
+    slots = (struct shared_cache_slot *)(header + 1);
+    data_area = (unsigned char *)(slots + header->nr_slots);
+    shared_cache_state = 1;
+    if (getenv("BGIT_OBJECT_CACHE_STATS"))
+        atexit(print_shared_cache_stats);
+    return 0;
+}
+
+/*
+ * Function: `first_slot`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ * Purpose: Return the number of the slot where the object is looked for
+ *          first. The bytes of an SHA1 hash are already random.
+ */
+static unsigned long long first_slot(const unsigned char *sha1)
+{
+    unsigned int hash;
+
+    memcpy(&hash, sha1, sizeof(hash));
+    return hash & (header->nr_slots - 1);
+}
+
+/*
+ * Function: `lookup_shared_cache`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object to look up.
+ *      -type: Filled in with the object type.
+ *      -size: Filled in with the size of the object data.
+ * Purpose: Return a copy of an object in the shared cache, which the caller
+ *          must free, or NULL if the object is not there or the shared cache
+ *          is off.
+ */
+void *lookup_shared_cache(const unsigned char *sha1, char *type,
+                          unsigned long *size)
+{
+    unsigned long long pos;
+    int rawsz = object_hash()->rawsz, i;
+
+    if (open_shared_cache() < 0)
+        return NULL;
+
+    pos = first_slot(sha1);
+    for (i = 0; i < MAX_PROBES; i++) {
+        struct shared_cache_slot *slot = &slots[pos];
+        unsigned int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state == SLOT_EMPTY)
+            break;
+        if (state == SLOT_READY && !memcmp(slot->sha1, sha1, rawsz)) {
+            char *buf;
+
+            if (slot->offset + slot->size > header->data_size)
+                break;
+            buf = malloc(slot->size + 1);
+            if (!buf)
+                return NULL;
+            memcpy(buf, data_area + slot->offset, slot->size);
+            buf[slot->size] = 0;
+            memcpy(type, slot->type, sizeof(slot->type));
+            type[sizeof(slot->type)] = 0;
+            *size = slot->size;
+            hits++;
+            return buf;
+        }
+        pos = (pos + 1) & (header->nr_slots - 1);
+    }
+    misses++;
+    return NULL;
+}
+
+/*
+ * Function: `add_shared_cache`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object.
+ *      -type: The object type.
+ *      -data, size: The object data, which is copied.
+ * Purpose: Add an object that was just read to the shared cache, if the
+ *          cache is on and has room for it. Objects larger than a quarter of
+ *          the data area are left out, so that one large blob does not use
+ *          up the space of many trees.
+ */
+void add_shared_cache(const unsigned char *sha1, const char *type,
+                      const void *data, unsigned long size)
+{
+    unsigned long long offset, need, pos;
+    int rawsz = object_hash()->rawsz, i;
+
+    if (open_shared_cache() < 0 || strlen(type) > sizeof(slots->type) ||
+        size > header->data_size / 4)
+        return;
+
+    /* Reserve room for the data, keeping every object 8-byte aligned. */
+    need = (size + 7) & ~7ULL;
+    offset = __atomic_fetch_add(&header->used, need, __ATOMIC_RELAXED);
+    if (offset + need > header->data_size)
+        return;
+    memcpy(data_area + offset, data, size);
+
+    /* Claim the first empty slot, unless another process added it first. */
+    pos = first_slot(sha1);
+    for (i = 0; i < MAX_PROBES; i++) {
+        struct shared_cache_slot *slot = &slots[pos];
+        unsigned int state = SLOT_EMPTY;
+
+        if (__atomic_compare_exchange_n(&slot->state, &state, SLOT_FILLING,
+                                        0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE)) {
+            memcpy(slot->sha1, sha1, rawsz);
+            memset(slot->type, 0, sizeof(slot->type));
+            memcpy(slot->type, type, strlen(type));
+            slot->offset = offset;
+            slot->size = size;
+            __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+            added++;
+            return;
+        }
+        if (state == SLOT_READY && !memcmp(slot->sha1, sha1, rawsz))
+            return;
+        pos = (pos + 1) & (header->nr_slots - 1);
+    }
+}
+
+#else
+
+/* Without `flock()` and `MAP_SHARED`, there is no shared cache. */
+void *lookup_shared_cache(const unsigned char *sha1, char *type,
+                          unsigned long *size)
+{
+    return NULL;
+}
+
+void add_shared_cache(const unsigned char *sha1, const char *type,
+                      const void *data, unsigned long size)
+{
+}
+
+#endif
@@ -23,7 +23,9 @@
  *
  *  The purpose of this file is to be compiled into an executable
  *  called `show-diff`. When `show-diff` is run from the command line
- *  it does not take any command line arguments.
+ *  without arguments it shows every file in the index. With `--stdin`
+ *  it only shows the files whose paths are read from standard input,
+ *  one per line, or terminated by NUL characters with `-z`.
  *
  *  The `show-diff` command is used to show the differences between
  *  files staged in the index and the current versions of those files
@@ -51,6 +53,9 @@
                           depending on the value of mode. Sourced from 
                           <stdio.h>.
 
+   -read_object_stream(): Inflate the next piece of an object. Sourced from
+                          "cache.h" (defined in stream.c).
+
    -fwrite(data, size, nitems, stream): Write up to `nitems`, each of size 
                                         `size`, from array `data` to `stream`.
                                         Sourced from <stdio.h>.
@@ -64,8 +69,34 @@
    -printf(message, ...): Write `message` to standard output stream stdout.  
                           Sourced from <stdio.h>.
 
-   -free(ptr): Deallocates the space pointed to by `ptr`. Sourced from 
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
+   -open_object_stream(): Open an object for reading a piece at a time.
+
+   -close_object_stream(): Release an object stream.
+
+   -strcmp(str1, str2): Compare two strings. Sourced from <string.h>.
+
+   -usage(): Print a usage message and exit. Sourced from "cache.h" (defined
+             in read-cache.c).
+
+   -read_path(): Read the next path given on standard input. Sourced from
+                 "cache.h" (defined in read-cache.c).
+
+   -cache_name_pos(): Find the position of a path in the active_cache
+                      array. Sourced from "cache.h" (defined in
+                      read-cache.c).
+
+   -strlen(string): Return the length of `string` in bytes.
+
+   -free(ptr): Release memory allocated by malloc(). Sourced from
                <stdlib.h>.
+
+   -finish_index_checksum(): Wait for the checksum of the index being
+                             checked in the background. Sourced from
+                             "cache.h" (defined in index-checksum.c).
 */
 
 #define MTIME_CHANGED   0x0001
@@ -129,17 +160,18 @@ static int match_stat(struct cache_entry *ce, struct stat *st)
  *      -ce: Pointer to a cache entry structure.
  *      -cur: Pointer to a stat structure containing metadata of the working 
  *            file that corresponds to the cache entry. 
- *      -old_contents: The blob data corresponding to the cache entry.
- *      -old_size: The size of the blob data in bytes.
+ *      -old: The open blob object corresponding to the cache entry.
  * Purpose: Use the diff shell command to display the differences between the 
  *          blob data corresponding to the cache entry and the contents of the 
  *          corresponding working file.
  */
 static void show_differences(struct cache_entry *ce, struct stat *cur,
-                             void *old_contents, unsigned long long old_size)
+                             struct object_stream *old)
 {
     static char cmd[1000];   /* String to store the diff command. */
+    static char buf[64 * 1024];   /* A piece of the blob data. */
     FILE *f;                 /* Declare a file pointer. */
+    long n;                  /* The number of bytes in `buf`. */
 
     /*
      * Construct the diff command for this cache entry, which will be used to 
@@ -158,14 +190,104 @@ static void show_differences(struct cache_entry *ce, struct stat *cur,
     /*
      * Write the blob object data corresponding to the current cache entry to 
      * the command stream to complete the command, thus effectively executing 
-     * the diff command.
+     * the diff command. The blob is inflated and written a piece at a time,
+     * so it never has to fit in memory as a whole.
      */
-    fwrite(old_contents, old_size, 1, f);
+    while ((n = read_object_stream(old, buf, sizeof(buf))) > 0)
+        fwrite(buf, n, 1, f);
 
     /* Close the command stream. */
     pclose(f);
 }
 
+/*
+ * Function: `show_entry`
+ * Parameters:
+ *      -ce: Pointer to a cache entry structure.
+ * Purpose: Show whether the working file of a cache entry changed, and if it
+ *          did, the differences between the blob object and the file.
+ */
+static void show_entry(struct cache_entry *ce)
+{
+    /* Declare a stat structure to store file metadata. */
+    struct stat st;
+    /* For loop counter. */
+    int n;
+    /* Flag to indicate which file metadata changed, if any. */
+    int changed;
+    /* Not used. */
+    unsigned int mode;
+    /* Blob object data size. */
+    unsigned long size;
+    /* Used to store the object type (blob in this case ). */
+    char type[20];
+    /* The blob object being read. */
+    struct object_stream *old;
+
+    /*
+     * Use the stat() function to obtain information about the working 
+     * file corresponding to the current cache entry and store it in the 
+     * `st` stat structure. If the stat() call fails, display an error
+     * message and return.
+     */
+    if (stat(ce->name, &st) < 0) {
+        printf("%s: %s\n", ce->name, strerror(errno));
+        return;
+    }
+
+    /*
+     * Compare the metadata stored in the cache entry to those of the 
+     * corresponding working file to check if they are the same or if
+     * anything changed. 
+     */
+    changed = match_stat(ce, &st);
+
+    /*
+     * If no metadata changed, display an ok message and return.
+     */
+    if (!changed) {
+        printf("%s: ok\n", ce->name);
+        return;
+    }
+
+    /* Fall through here if any metadata changed. */
+
+    /*
+     * Display the path of the file corresponding to the current cache
+     * entry.
+     */
+    printf("%.*s:  ", ce->namelen, ce->name);
+
+    /*
+     * Display the hexadecimal representation of the name of the blob 
+     * object corresponding to the current cache entry. 
+     */
+    for (n = 0; n < object_hash()->rawsz; n++)
+        printf("%02x", ce->sha1[n]);
+
+    printf("\n");   /* Print a newline. */
+
+    /*
+     * Open the blob object in the object store using its SHA1 hash, for
+     * reading the object data (without the prepended metadata) a piece
+     * at a time. Store the object type and object data size in `type`
+     * and `size` respectively.
+     */
+    old = open_object_stream(ce->sha1, type, &size);
+    if (!old)
+        return;
+
+    /*
+     * Use the diff shell command to display the differences between the 
+     * blob data corresponding to the current cache entry and the contents 
+     * of the corresponding working file.
+     */
+    show_differences(ce, &st, old);
+
+    /* Release the object stream. */
+    close_object_stream(old);
+}
+
 /*
  * Function: `main`
  * Parameters:
@@ -174,18 +296,44 @@ static void show_differences(struct cache_entry *ce, struct stat *cur,
  *      -argv: An array of the command line arguments, including the command 
  *             itself.
  * Purpose: Standard `main` function definition. Runs when the executable 
- *          `show-diff` is run from the command line. 
+ *          `show-diff` is run from the command line. Shows every entry in
+ *          the index, or with `--stdin` only those whose paths are read from
+ *          standard input, one per line, or terminated by NUL characters
+ *          with `-z`.
  */
 int main(int argc, char **argv)
 {
+    /* For loop counter. */
+    int i;
+    /* Whether the paths to show are read from standard input. */
+    int use_stdin = 0;
+    /* The character that ends each path read from standard input. */
+    int term = '\n';
+    /* A path read from standard input, and its position in the cache. */
+    char *path;
+    int pos;
+    /* The number of cache entries. */
+    int entries;
+
+    /*
+     * With `--stdin`, only the files whose paths are read from standard
+     * input are shown, one path per line, or terminated by NUL characters
+     * with `-z`.
+     */
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--stdin"))
+            use_stdin = 1;
+        else if (!strcmp(argv[i], "-z"))
+            term = '\0';
+        else
+            usage("show-diff [--stdin [-z]]");
+    }
+
     /*
      * Reads the contents of the `.dircache/index` file into the 
      * `active_cache` array and returns the number of cache entries.
      */
-    int entries = read_cache();
-
-    /* For loop counter. */
-    int i;
+    entries = read_cache();
 
     /*
      * If there was an error reading the cache, display an error message and 
@@ -196,86 +344,28 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    /* Loop through the cache entries in the active_cache array. */
-    for (i = 0; i < entries; i++) {
-        /* Declare a stat structure to store file metadata. */
-        struct stat st;
-        /* The current cache entry. */
-        struct cache_entry *ce = active_cache[i];
-        /* For loop counter. */
-        int n;
-        /* Flag to indicate which file metadata changed, if any. */
-        int changed;
-        /* Not used. */
-        unsigned int mode;
-        /* Blob object data size. */
-        unsigned long size;
-        /* Used to store the object type (blob in this case ). */
-        char type[20];
-        /* Used to store the blob object data. */
-        void *new;
-
-        /*
-         * Use the stat() function to obtain information about the working 
-         * file corresponding to the current cache entry and store it in the 
-         * `st` stat structure. If the stat() call fails, display an error
-         * message and continue to the next cache entry.
-         */
-        if (stat(ce->name, &st) < 0) {
-            printf("%s: %s\n", ce->name, strerror(errno));
-            continue;
-        }
-
-        /*
-         * Compare the metadata stored in the cache entry to those of the 
-         * corresponding working file to check if they are the same or if
-         * anything changed. 
-         */
-        changed = match_stat(ce, &st);
-
-        /*
-         * If no metadata changed, display an ok message and continue to the 
-         * next cache entry in the active_cache array. 
-         */
-        if (!changed) {
-            printf("%s: ok\n", ce->name);
-            continue;
+    /*
+     * Show each path as soon as it is read, looking it up in the cache with
+     * a binary search.
+     */
+    if (use_stdin) {
+        while ((path = read_path(stdin, term)) != NULL) {
+            pos = cache_name_pos(path, strlen(path));
+            if (pos < 0)
+                show_entry(active_cache[-pos-1]);
+            else
+                printf("%s: not in the cache\n", path);
+            free(path);
         }
-
-        /* Fall through here if any metadata changed. */
-
-        /*
-         * Display the path of the file corresponding to the current cache
-         * entry.
-         */
-        printf("%.*s:  ", ce->namelen, ce->name);
-
-        /*
-         * Display the hexadecimal representation of the SHA1 hash of the blob 
-         * object corresponding to the current cache entry. 
-         */
-        for (n = 0; n < 20; n++)
-            printf("%02x", ce->sha1[n]);
-
-        printf("\n");   /* Print a newline. */
-
-        /*
-         * Read the blob object from the object store using its SHA1 hash,
-         * inflate it, and return a pointer to the object data (without the 
-         * prepended metadata). Store the object type and object data size in 
-         * `type` and `size` respectively.
-         */
-        new = read_sha1_file(ce->sha1, type, &size);
-
-        /*
-         * Use the diff shell command to display the differences between the 
-         * blob data corresponding to the current cache entry and the contents 
-         * of the corresponding working file.
-         */
-        show_differences(ce, &st, new, size);
-
-        /* Deallocate the space pointed to by `new`. */
-        free(new);
+    } else {
+        /* Loop through the cache entries in the active_cache array. */
+        for (i = 0; i < entries; i++)
+            show_entry(active_cache[i]);
     }
-    return 0;
+
+    /*
+     * With `index.verify = background`, the checksum of the index may still
+     * be being checked. Fail if it does not match.
+     */
+    return finish_index_checksum() < 0;
 }
@@ -0,0 +1,549 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *  The purpose of this file is to split the index into two files, so that
+ *  a command that changes a few entries does not have to hash and write
+ *  all of them again:
+ *
+ *  -A shared index, `.dircache/sharedindex.<id>`, holding the entries at
+ *   some point. It is an index like any other (version 3 or 4, without
+ *   extensions), is never changed once written, and is named after the
+ *   SHA1 hash of its contents.
+ *
+ *  -The index, `.dircache/index`, holding only the entries added or
+ *   changed since, and a "LINK" extension naming the shared index and
+ *   listing the positions of its entries that were removed since:
+ *
+ *      <20-byte id> <number of removed entries> <positions, ascending>
+ *
+ *   where the numbers are 4-byte integers in the byte order of the
+ *   machine, like the rest of the index.
+ *
+ *  `read_cache()` reads both and merges them into the `active_cache`
+ *  array, so the other commands see the same entries as without a split
+ *  index. `write_cache()` compares the entries against the shared index and
+ *  writes the index with the differences only.
+ *
+ *  Splitting is turned on by setting `index.split` to 1. When the
+ *  differences grow to more than `index.splitmaxpercent` percent of the
+ *  entries of the shared index (20 by default), a new shared index is
+ *  written with all of the entries, and the index is empty again. Shared
+ *  indexes older than the one the index used before are then removed.
+ */
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Function names are followed by parenthesis whereas
+   variable/struct names are not:
+
+   -hex_encode(): Convert bytes to hexadecimal. Sourced from "cache.h"
+                  (defined in hex.c).
+
+   -sprintf(s, format, ...): Print to a string. Sourced from <stdio.h>.
+
+   -memcpy(s1, s2, n): Copy memory. Sourced from <string.h>.
+
+   -malloc(size): Allocate memory. Sourced from <stdlib.h>.
+
+   -OPEN_FILE(): Open a file. Sourced from "cache.h".
+
+   -error(): Print an error message and return -1. Sourced from "cache.h"
+             (defined in read-cache.c).
+
+   -fstat(fd, buf): Get the stat data of an open file. Sourced from
+                    <sys/stat.h>.
+
+   -close(fd): Close a file. Sourced from <unistd.h>.
+
+   -map_fd(): Map the contents of an open file into memory. Sourced from
+              "cache.h" (defined in read-cache.c).
+
+   -CACHE_SIGNATURE/CACHE_VERSION: The signature and latest version of the
+                                   index. Sourced from "cache.h".
+
+   -verify_index_checksum(): Check the checksum of an index, as
+                             `index.verify` says. Sourced from "cache.h"
+                             (defined in index-checksum.c).
+
+   -offsetof(type, member): The offset of a member in a structure. Sourced
+                            from <stddef.h>.
+
+   -ce_size(): The size of a cache entry. Sourced from "cache.h".
+
+   -free(ptr): Release allocated memory. Sourced from <stdlib.h>.
+
+   -calloc(nmemb, size): Allocate zeroed memory for an array. Sourced from
+                         <stdlib.h>.
+
+   -alloc_nr(x): Grow an allocation. Sourced from "cache.h".
+
+   -cache_name_compare(): Compare two names the way the index orders them.
+                          Sourced from "cache.h" (defined in read-cache.c).
+
+   -active_cache/active_nr/active_alloc: The entries of the index.
+
+   -opendir()/readdir()/closedir(): Read a directory. Sourced from
+                                    <dirent.h>.
+
+   -strncmp(s1, s2, n)/strlen(s)/strcmp(s1, s2): Compare strings and
+        return their length. Sourced from <string.h>.
+
+   -unlink(path): Remove a file. Sourced from <unistd.h>.
+
+   -index_checksum_kind(): The kind of checksum to write an index with.
+
+   -index_checksum_init()/index_checksum_update()/index_checksum_final():
+        Compute the checksum of an index.
+
+   -sha1_init()/sha1_update()/sha1_final(): Calculate an SHA1 hash. Sourced
+                                             from "cache.h" (defined in
+                                             sha1.c).
+
+   -write(fd, buf, n): Write to a file. Sourced from <unistd.h>.
+
+   -rename(old, new): Change the name of a file. Sourced from <stdio.h>.
+
+   -get_config_env_int(): Return the value of a key as a number, which can be
+                          overridden from the environment. Sourced from
+                          "cache.h" (defined in config.c).
+
+   -memcmp(s1, s2, n): Compare memory. Sourced from <string.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -SHARED_INDEX_PREFIX: The start of the names of shared indexes.
+
+   -base_linked/base_id: Whether the index read was split, and the name of
+                         its shared index.
+
+   -base_cache/base_nr: The entries of the shared index.
+
+   -deleted/nr_deleted: The positions of the entries of the shared index
+                        that were removed.
+
+   -shared_index_path(): Build the path of a shared index.
+
+   -read_link_extension(): Read the "LINK" extension of the index.
+
+   -load_shared_index(): Map and check the shared index.
+
+   -merge_shared_index(): Merge the entries of the shared index into the
+                          `active_cache` array.
+
+   -remove_old_shared_indexes(): Remove the shared indexes no index uses.
+
+   -write_shared_index(): Write a new shared index.
+
+   -split_cache(): Decide which entries `write_cache()` writes, and build
+                   the "LINK" extension.
+*/
+
+#ifndef BGIT_WINDOWS
+    #define RENAME( src_file, target_file ) rename( src_file, target_file )
+    #define RENAME_FAIL -1
+#else
+    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
+                                                target_file, \
+                                                MOVEFILE_REPLACE_EXISTING )
+    #define RENAME_FAIL 0
+#endif
+
+/* The start of the names of shared indexes. */
+#define SHARED_INDEX_PREFIX "sharedindex."
+
+/* Whether the index read was split, and the name of its shared index. */
+static int base_linked;
+static unsigned char base_id[20];
+
+/* The entries of the shared index, once it is read or written. */
+static struct cache_entry **base_cache;
+static unsigned int base_nr;
+
+/* The positions of the entries of the shared index that were removed. */
+static unsigned int *deleted;
+static unsigned int nr_deleted;
+
+/*
+ * Function: `shared_index_path`
+ * Parameters:
+ *      -path: Where to store the path, `PATH_MAX` bytes at most.
+ *      -id: The name of the shared index.
+ * Purpose: Build the path of a shared index from its name.
+ */
+static void shared_index_path(char *path, const unsigned char *id)
+{
+    char hex[41];
+
+    hex_encode(hex, id, 20);
+    hex[40] = '\0';
+    sprintf(path, ".dircache/" SHARED_INDEX_PREFIX "%s", hex);
+}
+
+/*
+ * Function: `read_link_extension`
+ * Parameters:
+ *      -data: The data of the "LINK" extension of the index.
+ *      -size: Its size in bytes.
+ * Purpose: Remember which shared index the index was split from and which
+ *          of its entries were removed, for `merge_shared_index()`. Returns
+ *          -1 if the extension is garbled.
+ */
+int read_link_extension(const char *data, unsigned long size)
+{
+    unsigned int nr;
+
+    if (size < 24)
+        return error("bad index link extension");
+    memcpy(base_id, data, 20);
+    memcpy(&nr, data + 20, 4);
+    if ((size - 24) / 4 != nr || (size - 24) % 4)
+        return error("bad index link extension");
+    deleted = malloc(nr * sizeof(unsigned int) + 1);
+    memcpy(deleted, data + 24, nr * sizeof(unsigned int));
+    nr_deleted = nr;
+    base_linked = 1;
+    return 0;
+}
+
+/*
+ * Function: `load_shared_index`
+ * Parameters: none
+ * Purpose: Map the shared index named by the "LINK" extension, check it
+ *          like the index itself, and point `base_cache` at its entries.
+ *          It stays mapped until the command exits.
+ */
+static int load_shared_index(void)
+{
+    char path[PATH_MAX];
+    struct cache_header *hdr;
+    struct stat st;
+    unsigned long size, offset;
+    unsigned int i;
+    void *map;
+    int fd;
+
+    shared_index_path(path, base_id);
+    fd = OPEN_FILE(path, O_RDONLY, 0);
+    if (fd < 0)
+        return error("shared index missing");
+    if (fstat(fd, &st) < 0 || st.st_size <= sizeof(*hdr)) {
+        close(fd);
+        return error("shared index too small");
+    }
+    size = st.st_size;
+    map = map_fd(fd, size);
+    close(fd);
+    if (!map)
+        return error("unable to map shared index");
+
+    hdr = map;
+    if (hdr->signature != CACHE_SIGNATURE || hdr->version < 3 ||
+        hdr->version > CACHE_VERSION || hdr->entries > size / 8)
+        return error("bad shared index header");
+    if (verify_index_checksum(path, hdr, size, &st) < 0)
+        return -1;
+
+    /* The entries, each of which must be inside of the file. */
+    base_cache = malloc(hdr->entries * sizeof(*base_cache) + 1);
+    offset = sizeof(*hdr);
+    for (i = 0; i < hdr->entries; i++) {
+        struct cache_entry *ce = (struct cache_entry *) ((char *) map + offset);
+
+        if (size - offset < offsetof(struct cache_entry, name) ||
+            ce_size(ce) > size - offset)
+            return error("shared index cut short");
+        base_cache[i] = ce;
+        offset += ce_size(ce);
+    }
+    base_nr = hdr->entries;
+    return 0;
+}
+
+/*
+ * Function: `merge_shared_index`
+ * Parameters: none
+ * Purpose: If the index read by `read_cache()` was split, replace the
+ *          `active_cache` array, which holds the entries of the index, by
+ *          the entries of the shared index without the removed ones, and
+ *          with the entries of the index added or put in the place of those
+ *          with the same name. Both are sorted, so they are merged in one
+ *          pass. Returns -1 if the shared index cannot be read.
+ */
+int merge_shared_index(void)
+{
+    struct cache_entry **merged;
+    unsigned int i, j, k, d, alloc;
+
+    if (!base_linked)
+        return 0;
+    if (load_shared_index() < 0)
+        return -1;
+    for (d = 0; d < nr_deleted; d++)
+        if (deleted[d] >= base_nr || (d && deleted[d] <= deleted[d - 1]))
+            return error("bad index link extension");
+
+    alloc = alloc_nr(base_nr - nr_deleted + active_nr);
+    merged = calloc(alloc, sizeof(struct cache_entry *));
+    i = j = k = d = 0;
+    while (i < base_nr || j < active_nr) {
+        int cmp;
+
+        if (d < nr_deleted && deleted[d] == i) {
+            i++;
+            d++;
+            continue;
+        }
+        if (i == base_nr)
+            cmp = 1;
+        else if (j == active_nr)
+            cmp = -1;
+        else
+            cmp = cache_name_compare((char *) base_cache[i]->name,
+                                     base_cache[i]->namelen,
+                                     (char *) active_cache[j]->name,
+                                     active_cache[j]->namelen);
+        if (cmp < 0) {
+            merged[k++] = base_cache[i++];
+            continue;
+        }
+        if (!cmp)
+            i++;
+        merged[k++] = active_cache[j++];
+    }
+    free(active_cache);
+    active_cache = merged;
+    active_nr = k;
+    active_alloc = alloc;
+    return 0;
+}
+
+/*
+ * Function: `remove_old_shared_indexes`
+ * Parameters:
+ *      -keep1, keep2: The names of the shared indexes to keep, or NULL.
+ * Purpose: Remove the shared indexes, and their ".stat" files (see
+ *          index-checksum.c), other than the new one and the one the index
+ *          used until now, which is still needed if the new index is not
+ *          put in place.
+ */
+static void remove_old_shared_indexes(const unsigned char *keep1,
+                                      const unsigned char *keep2)
+{
+    int prefix_len = strlen(SHARED_INDEX_PREFIX);
+    char hex1[41], hex2[41], path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+
+    hex1[0] = hex2[0] = '\0';
+    if (keep1) {
+        hex_encode(hex1, keep1, 20);
+        hex1[40] = '\0';
+    }
+    if (keep2) {
+        hex_encode(hex2, keep2, 20);
+        hex2[40] = '\0';
+    }
+    dir = opendir(".dircache");
+    if (!dir)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        const char *hex = de->d_name + prefix_len;
+
+        if (strncmp(de->d_name, SHARED_INDEX_PREFIX, prefix_len) ||
+            strlen(hex) < 40 || (strcmp(hex + 40, "") &&
+                                 strcmp(hex + 40, ".stat")) ||
+            !strncmp(hex, hex1, 40) || !strncmp(hex, hex2, 40))
+            continue;
+        sprintf(path, ".dircache/%s", de->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+/*
+ * Function: `write_shared_index`
+ * Parameters:
+ *      -cache: The cache entries.
+ *      -entries: The number of entries.
+ * Purpose: Write all of the entries into a new shared index, named after
+ *          the SHA1 hash of its contents, which the index written next is
+ *          split from. The entries are collected into large writes, since
+ *          there may be millions of them. The caller holds the index lock,
+ *          so the temporary file cannot be in use.
+ */
+static int write_shared_index(struct cache_entry **cache, int entries)
+{
+    static char tmp_path[] = ".dircache/" SHARED_INDEX_PREFIX "lock";
+    char path[PATH_MAX], *buf;
+    struct index_checksum c;
+    struct sha1_ctx id_ctx;
+    struct cache_header hdr;
+    unsigned char id[20];
+    unsigned long len = 0;
+    int kind = index_checksum_kind(), fd, i;
+
+    hdr.signature = CACHE_SIGNATURE;
+    hdr.version = kind == INDEX_CHECKSUM_SHA1 ? 3 : CACHE_VERSION;
+    hdr.entries = entries;
+    index_checksum_init(&c, kind);
+    index_checksum_update(&c, &hdr, offsetof(struct cache_header, sha1));
+    for (i = 0; i < entries; i++)
+        index_checksum_update(&c, cache[i], ce_size(cache[i]));
+    index_checksum_final(hdr.sha1, &c);
+
+    fd = OPEN_FILE(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return error("unable to create shared index");
+    sha1_init(&id_ctx);
+    sha1_update(&id_ctx, &hdr, sizeof(hdr));
+    buf = malloc(64 * 1024);
+    memcpy(buf, &hdr, sizeof(hdr));
+    len = sizeof(hdr);
+    for (i = 0; i <= entries; i++) {
+        int size = i < entries ? ce_size(cache[i]) : 0;
+
+        if (len && (i == entries || len + size > 64 * 1024)) {
+            if (write(fd, buf, len) != len)
+                break;
+            len = 0;
+        }
+        if (i == entries)
+            break;
+        sha1_update(&id_ctx, cache[i], size);
+        if (size > 64 * 1024) {
+            if (write(fd, cache[i], size) != size)
+                break;
+            continue;
+        }
+        memcpy(buf + len, cache[i], size);
+        len += size;
+    }
+    free(buf);
+    if (close(fd) < 0 || i < entries || len) {
+        unlink(tmp_path);
+        return error("unable to write shared index");
+    }
+    sha1_final(id, &id_ctx);
+    shared_index_path(path, id);
+    if (RENAME(tmp_path, path) == RENAME_FAIL) {
+        unlink(tmp_path);
+        return error("unable to write shared index");
+    }
+    remove_old_shared_indexes(base_linked ? base_id : NULL, id);
+
+    /* The index written next is split from the new shared index. */
+    free(base_cache);
+    base_cache = malloc(entries * sizeof(*base_cache) + 1);
+    memcpy(base_cache, cache, entries * sizeof(*base_cache));
+    base_nr = entries;
+    memcpy(base_id, id, 20);
+    base_linked = 1;
+    return 0;
+}
+
+/*
+ * Function: `split_cache`
+ * Parameters:
+ *      -cache: The cache entries `write_cache()` was given, replaced by the
+ *              entries it writes into the index.
+ *      -entries: Their number, replaced too.
+ *      -link: Set to the data of the "LINK" extension, allocated with
+ *             `malloc()`, or to NULL if the index is not split.
+ *      -link_size: Set to the size of the extension.
+ * Purpose: If `index.split` is set, compare the entries against the shared
+ *          index, and leave only the entries that were added or changed in
+ *          `cache`, in a new array. The removed entries are listed in the
+ *          extension. A new shared index is written first when there is
+ *          none yet, or when the differences grew too large. Returns -1 if
+ *          it cannot be written.
+ */
+int split_cache(struct cache_entry ***cache, int *entries, void **link,
+                unsigned long *link_size)
+{
+    struct cache_entry **all = *cache, **changed;
+    int nr = *entries, max_percent, nr_changed = 0, i = 0;
+    unsigned int *removed, nr_removed = 0, b = 0;
+    char *p;
+
+    *link = NULL;
+    if (!get_config_env_int("index.split", 0))
+        return 0;
+    max_percent = get_config_env_int("index.splitmaxpercent", 20);
+
+    /*
+     * Walk the entries and those of the shared index side by side. Entries
+     * read from the shared index and not changed since are the same
+     * pointers, and the others are compared by name and contents.
+     */
+    changed = malloc(nr * sizeof(*changed) + 1);
+    removed = malloc(base_nr * sizeof(*removed) + 1);
+    while (i < nr || b < base_nr) {
+        int cmp;
+
+        if (b == base_nr)
+            cmp = -1;
+        else if (i == nr)
+            cmp = 1;
+        else if (all[i] == base_cache[b])
+            cmp = 0;
+        else
+            cmp = cache_name_compare((char *) all[i]->name, all[i]->namelen,
+                                     (char *) base_cache[b]->name,
+                                     base_cache[b]->namelen);
+        if (cmp < 0) {
+            changed[nr_changed++] = all[i++];
+        } else if (cmp > 0) {
+            removed[nr_removed++] = b++;
+        } else {
+            if (all[i] != base_cache[b] &&
+                (ce_size(all[i]) != ce_size(base_cache[b]) ||
+                 memcmp(all[i], base_cache[b], ce_size(all[i]))))
+                changed[nr_changed++] = all[i];
+            i++;
+            b++;
+        }
+    }
+
+    /* Start from a new shared index when the differences grew too large. */
+    if (!base_cache ||
+        (double) (nr_changed + nr_removed) * 100 > (double) base_nr *
+                                                  max_percent) {
+        if (write_shared_index(all, nr) < 0) {
+            free(changed);
+            free(removed);
+            return -1;
+        }
+        nr_changed = nr_removed = 0;
+    }
+
+    *link_size = 24 + nr_removed * sizeof(unsigned int);
+    *link = p = malloc(*link_size);
+    memcpy(p, base_id, 20);
+    memcpy(p + 20, &nr_removed, 4);
+    memcpy(p + 24, removed, nr_removed * sizeof(unsigned int));
+    free(removed);
+    *cache = changed;
+    *entries = nr_changed;
+    return 0;
+}
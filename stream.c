@@ -0,0 +1,484 @@
+/*
+ *  All documentation (comments) unless explicitly noted:
+ *
+ *      Copyright 2018, AnalytixBar LLC, Jacob Stopak
+ *
+ *  All code & explicitly labelled documentation (comments):
+ *
+ *      Copyright 2005, Linus Torvalds
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to define functions that read an object a
+ *  piece at a time. `read_sha1_file()` allocates memory for the whole
+ *  object and decompresses all of it before returning, so reading a blob
+ *  of several GB needs that much memory, and nothing can be done with the
+ *  data until all of it is there. An object stream instead decompresses
+ *  only as much as the caller asks for:
+ *
+ *      stream = open_object_stream(sha1, type, &size);
+ *      while ((n = read_object_stream(stream, buf, sizeof(buf))) > 0)
+ *          ... use n bytes of buf ...
+ *      close_object_stream(stream);
+ *
+ *  A loose object file is read from disk STREAM_CHUNK bytes at a time, and
+ *  a packed object is inflated straight from the mapped pack, so the memory
+ *  used does not depend on the size of the object. Objects that can only be
+ *  rebuilt as a whole (packed deltas, and zstd objects when zstd is not
+ *  built in, which `read_sha1_file()` reports as an error anyway) are read
+ *  with `read_sha1_file()` and then handed out from memory.
+ */
+#include "cache.h"
+#include "pack.h"
+#ifdef BGIT_ZSTD
+    #include <zstd.h>
+#endif
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h", "pack.h" and <zstd.h> header files, ranked in
+   order of first use in this file. Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -read(fd, buf, n): Read from a file. Sourced from <unistd.h>.
+
+   -inflate(z_stream, flush): Decompress as much data as possible. Sourced
+                              from <zlib.h>.
+
+   -ZSTD_decompressStream(): Decompress part of a zstd frame. Sourced from
+                             <zstd.h>.
+
+   -error(): Print an error message and return -1.
+
+   -find_pack_entry(): Search the packs for an object. Sourced from "pack.h"
+                       (defined in pack.c).
+
+   -packed_object_data(): Locate the deflated data of a packed object.
+
+   -packed_object_info(): Learn the type and size of a packed object from
+                          its entry headers.
+
+   -read_sha1_file(): Read a whole object into memory.
+
+   -sha1_file_name(): Build the path of a loose object.
+
+   -codec_detect(): Tell from its first bytes which codec wrote an object.
+                    Sourced from "cache.h" (defined in codec.c).
+
+   -inflateInit()/inflateEnd(): Start and end decompressing zlib data.
+
+   -ZSTD_createDStream()/ZSTD_initDStream()/ZSTD_freeDStream(): Start and
+        end decompressing a zstd frame. Sourced from <zstd.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -object_stream: The state of an open object stream.
+
+   -fill(): Read the next chunk of a loose object file.
+
+   -decompress(): Decompress the next bytes of an object.
+
+   -read_header(): Decompress and parse the "<type> <size>\0" header.
+
+   -release_stream(): Release the file and decompression state of a stream.
+
+   -start_loose(): Prepare to decompress a loose object file.
+
+   -open_object_stream(): Open an object for reading in pieces.
+
+   -read_object_stream(): Read the next piece of an object.
+
+   -close_object_stream(): Release an object stream.
+
+   -sha1_object_info(): Learn the type and size of an object without reading
+                        its data.
+*/
+
+/* How much of a loose object file is read from disk at a time. */
+#define STREAM_CHUNK (64 * 1024)
+
+/*
+ * How much of a loose object file is read at a time when only its header
+ * is wanted. The header is almost always in the first few dozen compressed
+ * bytes, after the Huffman tables of the first deflate block.
+ */
+#define HEADER_CHUNK 512
+
+/* How the data of an object stream is produced. */
+#define STREAM_INFLATE 0   /* Inflated from a zlib stream. */
+#define STREAM_ZSTD    1   /* Decompressed from a zstd frame. */
+#define STREAM_MEMORY  2   /* Copied from an object read into memory. */
+
+/* Template of the state of an open object stream. */
+struct object_stream {
+    int kind;                /* One of the STREAM_* values above. */
+    int fd;                  /* The loose object file, or -1. */
+    int eof;                 /* Whether the whole file has been read. */
+    unsigned long left;      /* Bytes of object data not read yet. */
+    z_stream z;              /* The zlib state, for STREAM_INFLATE. */
+#ifdef BGIT_ZSTD
+    ZSTD_DStream *zs;        /* The zstd state, for STREAM_ZSTD. */
+#endif
+    char *buf;               /* The object data, for STREAM_MEMORY. */
+    unsigned long pos;       /* How much of `buf` has been read. */
+    unsigned char *in;       /* Compressed bytes not decompressed yet. */
+    unsigned long in_len;
+    unsigned char *chunk;    /* Chunk of a loose object file. */
+    unsigned long chunk_size;
+};
+
+/*
+ * Function: `fill`
+ * Parameters:
+ *      -st: An object stream.
+ * Purpose: When all compressed bytes read so far have been used, read the
+ *          next chunk of a loose object file. Packed objects are mapped as
+ *          a whole, so there is nothing to read for them. Returns -1 on a
+ *          read error.
+ */
+static int fill(struct object_stream *st)
+{
+    long n;
+
+    if (st->in_len || st->fd < 0 || st->eof)
+        return 0;
+    n = read(st->fd, st->chunk, st->chunk_size);
+    if (n < 0)
+        return -1;
+    if (!n)
+        st->eof = 1;
+    st->in = st->chunk;
+    st->in_len = n;
+    return 0;
+}
+
+/*
+ * Function: `decompress`
+ * Parameters:
+ *      -st: An object stream.
+ *      -out: Where to store the decompressed bytes.
+ *      -len: How many bytes to decompress.
+ * Purpose: Decompress exactly `len` more bytes of the object, header
+ *          included, reading more of the file as needed. Returns -1 if the
+ *          compressed data ends early or is corrupt.
+ */
+static int decompress(struct object_stream *st, void *out, unsigned long len)
+{
+    unsigned char *p = out;
+
+    while (len) {
+        unsigned long done, used;
+
+        if (fill(st) < 0)
+            return -1;
+        if (st->kind == STREAM_INFLATE) {
+            int ret;
+
+            st->z.next_in = st->in;
+            st->z.avail_in = st->in_len;
+            st->z.next_out = p;
+            st->z.avail_out = len;
+            ret = inflate(&st->z, Z_NO_FLUSH);
+            used = st->in_len - st->z.avail_in;
+            done = len - st->z.avail_out;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                return -1;
+            if (ret == Z_STREAM_END && done < len)
+                return -1;
+        }
+#ifdef BGIT_ZSTD
+        else {
+            ZSTD_inBuffer zin = { st->in, st->in_len, 0 };
+            ZSTD_outBuffer zout = { p, len, 0 };
+
+            if (ZSTD_isError(ZSTD_decompressStream(st->zs, &zout, &zin)))
+                return -1;
+            used = zin.pos;
+            done = zout.pos;
+        }
+#else
+        else {
+            return -1;
+        }
+#endif
+        st->in += used;
+        st->in_len -= used;
+        p += done;
+        len -= done;
+        /* Out of input with nothing more to read: the object is cut off. */
+        if (!done && !used && (st->fd < 0 || st->eof))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: `read_header`
+ * Parameters:
+ *      -st: An object stream positioned at the start of a loose object.
+ *      -type: Filled in with the object type.
+ *      -size: Filled in with the size of the object data.
+ * Purpose: Decompress the "<type> <size>\0" header of a loose object one
+ *          byte at a time, so that the first byte of data is not consumed,
+ *          and parse it.
+ */
+static int read_header(struct object_stream *st, char *type,
+                       unsigned long *size)
+{
+    char hdr[64];
+    int i;
+
+    for (i = 0; i < sizeof(hdr); i++) {
+        if (decompress(st, hdr + i, 1) < 0)
+            return -1;
+        if (!hdr[i])
+            break;
+    }
+    if (i == sizeof(hdr) || sscanf(hdr, "%10s %lu", type, size) != 2)
+        return -1;
+    return 0;
+}
+
+/*
+ * Function: `release_stream`
+ * Parameters:
+ *      -st: An object stream.
+ * Purpose: Release the file and the decompression state of an object
+ *          stream.
+ */
+static void release_stream(struct object_stream *st)
+{
+    if (st->fd >= 0)
+        close(st->fd);
+    st->fd = -1;
+    if (st->kind == STREAM_INFLATE)
+        inflateEnd(&st->z);
+#ifdef BGIT_ZSTD
+    if (st->zs)
+        ZSTD_freeDStream(st->zs);
+    st->zs = NULL;
+#endif
+}
+
+/*
+ * Function: `close_object_stream`
+ * Parameters:
+ *      -st: An object stream, or NULL.
+ * Purpose: Release the file, the decompression state and the memory of an
+ *          object stream.
+ */
+void close_object_stream(struct object_stream *st)
+{
+    if (!st)
+        return;
+    release_stream(st);
+    free(st->buf);
+    free(st);
+}
+
+/*
+ * Function: `start_loose`
+ * Parameters:
+ *      -st: An object stream whose `fd` is an open loose object file.
+ * Purpose: Read the first chunk of the file, tell from it which codec wrote
+ *          the object and prepare to decompress it. Returns the codec, or -1
+ *          if the file cannot be read or the codec is not built in.
+ */
+static int start_loose(struct object_stream *st)
+{
+    int codec;
+
+    if (fill(st) < 0)
+        return -1;
+
+    /* See codec.c for how the codec is told from the first bytes. */
+    codec = codec_detect(st->in, st->in_len);
+    switch (codec) {
+    case CODEC_ZLIB:
+        inflateInit(&st->z);
+        return codec;
+#ifdef BGIT_ZSTD
+    case CODEC_ZSTD:
+        st->kind = STREAM_ZSTD;
+        st->zs = ZSTD_createDStream();
+        if (!st->zs)
+            return -1;
+        ZSTD_initDStream(st->zs);
+        return codec;
+#endif
+    }
+    /* Do not let `release_stream()` end a zlib state never started. */
+    st->kind = STREAM_MEMORY;
+    return -1;
+}
+
+/*
+ * Function: `open_memory_stream`
+ * Parameters:
+ *      -st: A new object stream.
+ *      -sha1, type, size: As for `open_object_stream()`.
+ * Purpose: Read the whole object with `read_sha1_file()`, for objects that
+ *          cannot be decompressed in pieces.
+ */
+static struct object_stream *open_memory_stream(struct object_stream *st,
+                                                unsigned char *sha1,
+                                                char *type,
+                                                unsigned long *size)
+{
+    st->kind = STREAM_MEMORY;
+    st->buf = read_sha1_file(sha1, type, size);
+    if (!st->buf) {
+        close_object_stream(st);
+        return NULL;
+    }
+    st->left = *size;
+    return st;
+}
+
+/*
+ * Function: `open_object_stream`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the object to read.
+ *      -type: Filled in with the object type (blob, tree, or commit).
+ *      -size: Filled in with the size in bytes of the object data.
+ * Purpose: Open an object for reading with `read_object_stream()`. Returns
+ *          NULL if the object does not exist or its header is corrupt.
+ */
+struct object_stream *open_object_stream(unsigned char *sha1, char *type,
+                                         unsigned long *size)
+{
+    struct object_stream *st = calloc(1, sizeof(*st) + STREAM_CHUNK);
+    struct pack_entry e;
+    char *filename;
+
+    if (!st)
+        return NULL;
+    st->fd = -1;
+    st->chunk = (unsigned char *)(st + 1);
+    st->chunk_size = STREAM_CHUNK;
+
+    /*
+     * A packed object stored in full is inflated straight from the mapped
+     * pack. Its type and size are in the pack entry header, not in the
+     * deflated data.
+     */
+    if (find_pack_entry(sha1, &e)) {
+        st->in = packed_object_data(&e, type, size, &st->in_len);
+        if (!st->in)
+            return open_memory_stream(st, sha1, type, size);
+        inflateInit(&st->z);
+        st->left = *size;
+        return st;
+    }
+
+    filename = sha1_file_name(sha1);
+    st->fd = OPEN_FILE(filename, O_RDONLY, 0);
+    if (st->fd < 0) {
+        perror(filename);
+        free(st);
+        return NULL;
+    }
+    /*
+     * A codec that is not built in is left to `read_sha1_file()`, which
+     * reports the error.
+     */
+    if (start_loose(st) < 0) {
+        release_stream(st);
+        st->in_len = 0;
+        return open_memory_stream(st, sha1, type, size);
+    }
+
+    if (read_header(st, type, size) < 0)
+        goto corrupt;
+    st->left = *size;
+    return st;
+
+corrupt:
+    error("corrupt object file");
+    close_object_stream(st);
+    return NULL;
+}
+
+/*
+ * Function: `read_object_stream`
+ * Parameters:
+ *      -st: An object stream.
+ *      -buf: Where to store the data.
+ *      -len: The most bytes to read.
+ * Purpose: Read the next bytes of the object data into `buf`. Returns the
+ *          number of bytes read, which is less than `len` only at the end of
+ *          the object, 0 once the whole object has been read, or -1 if the
+ *          object is corrupt.
+ */
+long read_object_stream(struct object_stream *st, void *buf,
+                        unsigned long len)
+{
+    if (len > st->left)
+        len = st->left;
+    if (!len)
+        return 0;
+
+    if (st->kind == STREAM_MEMORY) {
+        memcpy(buf, st->buf + st->pos, len);
+        st->pos += len;
+    } else if (decompress(st, buf, len) < 0) {
+        return error("corrupt object data");
+    }
+    st->left -= len;
+    return len;
+}
+
+/*
+ * Function: `sha1_object_info`
+ * Parameters:
+ *      -sha1: The SHA1 hash of an object.
+ *      -type: Filled in with the object type (blob, tree, or commit).
+ *      -size: Filled in with the size in bytes of the object data.
+ * Purpose: Learn the type and size of an object without reading its data.
+ *          The answer is in the "<type> <size>\0" header at the start of a
+ *          loose object, so only the header is decompressed, from the first
+ *          HEADER_CHUNK bytes of the file or a little more. For a packed
+ *          object only the entry headers are read (see pack.c). Returns -1 if
+ *          the object does not exist or is corrupt.
+ */
+int sha1_object_info(unsigned char *sha1, char *type, unsigned long *size)
+{
+    struct object_stream st;
+    unsigned char chunk[HEADER_CHUNK];
+    struct pack_entry e;
+    char *filename;
+    int ret;
+
+    if (find_pack_entry(sha1, &e))
+        return packed_object_info(&e, type, size);
+
+    filename = sha1_file_name(sha1);
+    memset(&st, 0, sizeof(st));
+    st.fd = OPEN_FILE(filename, O_RDONLY, 0);
+    if (st.fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    st.chunk = chunk;
+    st.chunk_size = sizeof(chunk);
+
+    ret = start_loose(&st);
+    if (ret >= 0)
+        ret = read_header(&st, type, size);
+    release_stream(&st);
+    if (ret < 0)
+        return error("corrupt object file");
+    return 0;
+}
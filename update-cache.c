@@ -29,16 +29,18 @@
  *  in the README, the "Current Directory Cache"), which is stored 
  *  in the .dircache/index file by default. This can be thought of
  *  as the "Staging Area" where changes ready to be committed are
- *  built up.
+ *  built up. With `-r`, a directory given as an argument adds every
+ *  file below it.
  *
  *  The `main` function in this file will run when ./update-cache
  *  executable is run from the command line.
  */
 
 #include "cache.h"
-/* The above 'include' allows use of the following functions and
-   variables from "cache.h" header file, ranked in order of first use
-   in this file. Most are functions/macros from standard C libraries
+#include <pthread.h>
+/* The above 'include's allow use of the following functions and
+   variables from "cache.h" and <pthread.h> header files, ranked in order
+   of first use in this file. Most are functions/macros from standard C libraries
    that are `#included` in "cache.h". Function names are followed by
    parenthesis whereas variable/struct names are not:
 
@@ -60,30 +62,25 @@
    -sizeof(datatype): Operator that gives the number of bytes needed to store 
                       a datatype or variable. 
 
-   -z_stream: General-purpose compression/decompression stream. Sourced from
-              <zlib.h>.
-
    -malloc(size): Allocate unused space for an object whose size in bytes is 
                   specified by `size` and whose value is unspecified. Sourced 
                   from <stdlib.h>.
 
-   -mmap(addr, len, prot, flags, file_descriptor, offset): 
-        Establish a mapping between a process' address space and a file, 
-        shared memory object, or typed memory object. Sourced from 
-        <sys/mman.h>.
+   -write(fd, buf, n): Write `n` bytes from buffer `buf` to the file
+                       associated with `fd`. Sourced from <unistd.h>.
+
+   -read(fd, buf, n): Read up to `n` bytes from the file associated with
+                      `fd` into `buf`. Sourced from <unistd.h>.
+
+   -object_hash(): Return the hash algorithm objects are named with, whose
+                   init()/update()/final() functions hash with a
+                   `hash_ctx`. Sourced from "cache.h" (defined in hash.c).
 
-   -PROT_READ: Flag for the mmap() function's `prot` parameter describing
-               the desired memory protection of the mapping. `PROT_READ`
-               indicates that pages may be read. Sourced from <sys/mman.h>.
-                
-   -MAP_PRIVATE: Flag for the mmap() function's `flags` parameter describing
-                 the desired memory protection of the mapping. `MAP_PRIVATE`
-                 indicates that changes to the mapped data are private to the
-                 calling process and should not change the underlying object.
-                 Sourced from <sys/mman.h>.
+   -map_fd(): Map the contents of an open file into memory. Sourced from
+              "cache.h" (defined in read-cache.c).
 
-   -SHA_CTX: SHA context structure used to store information related to the
-             process of hashing the content. Sourced from <openssl/sha.h>.
+   -munmap(addr, len): Remove a mapping made with mmap(). Sourced from
+                       <sys/mman.h>.
 
    -close(fd): Deallocate the file descriptor `fd`. The file descriptor `fd` 
                will be made available to subsequent calls to open() or other 
@@ -91,59 +88,75 @@
                the process on the file associated with `fd`. Sourced from
                <unistd.h>.
 
+   -repository_format_version(): Return how objects are named in this
+                                 repository. Sourced from "cache.h" (defined
+                                 in config.c).
+
+   -has_sha1_file(): Check whether an object already exists.
+
+   -object_filter_add(): Add a new loose object to the filter of loose
+                         objects. Sourced from "cache.h" (defined in
+                         object-filter.c).
+
    -memset(void *s, int c, size_t n): Copies `c` (converted to an unsigned
                                       char) into each of the first `n` bytes
                                       of the object pointed to by `s`.
 
-   -deflateInit(z_stream, level): Initializes the internal `z_stream` state 
-                                  for compression at `level`, which indicates 
-                                  the scale of speed versus compression on a 
-                                  scale from 0 to 9. Sourced from <zlib.h>.
+   -lseek(fd, offset, whence): Move the offset of the file associated with
+                               `fd`. Sourced from <unistd.h>.
 
-   -Z_BEST_COMPRESSION: Translates to compression level 9, which, as an input 
-                        to `deflateInit()`, indicates optimizing compression
-                        size as opposed to compression speed. Sourced from
-                        <zlib.h>.
+   -compression_level_fd(): Choose the compression level for an object read
+                            from a file. Sourced from "cache.h" (defined in
+                            compress.c).
+
+   -get_object_directory(): Return the path to the object store.
+
+   -mkstemp(template): Create and open a uniquely named temporary file.
+                       Sourced from <stdlib.h>.
+
+   -compression_clock(): Return the CPU time used by the calling thread.
+                         Sourced from "cache.h" (defined in compress.c).
+
+   -compression_done(): Record the outcome of compressing an object for the
+                        compression report. Sourced from "cache.h" (defined
+                        in compress.c).
 
    -sprintf(s, message, ...): Writes `message` string constant to string 
                               variable `s` followed by the null character 
                               '\0'. Sourced from <stdio.h>.
 
-   -deflate(z_stream, flush): Compresses as much data as possible and stops
-                              when the input buffer becomes empty or the
-                              output buffer becomes full. Sourced from 
-                              <zlib.h>.
+   -object_codec(): Return the codec to compress objects with. Sourced from
+                    "cache.h" (defined in codec.c).
 
-   -Z_OK: Successful zlib return code. It is equal to 0. Sourced from 
-          <zlib.h>.
+   -codec_stream_init()/codec_stream_compress()/codec_stream_end(): Compress
+        an object a piece at a time. Sourced from "cache.h" (defined in
+        codec.c).
 
-   -Z_FINISH: Flush value for zlib that specifies processing of remaining 
-              input. It is equal to 4. Sourced from <zlib.h>.
+   -unlink(path): Remove a file. Sourced from <unistd.h>.
 
-   -deflateEnd(z_stream): All dynamically allocated data structures for
-                          `z_stream` are freed. Sourced from <zlib.h>.
+   -chmod(path, mode): Change the permissions of a file. Sourced from
+                       <sys/stat.h>.
 
-   -SHA1_Init(SHA_CTX *c): Initializes a SHA_CTX structure. Sourced from 
-                           <openssl/sha.h>. 
+   -umask(mask): Set the file creation mask, returning the old one.
+                 Sourced from <sys/stat.h>.
 
-   -SHA1_Update(SHA_CTX *c, const void *data, size_t len): 
-        Can be called repeatedly to calculate the hash value of chunks of data 
-        (len bytes from data). Sourced from <openssl/sha.h>.
+   -sha1_batch(sha1s, bufs, lens, nr): Hash many messages at once. Sourced
+                                       from "cache.h" (defined in sha1.c).
 
-   -SHA1_Final(unsigned char *md, SHA_CTX *c): 
-        Places the message digest in md, which must have space for 20 bytes of 
-        output, and erases the `c` SHA_CTX structure. Sourced from 
-        <openssl/sha.h>.
+   -free(ptr): Release memory allocated by malloc(). Sourced from
+               <stdlib.h>.
 
    -stat: Structure pointer used by stat() function to store information
           related to a filesystem file. Sourced from <sys/stat.h>.
 
-   -open(path, flags, perms): Open file in `path` for reading and/or writing 
-                              as specified in `flags` and return a file 
-                              descriptor that refers to the open file
-                              description. If the file does not exist, it is
-                              created with the permssions in `perms`. Sourced 
-                              from <fcntl.h>.
+   -OPEN_FILE(path, flags, perms): Open file in `path` for reading and/or
+                                   writing as specified in `flags` and return
+                                   a file descriptor that refers to the open
+                                   file description. If the file does not
+                                   exist, it is created with the permssions
+                                   in `perms`. Sourced from "cache.h", which
+                                   calls open() from <fcntl.h>, in binary
+                                   mode on Windows.
 
    -O_RDONLY: Flag for the open() function indicating to open the file for
               reading only. Sourced from <fcntl.h>.
@@ -163,17 +176,6 @@
    -memcpy(s1, s2, n): Copy n bytes from the object pointed to by s2 into the 
                        object pointed to by s1.
 
-   -cache_header: Structure representing header information for the cache.
-                  Sourced from "cache.h".
-
-   -CACHE_SIGNATURE: #Defined as `0x44495243`. Sourced from "cache.h".
-
-   -offsetof(type, member): Macro that expands to an integral constant 
-                            expression of type std::size_t, the value of which 
-                            is the offset, in bytes, from the beginning of an 
-                            object of specified type to its specified member, 
-                            including padding if any. Sourced from <stddef.h>.
-
    -perror(message): Write `message` to standard error stream. Sourced from 
                      <stdio.h>.
 
@@ -194,6 +196,61 @@
                       of the file to be renamed. `new` points to the new 
                       pathname of the file. Sourced from <stdio.h>.
 
+   -strdup(str): Copy a string into newly allocated memory. Sourced from
+                 <string.h>.
+
+   -pthread_mutex_lock()/pthread_mutex_unlock(): Lock and unlock a mutex.
+                                                 Sourced from <pthread.h>.
+
+   -pthread_cond_wait()/pthread_cond_signal()/pthread_cond_broadcast(): Wait
+        for and announce a change. Sourced from <pthread.h>.
+
+   -pthread_create()/pthread_join(): Start and wait for a thread.
+
+   -sysconf(_SC_NPROCESSORS_ONLN): Return the number of online CPUs.
+                                   Sourced from <unistd.h>.
+
+   -get_config_env_int(): Return the value of a setting as a number, which
+                          can be overridden from the environment. Sourced
+                          from "cache.h" (defined in config.c).
+
+   -compression_threads(), hash_threads(): Read the settings of compress.c
+                                           and hash.c, so that they are read
+                                           before the lock file is created
+                                           and before there are other
+                                           threads.
+
+   -check_index_settings(): Check the settings of the index checksum.
+                            Sourced from "cache.h" (defined in
+                            index-checksum.c).
+
+   -walk_directory(): List the files below a directory, reading the
+                      directories on several threads. Sourced from "cache.h"
+                      (defined in dir-walk.c).
+
+   -strcmp(str1, str2): Compare two strings. Sourced from <string.h>.
+
+   -usage(): Print a usage message and exit. Sourced from "cache.h" (defined
+             in read-cache.c).
+
+   -cache_tree_invalidate_path(): Mark the trees above a path as changed.
+                                  Sourced from "cache.h" (defined in
+                                  cache-tree.c).
+
+   -write_cache(): Write the header, the entries and the extensions of the
+                   index. Sourced from "cache.h" (defined in read-cache.c).
+
+   -stat(path, buf): Obtain information about the file in `path`, here to
+                     find out whether it is a directory. Sourced from
+                     <sys/stat.h>.
+
+   -read_path(): Read the next path given on standard input. Sourced from
+                 "cache.h" (defined in read-cache.c).
+
+   -cache_name_pos(): Determines the lexicographic position of a cache entry
+                      in the active_cache array. Sourced from "cache.h"
+                      (defined in read-cache.c).
+
    ****************************************************************
 
    The following variables and functions are defined in this source file.
@@ -208,33 +265,76 @@
 
    -verify_path(): Checks if a file path is a valid path.
 
-   -add_file_to_cache(): Get information about the file to add to the cache, 
-                         store the file metadata in a cache_entry structure, 
-                         then call the `index_fd()` function to construct a 
-                         blob object and write it to the object store, and the 
-                         `add_cache_entry()` function to insert the cache 
-                         entry into the `active_cache` array 
+   -blob_writer: The state of a blob object being written.
+
+   -write_compressed(): Append compressed output to an object file.
+
+   -read_chunk(): Read the next chunk of a file being added.
+
+   -file_to_add: A file being added to the cache.
+
+   -open_file_to_add(): Open a file to add, and read it if it is small.
+
+   -hash_file(): Hash a file too large to be hashed with others.
+
+   -deflate_file(): Construct a blob object and compress it into a temporary
+                    file in the object store.
+
+   -object_mode: The permissions of new objects.
+
+   -install_object(): Give a new blob object its name in the object store.
+
+   -release_file(): Close a file and free what is left of it.
+
+   -add_file_to_cache(): Store the metadata of a file to add to the cache in
+                         a cache_entry structure, give its blob object its
+                         name in the object store, and call the
+                         `add_cache_entry()` function to insert the cache
+                         entry into the `active_cache` array
                          lexicographically.
 
-   -index_fd(): Constructs a blob object, compresses it, calculates the SHA1 
-                hash of the compressed blob object, then write the blob object 
-                to the object database.
+   -update_batch: A batch of files being added together.
 
-   -add_cache_entry(): Inserts a cache entry into the active_cache array
-                       lexicographically.
+   -update_pipeline/pipeline: The stages files are added in, and the
+                              threads that run them.
+
+   -read_batch(): Open and hash a batch of files.
+
+   -pick_new_objects(): Find the files of a batch whose objects are new.
 
-   -cache_name_pos(): Determines the lexicographic position of a cache entry 
-                      in the active_cache array.
+   -deflate_batch(): Compress the new objects of a batch.
 
-   -cache_name_compare(): Compares the names of two cache entries
-                          lexicographically.
+   -merge_batch(): Add a batch of files to the cache in order.
+
+   -find_work(): Find a batch for a thread to work on.
+
+   -work_on_batch(): Run the read or deflate stage on a batch.
+
+   -update_worker(): The function each thread runs.
+
+   -pipeline_step(): Move the pipeline on from the main thread.
+
+   -update_threads(): Return how many threads add files.
+
+   -start_update(): Set up the pipeline and start its threads.
+
+   -queue_batch(): Hand a full batch to the read stage.
+
+   -update_path(): Queue a file to add.
+
+   -finish_update(): Wait for the queued files and stop the threads.
+
+   -add_directory(): Queue every file below a directory.
+
+   -add_argument(): Queue the file or directory named by a path given on
+                    the command line or on standard input.
+
+   -add_cache_entry(): Inserts a cache entry into the active_cache array
+                       lexicographically.
 
    -remove_file_from_cache(): Removes a file's cache entry from the
                               active_cache array.
 
-   -write_cache(): Constructs the cache header, calculates the SHA1 hash of 
-                   the cache, and then writes them to the 
-                   `.dircache/index.lock` file.
 */
 
 #ifndef BGIT_WINDOWS
@@ -247,65 +347,6 @@
     #define RENAME_FAIL 0 
 #endif
 
-/*
- * Function: `cache_name_compare`
- * Parameters:
- *      -name1: The name of the first file to compare.
- *      -len1: The length of name1.
- *      -name2: The name of the second file to compare.
- *      -len2: The length of name2.
- * Purpose: Compare the names of two cache entries lexicographically.
- */
-static int cache_name_compare(const char *name1, int len1, const char *name2, 
-                              int len2)
-{
-    int len = len1 < len2 ? len1 : len2;   /* len is the shorter length. */
-    int cmp;
-
-    cmp = memcmp(name1, name2, len);
-    if (cmp)           /* First len characters are different. */
-        return cmp;
-    if (len1 < len2)   /* First len characters are the same. */
-        return -1;
-    if (len1 > len2)   /* First len characters are the same. */
-        return 1;
-    return 0;          /* Exact match. */
-}
-
-/*
- * Function: `cache_name_pos`
- * Parameters:
- *      -name: The path of the file to be cached.
- *      -namelen: The length of the path.
- * Purpose: Determine the lexicographic position of a cache entry in the
- *          active_cache array.
- */
-static int cache_name_pos(const char *name, int namelen)
-{
-    /* Declare and initialize the indexes for the binary search. */
-    int first, last;
-    first = 0;
-    last = active_nr;
-
-    /*
-     * Perform a binary search to determine the lexicographic position of the 
-     * cache entry in the active_cache array.
-     */
-    while (last > first) {
-        int next = (last + first) >> 1;   /* Division by 2. */
-        struct cache_entry *ce = active_cache[next];
-        int cmp = cache_name_compare(name, namelen, ce->name, ce->namelen);
-        if (!cmp)            /* Exact match found. */
-            return -next-1;
-        if (cmp < 0) {
-            last = next;
-            continue;
-        }
-        first = next+1;
-    }
-    return first;
-}
-
 /*
  * Function: `remove_file_from_cache`
  * Parameters:
@@ -316,12 +357,15 @@ static int remove_file_from_cache(char *path)
 {
     int pos = cache_name_pos(path, strlen(path));
     if (pos < 0) {   /* If exact match found. */
+        /* The trees of the directories above the path change. */
+        cache_tree_invalidate_path(active_cache_tree, path);
         pos = -pos-1;
         active_nr--;
         if (pos < active_nr)
             memmove(active_cache + pos, active_cache + pos + 1, 
                     (active_nr - pos - 1) * sizeof(struct cache_entry *));
     }
+    return 0;
 }
 
 /*
@@ -340,11 +384,24 @@ static int add_cache_entry(struct cache_entry *ce)
     int pos;   
     pos = cache_name_pos(ce->name, ce->namelen);
 
-    /* Linus Torvalds: existing match? Just replace it */
+    /*
+     * Linus Torvalds: existing match? Just replace it
+     *
+     * The trees of the directories above the path only change if the blob
+     * object or the mode of the file did (see cache-tree.c), so re-adding
+     * unchanged files does not make `write-tree` build them again.
+     */
     if (pos < 0) {
+        struct cache_entry *old = active_cache[-pos-1];
+
+        if (memcmp(old->sha1, ce->sha1, object_hash()->rawsz) ||
+            old->st_mode != ce->st_mode)
+            cache_tree_invalidate_path(active_cache_tree,
+                                       (const char *) ce->name);
         active_cache[-pos-1] = ce;
         return 0;
     }
+    cache_tree_invalidate_path(active_cache_tree, (const char *) ce->name);
 
     /*
      * Make sure the `active_cache` array has space for the additional cache
@@ -366,198 +423,430 @@ static int add_cache_entry(struct cache_entry *ce)
 }
 
 /*
- * Function: `index_fd`
+ * How much of a large file is read at a time. The memory used to add a file
+ * does not depend on its size.
+ */
+#define INDEX_CHUNK (64 * 1024)
+
+/*
+ * Template of the state of a blob object being written: the temporary file
+ * it is written to, and in the original format the hash of the compressed
+ * output, which is the object's name.
+ */
+struct blob_writer {
+    int fd;                    /* The temporary object file. */
+    int hash_output;           /* Whether to hash the compressed output. */
+    const struct hash_algo *algo;   /* The hash algorithm of object names. */
+    struct hash_ctx c;         /* The hash of the compressed output. */
+    unsigned long size;        /* The size of the compressed output. */
+};
+
+/*
+ * Function: `write_compressed`
+ * Parameters:
+ *      -buf, len: A piece of compressed output.
+ *      -data: The `blob_writer`.
+ * Purpose: Callback for `codec_stream_compress()`. Appends compressed output
+ *          to the temporary object file.
+ */
+static int write_compressed(const void *buf, unsigned long len, void *data)
+{
+    struct blob_writer *w = data;
+    const char *p = buf;
+
+    if (w->hash_output)
+        w->algo->update(&w->c, buf, len);
+    w->size += len;
+    while (len) {
+        long n = write(w->fd, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Function: `read_chunk`
  * Parameters:
- *      -path: The path of the file to add to the object store.
- *      -namelen: The length of the path/filename to add.
- *      -ce: The cache entry structure corresponding to the file.
- *      -fd: The file descriptor associated with the file to be added.
- *      -st: The `stat` object containing info about the file to be added.
- * Purpose: Construct a blob object, compress it, calculate the SHA1 hash of
- *          the compressed blob object, then write the blob object to the 
- *          object database.
- */ 
-static int index_fd(const char *path, int namelen, struct cache_entry *ce, 
-                    int fd, struct stat *st)
+ *      -fd: The file being added.
+ *      -buf: Where to store the chunk.
+ *      -left: How many bytes of the file are left.
+ * Purpose: Read the next INDEX_CHUNK bytes of a file, or what is left of it.
+ *          Returns -1 if the file is shorter than its `stat` size said, i.e.
+ *          it was changed while it was being added.
+ */
+static long read_chunk(int fd, char *buf, unsigned long left)
 {
-    /* Declare zlib z_stream structure. */
-    z_stream stream;
-    /* Number of bytes to allocate for next compressed output. */
-    int max_out_bytes = namelen + st->st_size + 200; 
-    /* Allocate `max_out_bytes` of space to store next compressed output. */
-    void *out = malloc(max_out_bytes);
-    /* Allocate space to store file metadata. */
-    void *metadata = malloc(namelen + 200);
-
-    /* Map contents of file to be cached to memory. */
-    #ifndef BGIT_WINDOWS
-    void *in = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    #else
-    void *fhandle = CreateFileMapping( (HANDLE) _get_osfhandle(fd), NULL, 
-                                       PAGE_READONLY, 0, 0, NULL );
-    if (!fhandle)
-        return -1;
+    unsigned long want = left < INDEX_CHUNK ? left : INDEX_CHUNK;
+    unsigned long got = 0;
 
-    void *in = MapViewOfFile( fhandle, FILE_MAP_READ, 0, 0, st->st_size );
-    CloseHandle( fhandle );
-    #endif
+    while (got < want) {
+        long n = read(fd, buf + got, want - got);
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return got;
+}
 
-    /* Declare an SHA context structure. */
-    SHA_CTX c;
+/*
+ * How many files are read, hashed and compressed together, and how large a
+ * file may be to be hashed that way. Both bound the memory used: at most
+ * UPDATE_BATCH files of BATCH_FILE_MAX bytes are held per batch, and there
+ * are two batches per thread.
+ */
+#define UPDATE_BATCH 16
+#define BATCH_FILE_MAX INDEX_CHUNK
 
-    /* Release the file descriptor `fd` since we no longer need it. */
-    close(fd);
+/*
+ * Template of a file being added to the cache. The threads fill it in (see
+ * `read_batch()` and `deflate_batch()`), and the main thread adds it to the
+ * object store and index (see `add_file_to_cache()`).
+ */
+struct file_to_add {
+    char *path;                /* The path of the file. */
+    int free_path;             /* Whether `path` is freed once added. */
+    int fd;                    /* The open file, or -1. */
+    int err;                   /* The errno if it could not be opened. */
+    struct stat st;            /* The file's `stat` information. */
+    char *data;                /* Small files: the "blob <size>\0" header */
+    unsigned long len;         /* and contents, and their length. */
+    unsigned char sha1[MAX_RAWSZ];   /* The name of the blob object. */
+    int deflate;               /* Whether the object must be written. */
+    char *tmpfile;             /* The compressed object, not named yet. */
+    const char *failed;        /* Why the file could not be added, or NULL. */
+};
 
-    #ifndef BGIT_WINDOWS
-    /* Return -1 if memory allocation for the `out` or `in` memory failed. */
-    if (!out || (int)(long)in == -1)
-        return -1;
-    #else
-    if (!out || in == (void *) NULL)
-        return -1;
-    #endif
+/*
+ * Function: `open_file_to_add`
+ * Parameters:
+ *      -f: The file to open, whose `path` is set.
+ *      -content_ids: Whether objects are named by their contents.
+ * Purpose: Open a file to add to the cache and get its `stat` information.
+ *          In a repository that names objects by their contents, a small
+ *          file is also read into memory with its blob header, to be hashed
+ *          together with the others. If anything goes wrong, it is left for
+ *          `add_file_to_cache()` to report, in the order the files were
+ *          given.
+ */
+static void open_file_to_add(struct file_to_add *f, int content_ids)
+{
+    int hdrlen;
+
+    f->data = NULL;
+    f->tmpfile = NULL;
+    f->failed = NULL;
+    f->err = 0;
+    f->deflate = !content_ids;
+    f->fd = OPEN_FILE(f->path, O_RDONLY, 0);
+    if (f->fd < 0) {
+        f->err = errno;
+        return;
+    }
+    if (fstat(f->fd, &f->st) < 0) {
+        f->err = errno;
+        close(f->fd);
+        f->fd = -1;
+        return;
+    }
+    if (!content_ids || f->st.st_size > BATCH_FILE_MAX)
+        return;
+
+    f->data = malloc(50 + f->st.st_size);
+    hdrlen = 1 + sprintf(f->data, "blob %lu",
+                         (unsigned long) f->st.st_size);
+    /* A file that shrank is hashed, and reported, by `hash_file()`. */
+    if (f->st.st_size &&
+        read_chunk(f->fd, f->data + hdrlen, f->st.st_size) < 0) {
+        free(f->data);
+        f->data = NULL;
+        return;
+    }
+    f->len = hdrlen + f->st.st_size;
+}
 
-    /* Initialize the zlib stream to contain null characters. */
-    memset(&stream, 0, sizeof(stream));
+/*
+ * Function: `hash_file`
+ * Parameters:
+ *      -f: An open file to add.
+ * Purpose: In a repository that names objects by their uncompressed
+ *          contents, hash the "blob <size>\0" header and the file. This is
+ *          for files too large to be read into memory and hashed with
+ *          others in `read_batch()`; they are read a chunk at a time, or,
+ *          for an algorithm that hashes one large update on several threads
+ *          (BLAKE3, see blake3.c), given to it all at once.
+ */
+static void hash_file(struct file_to_add *f)
+{
+    const struct hash_algo *algo = object_hash();
+    struct hash_ctx c;
+    char metadata[50], *buf;
+    unsigned long left;
+    long n;
+    void *map;
+
+    algo->init(&c);
+    algo->update(&c, metadata, 1 + sprintf(metadata, "blob %lu",
+                                           (unsigned long) f->st.st_size));
+    if (algo->parallel && f->st.st_size > INDEX_CHUNK &&
+        (map = map_fd(f->fd, f->st.st_size)) != NULL) {
+        algo->update(&c, map, f->st.st_size);
+        #ifndef BGIT_WINDOWS
+        munmap(map, f->st.st_size);
+        #else
+        UnmapViewOfFile( map );
+        #endif
+    } else {
+        buf = malloc(INDEX_CHUNK);
+        lseek(f->fd, 0, SEEK_SET);
+        for (left = f->st.st_size; left; left -= n) {
+            n = read_chunk(f->fd, buf, left);
+            if (n < 0) {
+                f->failed = "file changed while it was being added";
+                break;
+            }
+            algo->update(&c, buf, n);
+        }
+        free(buf);
+    }
+    /* Finishing the hash also frees its state, so it is done either way. */
+    algo->final(f->sha1, &c);
+}
 
-    /*
-     * Initialize the compression stream for optimized compression 
-     * (as opposed to speed). 
-     */
-    deflateInit(&stream, Z_BEST_COMPRESSION);
+/*
+ * Function: `deflate_file`
+ * Parameters:
+ *      -f: An open file to add, whose object must be written.
+ *      -content_ids: Whether objects are named by their contents.
+ * Purpose: Construct a blob object and compress it into a temporary file in
+ *          the object store, which `install_object()` later renames to the
+ *          object's name. In the original format, the name is the hash of
+ *          the compressed output, calculated on the way.
+ *
+ *          A large file is read, compressed and written a chunk at a time,
+ *          so that files larger than the memory of the machine can be
+ *          added. A small file that was read already is compressed from
+ *          memory. The file is closed.
+ */
+static void deflate_file(struct file_to_add *f, int content_ids)
+{
+    /* A chunk of the file. */
+    char *buf = NULL;
+    /* The "blob <size>\0" header, and its length. */
+    char metadata[50];
+    int metadata_len;
+    /* The temporary object file, and the state of writing it. */
+    char tmpfile[PATH_MAX];
+    struct blob_writer w;
+    /* The compressor. */
+    struct codec_stream s;
+    /* The compression level, the policy that chose it, and the CPU time. */
+    int level, policy;
+    unsigned long long start;
+    /* Bytes of the file not read yet, and the size of the last chunk. */
+    unsigned long left;
+    long n;
 
     /*
      * Linus Torvalds: ASCII size + nul byte
-     */    
-    stream.next_in = metadata;   /* Set file metadata as the first addition */
-                                 /* to the compression stream input. */
-    /*
-     * Write `blob ` to the `metadata` array, followed by the size of the 
-     * file being added to the cache.  Set the number of bytes available as
-     * input for the next compression equal to the number of characters 
-     * written + 1 (for the terminating null character).
-     */
-    stream.avail_in = 1 + sprintf(metadata, "blob %lu", 
-                                  (unsigned long) st->st_size);
-    /* Specify `out` as the location to write the next compressed output. */
-    stream.next_out = out;
-    /* Number of bytes available for storing the next compressed output. */
-    stream.avail_out = max_out_bytes;
-
-    /* Compress the data, which so far is just the file metadata. */
-    while (deflate(&stream, 0) == Z_OK)
-        /* Linus Torvalds: nothing */;
-
-    /* Add the file content to the compression stream input. */
-    stream.next_in = in;
-    stream.avail_in = st->st_size;
-
-    /* Compress the file content. */
-    while (deflate(&stream, Z_FINISH) == Z_OK)
-        /* Linus Torvalds: nothing */;
-
-    /* Free data structures that were used for compression. */
-    deflateEnd(&stream);
-    /* Initialize the `c` SHA context structure. */
-    SHA1_Init(&c);
-    /*
-     * Calculate the hash of the compressed output, which has total size 
-     * `stream.total_out`. 
-     */
-    SHA1_Update(&c, out, stream.total_out); 
-    /*
-     * Store the SHA1 hash of the compressed output in the cache entry's 
-     * `sha1` member. 
+     *
+     * Write `blob ` to the `metadata` array, followed by the size of the
+     * file being added to the cache.
      */
-    SHA1_Final(ce->sha1, &c);
+    metadata_len = 1 + sprintf(metadata, "blob %lu",
+                               (unsigned long) f->st.st_size);
+
+    /* Choose the compression level for the file (see compress.c). */
+    level = compression_level_fd("blob", f->fd, f->st.st_size, &policy);
+    start = compression_clock();
+
+    /* Create the temporary object file in the object store. */
+    snprintf(tmpfile, sizeof(tmpfile), "%s/tmp_obj_XXXXXX",
+             get_object_directory());
+    memset(&w, 0, sizeof(w));
+    w.fd = mkstemp(tmpfile);
+    if (w.fd < 0) {
+        f->failed = "unable to create temporary object file";
+        goto out;
+    }
+    /* In the original format, the hash is that of the compressed output. */
+    w.hash_output = !content_ids;
+    w.algo = object_hash();
+    if (w.hash_output)
+        w.algo->init(&w.c);
 
     /*
-     * Write the blob object to the object store and return with the return
-     * value of the write_sha1_buffer function. 
+     * Compress the header and the file content with the configured codec
+     * (see codec.c): in one piece if the file was read already, otherwise a
+     * chunk at a time, reading the file from the start.
      */
-    return write_sha1_buffer(ce->sha1, out, stream.total_out); 
+    if (codec_stream_init(&s, object_codec(), level,
+                          metadata_len + f->st.st_size) < 0)
+        goto fail;
+    if (f->data) {
+        if (codec_stream_compress(&s, f->data, f->len, 1,
+                                  write_compressed, &w) < 0)
+            goto fail_stream;
+    } else {
+        lseek(f->fd, 0, SEEK_SET);
+        if (codec_stream_compress(&s, metadata, metadata_len, !f->st.st_size,
+                                  write_compressed, &w) < 0)
+            goto fail_stream;
+        buf = malloc(INDEX_CHUNK);
+        for (left = f->st.st_size; left; left -= n) {
+            n = read_chunk(f->fd, buf, left);
+            if (n < 0) {
+                f->failed = "file changed while it was being added";
+                goto fail_stream;
+            }
+            if (codec_stream_compress(&s, buf, n, n == left,
+                                      write_compressed, &w) < 0)
+                goto fail_stream;
+        }
+    }
+    codec_stream_end(&s);
+    compression_done(policy, level, f->st.st_size, w.size, start,
+                     s.helper_cpu);
+
+    if (w.hash_output)
+        w.algo->final(f->sha1, &w.c);
+    if (close(w.fd) < 0) {
+        unlink(tmpfile);
+        f->failed = "unable to write object file";
+        goto out;
+    }
+    f->tmpfile = strdup(tmpfile);
+    goto out;
+
+fail_stream:
+    codec_stream_end(&s);
+fail:
+    if (w.hash_output)
+        w.algo->final(f->sha1, &w.c);
+    close(w.fd);
+    unlink(tmpfile);
+    if (!f->failed)
+        f->failed = "unable to write object file";
+out:
+    free(buf);
+    close(f->fd);
+    f->fd = -1;
+}
+
+/* The permissions of new objects, 0666 less the umask. */
+static mode_t object_mode;
+
+/*
+ * Function: `install_object`
+ * Parameters:
+ *      -f: A file whose object was compressed by `deflate_file()`.
+ * Purpose: Give the blob object its name in the object store, unless an
+ *          object with that name already exists. It gets the permissions
+ *          `write_sha1_buffer()` gives objects, instead of mkstemp()'s 0600.
+ */
+static int install_object(struct file_to_add *f)
+{
+    char *tmpfile = f->tmpfile;
+
+    f->tmpfile = NULL;
+    if (has_sha1_file(f->sha1)) {
+        unlink(tmpfile);
+        free(tmpfile);
+        return 0;
+    }
+    chmod(tmpfile, object_mode);
+    if (RENAME(tmpfile, sha1_file_name(f->sha1)) == RENAME_FAIL) {
+        unlink(tmpfile);
+        free(tmpfile);
+        return error("unable to write object file");
+    }
+    free(tmpfile);
+    object_filter_add(f->sha1);
+    return 0;
+}
+
+/*
+ * Function: `release_file`
+ * Parameters:
+ *      -f: A file that was added, or is given up on.
+ * Purpose: Close the file and free what is left of it, including the
+ *          compressed object of a file that was not added after all.
+ */
+static void release_file(struct file_to_add *f)
+{
+    if (f->fd >= 0)
+        close(f->fd);
+    f->fd = -1;
+    if (f->tmpfile) {
+        unlink(f->tmpfile);
+        free(f->tmpfile);
+        f->tmpfile = NULL;
+    }
+    free(f->data);
+    f->data = NULL;
 }
 
 /*
  * Function: `add_file_to_cache`
  * Parameters:
- *      -path: The path of the file to add to the object store and index.
- * Purpose: Get information about the file to add to the cache, store the file 
- *          metadata in a cache_entry structure, then call the `index_fd()` 
- *          function to construct a blob object and write it to the object 
- *          store, and the `add_cache_entry()` function to insert the cache 
- *          entry into the `active_cache` array lexicographically.
- */
-static int add_file_to_cache(char *path)
+ *      -f: The file to add to the object store and index, read by
+ *          `read_batch()` and, if its object is new, compressed by
+ *          `deflate_batch()`.
+ * Purpose: Store the file metadata in a cache_entry structure, give the
+ *          blob object its name in the object store, and call the
+ *          `add_cache_entry()` function to insert the cache entry into the
+ *          `active_cache` array lexicographically.
+ */
+static int add_file_to_cache(struct file_to_add *f)
 {
     int size, namelen;
     /* Used to reference a cache entry. */
-    struct cache_entry *ce; 
-    /*
-     * Used to store file information obtained through an `fstat()` function 
-     * call. 
-     */
-    struct stat st;
-    /* File descriptor for the file to add to the cache. */
-    int fd;
-
-    /* Open the file to add to the cache and return a file descriptor. */
-    fd = open(path, O_RDONLY); 
+    struct cache_entry *ce;
 
     /*
-     * If the `open()` command fails, return -1. Remove the corresponding 
-     * cache entry from the active_cache array if the file does not exist in 
-     * the working directory.
+     * If the file could not be opened or `fstat()` failed, return -1. Remove
+     * the corresponding cache entry from the active_cache array if the file
+     * does not exist in the working directory.
      */
-    if (fd < 0) {
-        if (errno == ENOENT)
-            return remove_file_from_cache(path);
+    if (f->err) {
+        if (f->err == ENOENT)
+            return remove_file_from_cache(f->path);
         return -1;
     }
-
-    /*
-     * Get file information and store it in the `st` stat structure. If 
-     * fstat() fails, release the file descriptor and return -1.
-     */
-    if (fstat(fd, &st) < 0) {
-        close(fd);
+    if (f->failed)
+        return error(f->failed);
+    if (f->tmpfile && install_object(f) < 0)
         return -1;
-    }
 
     /* Get the length of the file path string. */
-    namelen = strlen(path); 
+    namelen = strlen(f->path);
     /* Calculate the size to allocate to the cache entry in bytes. */
-    size = cache_entry_size(namelen); 
+    size = cache_entry_size(namelen);
     /* Allocate `size` bytes to the cache entry. */
-    ce = malloc(size); 
+    ce = malloc(size);
     /* Initialize the cache entry to contain null characters. */
-    memset(ce, 0, size); 
+    memset(ce, 0, size);
     /* Copy `path` into the cache entry's `name` member. */
-    memcpy(ce->name, path, namelen); 
+    memcpy(ce->name, f->path, namelen);
 
     /*
      * Copy the file metadata obtained through the fstat() call to the cache
-     * entry structure members. 
+     * entry structure members.
      */
-    ce->ctime.sec = STAT_TIME_SEC( &st, st_ctim );
-    ce->ctime.nsec = STAT_TIME_NSEC( &st, st_ctim );
-    ce->mtime.sec = STAT_TIME_SEC( &st, st_mtim );
-    ce->mtime.nsec = STAT_TIME_NSEC( &st, st_mtim );
-    ce->st_dev = st.st_dev;
-    ce->st_ino = st.st_ino;
-    ce->st_mode = st.st_mode;
-    ce->st_uid = st.st_uid;
-    ce->st_gid = st.st_gid;
-    ce->st_size = st.st_size;
+    ce->ctime.sec = STAT_TIME_SEC( &f->st, st_ctim );
+    ce->ctime.nsec = STAT_TIME_NSEC( &f->st, st_ctim );
+    ce->mtime.sec = STAT_TIME_SEC( &f->st, st_mtim );
+    ce->mtime.nsec = STAT_TIME_NSEC( &f->st, st_mtim );
+    ce->st_dev = f->st.st_dev;
+    ce->st_ino = f->st.st_ino;
+    ce->st_mode = f->st.st_mode;
+    ce->st_uid = f->st.st_uid;
+    ce->st_gid = f->st.st_gid;
+    ce->st_size = f->st.st_size;
     ce->namelen = namelen;
-
-    /*
-     * Call the index_fd() function to construct a blob object, compress it, 
-     * calculate the SHA1 hash of the compressed blob object, then write the 
-     * blob object to the object database.
-     */
-    if (index_fd(path, namelen, ce, fd, &st) < 0)
-        return -1;
+    memcpy(ce->sha1, f->sha1, object_hash()->rawsz);
 
     /*
      * Insert the cache entry into the active_cache array lexicographically
@@ -566,59 +855,441 @@ static int add_file_to_cache(char *path)
     return add_cache_entry(ce);
 }
 
+/* The states of a batch of files. */
+#define BATCH_FREE    0   /* Not in use, or being filled with paths. */
+#define BATCH_READ    1   /* Waiting to be read and hashed. */
+#define BATCH_HASHED  2   /* Waiting for the new objects to be picked out. */
+#define BATCH_DEFLATE 3   /* Waiting for the new objects to be compressed. */
+#define BATCH_BUSY    4   /* Being worked on. */
+#define BATCH_DONE    5   /* Waiting to be added to the index. */
+
+/* Template of a batch of files being added together. */
+struct update_batch {
+    int state;                     /* One of the BATCH_* states above. */
+    int nr;                        /* The number of files. */
+    struct file_to_add files[UPDATE_BATCH];
+};
+
+/*
+ * Template of the pipeline that adds files to the cache. Batches are queued
+ * in a ring in the order of their paths, and pass through these stages:
+ *
+ *  1) Read (any thread): open the files, read the small ones and hash them.
+ *     In the original format, where an object's name is the hash of its
+ *     compressed bytes, the files are compressed right away instead.
+ *  2) Pick out (main thread): look up which of the hashed objects exist
+ *     already, so that they are not compressed again.
+ *  3) Deflate (any thread): compress the new objects into temporary files
+ *     in the object store.
+ *  4) Merge (main thread, in order): rename the new objects to their names
+ *     and insert the cache entries.
+ *
+ * Only the main thread touches the object store's names and the index, so
+ * none of that code needs locking. When it has nothing else to do, the main
+ * thread works on the stages the other threads do.
+ */
+struct update_pipeline {
+    int content_ids;               /* Whether objects are named by contents. */
+    int nr_threads;                /* Threads besides the main thread. */
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;           /* Signalled when a batch is queued. */
+    pthread_cond_t done;           /* Signalled when a batch moves on. */
+    int stop;                      /* Tells the threads to exit. */
+    int failed;                    /* Whether a file could not be added. */
+    struct update_batch *batches;  /* The ring of batches. */
+    unsigned int nr_batches;
+    unsigned long next_merge;      /* The oldest batch not merged yet. */
+    unsigned long next_fill;       /* The batch being filled with paths. */
+};
+
+/* The pipeline of this run of `update-cache`. */
+static struct update_pipeline pipeline;
+
 /*
- * Function: `write_cache`
+ * Function: `read_batch`
  * Parameters:
- *      -newfd: File descriptor associated with the index lock file.
- *      -cache: The array of pointers to cache entry structures to write to 
- *              the index lock file.
- *      -entries: The number of cache entries in the `active_cache` array.
- * Purpose: Construct the cache header, calculate the SHA1 hash of the cache 
- *          header and the cache entries in the `active_cache` array, and 
- *          then write them to the `.dircache/index.lock` file.
- */
-static int write_cache(int newfd, struct cache_entry **cache, int entries)
+ *      -b: A batch of files whose paths are set.
+ * Purpose: The read stage. Open the files, then in a repository that names
+ *          objects by their contents, hash them: the small ones all in one
+ *          call to `sha1_batch()`, which hashes several messages for little
+ *          more than the cost of one, and the others one at a time. In the
+ *          original format the files are compressed instead, since that is
+ *          what their names are the hash of.
+ */
+static void read_batch(struct update_batch *b)
 {
-    SHA_CTX c;                 /* Declare an SHA context structure. */
-    struct cache_header hdr;   /* Declare a cache_header structure. */
-    int i;                     /* For loop iterator. */
-
-    /* Set this to the signature defined in "cache.h". */
-    hdr.signature = CACHE_SIGNATURE; 
-    /* The version is always set to 1 in this release. */
-    hdr.version = 1; 
-    /*
-     * Store the number of cache entries in the `active_cache` array in the 
-     * cache header. 
-     */
-    hdr.entries = entries; 
-
-    /* Initialize the `c` SHA context structure. */
-    SHA1_Init(&c); 
-    /* Update the running SHA1 hash calculation with the cache header. */
-    SHA1_Update(&c, &hdr, offsetof(struct cache_header, sha1));
-    /* Update the running SHA1 hash calculation with each cache entry. */
-    for (i = 0; i < entries; i++) {
-        struct cache_entry *ce = cache[i];
-        int size = ce_size(ce);
-        SHA1_Update(&c, ce, size);
-    }
-    /* Store the final SHA1 hash in the header. */
-    SHA1_Final(hdr.sha1, &c);
-
-    /* Write the cache header to the index lock file. */
-    if (write(newfd, &hdr, sizeof(hdr)) != sizeof(hdr))
-        return -1;
+    struct file_to_add *f;
+    const struct hash_algo *algo = object_hash();
+    const void *bufs[UPDATE_BATCH];
+    unsigned long lens[UPDATE_BATCH];
+    unsigned char sha1s[UPDATE_BATCH * MAX_RAWSZ];
+    int i, n = 0;
+
+    for (i = 0; i < b->nr; i++) {
+        f = &b->files[i];
+        open_file_to_add(f, pipeline.content_ids);
+        if (f->data) {
+            bufs[n] = f->data;
+            lens[n++] = f->len;
+        } else if (f->fd >= 0 && pipeline.content_ids) {
+            hash_file(f);
+        } else if (f->fd >= 0) {
+            deflate_file(f, 0);
+        }
+    }
 
-    /* Write each of the cache entries to the index lock file. */
-    for (i = 0; i < entries; i++) {
-        struct cache_entry *ce = cache[i];
-        int size = ce_size(ce);
-        if (write(newfd, ce, size) != size)
-            return -1;
+    /* Repositories using another hash algorithm hash one file at a time. */
+    if (!strcmp(algo->name, "sha1")) {
+        sha1_batch(sha1s, bufs, lens, n);
+    } else {
+        for (i = 0; i < n; i++) {
+            struct hash_ctx c;
+
+            algo->init(&c);
+            algo->update(&c, bufs[i], lens[i]);
+            algo->final(sha1s + i * algo->rawsz, &c);
+        }
+    }
+    for (i = n = 0; i < b->nr; i++)
+        if (b->files[i].data)
+            memcpy(b->files[i].sha1, sha1s + algo->rawsz * n++, algo->rawsz);
+}
+
+/*
+ * Function: `pick_new_objects`
+ * Parameters:
+ *      -b: A batch of hashed files.
+ * Purpose: The pick out stage, which looks in the object store and so runs
+ *          on the main thread. Mark the files whose objects do not exist yet
+ *          to be compressed, and close the others: re-adding an unchanged
+ *          file costs no compression. Returns whether any file is marked.
+ */
+static int pick_new_objects(struct update_batch *b)
+{
+    int i, any = 0;
+
+    for (i = 0; i < b->nr; i++) {
+        struct file_to_add *f = &b->files[i];
+
+        if (f->fd < 0 || f->failed || pipeline.failed)
+            continue;
+        if (has_sha1_file(f->sha1)) {
+            release_file(f);
+            continue;
+        }
+        f->deflate = 1;
+        any = 1;
+    }
+    return any;
+}
+
+/*
+ * Function: `deflate_batch`
+ * Parameters:
+ *      -b: A batch of files picked out by `pick_new_objects()`.
+ * Purpose: The deflate stage. Compress the objects of the marked files.
+ */
+static void deflate_batch(struct update_batch *b)
+{
+    int i;
+
+    for (i = 0; i < b->nr; i++)
+        if (b->files[i].deflate && b->files[i].fd >= 0)
+            deflate_file(&b->files[i], 1);
+}
+
+/*
+ * Function: `merge_batch`
+ * Parameters:
+ *      -b: The oldest batch, which has been through all the other stages.
+ * Purpose: The merge stage. Add the files to the cache in the order they
+ *          were given. After a file cannot be added, the rest are only
+ *          cleaned up, as `update-cache` stops at the first failure.
+ */
+static void merge_batch(struct update_batch *b)
+{
+    int i;
+
+    for (i = 0; i < b->nr; i++) {
+        struct file_to_add *f = &b->files[i];
+
+        if (!pipeline.failed && add_file_to_cache(f)) {
+            fprintf(stderr, "Unable to add %s to database\n", f->path);
+            pipeline.failed = 1;
+        }
+        release_file(f);
+        if (f->free_path)
+            free(f->path);
+    }
+    b->nr = 0;
+}
+
+/*
+ * Function: `find_work`
+ * Parameters: none
+ * Purpose: Return the oldest batch waiting for the read or deflate stage,
+ *          or NULL. Called with the lock held.
+ */
+static struct update_batch *find_work(void)
+{
+    unsigned long i;
+
+    for (i = pipeline.next_merge; i < pipeline.next_fill; i++) {
+        struct update_batch *b = &pipeline.batches[i % pipeline.nr_batches];
+
+        if (b->state == BATCH_READ || b->state == BATCH_DEFLATE)
+            return b;
     }
+    return NULL;
+}
+
+/*
+ * Function: `work_on_batch`
+ * Parameters:
+ *      -b: A batch returned by `find_work()`.
+ * Purpose: Run the read or deflate stage on a batch. Called with the lock
+ *          held, which is released while the work is done.
+ */
+static void work_on_batch(struct update_batch *b)
+{
+    int state = b->state;
+
+    b->state = BATCH_BUSY;
+    pthread_mutex_unlock(&pipeline.lock);
+    if (state == BATCH_READ)
+        read_batch(b);
+    else
+        deflate_batch(b);
+    pthread_mutex_lock(&pipeline.lock);
+    b->state = state == BATCH_READ && pipeline.content_ids ?
+               BATCH_HASHED : BATCH_DONE;
+    pthread_cond_broadcast(&pipeline.done);
+}
+
+/*
+ * Function: `update_worker`
+ * Parameters:
+ *      -data: Not used.
+ * Purpose: The function each thread runs: work on queued batches until told
+ *          to stop.
+ */
+static void *update_worker(void *data)
+{
+    struct update_batch *b;
+
+    pthread_mutex_lock(&pipeline.lock);
+    for (;;) {
+        b = find_work();
+        if (b)
+            work_on_batch(b);
+        else if (pipeline.stop)
+            break;
+        else
+            pthread_cond_wait(&pipeline.work, &pipeline.lock);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+    return NULL;
+}
+
+/*
+ * Function: `pipeline_step`
+ * Parameters: none
+ * Purpose: Move the pipeline one step on from the main thread: pick out the
+ *          new objects of a hashed batch, merge the oldest batch if it is
+ *          done, or else work on a queued batch, or else wait for the other
+ *          threads. Called with the lock held.
+ */
+static void pipeline_step(void)
+{
+    struct update_batch *b;
+    unsigned long i;
+
+    for (i = pipeline.next_merge; i < pipeline.next_fill; i++) {
+        b = &pipeline.batches[i % pipeline.nr_batches];
+        if (b->state == BATCH_HASHED) {
+            int any;
+
+            b->state = BATCH_BUSY;
+            pthread_mutex_unlock(&pipeline.lock);
+            any = pick_new_objects(b);
+            pthread_mutex_lock(&pipeline.lock);
+            b->state = any ? BATCH_DEFLATE : BATCH_DONE;
+            if (any)
+                pthread_cond_signal(&pipeline.work);
+            return;
+        }
+    }
+
+    b = &pipeline.batches[pipeline.next_merge % pipeline.nr_batches];
+    if (b->state == BATCH_DONE) {
+        pthread_mutex_unlock(&pipeline.lock);
+        merge_batch(b);
+        pthread_mutex_lock(&pipeline.lock);
+        b->state = BATCH_FREE;
+        pipeline.next_merge++;
+        return;
+    }
+
+    b = find_work();
+    if (b)
+        work_on_batch(b);
+    else
+        pthread_cond_wait(&pipeline.done, &pipeline.lock);
+}
+
+/*
+ * Function: `update_threads`
+ * Parameters: none
+ * Purpose: Return how many threads add files, the main thread included,
+ *          which `update.threads` sets. By default every CPU is used.
+ */
+static int update_threads(void)
+{
+    static int threads;
+
+    if (!threads) {
+        threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        threads = get_config_env_int("update.threads", threads);
+        if (threads < 1)
+            threads = 1;
+    }
+    return threads;
+}
+
+/*
+ * Function: `start_update`
+ * Parameters: none
+ * Purpose: Set up the pipeline and start its threads (see
+ *          `update_threads()`).
+ *
+ *          Settings that are read the first time they are used are read
+ *          here, before there are other threads to race for them.
+ */
+static void start_update(void)
+{
+    const struct hash_algo *algo = object_hash();
+    struct hash_ctx c;
+    unsigned char sha1[MAX_RAWSZ];
+    int threads = update_threads(), i;
+    mode_t mask;
+
+    pipeline.content_ids = repository_format_version() ==
+                           REPOSITORY_FORMAT_CONTENT_IDS;
+    hash_threads();
+    get_object_directory();
+    /* The umask cannot be read without setting it, which threads would race. */
+    mask = umask(0);
+    umask(mask);
+    object_mode = 0666 & ~mask;
+    /* This also has sha1.c pick the code the CPU supports. */
+    algo->init(&c);
+    algo->final(sha1, &c);
+
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.work, NULL);
+    pthread_cond_init(&pipeline.done, NULL);
+    pipeline.nr_batches = 2 * threads;
+    pipeline.batches = calloc(pipeline.nr_batches,
+                              sizeof(struct update_batch));
+    pipeline.threads = calloc(threads, sizeof(pthread_t));
+    for (i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pipeline.threads[i], NULL, update_worker, NULL))
+            break;
+        pipeline.nr_threads++;
+    }
+}
+
+/*
+ * Function: `queue_batch`
+ * Parameters: none
+ * Purpose: Hand the batch being filled to the read stage. Called with the
+ *          lock held.
+ */
+static void queue_batch(void)
+{
+    struct update_batch *b;
+
+    b = &pipeline.batches[pipeline.next_fill % pipeline.nr_batches];
+    b->state = BATCH_READ;
+    pipeline.next_fill++;
+    pthread_cond_signal(&pipeline.work);
+}
+
+/*
+ * Function: `update_path`
+ * Parameters:
+ *      -path: The path of a file to add, which must stay valid until
+ *             `finish_update()` returns.
+ *      -allocated: Whether the path was allocated with `malloc()`. Such a
+ *                  path is freed once the file is added, so that paths read
+ *                  from standard input do not pile up in memory.
+ * Purpose: Add a file to the batch being filled, and queue the batch once it
+ *          is full. When all batches are in use, this waits for the oldest
+ *          one to be merged, which bounds the memory used. Returns -1 once
+ *          a file could not be added.
+ */
+static int update_path(char *path, int allocated)
+{
+    struct update_batch *b;
+
+    pthread_mutex_lock(&pipeline.lock);
+    while (!pipeline.failed &&
+           pipeline.next_fill - pipeline.next_merge == pipeline.nr_batches)
+        pipeline_step();
+    if (pipeline.failed) {
+        pthread_mutex_unlock(&pipeline.lock);
+        if (allocated)
+            free(path);
+        return -1;
+    }
+    b = &pipeline.batches[pipeline.next_fill % pipeline.nr_batches];
+    b->files[b->nr].free_path = allocated;
+    b->files[b->nr++].path = path;
+    if (b->nr == UPDATE_BATCH)
+        queue_batch();
+    pthread_mutex_unlock(&pipeline.lock);
     return 0;
-}        
+}
+
+/*
+ * Function: `finish_update`
+ * Parameters: none
+ * Purpose: Queue the last batch, wait until every batch is merged, and stop
+ *          the threads. Returns -1 if a file could not be added.
+ */
+static int finish_update(void)
+{
+    struct update_batch *b;
+    int i;
+
+    pthread_mutex_lock(&pipeline.lock);
+    /*
+     * When all batches are in use, the one after the last queued is the
+     * oldest, and no paths are waiting to be queued.
+     */
+    if (pipeline.next_fill - pipeline.next_merge < pipeline.nr_batches) {
+        b = &pipeline.batches[pipeline.next_fill % pipeline.nr_batches];
+        if (b->nr && !pipeline.failed)
+            queue_batch();
+        else
+            b->nr = 0;
+    }
+    while (pipeline.next_merge < pipeline.next_fill)
+        pipeline_step();
+    pipeline.stop = 1;
+    pthread_cond_broadcast(&pipeline.work);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    for (i = 0; i < pipeline.nr_threads; i++)
+        pthread_join(pipeline.threads[i], NULL);
+    free(pipeline.threads);
+    free(pipeline.batches);
+    return pipeline.failed ? -1 : 0;
+}
 
 /*
  * Linus Torvalds: We fundamentally don't like some paths: we don't want
@@ -647,6 +1318,96 @@ inside:
     }
 }
 
+/*
+ * Function: `add_directory`
+ * Parameters:
+ *      -dir: A directory given on the command line with `-r`.
+ * Purpose: Queue every file below a directory whose path `verify_path()`
+ *          accepts, in the order of the index. The directories are read on
+ *          as many threads as files are added on (see dir-walk.c). Returns
+ *          -1 if a directory could not be read or a file could not be added.
+ */
+static int add_directory(char *dir)
+{
+    char **paths;
+    int nr, i, ret = 0;
+
+    nr = walk_directory(dir, update_threads(), verify_path, &paths);
+    if (nr < 0)
+        return -1;
+    /* The paths are freed once added, and the rest when adding fails. */
+    for (i = 0; i < nr; i++) {
+        if (!ret && update_path(paths[i], 1) < 0)
+            ret = -1;
+        else if (ret)
+            free(paths[i]);
+    }
+    free(paths);
+    return ret;
+}
+
+/*
+ * Function: `add_argument`
+ * Parameters:
+ *      -path: A path given on the command line or on standard input.
+ *      -recursive: Whether a directory is added with the files below it.
+ *      -allocated: Whether the path was allocated with `malloc()`, in which
+ *                  case it is taken over.
+ * Purpose: Check a path and queue the file, or with `-r` every file below
+ *          the directory. Returns -1 once files cannot be added any more.
+ */
+static int add_argument(char *path, int recursive, int allocated)
+{
+    int len = strlen(path), ret;
+    struct stat st;
+
+    /*
+     * With `-r`, walk a directory and queue the files below it. Its
+     * trailing slashes are dropped, and `.` stands for the whole working
+     * directory.
+     */
+    if (recursive && !stat(path, &st) && S_ISDIR(st.st_mode)) {
+        while (len > 1 && path[len - 1] == '/')
+            path[--len] = '\0';
+        if (strcmp(path, ".") && !verify_path(path)) {
+            fprintf(stderr, "Ignoring path %s\n", path);
+            ret = 0;
+        } else {
+            ret = add_directory(path);
+        }
+        if (allocated)
+            free(path);
+        return ret;
+    }
+
+    /*
+     * Verify the path. If the path is not valid, continue to the next 
+     * file. 
+     */
+    if (!verify_path(path)) {
+        fprintf(stderr, "Ignoring path %s\n", path);
+        if (allocated)
+            free(path);
+        return 0;
+    }
+
+    /*
+     * Queue the path. The files are added in batches of UPDATE_BATCH,
+     * which pass through the stages of `update_pipeline` on several threads
+     * at once:
+     *      1) Open the files, get information about them, and hash them,
+     *         the small ones together.
+     *      2) Look up which of the objects exist already.
+     *      3) Compress the new objects into temporary files in the object
+     *         database.
+     *      4) For each file, in order, give the new blob object its name,
+     *         store the file metadata in a cache_entry structure and call
+     *         the add_cache_entry() function to insert it into the
+     *         active_cache array lexicographically.
+     */
+    return update_path(path, allocated);
+}
+
 /*
  * Function: `main`
  * Parameters:
@@ -663,12 +1424,37 @@ int main(int argc, char **argv)
     int newfd;     /* File descriptor to reference the index lock file. */
     int entries;   /* The number of entries in the cache, as returned by */
                    /* read_cache(). */
+    int first;           /* The first path on the command line. */
+    int recursive = 0;   /* Whether directories are added with their files. */
+    int use_stdin = 0;   /* Whether paths are read from standard input. */
+    int term = '\n';     /* The character that ends a path read from it. */
+    int failed = 0;      /* Whether files cannot be added any more. */
+    char *path;
 
     /* The name of the cache file. */
     char cache_file[]      = ".dircache/index";
     /* The name of the cache lock file. */
     char cache_lock_file[] = ".dircache/index.lock"; 
 
+    /*
+     * With `-r`, a directory given on the command line is added with every
+     * file below it, instead of running `find | xargs update-cache`, which
+     * reads and writes the whole index once per batch of paths. `--stdin`
+     * reads more paths from standard input, see below.
+     */
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--recursive"))
+            recursive = 1;
+        else if (!strcmp(argv[i], "--stdin"))
+            use_stdin = 1;
+        else if (!strcmp(argv[i], "-z"))
+            term = '\0';
+        else
+            usage("update-cache [-r | --recursive] [--stdin [-z]] "
+                  "<path>...");
+    }
+    first = i;
+
     /*
      * Read in the contents of the `.dircache/index` file into the 
      * `active_cache` array and return the number of cache entries. Display an
@@ -681,6 +1467,17 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    /*
+     * Check the settings that make the command exit with usage() when they
+     * are wrong, while there is no lock file yet that would be left behind.
+     * compression_threads() reads all of the compression settings. The
+     * settings of the index checksum are reported as errors instead.
+     */
+    object_codec();
+    compression_threads();
+    if (check_index_settings() < 0)
+        return 1;
+
     /*
      * Create and open a new cache lock file called `.dircache/index.lock` and 
      * return a file descriptor to reference it. Display an error message if 
@@ -693,44 +1490,42 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    /* Start the threads that add the files (see `update_pipeline`). */
+    start_update();
+
     /*
      * Loop over the files to add to the cache, whose paths or filenames were 
      * passed in as command line arguments:
      *
      * ./update-cache path1 path2...
      */
-    for (i = 1 ; i < argc; i++) {
-        /* Store the ith path that was passed as a command line argument. */
-        char *path = argv[i];
-
-        /*
-         * Verify the path. If the path is not valid, continue to the next 
-         * file. 
-         */
-        if (!verify_path(path)) {
-            fprintf(stderr, "Ignoring path %s\n", argv[i]);
-            continue;
+    for (i = first; i < argc; i++) {
+        /* Once a file cannot be added, stop queueing paths. */
+        if (add_argument(argv[i], recursive, 0) < 0) {
+            failed = 1;
+            break;
         }
+    }
 
-        /*
-         * This calls `add_file_to_cache()`, which does a few things:
-         *      1) Opens the file at `path`.
-         *      2) Gets information about the file and stores the file
-         *         metadata in a cache_entry structure.
-         *      3) Calls the index_fd() function to construct a corresponding
-         *         blob object and write it to the object database.
-         *      4) Calls the add_cache_entry() function to insert the cache
-         *         entry into the active_cache array lexicographically.
-         *
-         * If any of these steps leads to a nonzero return code (i.e. fails), 
-         * jump to the `out` label below.
-         */
-        if (add_file_to_cache(path)) {
-            fprintf(stderr, "Unable to add %s to database\n", path);
-            goto out;
-        }
+    /*
+     * With `--stdin`, go on with the paths read from standard input, one per
+     * line, or terminated by NUL characters with `-z`. Each path is queued
+     * as soon as it is read, so that a producer can stream any number of
+     * paths into one run of `update-cache`, which reads and writes the index
+     * only once.
+     */
+    while (use_stdin && !failed && (path = read_path(stdin, term)) != NULL) {
+        if (add_argument(path, recursive, 1) < 0)
+            failed = 1;
     }
 
+    /*
+     * Wait for the queued files to be added, and jump to the `out` label
+     * below if any of them failed.
+     */
+    if (finish_update() < 0 || failed)
+        goto out;
+
     /*
      * This does a few things as well:
      *      1) Calls `write_cache()` to set up a cache header, calculate the
@@ -745,7 +1540,11 @@ int main(int argc, char **argv)
         }
     }
 
-/* Unlink the `.dircache/index.lock` file. */
+/*
+ * Unlink the `.dircache/index.lock` file, and fail: a file could not be
+ * added, or the index could not be written, for example because the index
+ * that was read turned out to be damaged.
+ */
 out:
     close(newfd);
     #ifndef BGIT_WINDOWS
@@ -753,4 +1552,5 @@ out:
     #else
     _unlink(cache_lock_file);
     #endif
+    return 1;
 }
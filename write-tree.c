@@ -26,8 +26,15 @@
  *  it does not take any command line arguments.
  *
  *  The `write-tree` command takes the changes that have been staged in
- *  the index and creates a tree object in the object store recording
- *  these changes.
+ *  the index and creates tree objects in the object store recording
+ *  these changes: one for each directory, which names the trees of its
+ *  subdirectories with lines of mode 040000, and whose name is displayed
+ *  for the root directory.
+ *
+ *  The names of the trees written are remembered in the cache tree of the
+ *  index (see cache-tree.c). Only the trees of the directories in which
+ *  files changed since are written again, and the others are shared with
+ *  the trees written before.
  *
  *  Everything in the main function in this file will run
  *  when ./write-tree executable is run from the command line.
@@ -40,12 +47,15 @@
    that are `#included` in "cache.h". Function names are followed by
    parenthesis whereas variable/struct names are not:
 
+   -has_sha1_file(): Check whether an object exists in a pack or as a
+                     readable loose object file.
+
+   -access(path, mode): Check whether the process can access a file.
+                        Sourced from <unistd.h>.
+
    -sha1_file_name(): Build the path of an object in the object database
                       using the object's SHA1 hash value.
 
-   -access(path, amode): Check whether the file at `path` can be accessed
-                         according to the permissions specified in `amode`.
-
    -perror(message): Write `message` to standard error output stream. Sourced
                      from <stdio.h>.
 
@@ -53,12 +63,27 @@
                   `active_cache` array. The number of caches entries is 
                   returned.
 
+   -object_hash(): Return the hash algorithm of the repository, which tells
+                   how long object names are. Sourced from "cache.h"
+                   (defined in hash.c).
+
    -fprintf(stream, message, ...): Write `message` to the output `stream`. 
                                    Sourced from <stdio.h>.
 
    -exit(status): Stop execution of the program and exit with code `status`.
                   Sourced from <stdlib.h>.
 
+   -memcmp(s1, s2, n): Compare n bytes of two objects. Sourced from
+                       <string.h>.
+
+   -strchr(string, c): Return a pointer to the first occurrence of `c` in
+                       `string`. Sourced from <string.h>.
+
+   -cache_tree_sub(): Return a subdirectory of a node of the cache tree.
+                      Sourced from "cache.h" (defined in cache-tree.c).
+
+   -cache_tree_free(): Free a node of the cache tree and the nodes below it.
+
    -malloc(size): Allocate unused space for an object whose size in bytes is 
                   specified by `size` and whose value is unspecified. Sourced 
                   from <stdlib.h>.
@@ -77,9 +102,44 @@
    -memcpy(s1, s2, n): Copy n bytes from the object pointed to by s2 into the 
                        object pointed to by s1.
 
-   -write_sha1_file(): Deflate an object, calculate the hash value, then call
-                       the write_sha1_buffer function to write the deflated
-                       object to the object database.
+   -free(ptr): Release memory allocated by malloc(). Sourced from
+               <stdlib.h>.
+
+   -write_object_file(): Deflate an object, calculate the hash value, then
+                         call the write_sha1_buffer function to write the
+                         deflated object to the object database. The hash
+                         value is returned.
+
+   -unlink(path): Remove a file. Sourced from <unistd.h>.
+
+   -check_index_settings(): Check the settings of the index checksum.
+                            Sourced from "cache.h" (defined in
+                            index-checksum.c).
+
+   -OPEN_FILE(): Open a file. Sourced from "cache.h".
+
+   -atexit(fn): Call a function when the process exits. Sourced from
+                <stdlib.h>.
+
+   -active_cache_tree: The cache tree of the index, which remembers the
+                       tree objects written before. Sourced from "cache.h"
+                       (defined in cache-tree.c).
+
+   -finish_index_checksum(): Wait for the checksum of the index being
+                             checked in the background. Sourced from
+                             "cache.h" (defined in index-checksum.c).
+
+   -printf(message, ...): Write `message` to standard output. Sourced from
+                          <stdio.h>.
+
+   -sha1_to_hex(): Convert an object name to hexadecimal.
+
+   -cache_tree_new(): Allocate a node of the cache tree.
+
+   -write_cache(): Write the index with its extensions. Sourced from
+                   "cache.h" (defined in read-cache.c).
+
+   -rename(old, new): Change the name of a file. Sourced from <stdio.h>.
 
    ****************************************************************
 
@@ -87,8 +147,17 @@
 
    -main(): The main function runs each time the ./write-tree command is run.
 
+   -cache_file/cache_lock_file: The index and its lock file.
+
+   -lock_held: Whether this process created the lock file.
+
+   -remove_lock(): Remove the lock file at exit unless it was renamed.
+
+   -write_index_tree(): Build the tree objects of a directory and of its
+                        subdirectories and write them to the object store.
+
    -check_valid_sha1(): Check if user-supplied SHA1 hash corresponds to an
-                        object in the object database.
+                        object in the object database, packed or loose.
 
    -prpend_integer(): Prepend a string containing the decimal form of the size 
                       of the tree data in bytes to the buffer.
@@ -98,6 +167,16 @@
                  object data size.
 */
 
+#ifndef BGIT_WINDOWS
+    #define RENAME( src_file, target_file ) rename( src_file, target_file )
+    #define RENAME_FAIL -1
+#else
+    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
+                                                target_file, \
+                                                MOVEFILE_REPLACE_EXISTING )
+    #define RENAME_FAIL 0
+#endif
+
 /*
  * Function: `check_valid_sha1`
  * Parameters:
@@ -108,23 +187,24 @@
 static int check_valid_sha1(unsigned char *sha1)
 {
     /*
-     * Build the path of an object in the object database using the object's 
-     * SHA1 hash value.
+     * Check whether the object is in a pack, or whether the process has read
+     * access to the loose object in the object database.
      */
-    char *filename = sha1_file_name(sha1);
-    int ret;   /* Return code. */
+    if (has_sha1_file(sha1))
+        return 0;
 
     /*
-     * Check whether the process has read access to the object in the object 
-     * database. 
+     * A loose object written by a program that does not update the filter
+     * of loose objects (see object-filter.c) may be missing from it, so ask
+     * the file system before giving up. This costs a system call only for
+     * objects that are really missing, which is an error anyway.
      */
-    ret = access(filename, R_OK);
-
-    /* Error if the file is not accessible. */
-    if (ret)
-        perror(filename);
+    if (!access(sha1_file_name(sha1), R_OK))
+        return 0;
 
-    return ret;
+    /* Error if the object is not accessible. */
+    perror(sha1_file_name(sha1));
+    return -1;
 }
 
 /*
@@ -160,48 +240,107 @@ static int prepend_integer(char *buffer, unsigned val, int i)
 /* Linus Torvalds: Enough space to add the header of "tree <size>\0" */
 #define ORIG_OFFSET (40)
 
+/* The index, and the lock file it is written to before being renamed. */
+static char cache_file[] = ".dircache/index";
+static char cache_lock_file[] = ".dircache/index.lock";
+/* Whether this process created the lock file. */
+static int lock_held;
+
 /*
- * Function: `main`
+ * Function: `remove_lock`
+ * Parameters: none
+ * Purpose: Remove the index lock file when `write-tree` exits without
+ *          having renamed it, for example after finding a missing object.
+ */
+static void remove_lock(void)
+{
+    if (lock_held)
+        unlink(cache_lock_file);
+}
+
+/*
+ * Function: `write_index_tree`
  * Parameters:
- *      -argc: The number of command-line arguments supplied, inluding the 
- *             command itself. 
- *      -argv: An array of the command line arguments, including the command 
- *             itself.
- * Purpose: Standard `main` function definition. Runs when the executable 
- *          `write-tree` is run from the command line. 
+ *      -it: The node of the cache tree for the directory.
+ *      -cache: The cache entries of the directory come first here.
+ *      -entries: The number of cache entries from `cache` to the end of the
+ *                `active_cache` array.
+ *      -base: The path of the directory, ending with a slash, or "" for the
+ *             root.
+ *      -baselen: The length of `base`.
+ * Purpose: Write the tree object of a directory, with a line of mode 040000
+ *          for each subdirectory, whose tree is written first. The name of
+ *          the tree is stored in the node, and the number of cache entries
+ *          below the directory is returned, or -1 if an entry names a
+ *          missing object. A directory whose node is still valid is not
+ *          built again: its tree, and the trees below it, already exist.
  */
-int main(int argc, char **argv)
+static int write_index_tree(struct cache_tree *it, struct cache_entry **cache,
+                            int entries, const char *base, int baselen)
 {
     /* The size to be allocated to the buffer. */
     unsigned long size;
     /* Index of the buffer element to be filled next. */
     unsigned long offset;
-    /* Not used. Even Linus Torvalds makes mistakes. */
-    unsigned long val;
-    /* Iterator used in for loop. */
-    int i;
-    /*
-     * Read in the contents of the `.dircache/index` file into the 
-     * `active_cache` array. The number of cache entries is returned and 
-     * stored in `entries`.
-     */
-    int entries = read_cache();
-
+    /* Iterators used in the loops. */
+    int i, j;
+    /* The length of object names, in bytes. */
+    int rawsz = object_hash()->rawsz;
     /* String to hold the tree's content. */
     char *buffer;
 
+    /* Use the tree written before, if nothing below it changed since. */
+    if (it->entry_count >= 0 && it->entry_count <= entries &&
+        has_sha1_file(it->sha1))
+        return it->entry_count;
+
     /*
-     * If there are no active cache entries or if there was an error reading
-     * the cache, display an error message and exit since there is nothing to 
-     * write to a tree.
+     * Write the trees of the subdirectories first, since this tree names
+     * them. The entries of a subdirectory follow each other in the index,
+     * so each one is written from a run of the `cache` array and the
+     * entries of the run are skipped. The loop stops at the first entry
+     * outside of the directory.
      */
-    if (entries <= 0) {
-        fprintf(stderr, "No file-cache to create a tree of\n");
-        exit(1);
+    for (i = 0; i < it->subtree_nr; i++)
+        it->down[i]->used = 0;
+    i = 0;
+    while (i < entries) {
+        struct cache_entry *ce = cache[i];
+        const char *path = (const char *) ce->name + baselen;
+        const char *slash;
+        struct cache_tree_sub *sub;
+        int count;
+
+        if (ce->namelen <= baselen || memcmp(ce->name, base, baselen))
+            break;
+        slash = strchr(path, '/');
+        if (!slash) {
+            i++;
+            continue;
+        }
+        sub = cache_tree_sub(it, path, slash - path, 1);
+        sub->used = 1;
+        count = write_index_tree(sub->cache_tree, cache + i, entries - i,
+                                 (const char *) ce->name,
+                                 baselen + (slash - path) + 1);
+        if (count < 0)
+            return -1;
+        i += count;
     }
 
+    /* Forget the subdirectories that no longer have any entries. */
+    for (i = j = 0; i < it->subtree_nr; i++) {
+        if (it->down[i]->used) {
+            it->down[j++] = it->down[i];
+            continue;
+        }
+        cache_tree_free(it->down[i]->cache_tree);
+        free(it->down[i]);
+    }
+    it->subtree_nr = j;
+
     /* Linus Torvalds: Guess at an initial size */
-    size = entries * 40 + 400;
+    size = ORIG_OFFSET + 400;
     /* Allocate `size` bytes to buffer to store the tree content. */
     buffer = malloc(size);
     /*
@@ -212,28 +351,59 @@ int main(int argc, char **argv)
     offset = ORIG_OFFSET;
 
     /*
-     * Loop over each cache entry and build the tree object by adding the 
-     * data from the cache entry to the buffer.
+     * Loop over the cache entries of the directory again and build the tree
+     * object by adding a line for each file, and for each subdirectory.
+     * Entries are in the order of the index, in which a subdirectory sorts
+     * as if its name ended with a slash.
      */
-    for (i = 0; i < entries; i++) {
-        /* Pick out the ith cache entry from the active_cache array. */
-        struct cache_entry *ce = active_cache[i];
+    i = 0;
+    while (i < entries) {
+        /* Pick out the ith cache entry from the `cache` array. */
+        struct cache_entry *ce = cache[i];
+        const char *path = (const char *) ce->name + baselen;
+        const char *slash;
+        /* The mode, name and object name of the line. */
+        unsigned int mode = ce->st_mode;
+        int len;
+        unsigned char *sha1 = ce->sha1;
+
+        if (ce->namelen <= baselen || memcmp(ce->name, base, baselen))
+            break;
 
-        /* Check if the cache entry's SHA1 hash is valid. Otherwise, exit. */
-        if (check_valid_sha1(ce->sha1) < 0)
-            exit(1);
+        /*
+         * A subdirectory is named by its tree, and all of its entries are
+         * skipped.
+         */
+        slash = strchr(path, '/');
+        if (slash) {
+            struct cache_tree *sub;
+
+            len = slash - path;
+            sub = cache_tree_sub(it, path, len, 0)->cache_tree;
+            mode = S_IFDIR;
+            sha1 = sub->sha1;
+            i += sub->entry_count;
+        } else {
+            /* Check if the entry's SHA1 hash is valid. Otherwise, fail. */
+            if (check_valid_sha1(ce->sha1) < 0) {
+                free(buffer);
+                return -1;
+            }
+            len = ce->namelen - baselen;
+            i++;
+        }
 
         /* If needed, increase the size of the buffer. */
-        if (offset + ce->namelen + 60 > size) {
-            size = alloc_nr(offset + ce->namelen + 60);
+        if (offset + len + 60 > size) {
+            size = alloc_nr(offset + len + 60);
             buffer = realloc(buffer, size);
         }
 
         /*
-         * Write the cache entry's file mode and name to the buffer and
+         * Write the mode and the name within the directory to the buffer and
          * increment `offset` by the number of characters that were written.
          */
-        offset += sprintf(buffer + offset, "%o %s", ce->st_mode, ce->name);
+        offset += sprintf(buffer + offset, "%o %.*s", mode, len, path);
 
         /*
          * Write a null character to the buffer as a separator and increment
@@ -241,39 +411,128 @@ int main(int argc, char **argv)
          */
         buffer[offset++] = 0;
 
-        /* Add the cache entry's SHA1 hash to the buffer. */
-        memcpy(buffer + offset, ce->sha1, 20);
+        /* Add the object name of the file or subdirectory to the buffer. */
+        memcpy(buffer + offset, sha1, rawsz);
 
         /*
-         * Increment the offset by 20 bytes, the length of an SHA1 hash.
+         * Increment the offset by the length of an object name: 20 bytes for
+         * an SHA1 hash, 32 for the other hash algorithms (see hash.c).
          */
-        offset += 20;
+        offset += rawsz;
     }
 
     /*
      * Prepend a string containing the decimal form of the size of the tree 
      * data in bytes to the buffer.
      */
-    i = prepend_integer(buffer, offset - ORIG_OFFSET, ORIG_OFFSET);
+    j = prepend_integer(buffer, offset - ORIG_OFFSET, ORIG_OFFSET);
     /*
      * Prepend the string `tree ` to the buffer to identify this object as a 
      * tree in the object store.
      */
-    i -= 5;
-    memcpy(buffer+i, "tree ", 5);
+    j -= 5;
+    memcpy(buffer+j, "tree ", 5);
+
+    /* Compress the contents of the buffer, starting at the `tree` tag, and
+     * write the tree object to the object store.
+     */
+    if (write_object_file(buffer + j, offset - j, it->sha1) < 0) {
+        free(buffer);
+        return -1;
+    }
+    free(buffer);
+
+    /* The node is valid again. */
+    it->entry_count = i;
+    return i;
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the 
+ *             command itself. 
+ *      -argv: An array of the command line arguments, including the command 
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable 
+ *          `write-tree` is run from the command line. 
+ */
+int main(int argc, char **argv)
+{
+    /* File descriptor of the index lock file, or -1. */
+    int newfd;
+    /* The number of cache entries. */
+    int entries;
 
     /*
-     * Adjust buffer to start at the first character of the `tree` object 
-     * tag. 
+     * Lock the index before reading it, so that the tree written can be
+     * remembered in its cache tree (see cache-tree.c) without losing a
+     * change made in the meantime. If another command holds the lock, the
+     * tree is still written, only not remembered. A bad setting of the
+     * index checksum is reported before the lock is taken.
      */
-    buffer += i;
-    /* Calculate final total size of this buffer. */
-    offset -= i;
+    if (check_index_settings() < 0)
+        exit(1);
+    newfd = OPEN_FILE(cache_lock_file, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (newfd >= 0) {
+        lock_held = 1;
+        atexit(remove_lock);
+    }
 
-    /* Compress the contents of buffer, calculate SHA1 hash of compressed 
-     * output, and write the tree object to the object store. 
+    /*
+     * Read in the contents of the `.dircache/index` file into the 
+     * `active_cache` array. The number of cache entries is returned and 
+     * stored in `entries`.
+     */
+    entries = read_cache();
+
+    /*
+     * If there are no active cache entries or if there was an error reading
+     * the cache, display an error message and exit since there is nothing to 
+     * write to a tree.
      */
-    write_sha1_file(buffer, offset);
+    if (entries <= 0) {
+        fprintf(stderr, "No file-cache to create a tree of\n");
+        exit(1);
+    }
+
+    /*
+     * If no entry changed since the tree was last written, its name is in
+     * the cache tree, and nothing needs to be built or hashed. Its name is
+     * only trusted once the checksum of the index is known to match, which
+     * with `index.verify = background` is still being checked.
+     */
+    if (active_cache_tree && active_cache_tree->entry_count == entries &&
+        has_sha1_file(active_cache_tree->sha1)) {
+        if (finish_index_checksum() < 0)
+            exit(1);
+        printf("%s\n", sha1_to_hex(active_cache_tree->sha1));
+        return 0;
+    }
+
+    /*
+     * Build and write the trees of the directories whose entries changed,
+     * and display the name of the root tree.
+     */
+    if (!active_cache_tree)
+        active_cache_tree = cache_tree_new();
+    if (write_index_tree(active_cache_tree, active_cache, entries, "", 0) < 0)
+        exit(1);
+    if (finish_index_checksum() < 0)
+        exit(1);
+    printf("%s\n", sha1_to_hex(active_cache_tree->sha1));
+
+    /*
+     * Remember the trees in the index, if it is locked. If the index cannot
+     * be written, exit with an error, and `remove_lock()` removes the lock
+     * file.
+     */
+    if (newfd < 0)
+        return 0;
+    if (write_cache(newfd, active_cache, entries) < 0 || close(newfd) < 0 ||
+        RENAME(cache_lock_file, cache_file) == RENAME_FAIL)
+        exit(1);
+    lock_held = 0;
 
     /* Return success. */
     return 0;